@@ -202,14 +202,14 @@ namespace GEMLoader
 	class GEMModelLoader
 	{
 	private:
-		GEMMaterialProperty loadProperty(std::ifstream& file)
+		GEMMaterialProperty loadProperty(std::istream& file)
 		{
 			GEMMaterialProperty prop;
 			prop.name = loadString(file);
 			prop.value = loadString(file);
 			return prop;
 		}
-		void loadMesh(std::ifstream& file, GEMMesh& mesh, int isAnimated)
+		void loadMesh(std::istream& file, GEMMesh& mesh, int isAnimated)
 		{
 			unsigned int n = 0;
 			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
@@ -252,7 +252,7 @@ namespace GEMLoader
 				}
 			}
 		}
-		std::string loadString(std::ifstream& file)
+		std::string loadString(std::istream& file)
 		{
 			int l = 0;
 			file.read(reinterpret_cast<char*>(&l), sizeof(int));
@@ -264,25 +264,25 @@ namespace GEMLoader
 			delete[] buffer;
 			return str;
 		}
-		GEMVec3 loadVec3(std::ifstream& file)
+		GEMVec3 loadVec3(std::istream& file)
 		{
 			GEMVec3 v;
 			file.read(reinterpret_cast<char*>(&v), sizeof(GEMVec3));
 			return v;
 		}
-		GEMMatrix loadMatrix(std::ifstream& file)
+		GEMMatrix loadMatrix(std::istream& file)
 		{
 			GEMMatrix mat;
 			file.read(reinterpret_cast<char*>(&mat.m), sizeof(float) * 16);
 			return mat;
 		}
-		GEMQuaternion loadQuaternion(std::ifstream& file)
+		GEMQuaternion loadQuaternion(std::istream& file)
 		{
 			GEMQuaternion q;
 			file.read(reinterpret_cast<char*>(&q.q), sizeof(float) * 4);
 			return q;
 		}
-		void loadFrame(GEMAnimationSequence& aseq, std::ifstream& file, int bonesN)
+		void loadFrame(GEMAnimationSequence& aseq, std::istream& file, int bonesN)
 		{
 			GEMAnimationFrame frame;
 			for (int i = 0; i < bonesN; i++)
@@ -302,7 +302,7 @@ namespace GEMLoader
 			}
 			aseq.frames.push_back(frame);
 		}
-		void loadFrames(GEMAnimationSequence& aseq, std::ifstream& file, int bonesN, int frames)
+		void loadFrames(GEMAnimationSequence& aseq, std::istream& file, int bonesN, int frames)
 		{
 			for (int i = 0; i < frames; i++)
 			{
@@ -326,6 +326,53 @@ namespace GEMLoader
 			file.close();
 			return isAnimated;
 		}
+		// any .gem, static or animated, from an open stream (e.g. a file already read into
+		// memory by a loader thread). Returns false instead of exiting on a bad file.
+		bool load(std::istream& file, std::vector<GEMMesh>& meshes, GEMAnimation& animation)
+		{
+			unsigned int n = 0;
+			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
+			if (!file || n != 4058972161)
+			{
+				return false;
+			}
+			unsigned int isAnimated = 0;
+			file.read(reinterpret_cast<char*>(&isAnimated), sizeof(unsigned int));
+			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
+			for (unsigned int i = 0; i < n && file; i++)
+			{
+				GEMMesh mesh;
+				loadMesh(file, mesh, isAnimated);
+				meshes.push_back(mesh);
+			}
+			if (isAnimated == 0)
+			{
+				return (bool)file;
+			}
+			unsigned int bonesN = 0;
+			file.read(reinterpret_cast<char*>(&bonesN), sizeof(unsigned int));
+			for (unsigned int i = 0; i < bonesN && file; i++)
+			{
+				GEMBone bone;
+				bone.name = loadString(file);
+				bone.offset = loadMatrix(file);
+				file.read(reinterpret_cast<char*>(&bone.parentIndex), sizeof(int));
+				animation.bones.push_back(bone);
+			}
+			animation.globalInverse = loadMatrix(file);
+			file.read(reinterpret_cast<char*>(&n), sizeof(unsigned int));
+			for (unsigned int i = 0; i < n && file; i++)
+			{
+				GEMAnimationSequence aseq;
+				aseq.name = loadString(file);
+				int frames = 0;
+				file.read(reinterpret_cast<char*>(&frames), sizeof(int));
+				file.read(reinterpret_cast<char*>(&aseq.ticksPerSecond), sizeof(float));
+				loadFrames(aseq, file, bonesN, frames);
+				animation.animations.push_back(aseq);
+			}
+			return (bool)file;
+		}
 		void load(std::string filename, std::vector<GEMMesh>& meshes)
 		{
 			std::ifstream file(filename, ::std::ios::binary);
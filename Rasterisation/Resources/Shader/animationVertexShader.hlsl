@@ -5,11 +5,30 @@ cbuffer animatedMeshBuffer
 	float4x4 bones[256];
 };
 
+#ifdef PACKED_VERTICES
+// octahedral normal from SNORM16, the same as octDecode in vertex.h
+float3 decodeDirection(float2 e)
+{
+	float3 n = float3(e.x, e.y, 1.0f - abs(e.x) - abs(e.y));
+	if (n.z < 0.0f)
+		n.xy = (1.0f - abs(n.yx)) * (n.xy >= 0.0f ? 1.0f : -1.0f);
+	return normalize(n);
+}
+#define DIRECTION float2
+#else
+float3 decodeDirection(float3 n)
+{
+	return n;
+}
+#define DIRECTION float3
+#endif
+
+// packed: byte ids and UNORM8 weights, the input layout expands both
 struct VS_INPUT
 {
 	float4 Pos : POS;
-	float3 Normal : NORMAL;
-	float3 Tangent : TANGENT;
+	DIRECTION Normal : NORMAL;
+	DIRECTION Tangent : TANGENT;
 	float2 TexCoords : TEXCOORD;
 	uint4 BoneIDs : BONEIDS;
 	float4 BoneWeights : BONEWEIGHTS;
@@ -35,10 +54,10 @@ PS_INPUT VS(VS_INPUT input)
 	output.Pos = mul(output.Pos, W);
     output.WorldPos = output.Pos.xyz;
 	output.Pos = mul(output.Pos, VP);
-	output.Normal = mul(input.Normal, (float3x3)transform);
+	output.Normal = mul(decodeDirection(input.Normal), (float3x3)transform);
 	output.Normal = mul(output.Normal, (float3x3)W);
 	output.Normal = normalize(output.Normal);
-	output.Tangent = mul(input.Tangent, (float3x3)transform);
+	output.Tangent = mul(decodeDirection(input.Tangent), (float3x3)transform);
 	output.Tangent = mul(output.Tangent, (float3x3)W);
 	output.Tangent = normalize(output.Tangent);
 	output.TexCoords = input.TexCoords;
@@ -4,11 +4,29 @@ cbuffer staticMeshBuffer
 	float4x4 VP;
 };
 
+#ifdef PACKED_VERTICES
+// octahedral normal from SNORM16, the same as octDecode in vertex.h
+float3 decodeDirection(float2 e)
+{
+	float3 n = float3(e.x, e.y, 1.0f - abs(e.x) - abs(e.y));
+	if (n.z < 0.0f)
+		n.xy = (1.0f - abs(n.yx)) * (n.xy >= 0.0f ? 1.0f : -1.0f);
+	return normalize(n);
+}
+#define DIRECTION float2
+#else
+float3 decodeDirection(float3 n)
+{
+	return n;
+}
+#define DIRECTION float3
+#endif
+
 struct VS_INPUT
 {
 	float4 Pos : POS;
-	float3 Normal : NORMAL;
-	float3 Tangent : TANGENT;
+	DIRECTION Normal : NORMAL;
+	DIRECTION Tangent : TANGENT;
 	float2 TexCoords : TEXCOORD;
 };
 
@@ -27,8 +45,8 @@ PS_INPUT VS(VS_INPUT input)
 	output.Pos = mul(input.Pos, W);
     output.WorldPos = mul(input.Pos, W).xyz;
 	output.Pos = mul(output.Pos, VP);
-	output.Normal = mul(input.Normal, (float3x3)W);
-	output.Tangent = mul(input.Tangent, (float3x3)W);
+	output.Normal = mul(decodeDirection(input.Normal), (float3x3)W);
+	output.Tangent = mul(decodeDirection(input.Tangent), (float3x3)W);
 	output.TexCoords = input.TexCoords;
 	return output;
 }
\ No newline at end of file
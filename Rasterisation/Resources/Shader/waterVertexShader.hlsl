@@ -4,6 +4,7 @@ cbuffer staticMeshBuffer
 	float4x4 VP;
 };
 
+// WaveParams in water.h, the CPU evaluates the same waves for gameplay
 cbuffer waterParams
 {
     float time;
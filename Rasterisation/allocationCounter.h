@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Counts heap allocations made through operator new, so a frame loop can prove it
+// does not allocate. The counting operators replace the global ones for the whole
+// program, so exactly one .cpp defines GE_ALLOCATION_COUNTER_IMPLEMENTATION before
+// including this header (headless does). Without it the counts stay at 0.
+class AllocationCounter {
+public:
+	static uint64_t allocations() { return counts().allocations.load(std::memory_order_relaxed); }
+	static uint64_t frees() { return counts().frees.load(std::memory_order_relaxed); }
+	static uint64_t bytes() { return counts().bytes.load(std::memory_order_relaxed); }
+
+	static void recordAllocation(size_t size) {
+		counts().allocations.fetch_add(1, std::memory_order_relaxed);
+		counts().bytes.fetch_add(size, std::memory_order_relaxed);
+	}
+
+	static void recordFree() {
+		counts().frees.fetch_add(1, std::memory_order_relaxed);
+	}
+
+private:
+	struct Counts {
+		std::atomic<uint64_t> allocations{ 0 };
+		std::atomic<uint64_t> frees{ 0 };
+		std::atomic<uint64_t> bytes{ 0 };
+	};
+
+	// constant initialised, so it is usable from allocations made before main
+	static Counts& counts() {
+		static Counts c;
+		return c;
+	}
+};
+
+// allocations made between construction and the call, e.g. around one frame
+class AllocationScope {
+public:
+	AllocationScope() : startAllocations(AllocationCounter::allocations()), startBytes(AllocationCounter::bytes()) {}
+
+	uint64_t allocations() const { return AllocationCounter::allocations() - startAllocations; }
+	uint64_t bytes() const { return AllocationCounter::bytes() - startBytes; }
+
+private:
+	uint64_t startAllocations;
+	uint64_t startBytes;
+};
+
+#ifdef GE_ALLOCATION_COUNTER_IMPLEMENTATION
+// over-aligned new keeps the library version, nothing in the engine uses it
+void* operator new(size_t size) {
+	AllocationCounter::recordAllocation(size);
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	AllocationCounter::recordAllocation(size);
+	return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+	return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept {
+	if (!p) return;
+	AllocationCounter::recordFree();
+	free(p);
+}
+
+void operator delete[](void* p) noexcept {
+	operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+	operator delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+	operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+	operator delete(p);
+}
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+#include "mathLib.h"
+#include "GEMLoader.h"
+#include "animation.h"
+#include "collision.h"
+
+// CPU side of an animated model: skeleton, animation clips, playback state and
+// bind pose bounds. animatedModel adds the GPU meshes on top of this, the
+// headless driver uses it on its own.
+class AnimatedRig {
+public:
+	Animation animation;
+	AnimationInstance instance;
+	AABB bounds;
+
+	// load the skeleton and animations of a .gem file without creating any GPU resources
+	void load(std::string filename) {
+		GEMLoader::GEMModelLoader loader;
+		std::vector<GEMLoader::GEMMesh> gemmeshes;
+		GEMLoader::GEMAnimation gemanimation;
+		loader.load(filename, gemmeshes, gemanimation);
+		initRig(gemmeshes, gemanimation);
+	}
+
+	void initRig(std::vector<GEMLoader::GEMMesh>& gemmeshes, GEMLoader::GEMAnimation& gemanimation) {
+		// init Bones
+		for (int i = 0; i < gemanimation.bones.size(); i++)
+		{
+			Bone bone;
+			bone.name = gemanimation.bones[i].name;
+			memcpy(&bone.offset, &gemanimation.bones[i].offset, 16 * sizeof(float));
+			bone.parentIndex = gemanimation.bones[i].parentIndex;
+			animation.skeleton.bones.push_back(bone);
+		}
+
+		// animation copy data
+		for (int i = 0; i < gemanimation.animations.size(); i++)
+		{
+			std::string name = gemanimation.animations[i].name;
+			AnimationSequence aseq;
+			aseq.ticksPerSecond = gemanimation.animations[i].ticksPerSecond;
+			for (int n = 0; n < gemanimation.animations[i].frames.size(); n++)
+			{
+				AnimationFrame frame;
+				for (int index = 0; index < gemanimation.animations[i].frames[n].positions.size(); index++)
+				{
+					mathLib::Vec3 p;
+					mathLib::Quaternion q;
+					mathLib::Vec3 s;
+					memcpy(&p, &gemanimation.animations[i].frames[n].positions[index], sizeof(mathLib::Vec3));
+					frame.positions.push_back(p);
+					memcpy(&q, &gemanimation.animations[i].frames[n].rotations[index], sizeof(mathLib::Quaternion));
+					frame.rotations.push_back(q);
+					memcpy(&s, &gemanimation.animations[i].frames[n].scales[index], sizeof(mathLib::Vec3));
+					frame.scales.push_back(s);
+				}
+				aseq.frames.push_back(frame);
+			}
+			animation.animations.insert({ name, aseq });
+		}
+
+		instance.animation = &animation;
+		instance.t = 0.0f;
+		calculateBoundingBox(gemmeshes);
+	}
+
+	void calculateBoundingBox(std::vector<GEMLoader::GEMMesh>& gemmeshes) {
+		bounds.reset();
+		for (int i = 0; i < gemmeshes.size(); i++) {
+			for (int j = 0; j < gemmeshes[i].verticesAnimated.size(); j++) {
+				GEMLoader::GEMVec3& p = gemmeshes[i].verticesAnimated[j].position;
+				bounds.extend(mathLib::Vec3(p.x, p.y, p.z));
+			}
+		}
+	}
+};
@@ -2,6 +2,7 @@
 #include "mathLib.h"
 #include <vector>
 #include <map>
+#include "profiler.h"
 
 struct Bone
 {
@@ -112,20 +113,25 @@ public:
 		return false;
 	}
 
-	void update(std::string name, float dt) {
+	// only reads the shared Animation, so instances of one model can update on different threads
+	void update(const std::string& name, float dt) {
+		PROFILE_SCOPE("AnimationInstance::update");
 		if (name == currentAnimation) {
 			t += dt;
 		}
 		else {
 			currentAnimation = name;  t = 0;
 		}
-		if (animationFinished() == true) { resetAnimationTime(); }
+		auto it = animation->animations.find(name);
+		if (it == animation->animations.end()) return;
+		AnimationSequence& sequence = it->second;
+		if (t > sequence.duration()) { resetAnimationTime(); }
 		int frame = 0;
 		float interpolationFact = 0;
-		animation->calcFrame(name, t, frame, interpolationFact);
+		sequence.calcFrame(t, frame, interpolationFact);
 		for (int i = 0; i < animation->skeleton.bones.size(); i++)
 		{
-			matrices[i] = animation->interpolateBoneToGlobal(name, matrices, frame, interpolationFact, i);
+			matrices[i] = sequence.interpolateBoneToGlobal(matrices, frame, interpolationFact, &animation->skeleton, i);
 		}
 		animation->calcFinalTransforms(matrices);
 	}
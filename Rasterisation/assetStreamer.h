@@ -0,0 +1,435 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include "timer.h"
+#include "profiler.h"
+#include "jobSystem.h"
+
+// Loads assets in the background so startup does not wait for every file. Requests go
+// into a queue ordered by priority (lower first, e.g. distance to the camera, which the
+// caller can update every frame). One I/O thread reads the files, the decode runs on
+// the job workers, and update() hands finished assets to their load callbacks on the
+// thread that calls it, once per frame. Until then the caller draws a placeholder.
+// A file that cannot be read or decoded goes through update() as well, to its failed
+// callback instead of the load callback.
+//
+// Memory budget: a read only starts while the resident bytes plus the files being read
+// and decoded are under budget. Resident are the decoded payloads waiting for update()
+// (what the decoders reported) and the loaded assets that have an eviction callback,
+// which their owners keep on the streamer's behalf. Assets without one leave the count
+// once their load callback took the payload, the streamer could not free them anyway
+// (textures, which TextureResidency budgets on the GPU). When loads are waiting and the
+// budget is full, update() evicts the least recently touched evictable assets; touching
+// an evicted asset queues it again. If nothing can be evicted the queue stalls and
+// stats().stalled says so.
+
+enum class AssetState {
+	Queued,
+	Reading,
+	Decoding,
+	Decoded,     // waiting for update() to run the load callback
+	Ready,
+	Failed,
+	Evicted
+};
+
+typedef int AssetHandle;
+static const AssetHandle InvalidAsset = -1;
+
+struct AssetStreamerStats {
+	uint64_t requested = 0;
+	uint64_t loaded = 0;
+	uint64_t failed = 0;
+	uint64_t evicted = 0;
+	uint64_t bytesRead = 0;
+	size_t residentBytes = 0;
+	size_t peakResidentBytes = 0;
+	size_t budgetBytes = 0;         // 0 = no limit
+	size_t queued = 0;              // not started yet
+	size_t inFlight = 0;            // reading, decoding or waiting for update()
+	bool stalled = false;           // loads waiting, budget full of assets that can't be evicted
+	double readMs = 0.0;            // sums over loaded assets
+	double decodeMs = 0.0;
+	double latencyMs = 0.0;         // request to load callback
+	double maxLatencyMs = 0.0;
+
+	double averageLatencyMs() const { return loaded ? latencyMs / loaded : 0.0; }
+};
+
+class AssetStreamer {
+public:
+	AssetStreamer() {}
+	AssetStreamer(const AssetStreamer&) = delete;
+	AssetStreamer& operator=(const AssetStreamer&) = delete;
+	~AssetStreamer() { shutdown(); }
+
+	// jobs decodes, nullptr (or a job system without worker threads) decodes on the I/O thread
+	void init(JobSystem* _jobs, size_t budgetBytes = 0) {
+		shutdown();
+		jobs = _jobs;
+		budget = budgetBytes;
+		running = true;
+		ioThread = std::thread([this] { ioLoop(); });
+	}
+
+	// stops after the reads in progress, finished loads whose callback has not run are dropped
+	void shutdown() {
+		if (!ioThread.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		condition.notify_all();
+		ioThread.join();
+		if (jobs) jobs->wait(decoding);
+		std::lock_guard<std::mutex> lock(mutex);
+		completed.clear();
+	}
+
+	void setBudget(size_t bytes) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			budget = bytes;
+		}
+		condition.notify_all();
+	}
+
+	// decode(file, T&) runs on a worker and returns the bytes the asset keeps resident, 0 if
+	// the file is bad. loaded(T&) runs in update(), the T is cleared after it returns so
+	// move out what is kept. evicted() runs in update() when the budget needs the room,
+	// failed() in update() when the file could not be read or decoded.
+	template<typename T, typename Decode, typename Loaded>
+	AssetHandle request(const std::string& filename, float priority, Decode decode, Loaded loaded, std::function<void()> evicted = nullptr,
+		std::function<void()> failed = nullptr) {
+		std::shared_ptr<T> payload = std::make_shared<T>();
+		std::unique_ptr<Asset> asset(new Asset());
+		asset->filename = filename;
+		asset->priority = priority;
+		asset->decode = [payload, decode](const std::vector<unsigned char>& file) { return (size_t)decode(file, *payload); };
+		asset->loaded = [payload, loaded]() {
+			loaded(*payload);
+			*payload = T();
+		};
+		asset->failed = [payload, failed]() {
+			*payload = T();
+			if (failed) failed();
+		};
+		asset->evicted = evicted;
+		AssetHandle handle;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			asset->requestTime = Timer::now();
+			asset->lastUsed = frame;
+			handle = (AssetHandle)assets.size();
+			assets.push_back(std::move(asset));
+			counters.requested++;
+		}
+		condition.notify_all();
+		return handle;
+	}
+
+	void setPriority(AssetHandle handle, float priority) {
+		std::lock_guard<std::mutex> lock(mutex);
+		assets[handle]->priority = priority;
+	}
+
+	// the asset was used this frame, keeps it from being evicted and queues it again if it was
+	void touch(AssetHandle handle) {
+		bool requeued = false;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			Asset& asset = *assets[handle];
+			asset.lastUsed = frame;
+			if (asset.state == AssetState::Evicted) {
+				asset.state = AssetState::Queued;
+				asset.requestTime = Timer::now();
+				requeued = true;
+			}
+		}
+		if (requeued) condition.notify_all();
+	}
+
+	// reads and decodes a loaded, evicted or failed asset again and runs its load callback
+	// again, for an owner that has since thrown its copy away (e.g. a texture the GPU
+	// dropped) or a file that was fixed
+	void reload(AssetHandle handle) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			Asset& asset = *assets[handle];
+			bool failed = asset.state == AssetState::Failed && asset.failureReported;
+			if (asset.state != AssetState::Ready && asset.state != AssetState::Evicted && !failed)
+				return;
+			residentBytes -= asset.bytes;
+			asset.bytes = 0;
+			asset.state = AssetState::Queued;
+			asset.lastUsed = frame;
+			asset.requestTime = Timer::now();
+		}
+		condition.notify_all();
+	}
+
+	AssetState state(AssetHandle handle) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return assets[handle]->state;
+	}
+
+	bool isReady(AssetHandle handle) { return state(handle) == AssetState::Ready; }
+
+	// call once per frame: runs up to maxLoads load or failed callbacks (0 = all finished
+	// ones) and evicts for the budget. Callbacks run on this thread, outside the
+	// streamer's lock.
+	int update(int maxLoads = 0) {
+		PROFILE_SCOPE("stream: update");
+		finishing.clear();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			frame++;
+			size_t n = maxLoads > 0 && completed.size() > (size_t)maxLoads ? (size_t)maxLoads : completed.size();
+			finishing.assign(completed.begin(), completed.begin() + n);
+			completed.erase(completed.begin(), completed.begin() + n);
+		}
+		// only update() moves an asset on from Decoded or Failed, so the callback runs without the lock
+		for (AssetHandle handle : finishing) {
+			Asset* asset = get(handle);
+			if (state(handle) == AssetState::Failed) {
+				asset->failed();
+				std::lock_guard<std::mutex> lock(mutex);
+				asset->failureReported = true;
+				continue;
+			}
+			asset->loaded();
+			std::lock_guard<std::mutex> lock(mutex);
+			asset->state = AssetState::Ready;
+			asset->lastUsed = frame;
+			if (!asset->evicted) {
+				// the owner has the payload now and the streamer cannot take it back
+				residentBytes -= asset->bytes;
+				asset->bytes = 0;
+			}
+			double latency = (Timer::now() - asset->requestTime) * 1e-6;
+			counters.loaded++;
+			counters.latencyMs += latency;
+			if (latency > counters.maxLatencyMs) counters.maxLatencyMs = latency;
+		}
+		evictForBudget();
+		return (int)finishing.size();
+	}
+
+	// nothing queued, in flight or waiting for update()
+	bool idle() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!completed.empty()) return false;
+		for (auto& asset : assets) {
+			AssetState s = asset->state;
+			if (s == AssetState::Queued || s == AssetState::Reading || s == AssetState::Decoding || s == AssetState::Decoded)
+				return false;
+		}
+		return true;
+	}
+
+	AssetStreamerStats stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		AssetStreamerStats s = counters;
+		s.residentBytes = residentBytes;
+		s.budgetBytes = budget;
+		for (auto& asset : assets) {
+			if (asset->state == AssetState::Queued) s.queued++;
+			else if (asset->state == AssetState::Reading || asset->state == AssetState::Decoding || asset->state == AssetState::Decoded) s.inFlight++;
+		}
+		return s;
+	}
+
+	// one line for the once a second output
+	std::string report() {
+		AssetStreamerStats s = stats();
+		std::ostringstream out;
+		out << "streaming: " << s.loaded << "/" << s.requested << " loaded, " << s.queued << " queued, " << s.inFlight << " in flight, "
+			<< s.failed << " failed, " << s.evicted << " evicted, " << s.residentBytes / (1024 * 1024) << " MB resident";
+		if (s.budgetBytes) out << " of " << s.budgetBytes / (1024 * 1024) << " MB";
+		if (s.stalled) out << " (stalled)";
+		out << ", latency avg " << s.averageLatencyMs() << " ms max " << s.maxLatencyMs << " ms";
+		return out.str();
+	}
+
+private:
+	struct Asset {
+		std::string filename;
+		float priority = 0.0f;
+		AssetState state = AssetState::Queued;
+		std::vector<unsigned char> file;                // only while reading and decoding
+		std::function<size_t(const std::vector<unsigned char>&)> decode;
+		std::function<void()> loaded;
+		std::function<void()> evicted;
+		std::function<void()> failed;
+		size_t bytes = 0;
+		bool failureReported = false;                   // the failed callback ran, reload() may try again
+		uint64_t lastUsed = 0;                          // update() count
+		uint64_t requestTime = 0;                       // ns
+	};
+
+	JobSystem* jobs = nullptr;
+	std::thread ioThread;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool running = false;
+	// unique_ptr so the I/O thread and decoders keep their Asset* while the list grows
+	std::vector<std::unique_ptr<Asset>> assets;
+	std::vector<AssetHandle> completed;             // decoded or failed, for update()
+	std::vector<AssetHandle> finishing;             // update()'s share of completed
+	JobCounter decoding;
+	size_t budget = 0;
+	size_t residentBytes = 0;
+	size_t pendingBytes = 0;                        // files read and not decoded yet
+	uint64_t frame = 0;
+	AssetStreamerStats counters;
+
+	Asset* get(AssetHandle handle) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return assets[handle].get();
+	}
+
+	bool underBudget() const { return budget == 0 || residentBytes + pendingBytes < budget; }
+
+	// lowest priority value among the queued ones. A scan rather than a heap since the
+	// priorities change every frame as the camera moves, and the list is short.
+	Asset* next(AssetHandle& handle) {
+		Asset* best = nullptr;
+		for (size_t i = 0; i < assets.size(); i++) {
+			Asset* asset = assets[i].get();
+			if (asset->state != AssetState::Queued) continue;
+			if (!best || asset->priority < best->priority) {
+				best = asset;
+				handle = (AssetHandle)i;
+			}
+		}
+		return best;
+	}
+
+	void ioLoop() {
+		Profiler::setThreadName("asset I/O");
+		for (;;) {
+			Asset* asset = nullptr;
+			AssetHandle handle = InvalidAsset;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [&] {
+					if (!running) return true;
+					if (!underBudget()) return false;
+					asset = next(handle);
+					return asset != nullptr;
+				});
+				if (!running) return;
+				asset->state = AssetState::Reading;
+			}
+			Timer timer;
+			bool ok;
+			{
+				PROFILE_SCOPE("stream: read");
+				ok = readFile(asset->filename, asset->file);
+			}
+			double readMs = timer.elapsed() * 1000.0;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				counters.readMs += readMs;
+				counters.bytesRead += asset->file.size();
+				if (ok) pendingBytes += asset->file.size();
+				asset->state = ok ? AssetState::Decoding : AssetState::Failed;
+				asset->failureReported = false;
+				if (!ok) {
+					std::vector<unsigned char>().swap(asset->file);
+					counters.failed++;
+					completed.push_back(handle);
+					continue;
+				}
+			}
+			if (jobs && jobs->workerCount() > 1)
+				jobs->run([this, handle] { decodeAsset(handle); }, &decoding);
+			else
+				decodeAsset(handle);
+		}
+	}
+
+	void decodeAsset(AssetHandle handle) {
+		PROFILE_SCOPE("stream: decode");
+		Asset* asset = get(handle);
+		Timer timer;
+		size_t bytes = asset->decode(asset->file);
+		double decodeMs = timer.elapsed() * 1000.0;
+		size_t fileBytes = asset->file.size();
+		std::vector<unsigned char>().swap(asset->file);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			counters.decodeMs += decodeMs;
+			pendingBytes -= fileBytes;
+			if (bytes == 0) {
+				asset->state = AssetState::Failed;
+				asset->failureReported = false;
+				counters.failed++;
+				completed.push_back(handle);
+			}
+			else {
+				asset->state = AssetState::Decoded;
+				asset->bytes = bytes;
+				residentBytes += bytes;
+				if (residentBytes > counters.peakResidentBytes) counters.peakResidentBytes = residentBytes;
+				completed.push_back(handle);
+			}
+		}
+		// the file no longer counts against the budget, the I/O thread may be waiting for that
+		condition.notify_all();
+	}
+
+	// least recently touched first, never what was touched since the previous update()
+	void evictForBudget() {
+		for (;;) {
+			Asset* victim = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				counters.stalled = false;
+				if (underBudget()) return;
+				bool waiting = false;
+				bool progress = false;    // something in flight, or evictable once it is not in use
+				for (auto& asset : assets) {
+					AssetState s = asset->state;
+					if (s == AssetState::Queued) waiting = true;
+					if (s == AssetState::Reading || s == AssetState::Decoding || s == AssetState::Decoded) progress = true;
+					if (s != AssetState::Ready || !asset->evicted) continue;
+					progress = true;
+					if (asset->lastUsed + 1 >= frame) continue;
+					if (!victim || asset->lastUsed < victim->lastUsed) victim = asset.get();
+				}
+				if (!waiting) return;
+				if (!victim) {
+					counters.stalled = !progress;
+					return;
+				}
+				victim->state = AssetState::Evicted;
+				residentBytes -= victim->bytes;
+				victim->bytes = 0;
+				counters.evicted++;
+			}
+			PROFILE_SCOPE("stream: evict");
+			victim->evicted();
+			condition.notify_all();
+		}
+	}
+
+	static bool readFile(const std::string& filename, std::vector<unsigned char>& data) {
+		std::ifstream file(filename, std::ios::binary | std::ios::ate);
+		if (!file) return false;
+		std::streamoff size = file.tellg();
+		if (size <= 0) return false;
+		data.resize((size_t)size);
+		file.seekg(0);
+		file.read((char*)data.data(), size);
+		return (bool)file;
+	}
+};
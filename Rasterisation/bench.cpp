@@ -0,0 +1,829 @@
+// Micro benchmarks for the simulation core: mathLib, animation, collision, culling,
+// the render queue, shooting and the asset loaders. Every benchmark is run as a
+// number of timed samples, each sample calls the code under test `batch` times so
+// short functions are not swamped by timer resolution. Results are per operation.
+#include <string>
+#include <vector>
+#include <initializer_list>
+#include <filesystem>
+#include <cstdlib>
+#include <fstream>
+#include "mathLib.h"
+#include "GEMLoader.h"
+#include "animatedRig.h"
+#include "collision.h"
+#include "culling.h"
+#include "renderQueue.h"
+#include "renderDevice.h"
+#include "headlessScene.h"
+#include "frameArena.h"
+#include "jobSystem.h"
+#include "shooting.h"
+#include "water.h"
+#include "foliage.h"
+#include "image.h"
+#include "timer.h"
+#include "profiler.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+struct BenchOptions {
+	std::string resources = "Resources";
+	std::string json;           // results written here when set
+	std::string filter;         // only run benchmarks whose name contains this
+	std::string label;          // free text stored in the JSON, e.g. the commit hash
+	int samples = 50;
+	double maxSeconds = 1.0;    // per benchmark, stops early once at least minSamples are taken
+	int minSamples = 5;
+	double sampleMs = 0.5;      // batch size is picked so one sample takes about this long
+	std::vector<int> bullets = { 64, 256, 1024 };
+	std::vector<int> enemies = { 16, 64, 256 };
+	bool profile = false;       // keep PROFILE_SCOPE zones recording while measuring
+};
+
+struct BenchResult {
+	std::string name;
+	int samples;
+	uint64_t batch;             // calls per sample
+	double itemsPerOp;          // e.g. bullets updated per ShootingSystem::update
+	double bytesPerOp;          // input bytes per call, 0 when not meaningful
+	double minNs;
+	double medianNs;
+	double p99Ns;
+	double meanNs;
+	double throughput;          // items per second at the median
+};
+
+// keeps the optimiser from deleting a computation whose result is never used
+template<typename T>
+inline void doNotOptimise(const T& value) {
+#if defined(_MSC_VER)
+	static const volatile void* sink;
+	sink = &value;
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "r"(&value) : "memory");
+#endif
+}
+
+class BenchRunner {
+public:
+	BenchOptions& options;
+	std::vector<BenchResult> results;
+
+	BenchRunner(BenchOptions& _options) : options(_options) {}
+
+	bool selected(const std::string& name) const {
+		return options.filter.empty() || name.find(options.filter) != std::string::npos;
+	}
+
+	// any of them, checked before a fixture is built so a filtered out benchmark costs nothing
+	bool selected(std::initializer_list<std::string> names) const {
+		for (auto& name : names)
+			if (selected(name)) return true;
+		return false;
+	}
+
+	// op() is one call of the code under test, setup() runs untimed before every sample
+	template<typename Op, typename Setup>
+	void run(const std::string& name, double itemsPerOp, double bytesPerOp, Op op, Setup setup) {
+		if (!selected(name)) return;
+
+		// warm up and double the batch until one sample takes sampleMs
+		uint64_t batch = 1;
+		while (true) {
+			setup();
+			uint64_t start = Timer::now();
+			for (uint64_t i = 0; i < batch; i++)
+				op();
+			double ns = (double)(Timer::now() - start);
+			if (ns >= options.sampleMs * 1e6 || batch >= (1u << 24)) break;
+			batch *= 2;
+		}
+
+		std::vector<double> perOp;
+		perOp.reserve(options.samples);
+		Timer total;
+		for (int s = 0; s < options.samples; s++) {
+			setup();
+			uint64_t start = Timer::now();
+			for (uint64_t i = 0; i < batch; i++)
+				op();
+			uint64_t end = Timer::now();
+			perOp.push_back((double)(end - start) / batch);
+			if (s + 1 >= options.minSamples && total.elapsed() > options.maxSeconds) break;
+		}
+		record(name, batch, itemsPerOp, bytesPerOp, perOp);
+	}
+
+	template<typename Op>
+	void run(const std::string& name, double itemsPerOp, Op op) {
+		run(name, itemsPerOp, 0.0, op, [] {});
+	}
+
+	void record(const std::string& name, uint64_t batch, double itemsPerOp, double bytesPerOp, std::vector<double>& perOp) {
+		std::sort(perOp.begin(), perOp.end());
+		BenchResult r;
+		r.name = name;
+		r.samples = (int)perOp.size();
+		r.batch = batch;
+		r.itemsPerOp = itemsPerOp;
+		r.bytesPerOp = bytesPerOp;
+		r.minNs = perOp.front();
+		r.medianNs = percentile(perOp, 0.5);
+		r.p99Ns = percentile(perOp, 0.99);
+		double sum = 0.0;
+		for (double v : perOp) sum += v;
+		r.meanNs = sum / perOp.size();
+		r.throughput = r.medianNs > 0.0 ? itemsPerOp * 1e9 / r.medianNs : 0.0;
+		results.push_back(r);
+		print(r);
+	}
+
+	// nearest rank on sorted samples
+	static double percentile(const std::vector<double>& sorted, double p) {
+		size_t rank = (size_t)std::ceil(p * sorted.size());
+		if (rank < 1) rank = 1;
+		return sorted[rank - 1];
+	}
+
+	static void print(const BenchResult& r) {
+		std::cout << r.name << ": min " << formatNs(r.minNs) << ", median " << formatNs(r.medianNs)
+			<< ", p99 " << formatNs(r.p99Ns) << ", " << r.throughput << "/s";
+		if (r.bytesPerOp > 0.0)
+			std::cout << " (" << r.bytesPerOp * 1e3 / r.medianNs << " MB/s)";
+		std::cout << " [" << r.samples << " x " << r.batch << "]" << std::endl;
+	}
+
+	static std::string formatNs(double ns) {
+		std::ostringstream s;
+		if (ns < 1e3) s << ns << " ns";
+		else if (ns < 1e6) s << ns * 1e-3 << " us";
+		else s << ns * 1e-6 << " ms";
+		return s.str();
+	}
+
+	bool writeJson(const std::string& filename) const {
+		std::ofstream file(filename);
+		if (!file.is_open()) return false;
+		file << "{\n  \"label\": \"" << escape(options.label) << "\",\n";
+		file << "  \"compiler\": \"" << compiler() << "\",\n";
+#ifdef NDEBUG
+		file << "  \"build\": \"release\",\n";
+#else
+		file << "  \"build\": \"debug\",\n";
+#endif
+		file << "  \"profiler\": " << (options.profile ? "true" : "false") << ",\n";
+		file << "  \"benchmarks\": [";
+		for (size_t i = 0; i < results.size(); i++) {
+			const BenchResult& r = results[i];
+			file << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << escape(r.name) << "\", \"samples\": " << r.samples
+				<< ", \"batch\": " << r.batch << ", \"items_per_op\": " << r.itemsPerOp
+				<< ", \"min_ns\": " << r.minNs << ", \"median_ns\": " << r.medianNs << ", \"p99_ns\": " << r.p99Ns
+				<< ", \"mean_ns\": " << r.meanNs << ", \"throughput_per_s\": " << r.throughput;
+			if (r.bytesPerOp > 0.0)
+				file << ", \"bytes_per_s\": " << r.bytesPerOp * 1e9 / r.medianNs;
+			file << "}";
+		}
+		file << "\n  ]\n}\n";
+		return true;
+	}
+
+	static std::string escape(const std::string& text) {
+		std::string out;
+		for (char c : text) {
+			if (c == '"' || c == '\\') out += '\\';
+			out += c;
+		}
+		return out;
+	}
+
+	static std::string compiler() {
+#if defined(_MSC_VER)
+		return "msvc " + std::to_string(_MSC_VER);
+#elif defined(__clang__)
+		return "clang " + std::to_string(__clang_major__) + "." + std::to_string(__clang_minor__);
+#elif defined(__GNUC__)
+		return "gcc " + std::to_string(__GNUC__) + "." + std::to_string(__GNUC_MINOR__);
+#else
+		return "unknown";
+#endif
+	}
+};
+
+static void printUsage() {
+	std::cout << "usage: bench [--resources dir] [--json out.json] [--filter text] [--label text] [--samples n]\n"
+		"             [--max-seconds s] [--bullets n,n,..] [--enemies m,m,..] [--profile]" << std::endl;
+}
+
+static std::vector<int> parseList(const std::string& text) {
+	std::vector<int> values;
+	std::stringstream s(text);
+	std::string item;
+	while (std::getline(s, item, ','))
+		if (!item.empty()) values.push_back(atoi(item.c_str()));
+	return values;
+}
+
+static bool parseOptions(int argc, char** argv, BenchOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--resources" && i + 1 < argc) options.resources = argv[++i];
+		else if (arg == "--json" && i + 1 < argc) options.json = argv[++i];
+		else if (arg == "--filter" && i + 1 < argc) options.filter = argv[++i];
+		else if (arg == "--label" && i + 1 < argc) options.label = argv[++i];
+		else if (arg == "--samples" && i + 1 < argc) options.samples = atoi(argv[++i]);
+		else if (arg == "--max-seconds" && i + 1 < argc) options.maxSeconds = atof(argv[++i]);
+		else if (arg == "--bullets" && i + 1 < argc) options.bullets = parseList(argv[++i]);
+		else if (arg == "--enemies" && i + 1 < argc) options.enemies = parseList(argv[++i]);
+		else if (arg == "--profile") options.profile = true;
+		else return false;
+	}
+	if (options.samples < 1) options.samples = 1;
+	if (options.minSamples > options.samples) options.minSamples = options.samples;
+	return true;
+}
+
+// every file in a directory with the given extension, sorted so runs line up
+static std::vector<std::string> listFiles(const std::string& directory, const std::vector<std::string>& extensions) {
+	std::vector<std::string> files;
+	if (!std::filesystem::is_directory(directory)) return files;
+	for (auto& entry : std::filesystem::directory_iterator(directory)) {
+		std::string extension = entry.path().extension().string();
+		for (auto& e : extensions)
+			if (extension == e) files.push_back(entry.path().string());
+	}
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+static std::string fileName(const std::string& path) {
+	return std::filesystem::path(path).filename().string();
+}
+
+// fixed seed so every run measures the same inputs
+static float randomFloat(uint32_t& seed, float lo, float hi) {
+	seed = seed * 1664525u + 1013904223u;
+	return lo + (hi - lo) * ((seed >> 8) * (1.0f / 16777216.0f));
+}
+
+static void benchMath(BenchRunner& runner) {
+	if (!runner.selected({ "mathLib::Matrix::mul", "mathLib::Matrix::invert", "mathLib::Quaternion::slerp" })) return;
+	const int count = 64;
+	uint32_t seed = 1234;
+	std::vector<mathLib::Matrix> a(count), b(count), out(count);
+	for (int i = 0; i < count; i++) {
+		mathLib::Vec3 t(randomFloat(seed, -10, 10), randomFloat(seed, -10, 10), randomFloat(seed, -10, 10));
+		a[i] = mathLib::Matrix::rotateY(randomFloat(seed, 0, 6.28f)) * mathLib::Matrix::translation(t);
+		b[i] = mathLib::Matrix::rotateX(randomFloat(seed, 0, 6.28f)) * mathLib::Matrix::scaling(mathLib::Vec3(2, 2, 2));
+	}
+	int i = 0;
+	runner.run("mathLib::Matrix::mul", 1, [&] {
+		out[i] = a[i].mul(b[i]);
+		doNotOptimise(out[i]);
+		i = (i + 1) & (count - 1);
+	});
+	runner.run("mathLib::Matrix::invert", 1, [&] {
+		out[i] = a[i].invert();
+		doNotOptimise(out[i]);
+		i = (i + 1) & (count - 1);
+	});
+
+	// pairs far enough apart to take the acos/sin path, not the nlerp fallback
+	std::vector<mathLib::Quaternion> q1(count), q2(count), q(count);
+	for (int n = 0; n < count; n++) {
+		q1[n] = mathLib::Quaternion(randomFloat(seed, -1, 1), randomFloat(seed, -1, 1), randomFloat(seed, -1, 1), randomFloat(seed, -1, 1));
+		q2[n] = mathLib::Quaternion(randomFloat(seed, -1, 1), randomFloat(seed, -1, 1), randomFloat(seed, -1, 1), randomFloat(seed, -1, 1));
+		q1[n].normalize();
+		q2[n].normalize();
+	}
+	float t = 0.0f;
+	runner.run("mathLib::Quaternion::slerp", 1, [&] {
+		q[i] = mathLib::Quaternion::slerp(q1[i], q2[i], t);
+		doNotOptimise(q[i]);
+		i = (i + 1) & (count - 1);
+		t = t > 1.0f ? 0.0f : t + 0.01f;
+	});
+}
+
+static void benchAnimation(BenchRunner& runner, const std::string& gemDirectory) {
+	std::string filename = gemDirectory + "/TRex.gem";
+	std::string clip = "Run";
+	std::string name = "AnimationInstance::update TRex " + clip;
+	if (!runner.selected(name)) return;
+	if (!std::filesystem::exists(filename)) {
+		std::cout << "skipping " << name << ", " << filename << " not found" << std::endl;
+		return;
+	}
+	AnimatedRig trex;
+	trex.load(filename);
+	std::cout << "TRex: " << trex.animation.skeleton.bones.size() << " bones" << std::endl;
+	runner.run(name, 1, [&] {
+		trex.instance.update(clip, 1.0f / 60.0f);
+		doNotOptimise(trex.instance.matrices);
+	});
+}
+
+static void benchCollision(BenchRunner& runner) {
+	if (!runner.selected("Ray::intersectsAABB")) return;
+	const int count = 1024;
+	uint32_t seed = 99;
+	AABB box;
+	box.extend(mathLib::Vec3(-1, -1, -1));
+	box.extend(mathLib::Vec3(1, 1, 1));
+	// random rays aimed near the box, roughly half of them hit
+	std::vector<Ray> rays(count);
+	for (int n = 0; n < count; n++) {
+		mathLib::Vec3 o(randomFloat(seed, -10, 10), randomFloat(seed, -10, 10), randomFloat(seed, -10, 10));
+		mathLib::Vec3 target(randomFloat(seed, -2, 2), randomFloat(seed, -2, 2), randomFloat(seed, -2, 2));
+		rays[n].init(o, (target - o).normalize());
+	}
+	int i = 0;
+	int hits = 0;
+	runner.run("Ray::intersectsAABB", 1, [&] {
+		float tmin, tmax;
+		hits += rays[i].intersectsAABB(box, tmin, tmax) ? 1 : 0;
+		doNotOptimise(hits);
+		i = (i + 1) & (count - 1);
+	});
+}
+
+// ground queries at random points, and an edit with the chunk rebuild it causes
+static void benchTerrain(BenchRunner& runner) {
+	std::string editName = "TerrainMesh edit + rebuildDirty (radius 3)";
+	if (!runner.selected({ "Heightfield::heightAt", "Heightfield::normalAt", editName })) return;
+	const int count = 1024;
+	uint32_t seed = 5;
+	Heightfield field;
+	createGround(field);
+	TerrainMesh terrain;
+	terrain.build(field);
+	std::vector<mathLib::Vec3> points(count);
+	for (auto& point : points)
+		point = mathLib::Vec3(randomFloat(seed, -100, 100), 0.0f, randomFloat(seed, -100, 100));
+	runner.run("Heightfield::heightAt", count, [&] {
+		float sum = 0.0f;
+		for (auto& point : points)
+			sum += field.heightAt(point.x, point.z);
+		doNotOptimise(sum);
+	});
+	runner.run("Heightfield::normalAt", count, [&] {
+		mathLib::Vec3 sum;
+		for (auto& point : points)
+			sum += field.normalAt(point.x, point.z);
+		doNotOptimise(sum);
+	});
+	float delta = 0.1f;
+	runner.run(editName, 1, [&] {
+		terrain.markDirty(field.edit(50.0f, 50.0f, 3.0f, delta));
+		delta = -delta;
+		doNotOptimise(terrain.rebuildDirty());
+	});
+}
+
+// WinMain's grass layer scattered on one thread and on the job workers
+static void benchFoliage(BenchRunner& runner, const std::string& resources) {
+	std::string name = "FoliageField::generate grass";
+	std::string threadedName = name + " (" + std::to_string(JobSystem::threadCount()) + " threads)";
+	if (!runner.selected({ name, threadedName })) return;
+	Heightfield field;
+	createGround(field, resources);
+	DensityMap grassDensity, bambooDensity;
+	FoliageLayer grass, bamboo;
+	createFoliage(field, grassDensity, bambooDensity, grass, bamboo, resources);
+	FoliageField foliage;
+	runner.run(name, 1, [&] {
+		foliage.generate(grass);
+		doNotOptimise(foliage.stats);
+	});
+	if (runner.selected(threadedName)) {
+		JobSystem jobs;
+		jobs.init();
+		runner.run(threadedName, 1, [&] {
+			foliage.generate(grass, &jobs);
+			doNotOptimise(foliage.stats);
+		});
+	}
+	std::cout << "grass " << foliage.report() << std::endl;
+}
+
+// the shader's waves at 1024 points one at a time and as a batch, then an FFT ocean
+// tile on one thread and on the job workers
+static void benchWater(BenchRunner& runner) {
+	std::string oceanName = "OceanSpectrum::update 128x128";
+	std::string threadedName = oceanName + " (" + std::to_string(JobSystem::threadCount()) + " threads)";
+	if (!runner.selected({ "waterHeightAt (sinf)", "waterHeightAt", "waterHeightsAt", oceanName, threadedName })) return;
+	const int count = 1024;
+	uint32_t seed = 9;
+	std::vector<float> x(count), z(count), heights(count);
+	for (int i = 0; i < count; i++) {
+		x[i] = randomFloat(seed, -100, 100);
+		z[i] = randomFloat(seed, -100, 100);
+	}
+	WaveParams waves;
+	float time = 1.5f;
+	runner.run("waterHeightAt (sinf)", count, [&] {
+		float phase = time * waves.speed;
+		for (int i = 0; i < count; i++)
+			heights[i] = sinf(x[i] * waves.frequency + phase) * waves.amplitude + cosf(z[i] * waves.frequency + phase) * waves.amplitude;
+		doNotOptimise(heights);
+	});
+	runner.run("waterHeightAt", count, [&] {
+		for (int i = 0; i < count; i++)
+			heights[i] = waterHeightAt(waves, x[i], z[i], time);
+		doNotOptimise(heights);
+	});
+	runner.run("waterHeightsAt", count, [&] {
+		waterHeightsAt(waves, x.data(), z.data(), count, time, heights.data());
+		doNotOptimise(heights);
+	});
+	if (!runner.selected({ oceanName, threadedName })) return;
+	OceanSpectrum ocean;
+	ocean.init(128, 32.0f, 8.0f, 1.0f, 0.5f, 0.3f);
+	ocean.choppiness = 1.0f;
+	runner.run(oceanName, 1, [&] {
+		time += 1.0f / 60.0f;
+		ocean.update(time);
+		doNotOptimise(ocean.heights);
+	});
+	if (!runner.selected(threadedName)) return;
+	JobSystem jobs;
+	jobs.init();
+	runner.run(threadedName, 1, [&] {
+		time += 1.0f / 60.0f;
+		ocean.update(time, &jobs);
+		doNotOptimise(ocean.heights);
+	});
+}
+
+// 1024 boxes scattered around a camera at the origin, batch SoA test against one box at a time
+static void benchFrustum(BenchRunner& runner) {
+	const int count = 1024;
+	std::string batchName = "Frustum::cullAABBs " + std::to_string(count) + " boxes";
+	std::string singleName = "Frustum::containsAABB " + std::to_string(count) + " boxes";
+	if (!runner.selected({ batchName, singleName })) return;
+	uint32_t seed = 7;
+	std::vector<AABB> boxes(count);
+	for (auto& box : boxes) {
+		mathLib::Vec3 c(randomFloat(seed, -100, 100), randomFloat(seed, -5, 5), randomFloat(seed, -100, 100));
+		box.extend(c - mathLib::Vec3(1, 1, 1));
+		box.extend(c + mathLib::Vec3(1, 1, 1));
+	}
+	BoundsBatch batch;
+	batch.build(boxes);
+	mathLib::Vec3 from(0, 2, 0), to(0, 2, 1), up(0, 1, 0);
+	mathLib::Matrix view = mathLib::view(from, to, up);
+	mathLib::Matrix vp = view * mathLib::Matrix::perspectiveProjection(1.f, 60.0f * M_PI / 180.0f, 200.f, 0.1f);
+	mathLib::Frustum frustum(vp);
+	VisibilitySet visible;
+	visible.resize(count);
+	runner.run(batchName, count, [&] {
+		frustum.cullAABBs(batch.cx.data(), batch.cy.data(), batch.cz.data(), batch.ex.data(), batch.ey.data(), batch.ez.data(), batch.size(), visible.words);
+		doNotOptimise(visible.words[0]);
+	});
+	runner.run(singleName, count, [&] {
+		for (int i = 0; i < count; i++)
+			visible.set(i, frustum.containsAABB(boxes[i].min, boxes[i].max));
+		doNotOptimise(visible.words[0]);
+	});
+}
+
+// a frame of 4096 packets over 4 shaders, 64 materials and 256 meshes, submitted in random order
+static void benchRenderQueue(BenchRunner& runner) {
+	const int count = 4096;
+	std::string submitName = "RenderQueue submit " + std::to_string(count);
+	std::string sortName = "RenderQueue sort " + std::to_string(count);
+	std::string executeName = "RenderQueue execute " + std::to_string(count) + " (recording backend)";
+	std::string ringName = "UploadRing allocate " + std::to_string(count);
+	if (!runner.selected({ submitName, sortName, executeName, ringName })) return;
+	uint32_t seed = 11;
+	std::vector<DrawPacket> packets(count);
+	for (auto& packet : packets) {
+		packet.shader = (RenderHandle)(randomFloat(seed, 0, 4));
+		packet.textures[0] = (RenderHandle)(randomFloat(seed, 0, 64)) * 2;
+		packet.textures[1] = packet.textures[0] + 1;
+		packet.sampler = 0;
+		packet.mesh = (RenderHandle)(randomFloat(seed, 0, 256));
+		packet.depth = randomFloat(seed, 0, 200);
+	}
+	mathLib::Matrix constants[2];
+	RenderQueue queue;
+	RecordingBackend recorder;
+	runner.run(submitName, count, [&] {
+		queue.begin();
+		for (auto& packet : packets) {
+			DrawPacket p = packet;
+			p.constantOffset = queue.pushConstants(constants, sizeof(constants));
+			p.constantSize = sizeof(constants);
+			queue.submit(p);
+		}
+		doNotOptimise(queue);
+	});
+	runner.run(sortName, count, [&] {
+		queue.sort();
+		doNotOptimise(queue);
+	});
+	runner.run(executeName, count, [&] {
+		recorder.clear();
+		queue.execute(recorder);
+		doNotOptimise(recorder.commands);
+	});
+	// one frame of draw-sized blocks, retired two frames later like a GPU would
+	UploadRing ring;
+	ring.init(4 << 20);
+	uint64_t fence = 0;
+	runner.run(ringName, count, [&] {
+		ring.retire(fence > 2 ? fence - 2 : 0);
+		ring.beginFrame();
+		uint32_t offset = 0;
+		for (int i = 0; i < count; i++)
+			ring.allocate(sizeof(constants), offset);
+		ring.endFrame(++fence);
+		doNotOptimise(offset);
+	});
+}
+
+// CPU cost of a WinMain frame up to the device: cull, record, sort and execute into a
+// null device, with and without the command stream being written
+static void benchFrameBuild(BenchRunner& runner, const std::string& resources) {
+	auto name = [](int ring, int recording) {
+		return std::string("frame build: WinMain scene, null device") + (ring ? ", upload ring" : "") + (recording ? " (recording)" : "");
+	};
+	if (!runner.selected({ name(0, 1), name(0, 0), name(1, 1), name(1, 0) })) return;
+	std::string gemDirectory = resources + "/GemModel";
+	NullDevice device;
+	DeviceBackend backend;
+	backend.init(&device);
+	Heightfield field;
+	createGround(field, resources);
+	TerrainMesh terrain;
+	terrain.build(field);
+	DensityMap grassDensity, bambooDensity;
+	FoliageLayer grassLayer, bambooLayer;
+	createFoliage(field, grassDensity, bambooDensity, grassLayer, bambooLayer, resources);
+	HeadlessScene scene;
+	if (!scene.init(backend, device, gemDirectory, terrain, grassLayer, bambooLayer)) {
+		std::cout << "skipping frame build, could not load the scene from " << gemDirectory << std::endl;
+		return;
+	}
+	mathLib::Vec3 from(0, 5, -30), to(0, 0, 0), up(0, 1, 0);
+	mathLib::Matrix vp = mathLib::view(from, to, up) * mathLib::Matrix::perspectiveProjection(1.f, 60.0f * M_PI / 180.0f, 200.f, 0.1f);
+	mathLib::Matrix playerWorld;
+	std::vector<mathLib::Matrix> bones(256);
+	LodSelector lods;
+	lods.init(from, 60.0f * M_PI / 180.0f, 768.0f);
+	RenderQueue queue;
+	ClusterCuller clusters;
+	FrameArena memory;
+	for (int ring = 0; ring <= 1; ring++) {
+		backend.enableUploadRing(ring ? 4 << 20 : 0);
+		for (int recording = 1; recording >= 0; recording--) {
+			device.recording = recording != 0;
+			runner.run(name(ring, recording), 1, [&] {
+				device.stream.clear();
+				memory.reset();
+				clusters.begin(vp, from);
+				scene.record(queue, memory, vp, from, playerWorld, bones.data(), &lods, &clusters);
+				queue.sort();
+				queue.execute(backend);
+				doNotOptimise(device.counters);
+			});
+		}
+	}
+}
+
+// transient per-frame data: many small blocks and a growing list, from the arena and from the heap
+static void benchFrameArena(BenchRunner& runner) {
+	const int count = 256;
+	std::string arenaName = "FrameArena allocate " + std::to_string(count) + " x 64 B + reset";
+	std::string heapName = "operator new " + std::to_string(count) + " x 64 B + delete";
+	std::string frameVectorName = "FrameVector<AABB> push_back " + std::to_string(count);
+	std::string vectorName = "std::vector<AABB> push_back " + std::to_string(count);
+	if (!runner.selected({ arenaName, heapName, frameVectorName, vectorName })) return;
+	FrameArena arena;
+	std::vector<void*> blocks(count);
+	runner.run(arenaName, count, [&] {
+		for (int i = 0; i < count; i++)
+			blocks[i] = arena.allocate(64);
+		doNotOptimise(blocks);
+		arena.reset();
+	});
+	runner.run(heapName, count, [&] {
+		for (int i = 0; i < count; i++)
+			blocks[i] = new unsigned char[64];
+		doNotOptimise(blocks);
+		for (int i = 0; i < count; i++)
+			delete[] (unsigned char*)blocks[i];
+	});
+	AABB box;
+	runner.run(frameVectorName, count, [&] {
+		FrameVector<AABB> boxes{ FrameAllocator<AABB>(arena) };
+		for (int i = 0; i < count; i++)
+			boxes.push_back(box);
+		doNotOptimise(boxes);
+		arena.reset();
+	});
+	runner.run(vectorName, count, [&] {
+		std::vector<AABB> boxes;
+		for (int i = 0; i < count; i++)
+			boxes.push_back(box);
+		doNotOptimise(boxes);
+	});
+}
+
+// scheduler overhead, then the job system's first users: a crowd of animated instances
+// and loading every .gem file, serial and spread over the workers
+static void benchJobs(BenchRunner& runner, const std::string& gemDirectory) {
+	std::string threads = " (" + std::to_string(JobSystem::threadCount()) + " threads)";
+	const int count = 1024;
+	const size_t crowdSize = 64;
+	std::vector<std::string> files = listFiles(gemDirectory, { ".gem" });
+	std::string runName = "JobSystem run + wait " + std::to_string(count) + " jobs" + threads;
+	std::string crowdName = "AnimationInstance::update x" + std::to_string(crowdSize);
+	std::string loadName = "GEMModelLoader::load all " + std::to_string(files.size()) + " files";
+	bool crowdSelected = runner.selected({ crowdName + " serial", crowdName + " parallelFor" + threads });
+	bool loadSelected = runner.selected({ loadName + " serial", loadName + " parallelFor" + threads });
+	if (!runner.selected(runName) && !crowdSelected && !loadSelected) return;
+	JobSystem jobs;
+	jobs.init();
+	std::atomic<int> sink(0);
+	runner.run(runName, count, [&] {
+		JobCounter counter;
+		for (int i = 0; i < count; i++)
+			jobs.run([&sink] { sink.fetch_add(1, std::memory_order_relaxed); }, &counter);
+		jobs.wait(counter);
+	});
+
+	std::string filename = gemDirectory + "/TRex.gem";
+	if (crowdSelected && std::filesystem::exists(filename)) {
+		AnimatedRig trex;
+		trex.load(filename);
+		std::string clip = "Run";
+		std::vector<AnimationInstance> crowd(crowdSize);
+		for (size_t i = 0; i < crowd.size(); i++) {
+			crowd[i].animation = &trex.animation;
+			crowd[i].update(clip, 0.1f * i);
+		}
+		runner.run(crowdName + " serial", (double)crowd.size(), [&] {
+			for (auto& instance : crowd)
+				instance.update(clip, 1.0f / 60.0f);
+			doNotOptimise(crowd[0].matrices);
+		});
+		runner.run(crowdName + " parallelFor" + threads, (double)crowd.size(), [&] {
+			jobs.parallelFor(crowd.size(), 4, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++)
+					crowd[i].update(clip, 1.0f / 60.0f);
+			});
+			doNotOptimise(crowd[0].matrices);
+		});
+	}
+
+	if (!loadSelected) return;
+	auto load = [&](size_t begin, size_t end) {
+		GEMLoader::GEMModelLoader loader;
+		for (size_t i = begin; i < end; i++) {
+			std::vector<GEMLoader::GEMMesh> meshes;
+			GEMLoader::GEMAnimation animation;
+			if (loader.isAnimatedModel(files[i]))
+				loader.load(files[i], meshes, animation);
+			else
+				loader.load(files[i], meshes);
+			doNotOptimise(meshes);
+		}
+	};
+	runner.run(loadName + " serial", (double)files.size(), [&] { load(0, files.size()); });
+	runner.run(loadName + " parallelFor" + threads, (double)files.size(), [&] { jobs.parallelFor(files.size(), 1, load); });
+}
+
+static void benchShooting(BenchRunner& runner, int bulletCount, int enemyCount) {
+	std::string name = "ShootingSystem::update " + std::to_string(bulletCount) + " bullets x " + std::to_string(enemyCount) + " enemies";
+	if (!runner.selected(name)) return;
+	EntityWorld world;
+	ShootingSystem shooting(world, nullptr);
+	// enemies on a grid above the bullets, so every bullet tests every enemy and nothing is removed
+	for (int e = 0; e < enemyCount; e++) {
+		mathLib::Vec3 centre((e % 16) * 3.0f, 50.0f + (e / 16) * 3.0f, 0.0f);
+		shooting.addEnemy(centre - mathLib::Vec3(1, 1, 1), centre + mathLib::Vec3(1, 1, 1), 100);
+	}
+	// each sample starts from the same bullets, a batch moves them a little further along z
+	runner.run(name, bulletCount, 0.0, [&] {
+		shooting.update(1.0f / 60.0f);
+		doNotOptimise(shooting.bullets);
+	}, [&] {
+		shooting.clearBullets();
+		for (int b = 0; b < bulletCount; b++) {
+			mathLib::Vec3 position((b % 32) * 0.5f, 0.0f, (b / 32) * 0.5f);
+			shooting.spawnBullet(position, mathLib::Vec3(0.0f, 0.0f, 1.0f), 50.0f, 1e6f);
+		}
+	});
+}
+
+// a query walking two archetypes (half the entities also have Health), serial and over the jobs
+static void benchEntities(BenchRunner& runner) {
+	std::string threads = " (" + std::to_string(JobSystem::threadCount()) + " threads)";
+	const int count = 100000;
+	std::string name = "EntityWorld query Transform + Velocity x" + std::to_string(count);
+	if (!runner.selected({ name + " serial", name + " parallelEach" + threads })) return;
+	JobSystem jobs;
+	jobs.init();
+	EntityWorld world;
+	for (int i = 0; i < count; i++) {
+		Transform transform;
+		transform.position = mathLib::Vec3((float)i, 0.0f, 0.0f);
+		Velocity velocity;
+		velocity.value = mathLib::Vec3(0.0f, 0.0f, 1.0f);
+		Health health;
+		health.current = health.maximum = 100;
+		if (i & 1) world.create(transform, velocity, health);
+		else world.create(transform, velocity);
+	}
+	Query<Transform, Velocity> moving = world.query<Transform, Velocity>();
+	auto step = [](Entity, Transform& transform, Velocity& velocity) { transform.position += velocity.value * (1.0f / 60.0f); };
+	std::cout << "EntityWorld: " << count << " entities in " << world.chunkCount() << " chunks" << std::endl;
+	runner.run(name + " serial", count, [&] {
+		moving.each(step);
+		doNotOptimise(world);
+	});
+	runner.run(name + " parallelEach" + threads, count, [&] {
+		moving.parallelEach(jobs, step);
+		doNotOptimise(world);
+	});
+}
+
+static void benchGemLoad(BenchRunner& runner, const std::string& gemDirectory) {
+	for (auto& filename : listFiles(gemDirectory, { ".gem" })) {
+		std::string name = "GEMModelLoader::load " + fileName(filename);
+		if (!runner.selected(name)) continue;
+		double bytes = (double)std::filesystem::file_size(filename);
+		GEMLoader::GEMModelLoader loader;
+		bool animated = loader.isAnimatedModel(filename);
+		runner.run(name, 1, bytes, [&] {
+			std::vector<GEMLoader::GEMMesh> meshes;
+			GEMLoader::GEMAnimation animation;
+			if (animated)
+				loader.load(filename, meshes, animation);
+			else
+				loader.load(filename, meshes);
+			doNotOptimise(meshes);
+		}, [] {});
+	}
+}
+
+static void benchTextureDecode(BenchRunner& runner, const std::string& textureDirectory) {
+	for (auto& filename : listFiles(textureDirectory, { ".png", ".bmp", ".jpg", ".tga" })) {
+		std::string name = "texture decode " + fileName(filename);
+		if (!runner.selected(name)) continue;
+		double bytes = (double)std::filesystem::file_size(filename);
+		Image probe;
+		if (!probe.load(filename)) {
+			std::cout << "skipping " << name << ", stb_image cannot decode it: " << stbi_failure_reason() << std::endl;
+			continue;
+		}
+		runner.run(name, 1, bytes, [&] {
+			Image image;
+			image.load(filename);
+			doNotOptimise(image.texels);
+		}, [] {});
+	}
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage();
+		return 1;
+	}
+	// zones cost a ring buffer write each, leave them out of the numbers unless asked for
+	Profiler::setEnabled(options.profile);
+	BenchRunner runner(options);
+	std::string gemDirectory = options.resources + "/GemModel";
+
+	benchMath(runner);
+	benchAnimation(runner, gemDirectory);
+	benchCollision(runner);
+	benchTerrain(runner);
+	benchFoliage(runner, options.resources);
+	benchWater(runner);
+	benchFrustum(runner);
+	benchRenderQueue(runner);
+	benchFrameBuild(runner, options.resources);
+	benchFrameArena(runner);
+	benchJobs(runner, gemDirectory);
+	for (int bullets : options.bullets)
+		for (int enemies : options.enemies)
+			benchShooting(runner, bullets, enemies);
+	benchEntities(runner);
+	benchGemLoad(runner, gemDirectory);
+	benchTextureDecode(runner, options.resources + "/Textures");
+
+	if (!options.json.empty()) {
+		if (runner.writeJson(options.json))
+			std::cout << "wrote " << options.json << std::endl;
+		else {
+			std::cout << "could not write " << options.json << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -1,6 +1,8 @@
 ﻿#pragma once
 #include "mathLib.h"
 #include "player.h"
+#include "input.h"
+#include "terrain.h"
 
 //class FPSCamera {
 //public:
@@ -122,7 +124,7 @@ public:
 	}
 
 	// mouse movement process
-	void processMouse(Window& canvas) {
+	void processMouse(InputSource& canvas) {
 		float deltaX, deltaY;
 		canvas.getMouseMovement(deltaX, deltaY);
 
@@ -150,11 +152,12 @@ private:
 	}
 };
 
-static float getGroundHeight(const mathLib::Vec3& position) {
-	return 0.0f;
+// the ground under position, 0 without a heightfield
+static float getGroundHeight(const Heightfield* ground, const mathLib::Vec3& position) {
+	return ground ? ground->heightAt(position.x, position.z) : 0.0f;
 }
 
-static void handleInput(Player& player, TPSCamera& camera, Window& canvas, float deltaTime, AABB& obstacle) {
+static void handleInput(Player& player, TPSCamera& camera, InputSource& canvas, float deltaTime, AABB& obstacle, const Heightfield* ground = nullptr) {
 	// Forward and right direction of the player
 	mathLib::Vec3 forward = camera.target - camera.position;
 	forward.y = 0;
@@ -163,7 +166,7 @@ static void handleInput(Player& player, TPSCamera& camera, Window& canvas, float
 	mathLib::Vec3 right = mathLib::Vec3(0.0f, 1.0f, 0.0f).cross(forward).normalize();
 
 	// attack logic
-	if (canvas.keys['J'] && !player.isAttacking) {
+	if (canvas.keyDown('J') && !player.isAttacking) {
 		player.isAttacking = true;
 		player.attackAnimationTime = 0.0f; // reset animation time
 		player.updateAnimation("attack", deltaTime); // switch to attack animation
@@ -172,20 +175,20 @@ static void handleInput(Player& player, TPSCamera& camera, Window& canvas, float
 	// player move
 	if (!player.isAttacking) {
 		mathLib::Vec3 moveDirection(0.0f, 0.0f, 0.0f);
-		if (canvas.keys['W'])
+		if (canvas.keyDown('W'))
 			moveDirection += forward;
-		if (canvas.keys['S'])
+		if (canvas.keyDown('S'))
 			moveDirection -= forward;
-		if (canvas.keys['D'])
+		if (canvas.keyDown('D'))
 			moveDirection -= right;
-		if (canvas.keys['A'])
+		if (canvas.keyDown('A'))
 			moveDirection += right;
 
 		if (!(moveDirection.x == 0 && moveDirection.y == 0 && moveDirection.z == 0)) {
 			moveDirection = moveDirection.normalize();
 		}
 
-		player.update(moveDirection, forward, obstacle, deltaTime);
+		player.update(moveDirection, obstacle, deltaTime);
 	}
 	else {
 		player.attackAnimationTime += deltaTime;
@@ -203,6 +206,6 @@ static void handleInput(Player& player, TPSCamera& camera, Window& canvas, float
 	camera.processMouse(canvas);
 
 	// constrain player's position
-	float groundHeight = getGroundHeight(player.position);
+	float groundHeight = getGroundHeight(ground, player.position);
 	player.stayOnGround(groundHeight);
 }
@@ -0,0 +1,196 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include "mathLib.h"
+#include "meshlet.h"
+#include "culling.h"
+#include "visibility.h"
+#include "frameArena.h"
+#include "renderDevice.h"
+#include "timer.h"
+#include "profiler.h"
+
+struct ClusterCullingStats {
+	uint64_t clusters = 0;              // tested
+	uint64_t frustumCulled = 0;
+	uint64_t backfaceCulled = 0;
+	uint64_t triangles = 0;             // of the instances tested
+	uint64_t trianglesKept = 0;
+	double ms = 0.0;
+};
+
+// Per-cluster culling of meshlet meshes, after the instance itself passed the
+// frustum: the cluster spheres go through the frustum four at a time, the clusters
+// left are dropped when their normal cone faces away from the camera, and the index
+// runs of the rest are appended to a per-frame index list. Cone culling is only
+// right for surfaces that are never seen from behind (closed meshes, the ground),
+// the caller decides. Reuses its buffers, no allocations once warm.
+class ClusterCuller {
+public:
+	ClusterCullingStats stats;
+
+	void begin(const mathLib::Matrix& vp, const mathLib::Vec3& cameraPosition) {
+		frustum.extract(vp);
+		camera = cameraPosition;
+		stats = ClusterCullingStats();
+	}
+
+	// the kept triangles of mesh, drawn with world, appended to out (a vector of 16 or 32
+	// bit indices) as indices into the mesh's vertices; returns how many were appended
+	template<typename Indices>
+	size_t cull(const MeshletMesh& mesh, const std::vector<unsigned int>& indices, const mathLib::Matrix& world, Indices& out,
+		bool cones = true) {
+		PROFILE_SCOPE("cull: clusters");
+		Timer timer;
+		size_t start = out.size();
+		// largest axis scale for the radii; cones need the same scale on every axis
+		float scale[3];
+		for (int j = 0; j < 3; j++)
+			scale[j] = sqrtf(world.a[0][j] * world.a[0][j] + world.a[1][j] * world.a[1][j] + world.a[2][j] * world.a[2][j]);
+		float maxScale = scale[0] > scale[1] ? (scale[0] > scale[2] ? scale[0] : scale[2]) : (scale[1] > scale[2] ? scale[1] : scale[2]);
+		float minScale = scale[0] < scale[1] ? (scale[0] < scale[2] ? scale[0] : scale[2]) : (scale[1] < scale[2] ? scale[1] : scale[2]);
+		cones = cones && maxScale > 0.0f && minScale > maxScale * 0.99f;
+
+		spheres.clear();
+		for (const MeshletBounds& b : mesh.bounds)
+			spheres.add(transformPoint(world, b.center), b.radius * maxScale);
+		visible.resize(spheres.size(), false);
+		frustum.cullSpheres(spheres.x.data(), spheres.y.data(), spheres.z.data(), spheres.radius.data(), spheres.size(), visible.words);
+
+		// neighbouring clusters that are both kept are copied as one run
+		size_t runStart = 0;
+		size_t runEnd = 0;
+		for (size_t i = 0; i < mesh.size(); i++) {
+			const Meshlet& m = mesh.meshlets[i];
+			stats.clusters++;
+			stats.triangles += m.triangleCount;
+			if (!visible.test(i)) {
+				stats.frustumCulled++;
+				continue;
+			}
+			if (cones && facesAway(world, mesh.bounds[i], maxScale)) {
+				stats.backfaceCulled++;
+				continue;
+			}
+			stats.trianglesKept += m.triangleCount;
+			if (m.firstIndex != runEnd) {
+				append(indices, runStart, runEnd, out);
+				runStart = m.firstIndex;
+			}
+			runEnd = m.firstIndex + m.triangleCount * 3;
+		}
+		append(indices, runStart, runEnd, out);
+		stats.ms += timer.elapsed() * 1000.0;
+		return out.size() - start;
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "clusters: " << stats.clusters << " tested, " << stats.frustumCulled << " outside the frustum, " << stats.backfaceCulled
+			<< " facing away, " << stats.trianglesKept << "/" << stats.triangles << " triangles kept, " << stats.ms << " ms";
+		return out.str();
+	}
+
+private:
+	mathLib::Frustum frustum;
+	mathLib::Vec3 camera;
+	SphereBatch spheres;
+	VisibilitySet visible;
+
+	static mathLib::Vec3 transformPoint(const mathLib::Matrix& m, const mathLib::Vec3& p) {
+		return mathLib::Vec3(m.a[0][0] * p.x + m.a[0][1] * p.y + m.a[0][2] * p.z + m.a[0][3],
+			m.a[1][0] * p.x + m.a[1][1] * p.y + m.a[1][2] * p.z + m.a[1][3],
+			m.a[2][0] * p.x + m.a[2][1] * p.y + m.a[2][2] * p.z + m.a[2][3]);
+	}
+
+	bool facesAway(const mathLib::Matrix& world, const MeshletBounds& b, float scale) const {
+		if (b.coneCutoff >= 1.0f) return false;
+		mathLib::Vec3 center = transformPoint(world, b.center);
+		const mathLib::Vec3& a = b.coneAxis;
+		// uniform scale: the rotated axis only needs the scale taken out
+		mathLib::Vec3 axis((world.a[0][0] * a.x + world.a[0][1] * a.y + world.a[0][2] * a.z) / scale,
+			(world.a[1][0] * a.x + world.a[1][1] * a.y + world.a[1][2] * a.z) / scale,
+			(world.a[2][0] * a.x + world.a[2][1] * a.y + world.a[2][2] * a.z) / scale);
+		mathLib::Vec3 view = center - camera;
+		float d = view.x * axis.x + view.y * axis.y + view.z * axis.z;
+		return d >= b.coneCutoff * view.getLength() + b.radius * scale;
+	}
+
+	template<typename Indices>
+	static void append(const std::vector<unsigned int>& indices, size_t begin, size_t end, Indices& out) {
+		typedef typename Indices::value_type Index;
+		for (size_t i = begin; i < end; i++)
+			out.push_back((Index)indices[i]);
+	}
+};
+
+// The GPU side of a culled meshlet mesh: a dynamic index buffer the culled indices of
+// every instance drawn in a frame go into, bound with the mesh's vertex buffer. Per
+// frame: begin() with the frame's arena, add() per instance (each gives its packet an
+// index range), then upload() once before the queue executes. The buffer is sized for
+// the worst case, every cluster of every instance, so it never grows; the CPU list is
+// arena memory with room for last frame's count and a quarter more.
+class ClusterDrawList {
+public:
+	RenderHandle mesh = InvalidRenderHandle;
+
+	bool ready() const { return device != nullptr; }
+
+	void init(DeviceBackend& backend, RenderDevice& _device, DeviceHandle vertexBuffer, uint32_t stride, IndexFormat _format, size_t maxIndices) {
+		device = &_device;
+		format = _format;
+		capacity = maxIndices;
+		BufferDesc desc;
+		desc.binding = BindIndexBuffer;
+		desc.size = (uint32_t)(maxIndices * (format == Index16 ? sizeof(uint16_t) : sizeof(uint32_t)));
+		desc.dynamic = true;
+		indexBuffer = device->createBuffer(desc, nullptr);
+		mesh = backend.addMesh(vertexBuffer, indexBuffer, stride, 0, format);
+	}
+
+	// the indices of this frame go into memory, which has to outlive upload()
+	void begin(FrameArena& memory) {
+		size_t expected = used() + used() / 4;
+		if (expected > capacity) expected = capacity;
+		if (format == Index16) {
+			shortIndices = FrameVector<uint16_t>(FrameAllocator<uint16_t>(memory));
+			shortIndices.reserve(expected);
+		}
+		else {
+			longIndices = FrameVector<uint32_t>(FrameAllocator<uint32_t>(memory));
+			longIndices.reserve(expected);
+		}
+	}
+
+	// culls one instance; false when nothing of it is left, otherwise the range to draw
+	bool add(ClusterCuller& culler, const MeshletMesh& meshlets, const std::vector<unsigned int>& indices, const mathLib::Matrix& world,
+		uint32_t& firstIndex, uint32_t& indexCount, bool cones = true) {
+		size_t first = used();
+		if (first + indices.size() > capacity) return false;
+		size_t count = format == Index16 ? culler.cull(meshlets, indices, world, shortIndices, cones) : culler.cull(meshlets, indices, world, longIndices, cones);
+		firstIndex = (uint32_t)first;
+		indexCount = (uint32_t)count;
+		return count > 0;
+	}
+
+	void upload() {
+		size_t bytes = format == Index16 ? shortIndices.size() * sizeof(uint16_t) : longIndices.size() * sizeof(uint32_t);
+		if (bytes == 0) return;
+		void* dst = device->map(indexBuffer);
+		if (dst) memcpy(dst, format == Index16 ? (const void*)shortIndices.data() : (const void*)longIndices.data(), bytes);
+		device->unmap(indexBuffer);
+	}
+
+private:
+	RenderDevice* device = nullptr;
+	DeviceHandle indexBuffer = InvalidDeviceHandle;
+	IndexFormat format = Index32;
+	size_t capacity = 0;
+	FrameVector<uint16_t> shortIndices;
+	FrameVector<uint32_t> longIndices;
+
+	size_t used() const { return format == Index16 ? shortIndices.size() : longIndices.size(); }
+};
@@ -21,6 +21,16 @@ public:
 		min = Min(min, p);
 	}
 
+	// bounds of this box after a transform, e.g. a local model AABB moved into world space
+	AABB transformed(mathLib::Matrix& m) const {
+		AABB out;
+		for (int i = 0; i < 8; i++) {
+			mathLib::Vec3 corner((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+			out.extend(m.mulPoint(corner));
+		}
+		return out;
+	}
+
 	bool intersects(const AABB& other) const {
 		return (min.x <= other.max.x && max.x >= other.min.x &&
 			min.y <= other.max.y && max.y >= other.min.y &&
@@ -149,7 +159,7 @@ public:
 	}
 };
 
-bool AABB::intersects(const Sphere& sphere) {
+inline bool AABB::intersects(const Sphere& sphere) {
 	float distSquared = 0.0f;// Initialize the square of the shortest distance from the center of the sphere to the AABB.
 	for (int i = 0; i < 3; ++i) {// Iterate over the x, y, and z axes.
 		float v = sphere.centre[i];  // Get the coordinates of the center of the sphere in the current axis
@@ -157,13 +167,11 @@ bool AABB::intersects(const Sphere& sphere) {
 		if (v < min[i]) distSquared += (min[i] - v) * (min[i] - v);
 		if (v > max[i]) distSquared += (v - max[i]) * (v - max[i]);
 	}
-	std::cout << "Distance Squared: " << distSquared << "\n";
-	std::cout << "Sphere Radius Squared: " << sphere.radius * sphere.radius << "\n";
 	//  Compare the square of the shortest distance from the center of the sphere to AABB to the square of the radius of the sphere.
 	return distSquared <= sphere.radius * sphere.radius;
 }
 
-bool AABB::intersects(Ray& ray, float& tmin, float& tmax) {
+inline bool AABB::intersects(Ray& ray, float& tmin, float& tmax) {
 	tmin = 0.0f;
 	tmax = FLT_MAX;
 
@@ -181,7 +189,7 @@ bool AABB::intersects(Ray& ray, float& tmin, float& tmax) {
 	return true;
 }
 
-bool Sphere::intersects(Ray& ray, float& t) {
+inline bool Sphere::intersects(Ray& ray, float& t) {
 	mathLib::Vec3 oc = ray.o - centre;
 
 	float a = dot(ray.dir, ray.dir);
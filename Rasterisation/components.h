@@ -0,0 +1,44 @@
+#pragma once
+#include "mathLib.h"
+#include "collision.h"
+#include "transformHierarchy.h"
+
+class AnimatedRig;
+
+// Gameplay components for EntityWorld (ecs.h). Plain data, systems hold the logic.
+
+// where the entity is; node is its TransformHierarchy node when it is drawn with a
+// world matrix, NoTransform for things like bullets that only have a position
+struct Transform {
+	mathLib::Vec3 position;
+	TransformId node = NoTransform;
+};
+
+// world space box for collision and culling
+struct Bounds {
+	AABB box;
+};
+
+// skeleton and animation state, owned elsewhere
+struct AnimatedModelRef {
+	AnimatedRig* rig = nullptr;
+};
+
+struct Health {
+	int current = 0;
+	int maximum = 0;
+
+	bool alive() const { return current > 0; }
+};
+
+// units per second
+struct Velocity {
+	mathLib::Vec3 value;
+};
+
+// bullets: removed when lifeTime runs out or they hit something
+struct Projectile {
+	float lifeTime = 0.0f;      // seconds left
+	float radius = 0.2f;
+	int damage = 0;
+};
@@ -0,0 +1,114 @@
+#pragma once
+#include <vector>
+#include "mathLib.h"
+#include "collision.h"
+#include "visibility.h"
+#include "timer.h"
+#include "profiler.h"
+#include "jobSystem.h"
+
+// Instance AABBs as centre / half extent arrays for mathLib::Frustum::cullAABBs.
+// Static instances (grass, trees, pool walls) build this once after loading.
+class BoundsBatch {
+public:
+	std::vector<float> cx, cy, cz;
+	std::vector<float> ex, ey, ez;
+
+	void build(const std::vector<AABB>& boxes) {
+		build(boxes.data(), boxes.size());
+	}
+
+	void build(const AABB* boxes, size_t n) {
+		cx.resize(n); cy.resize(n); cz.resize(n);
+		ex.resize(n); ey.resize(n); ez.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			const AABB& b = boxes[i];
+			cx[i] = (b.min.x + b.max.x) * 0.5f;
+			cy[i] = (b.min.y + b.max.y) * 0.5f;
+			cz[i] = (b.min.z + b.max.z) * 0.5f;
+			ex[i] = (b.max.x - b.min.x) * 0.5f;
+			ey[i] = (b.max.y - b.min.y) * 0.5f;
+			ez[i] = (b.max.z - b.min.z) * 0.5f;
+		}
+	}
+
+	size_t size() const { return cx.size(); }
+};
+
+// Bounding spheres, same layout
+class SphereBatch {
+public:
+	std::vector<float> x, y, z, radius;
+
+	void add(const mathLib::Vec3& centre, float r) {
+		x.push_back(centre.x);
+		y.push_back(centre.y);
+		z.push_back(centre.z);
+		radius.push_back(r);
+	}
+
+	void clear() {
+		x.clear(); y.clear(); z.clear(); radius.clear();
+	}
+
+	size_t size() const { return x.size(); }
+};
+
+struct CullingStats {
+	int tested = 0;
+	int visible = 0;
+	double ms = 0.0;
+};
+
+// View-frustum culling, the first culling stage. Planes come from the same VP that is
+// uploaded to the shaders, so there is no separate camera description to keep in sync.
+// Usage per frame: begin(vp), then cull(batch, visible) per instance list and
+// isVisible(box) for single objects. The occlusion pass then only refines the bits
+// that are still set.
+class FrustumCuller {
+public:
+	static const size_t ParallelGrain = 1024;  // boxes per job, a multiple of 64
+
+	mathLib::Frustum frustum;
+	CullingStats stats;
+
+	void begin(const mathLib::Matrix& vp) {
+		frustum.extract(vp);
+		stats = CullingStats();
+	}
+
+	// with jobs, big batches are split into chunks of whole visibility words over the workers
+	void cull(const BoundsBatch& batch, VisibilitySet& visible, JobSystem* jobs = nullptr) {
+		PROFILE_SCOPE("cull: frustum");
+		Timer timer;
+		visible.resize(batch.size(), false);
+		if (jobs) {
+			jobs->parallelFor(batch.size(), ParallelGrain, [&](size_t begin, size_t end) {
+				frustum.cullAABBs(batch.cx.data() + begin, batch.cy.data() + begin, batch.cz.data() + begin, batch.ex.data() + begin,
+					batch.ey.data() + begin, batch.ez.data() + begin, end - begin, visible.words + begin / 64);
+			});
+		}
+		else
+			frustum.cullAABBs(batch.cx.data(), batch.cy.data(), batch.cz.data(), batch.ex.data(), batch.ey.data(), batch.ez.data(), batch.size(), visible.words);
+		stats.tested += (int)batch.size();
+		stats.visible += (int)visible.count();
+		stats.ms += timer.elapsed() * 1000.0;
+	}
+
+	void cull(const SphereBatch& batch, VisibilitySet& visible) {
+		PROFILE_SCOPE("cull: frustum");
+		Timer timer;
+		visible.resize(batch.size(), false);
+		frustum.cullSpheres(batch.x.data(), batch.y.data(), batch.z.data(), batch.radius.data(), batch.size(), visible.words);
+		stats.tested += (int)batch.size();
+		stats.visible += (int)visible.count();
+		stats.ms += timer.elapsed() * 1000.0;
+	}
+
+	bool isVisible(const AABB& box) {
+		bool visible = frustum.containsAABB(box.min, box.max);
+		stats.tested++;
+		if (visible) stats.visible++;
+		return visible;
+	}
+};
@@ -0,0 +1,212 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <thread>
+#include <d3d11.h>
+#include <d3d11_1.h>
+#include "dxCore.h"
+#include "shader.h"
+#include "renderDevice.h"
+
+// RenderDevice on D3D11. Buffers can be created through the interface or adopted
+// from existing code (Mesh), shaders, textures and samplers are registered once.
+// Constant ranges need the 11.1 context and a driver that offsets constant buffers
+// and maps them no-overwrite; fences are event queries.
+class DxDevice : public RenderDevice {
+public:
+	void init(DxCore* _core) {
+		core = _core;
+		D3D11_FEATURE_DATA_D3D11_OPTIONS options;
+		memset(&options, 0, sizeof(options));
+		if (SUCCEEDED(core->device->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &options, sizeof(options))) &&
+			options.ConstantBufferOffsetting && options.MapNoOverwriteOnDynamicConstantBuffer)
+			core->devicecontext->QueryInterface(__uuidof(ID3D11DeviceContext1), (void**)&context1);
+	}
+
+	DeviceHandle addBuffer(ID3D11Buffer* buffer) { return findOrAdd(buffers, buffer); }
+	DeviceHandle addShader(Shader* shader) { return findOrAdd(shaders, shader); }
+	DeviceHandle addTexture(ID3D11ShaderResourceView* srv) {
+		auto it = handles.find(srv);
+		if (it != handles.end())
+			return it->second;
+		if (freeTextures.empty())
+			return findOrAdd(textures, srv);
+		DeviceHandle handle = freeTextures.back();
+		freeTextures.pop_back();
+		textures[handle] = srv;
+		handles[srv] = handle;
+		return handle;
+	}
+
+	// before srv is released: its handle goes to the next texture added
+	void removeTexture(ID3D11ShaderResourceView* srv) {
+		auto it = handles.find(srv);
+		if (it == handles.end()) return;
+		textures[it->second] = nullptr;
+		freeTextures.push_back(it->second);
+		handles.erase(it);
+	}
+	DeviceHandle addSampler(ID3D11SamplerState* state) { return findOrAdd(samplers, state); }
+
+	DeviceHandle createBuffer(const BufferDesc& desc, const void* data) override {
+		D3D11_BUFFER_DESC bd;
+		memset(&bd, 0, sizeof(D3D11_BUFFER_DESC));
+		bd.ByteWidth = desc.binding == BindConstantBuffer ? ((desc.size + 15) & ~15u) : desc.size;
+		bd.Usage = desc.dynamic ? D3D11_USAGE_DYNAMIC : D3D11_USAGE_DEFAULT;
+		bd.CPUAccessFlags = desc.dynamic ? D3D11_CPU_ACCESS_WRITE : 0;
+		bd.BindFlags = desc.binding == BindVertexBuffer ? D3D11_BIND_VERTEX_BUFFER :
+			(desc.binding == BindIndexBuffer ? D3D11_BIND_INDEX_BUFFER : D3D11_BIND_CONSTANT_BUFFER);
+		D3D11_SUBRESOURCE_DATA initial;
+		memset(&initial, 0, sizeof(D3D11_SUBRESOURCE_DATA));
+		initial.pSysMem = data;
+		ID3D11Buffer* buffer = nullptr;
+		core->device->CreateBuffer(&bd, data ? &initial : NULL, &buffer);
+		buffers.push_back(buffer);
+		return (DeviceHandle)(buffers.size() - 1);
+	}
+
+	void* map(DeviceHandle buffer) override {
+		D3D11_MAPPED_SUBRESOURCE mapped;
+		if (FAILED(core->devicecontext->Map(buffers[buffer], 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+			return nullptr;
+		return mapped.pData;
+	}
+
+	void unmap(DeviceHandle buffer) override {
+		core->devicecontext->Unmap(buffers[buffer], 0);
+	}
+
+	void bindShader(DeviceHandle handle) override {
+		Shader* shader = shaders[handle];
+		core->devicecontext->IASetInputLayout(shader->layout);
+		core->devicecontext->VSSetShader(shader->vertexShader, NULL, 0);
+		core->devicecontext->PSSetShader(shader->pixelShader, NULL, 0);
+	}
+
+	void bindVertexBuffer(DeviceHandle buffer, uint32_t stride) override {
+		UINT offset = 0;
+		UINT strides = stride;
+		core->devicecontext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+		core->devicecontext->IASetVertexBuffers(0, 1, &buffers[buffer], &strides, &offset);
+	}
+
+	void bindIndexBuffer(DeviceHandle buffer, IndexFormat format) override {
+		core->devicecontext->IASetIndexBuffer(buffers[buffer], format == Index16 ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT, 0);
+	}
+
+	void bindConstantBuffer(DeviceStage stage, int slot, DeviceHandle buffer) override {
+		if (stage == StageVertex)
+			core->devicecontext->VSSetConstantBuffers(slot, 1, &buffers[buffer]);
+		else
+			core->devicecontext->PSSetConstantBuffers(slot, 1, &buffers[buffer]);
+	}
+
+	void bindTexture(int slot, DeviceHandle texture) override {
+		core->devicecontext->PSSetShaderResources(slot, 1, &textures[texture]);
+	}
+
+	void bindSampler(int slot, DeviceHandle sampler) override {
+		core->devicecontext->PSSetSamplers(slot, 1, &samplers[sampler]);
+	}
+
+	void drawIndexed(uint32_t indexCount, uint32_t startIndex, int32_t baseVertex) override {
+		core->devicecontext->DrawIndexed(indexCount, startIndex, baseVertex);
+	}
+
+	void draw(uint32_t vertexCount, uint32_t startVertex) override {
+		core->devicecontext->Draw(vertexCount, startVertex);
+	}
+
+	bool supportsConstantRanges() const override { return context1 != nullptr; }
+
+	void* mapNoOverwrite(DeviceHandle buffer) override {
+		D3D11_MAPPED_SUBRESOURCE mapped;
+		if (FAILED(core->devicecontext->Map(buffers[buffer], 0, D3D11_MAP_WRITE_NO_OVERWRITE, 0, &mapped)))
+			return nullptr;
+		return mapped.pData;
+	}
+
+	void unmapRange(DeviceHandle buffer, uint32_t, uint32_t) override {
+		core->devicecontext->Unmap(buffers[buffer], 0);
+	}
+
+	// ranges are counted in 16-byte constants, the count a multiple of 16
+	void bindConstantRange(DeviceStage stage, int slot, DeviceHandle buffer, uint32_t offset, uint32_t size) override {
+		UINT first = offset / 16;
+		UINT count = ((size + 255) & ~255u) / 16;
+		if (stage == StageVertex)
+			context1->VSSetConstantBuffers1(slot, 1, &buffers[buffer], &first, &count);
+		else
+			context1->PSSetConstantBuffers1(slot, 1, &buffers[buffer], &first, &count);
+	}
+
+	uint64_t signalFence() override {
+		ID3D11Query* query = nullptr;
+		if (!freeQueries.empty()) {
+			query = freeQueries.back();
+			freeQueries.pop_back();
+		}
+		else {
+			D3D11_QUERY_DESC desc;
+			desc.Query = D3D11_QUERY_EVENT;
+			desc.MiscFlags = 0;
+			if (FAILED(core->device->CreateQuery(&desc, &query)))
+				query = nullptr;
+		}
+		fenceSignaled++;
+		if (query) {
+			core->devicecontext->End(query);
+			pendingFences.push_back({ fenceSignaled, query });
+		}
+		else fenceCompleted = fenceSignaled;     // no query to wait on, treat it as passed
+		return fenceSignaled;
+	}
+
+	uint64_t completedFence() override {
+		// queries finish in order, stop at the first one that has not
+		while (!pendingFences.empty() && core->devicecontext->GetData(pendingFences.front().second, NULL, 0, D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK)
+			retireFence();
+		return fenceCompleted;
+	}
+
+	void waitForFence(uint64_t value) override {
+		while (fenceCompleted < value && !pendingFences.empty()) {
+			// without DONOTFLUSH so the commands before the query get submitted
+			if (core->devicecontext->GetData(pendingFences.front().second, NULL, 0, 0) == S_OK)
+				retireFence();
+			else
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	DxCore* core = nullptr;
+	std::vector<ID3D11Buffer*> buffers;
+	std::vector<Shader*> shaders;
+	std::vector<ID3D11ShaderResourceView*> textures;
+	std::vector<DeviceHandle> freeTextures;
+	std::vector<ID3D11SamplerState*> samplers;
+	std::map<const void*, DeviceHandle> handles;
+	ID3D11DeviceContext1* context1 = nullptr;
+	std::vector<std::pair<uint64_t, ID3D11Query*>> pendingFences;     // oldest first
+	std::vector<ID3D11Query*> freeQueries;
+	uint64_t fenceSignaled = 0;
+	uint64_t fenceCompleted = 0;
+
+	void retireFence() {
+		fenceCompleted = pendingFences.front().first;
+		freeQueries.push_back(pendingFences.front().second);
+		pendingFences.erase(pendingFences.begin());
+	}
+
+	template<typename T>
+	DeviceHandle findOrAdd(std::vector<T*>& list, T* item) {
+		auto it = handles.find(item);
+		if (it != handles.end())
+			return it->second;
+		list.push_back(item);
+		DeviceHandle handle = (DeviceHandle)(list.size() - 1);
+		handles[item] = handle;
+		return handle;
+	}
+};
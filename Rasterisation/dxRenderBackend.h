@@ -0,0 +1,67 @@
+#pragma once
+#include <map>
+#include <d3d11.h>
+#include "dxCore.h"
+#include "shader.h"
+#include "renderQueue.h"
+#include "renderDevice.h"
+#include "dxDevice.h"
+
+// RenderQueue backend for D3D11: DeviceBackend on a DxDevice, plus registration from
+// the engine's own objects. Adding the same shader, texture or sampler twice gives
+// the same handle back.
+class DxRenderBackend : public DeviceBackend {
+public:
+	DxDevice dxDevice;
+
+	void init(DxCore* core) {
+		dxDevice.init(core);
+		DeviceBackend::init(&dxDevice);
+	}
+
+	// the per-draw block is the shader's first VS cbuffer (staticMeshBuffer / animatedMeshBuffer)
+	RenderHandle addShader(Shader* shader) {
+		auto it = handles.find(shader);
+		if (it != handles.end())
+			return it->second;
+		RenderHandle handle = DeviceBackend::addShader(dxDevice.addShader(shader), shader->vsConstantBuffers[0].cbSizeInBytes);
+		handles[shader] = handle;
+		return handle;
+	}
+
+	RenderHandle addMesh(ID3D11Buffer* vertexBuffer, ID3D11Buffer* indexBuffer, UINT stride, int indexCount, IndexFormat indexFormat = Index32,
+		UINT firstIndex = 0) {
+		return DeviceBackend::addMesh(dxDevice.addBuffer(vertexBuffer), dxDevice.addBuffer(indexBuffer), stride, indexCount, indexFormat, firstIndex);
+	}
+
+	RenderHandle addTexture(ID3D11ShaderResourceView* srv) {
+		auto it = handles.find(srv);
+		if (it != handles.end())
+			return it->second;
+		RenderHandle handle = DeviceBackend::addTexture(dxDevice.addTexture(srv));
+		handles[srv] = handle;
+		return handle;
+	}
+
+	// before srv is released, e.g. from DxTextureBackend::onRelease: both handles are reused
+	// and a new SRV at the same address is not mistaken for it
+	void removeTexture(ID3D11ShaderResourceView* srv) {
+		auto it = handles.find(srv);
+		if (it == handles.end()) return;
+		DeviceBackend::removeTexture(it->second);
+		dxDevice.removeTexture(srv);
+		handles.erase(it);
+	}
+
+	RenderHandle addSampler(ID3D11SamplerState* state) {
+		auto it = handles.find(state);
+		if (it != handles.end())
+			return it->second;
+		RenderHandle handle = DeviceBackend::addSampler(dxDevice.addSampler(state));
+		handles[state] = handle;
+		return handle;
+	}
+
+private:
+	std::map<const void*, RenderHandle> handles;
+};
@@ -0,0 +1,370 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <stdexcept>
+#include "jobSystem.h"
+
+// A small archetype entity store. Entities with the same set of components share an
+// archetype, whose rows live in 16 KB chunks: one array per component per chunk, so a
+// system walks dense arrays of exactly the components it asks for. Components are
+// plain data (trivially copyable), rows move with memcpy.
+//
+// Rows stay packed: destroying an entity moves the archetype's last row into its slot,
+// and chunks emptied that way are kept for the next create, so a steady number of
+// entities does not touch the heap. Structural changes (create, destroy, add, remove)
+// must not happen while a query iterates; collect the entities and change them after.
+
+struct Entity {
+	uint32_t index = 0xffffffff;
+	uint32_t generation = 0;
+
+	bool valid() const { return index != 0xffffffff; }
+	bool operator==(const Entity& other) const { return index == other.index && generation == other.generation; }
+	bool operator!=(const Entity& other) const { return !(*this == other); }
+};
+
+const size_t ChunkBytes = 16 * 1024;
+const size_t MaxComponentTypes = 64;
+typedef uint64_t ComponentMask;
+
+struct ComponentInfo {
+	size_t size = 0;
+	size_t align = 0;
+};
+
+// the types seen so far, numbered in order of first use
+inline ComponentInfo* componentInfos() {
+	static ComponentInfo infos[MaxComponentTypes];
+	return infos;
+}
+
+inline size_t registerComponent(size_t size, size_t align) {
+	static std::mutex mutex;
+	static size_t count = 0;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (count == MaxComponentTypes) throw std::runtime_error("ecs: more than 64 component types");
+	componentInfos()[count].size = size;
+	componentInfos()[count].align = align;
+	return count++;
+}
+
+template<typename T>
+size_t componentId() {
+	static_assert(std::is_trivially_copyable<T>::value, "components are plain data");
+	static_assert(alignof(T) <= 16, "chunks are 16 byte aligned");
+	static const size_t id = registerComponent(sizeof(T), alignof(T));
+	return id;
+}
+
+template<typename... Cs>
+ComponentMask componentMask() {
+	ComponentMask mask = 0;
+	size_t ids[] = { componentId<Cs>()... };
+	for (size_t id : ids)
+		mask |= 1ull << id;
+	return mask;
+}
+
+struct alignas(16) EntityChunk {
+	unsigned char bytes[ChunkBytes];
+};
+
+// every entity with exactly the components in mask. Row r is in chunk r / capacity.
+class Archetype {
+public:
+	ComponentMask mask = 0;
+	size_t capacity = 0;                            // rows per chunk
+	size_t count = 0;                               // rows in use
+	size_t offsets[MaxComponentTypes] = {};         // of each column in a chunk, for the types in mask
+	std::vector<std::unique_ptr<EntityChunk>> chunks;
+
+	explicit Archetype(ComponentMask _mask) : mask(_mask) {
+		// the entity column first, then the components in id order
+		size_t rowBytes = sizeof(Entity);
+		for (size_t id = 0; id < MaxComponentTypes; id++)
+			if (mask & (1ull << id)) rowBytes += componentInfos()[id].size;
+		for (capacity = ChunkBytes / rowBytes; capacity > 1 && layout(capacity) > ChunkBytes; capacity--) {}
+		layout(capacity);
+	}
+
+	size_t chunkCount() const { return (count + capacity - 1) / capacity; }
+	size_t rowsIn(size_t chunk) const { return count - chunk * capacity < capacity ? count - chunk * capacity : capacity; }
+
+	Entity* entities(size_t chunk) { return reinterpret_cast<Entity*>(chunks[chunk]->bytes); }
+
+	unsigned char* column(size_t chunk, size_t id) { return chunks[chunk]->bytes + offsets[id]; }
+
+	template<typename T>
+	T& at(size_t row) { return reinterpret_cast<T*>(column(row / capacity, componentId<T>()))[row % capacity]; }
+
+	Entity& entityAt(size_t row) { return entities(row / capacity)[row % capacity]; }
+
+	// a new last row, components left for the caller to fill
+	size_t push(Entity entity) {
+		size_t row = count++;
+		if (row / capacity == chunks.size())
+			chunks.emplace_back(new EntityChunk);
+		entityAt(row) = entity;
+		return row;
+	}
+
+	// copies row's components to the other archetype's row, the ones it has
+	void copyRow(size_t row, Archetype& to, size_t toRow) {
+		ComponentMask shared = mask & to.mask;
+		for (size_t id = 0; id < MaxComponentTypes; id++) {
+			if (!(shared & (1ull << id))) continue;
+			size_t size = componentInfos()[id].size;
+			memcpy(to.column(toRow / to.capacity, id) + (toRow % to.capacity) * size, column(row / capacity, id) + (row % capacity) * size, size);
+		}
+	}
+
+	// moves the last row into row; returns the entity that moved there (invalid when row was last)
+	Entity removeRow(size_t row) {
+		size_t last = --count;
+		if (row == last) return Entity();
+		copyRow(last, *this, row);
+		Entity moved = entityAt(last);
+		entityAt(row) = moved;
+		return moved;
+	}
+
+private:
+	size_t layout(size_t rows) {
+		size_t offset = sizeof(Entity) * rows;
+		for (size_t id = 0; id < MaxComponentTypes; id++) {
+			if (!(mask & (1ull << id))) continue;
+			const ComponentInfo& info = componentInfos()[id];
+			offset = (offset + info.align - 1) / info.align * info.align;
+			offsets[id] = offset;
+			offset += info.size * rows;
+		}
+		return offset;
+	}
+};
+
+template<typename... Cs> class Query;
+
+class EntityWorld {
+public:
+	template<typename... Cs>
+	Entity create(const Cs&... components) {
+		Archetype& archetype = archetypeFor(componentMask<Cs...>());
+		Entity entity = allocate();
+		size_t row = archetype.push(entity);
+		Record& record = records[entity.index];
+		record.archetype = &archetype;
+		record.row = row;
+		int unused[] = { 0, (archetype.at<Cs>(row) = components, 0)... };
+		(void)unused;
+		alive++;
+		return entity;
+	}
+
+	void destroy(Entity entity) {
+		if (!isAlive(entity)) return;
+		Record& record = records[entity.index];
+		Entity moved = record.archetype->removeRow(record.row);
+		if (moved.valid()) records[moved.index].row = record.row;
+		record.archetype = nullptr;
+		record.generation++;
+		freeList.push_back(entity.index);
+		alive--;
+	}
+
+	bool isAlive(Entity entity) const {
+		return entity.index < records.size() && records[entity.index].generation == entity.generation && records[entity.index].archetype;
+	}
+
+	template<typename T>
+	bool has(Entity entity) const {
+		return isAlive(entity) && (records[entity.index].archetype->mask & (1ull << componentId<T>()));
+	}
+
+	// nullptr when the entity is gone or does not have T. Valid until the next structural change
+	template<typename T>
+	T* get(Entity entity) {
+		if (!has<T>(entity)) return nullptr;
+		Record& record = records[entity.index];
+		return &record.archetype->at<T>(record.row);
+	}
+
+	// moves the entity to the archetype with T as well; sets T when it already has it
+	template<typename T>
+	void add(Entity entity, const T& value) {
+		if (!isAlive(entity)) return;
+		if (T* existing = get<T>(entity)) {
+			*existing = value;
+			return;
+		}
+		Record& record = records[entity.index];
+		move(entity, archetypeFor(record.archetype->mask | (1ull << componentId<T>())));
+		record.archetype->at<T>(record.row) = value;
+	}
+
+	template<typename T>
+	void remove(Entity entity) {
+		if (!has<T>(entity)) return;
+		move(entity, archetypeFor(records[entity.index].archetype->mask & ~(1ull << componentId<T>())));
+	}
+
+	size_t size() const { return alive; }
+
+	// room for that many entities at once without growing the bookkeeping
+	void reserve(size_t entities) {
+		records.reserve(entities);
+		freeList.reserve(entities);
+	}
+
+	size_t chunkCount() const {
+		size_t n = 0;
+		for (auto& archetype : archetypes)
+			n += archetype->chunks.size();
+		return n;
+	}
+
+	template<typename... Cs>
+	Query<Cs...> query() { return Query<Cs...>(*this); }
+
+	// changes whenever an archetype is added, queries recollect theirs then
+	size_t archetypeVersion() const { return archetypes.size(); }
+	Archetype& archetype(size_t i) { return *archetypes[i]; }
+
+private:
+	struct Record {
+		Archetype* archetype = nullptr;
+		size_t row = 0;
+		uint32_t generation = 0;
+	};
+	std::vector<Record> records;
+	std::vector<uint32_t> freeList;
+	std::vector<std::unique_ptr<Archetype>> archetypes;
+	size_t alive = 0;
+
+	Entity allocate() {
+		Entity entity;
+		if (!freeList.empty()) {
+			entity.index = freeList.back();
+			freeList.pop_back();
+		}
+		else {
+			entity.index = (uint32_t)records.size();
+			records.emplace_back();
+		}
+		entity.generation = records[entity.index].generation;
+		return entity;
+	}
+
+	Archetype& archetypeFor(ComponentMask mask) {
+		for (auto& archetype : archetypes)
+			if (archetype->mask == mask) return *archetype;
+		archetypes.emplace_back(new Archetype(mask));
+		return *archetypes.back();
+	}
+
+	void move(Entity entity, Archetype& to) {
+		Record& record = records[entity.index];
+		size_t row = to.push(entity);
+		record.archetype->copyRow(record.row, to, row);
+		Entity moved = record.archetype->removeRow(record.row);
+		if (moved.valid()) records[moved.index].row = record.row;
+		record.archetype = &to;
+		record.row = row;
+	}
+};
+
+// The entities that have at least Cs, chunk by chunk. Keep the query and reuse it:
+// the matching archetypes are collected again only when the world gained one.
+template<typename... Cs>
+class Query {
+public:
+	static_assert(sizeof...(Cs) > 0, "a query needs at least one component");
+
+	explicit Query(EntityWorld& _world) : world(&_world), required(componentMask<Cs...>()) {}
+
+	// function(count, entities, Cs* columns...) once per chunk
+	template<typename F>
+	void eachChunk(F&& function) {
+		refresh();
+		for (Match& match : matches)
+			for (size_t c = 0; c < match.archetype->chunkCount(); c++)
+				callChunk(function, match, c, std::index_sequence_for<Cs...>());
+	}
+
+	// function(entity, Cs&...) once per entity
+	template<typename F>
+	void each(F&& function) {
+		eachChunk([&](size_t count, const Entity* entities, Cs*... columns) {
+			for (size_t i = 0; i < count; i++)
+				function(entities[i], columns[i]...);
+		});
+	}
+
+	// eachChunk with the chunks spread over the job system; function may only write
+	// the rows it is given
+	template<typename F>
+	void parallelEachChunk(JobSystem& jobs, F&& function) {
+		refresh();
+		work.clear();
+		for (size_t m = 0; m < matches.size(); m++)
+			for (size_t c = 0; c < matches[m].archetype->chunkCount(); c++)
+				work.push_back(std::make_pair(m, c));
+		jobs.parallelFor(work.size(), 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				callChunk(function, matches[work[i].first], work[i].second, std::index_sequence_for<Cs...>());
+		});
+	}
+
+	template<typename F>
+	void parallelEach(JobSystem& jobs, F&& function) {
+		parallelEachChunk(jobs, [&](size_t count, const Entity* entities, Cs*... columns) {
+			for (size_t i = 0; i < count; i++)
+				function(entities[i], columns[i]...);
+		});
+	}
+
+	size_t count() {
+		refresh();
+		size_t n = 0;
+		for (Match& match : matches)
+			n += match.archetype->count;
+		return n;
+	}
+
+private:
+	struct Match {
+		Archetype* archetype;
+		size_t offsets[sizeof...(Cs)];
+	};
+	EntityWorld* world;
+	ComponentMask required;
+	size_t version = 0;
+	std::vector<Match> matches;
+	std::vector<std::pair<size_t, size_t>> work;    // (match, chunk) for the parallel walk
+
+	void refresh() {
+		if (version == world->archetypeVersion() && version != 0) return;
+		version = world->archetypeVersion();
+		matches.clear();
+		size_t ids[] = { componentId<Cs>()... };
+		for (size_t a = 0; a < version; a++) {
+			Archetype& archetype = world->archetype(a);
+			if ((archetype.mask & required) != required) continue;
+			Match match;
+			match.archetype = &archetype;
+			for (size_t i = 0; i < sizeof...(Cs); i++)
+				match.offsets[i] = archetype.offsets[ids[i]];
+			matches.push_back(match);
+		}
+	}
+
+	template<typename F, size_t... I>
+	static void callChunk(F& function, Match& match, size_t chunk, std::index_sequence<I...>) {
+		unsigned char* base = match.archetype->chunks[chunk]->bytes;
+		function(match.archetype->rowsIn(chunk), match.archetype->entities(chunk), reinterpret_cast<Cs*>(base + match.offsets[I])...);
+	}
+};
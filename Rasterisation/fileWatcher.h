@@ -0,0 +1,140 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+// Change detection for a handful of source files. poll() stats each one and reports
+// those whose size or modification time moved and whose contents really differ, so an
+// editor saving the same text does not count. A file last read within the second of its
+// modification time is read again on the next poll: a same-size save in that second may
+// not move the stamp, only the seconds where stat has no sub-second time. On Linux an
+// inotify watch on their directories wakes wait() as soon as something is written;
+// elsewhere wait() sleeps the interval and the stat calls find the changes.
+class FileWatcher {
+public:
+	~FileWatcher() {
+#ifdef __linux__
+		if (notifyFd >= 0) ::close(notifyFd);
+#endif
+	}
+
+	void add(const std::string& filename) {
+		for (auto& f : files)
+			if (f.name == filename) return;
+		File file;
+		file.name = filename;
+		stamp(file);
+		file.hash = contentHash(filename);
+		file.hashed = std::time(nullptr);
+		files.push_back(file);
+#ifdef __linux__
+		if (notifyFd < 0) notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (notifyFd >= 0) {
+			size_t slash = filename.find_last_of("/\\");
+			std::string directory = slash == std::string::npos ? std::string(".") : filename.substr(0, slash);
+			// the same directory twice gives the same watch back
+			inotify_add_watch(notifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY);
+		}
+#endif
+	}
+
+	size_t size() const { return files.size(); }
+	bool usesNotifications() const { return notifyFd >= 0; }
+
+	// until something in a watched directory is written or timeoutMs passed. Saves come
+	// as a burst (truncate, write, rename), so it returns once they have been quiet for
+	// settleMs rather than on the first event and a half-written file.
+	void wait(int timeoutMs, int settleMs = 50) {
+#ifdef __linux__
+		if (notifyFd >= 0) {
+			pollfd p = { notifyFd, POLLIN, 0 };
+			if (::poll(&p, 1, timeoutMs) <= 0) return;
+			drain();
+			while (::poll(&p, 1, settleMs) > 0)
+				drain();
+			return;
+		}
+#endif
+		std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+	}
+
+	// appends the files that changed since the last poll, returns how many. A file that
+	// is gone (an editor in the middle of a rename) counts once it is back.
+	int poll(std::vector<std::string>& changed) {
+		// a notification may come within the stat's time resolution, then only the contents tell
+		bool checkContents = notified;
+		notified = false;
+		int64_t now = std::time(nullptr);
+		int count = 0;
+		for (auto& f : files) {
+			File before = f;
+			stamp(f);
+			if (!f.exists) continue;
+			bool settled = f.hashed > f.modified / 1000000000;
+			if (!checkContents && settled && f.exists == before.exists && f.size == before.size && f.modified == before.modified) continue;
+			uint64_t h = contentHash(f.name);
+			f.hashed = now;
+			if (h == f.hash) continue;
+			f.hash = h;
+			changed.push_back(f.name);
+			count++;
+		}
+		return count;
+	}
+
+private:
+	struct File {
+		std::string name;
+		bool exists = false;
+		int64_t size = 0;
+		int64_t modified = 0;       // ns, whole seconds where stat has nothing finer
+		uint64_t hash = 0;
+		int64_t hashed = 0;         // time() when hash was taken
+	};
+
+	std::vector<File> files;
+	int notifyFd = -1;
+	bool notified = false;
+
+	static void stamp(File& f) {
+		struct stat info;
+		f.exists = stat(f.name.c_str(), &info) == 0;
+		f.size = f.exists ? (int64_t)info.st_size : 0;
+		f.modified = 0;
+		if (!f.exists) return;
+#ifdef __linux__
+		f.modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#else
+		f.modified = (int64_t)info.st_mtime * 1000000000;
+#endif
+	}
+
+	// FNV-1a over the file, 0 when it cannot be read
+	static uint64_t contentHash(const std::string& filename) {
+		std::ifstream file(filename, std::ios::binary);
+		if (!file) return 0;
+		uint64_t h = 14695981039346656037ull;
+		for (std::istreambuf_iterator<char> it(file), end; it != end; ++it)
+			h = (h ^ (unsigned char)*it) * 1099511628211ull;
+		return h;
+	}
+
+#ifdef __linux__
+	void drain() {
+		char events[4096];
+		while (read(notifyFd, events, sizeof(events)) > 0)
+			notified = true;
+	}
+#endif
+};
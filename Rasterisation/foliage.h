@@ -0,0 +1,405 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cmath>
+#include <cstdint>
+#include <cfloat>
+#include "mathLib.h"
+#include "collision.h"
+#include "visibility.h"
+#include "image.h"
+#include "terrain.h"
+#include "jobSystem.h"
+#include "timer.h"
+#include "profiler.h"
+
+// Grass and trees scattered over the ground. Each layer is cut into square chunks;
+// a chunk fills itself with a Poisson disk set (Bridson: no two instances closer than
+// the layer's spacing) from its own seed, keeps each point with the probability its
+// density map gives there and stands the rest on the ground. Chunks are independent,
+// so they are generated on the job workers and come out the same on any thread count.
+// Culling and the draw distance work on chunk bounds, instances only matter in the
+// chunks that pass. No D3D in here, like the terrain.
+
+// 0 (nothing grows) to 1 (as dense as the spacing allows) over a rectangle of the
+// world, bilinear between texels; 0 outside
+class DensityMap {
+public:
+	int width = 0;
+	int depth = 0;
+	float minX = 0.0f, minZ = 0.0f, maxX = 0.0f, maxZ = 0.0f;
+	std::vector<float> values;  // row by row, z major
+
+	void init(int texelsX, int texelsZ, float x0, float z0, float x1, float z1, float value = 1.0f) {
+		width = texelsX < 2 ? 2 : texelsX;
+		depth = texelsZ < 2 ? 2 : texelsZ;
+		minX = x0; minZ = z0; maxX = x1; maxZ = z1;
+		values.assign((size_t)width * depth, value);
+	}
+
+	// the first channel of an image over x0, z0 - x1, z1 at its own resolution; false
+	// when it does not load and the map stays as it is
+	bool loadImage(const std::string& filename, float x0, float z0, float x1, float z1) {
+		Image image;
+		if (!image.load(filename) || image.width < 2 || image.height < 2) return false;
+		init(image.width, image.height, x0, z0, x1, z1);
+		for (size_t i = 0; i < values.size(); i++)
+			values[i] = image.texels[i * image.channels] * (1.0f / 255.0f);
+		return true;
+	}
+
+	// patches of noise from 0 to 1 with features about wavelength apart, thinned out
+	// where the ground is steep: full below flatSlope, none above steepSlope (1 - normal.y)
+	void fromGround(const Heightfield& field, uint32_t seed, float wavelength, float flatSlope, float steepSlope) {
+		for (int z = 0; z < depth; z++) {
+			for (int x = 0; x < width; x++) {
+				float wx = minX + (maxX - minX) * x / (width - 1);
+				float wz = minZ + (maxZ - minZ) * z / (depth - 1);
+				float noise = Heightfield::valueNoise(wx / wavelength, wz / wavelength, seed) * 0.5f + 0.5f;
+				float slope = 1.0f - field.normalAt(wx, wz).y;
+				float t = (slope - flatSlope) / (steepSlope - flatSlope);
+				t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+				values[(size_t)z * width + x] *= noise * (1.0f - t);
+			}
+		}
+	}
+
+	// nothing inside radius, e.g. around the pool
+	void clear(float x, float z, float radius) {
+		for (int tz = 0; tz < depth; tz++) {
+			for (int tx = 0; tx < width; tx++) {
+				float dx = minX + (maxX - minX) * tx / (width - 1) - x;
+				float dz = minZ + (maxZ - minZ) * tz / (depth - 1) - z;
+				if (dx * dx + dz * dz < radius * radius) values[(size_t)tz * width + tx] = 0.0f;
+			}
+		}
+	}
+
+	float at(float x, float z) const {
+		if (values.empty() || x < minX || x > maxX || z < minZ || z > maxZ) return 0.0f;
+		float fx = (x - minX) / (maxX - minX) * (width - 1);
+		float fz = (z - minZ) / (maxZ - minZ) * (depth - 1);
+		int ix = (int)fx, iz = (int)fz;
+		if (ix > width - 2) ix = width - 2;
+		if (iz > depth - 2) iz = depth - 2;
+		float tx = fx - ix, tz = fz - iz;
+		const float* row = &values[(size_t)iz * width + ix];
+		float top = row[0] + (row[1] - row[0]) * tx;
+		float bottom = row[width] + (row[width + 1] - row[width]) * tx;
+		return top + (bottom - top) * tz;
+	}
+};
+
+// what to scatter and where
+struct FoliageLayer {
+	uint32_t seed = 1;
+	float spacing = 2.0f;               // least distance between two instances
+	float minX = -50.0f, minZ = -50.0f; // area covered
+	float maxX = 50.0f, maxZ = 50.0f;
+	float chunkSize = 16.0f;
+	float minScale = 0.01f, maxScale = 0.03f;
+	float drawDistance = 0.0f;          // chunks farther from the camera are not drawn, 0 = no limit
+	const DensityMap* density = nullptr; // nullptr = 1 everywhere
+	const Heightfield* ground = nullptr; // instances stand on it, at y = 0 without one
+};
+
+struct FoliageChunk {
+	int x = 0, z = 0;                           // in chunks from the layer's min corner
+	AABB bounds;                                // of its instances once the model's bounds are set, empty before
+	std::vector<mathLib::Vec3> positions;       // on the ground
+	std::vector<mathLib::Matrix> worlds;        // translation * rotation * scale, like forest::place did
+	std::vector<AABB> instanceBounds;           // same order
+};
+
+struct FoliageStats {
+	size_t chunks = 0;
+	size_t instances = 0;
+	size_t candidates = 0;      // Poisson points before density and the seams thinned them
+	double ms = 0.0;            // of the last generate
+};
+
+class FoliageField {
+public:
+	FoliageLayer layer;
+	int chunksX = 0, chunksZ = 0;
+	std::vector<FoliageChunk> chunks;   // row by row, z major
+	std::vector<AABB> chunkBounds;      // chunks[i].bounds, for BoundsBatch and the occlusion pass
+	FoliageStats stats;
+
+	// fills every chunk, spread over jobs when given
+	void generate(const FoliageLayer& foliageLayer, JobSystem* jobs = nullptr) {
+		PROFILE_SCOPE("foliage: generate");
+		Timer timer;
+		layer = foliageLayer;
+		chunksX = (int)ceilf((layer.maxX - layer.minX) / layer.chunkSize);
+		chunksZ = (int)ceilf((layer.maxZ - layer.minZ) / layer.chunkSize);
+		if (chunksX < 1) chunksX = 1;
+		if (chunksZ < 1) chunksZ = 1;
+		chunks.assign((size_t)chunksX * chunksZ, FoliageChunk());
+		std::vector<std::vector<mathLib::Vec3>> candidates(chunks.size());
+		std::vector<std::vector<uint8_t>> keep(chunks.size());
+		auto run = [&](auto&& function) {
+			if (jobs) jobs->parallelFor(chunks.size(), 1, function);
+			else function(0, chunks.size());
+		};
+		// the Poisson points of each chunk
+		run([&](size_t begin, size_t end) {
+			for (size_t c = begin; c < end; c++) {
+				chunks[c].x = (int)(c % chunksX);
+				chunks[c].z = (int)(c / chunksX);
+				poissonDisk(chunks[c].x, chunks[c].z, candidates[c]);
+			}
+		});
+		run([&](size_t begin, size_t end) {
+			for (size_t c = begin; c < end; c++)
+				thinDensity(c, candidates[c], keep[c]);
+		});
+		// the seams: a point closer than spacing to an accepted point of a neighbour with a
+		// lower index goes, so each pair across a seam loses one point. Those neighbours must
+		// be final first: chunk (x, z) is in wave x + 2z, after all of them, and no two chunks
+		// of a wave are neighbours
+		if (jobs) {
+			for (int wave = 0; wave < chunksX + 2 * (chunksZ - 1); wave++) {
+				int zFirst = (wave - chunksX + 2) / 2;
+				zFirst = zFirst > 0 ? zFirst : 0;
+				int zLast = wave / 2 < chunksZ - 1 ? wave / 2 : chunksZ - 1;
+				if (zLast < zFirst) continue;
+				jobs->parallelFor((size_t)(zLast - zFirst + 1), 1, [&](size_t begin, size_t end) {
+					for (size_t i = begin; i < end; i++) {
+						int z = zFirst + (int)i;
+						thinSeams((size_t)z * chunksX + (wave - 2 * z), candidates, keep);
+					}
+				});
+			}
+		}
+		else {
+			for (size_t c = 0; c < chunks.size(); c++)
+				thinSeams(c, candidates, keep);
+		}
+		run([&](size_t begin, size_t end) {
+			for (size_t c = begin; c < end; c++)
+				place(chunks[c], candidates[c], keep[c]);
+		});
+		chunkBounds.assign(chunks.size(), AABB());
+		stats.chunks = chunks.size();
+		stats.instances = 0;
+		stats.candidates = 0;
+		for (size_t c = 0; c < chunks.size(); c++) {
+			stats.instances += chunks[c].positions.size();
+			stats.candidates += candidates[c].size();
+		}
+		stats.ms = timer.elapsed() * 1000.0;
+	}
+
+	// instance and chunk bounds from the model's, once it is known
+	void setBounds(const AABB& modelBounds, JobSystem* jobs = nullptr) {
+		auto bound = [&](size_t begin, size_t end) {
+			for (size_t c = begin; c < end; c++) {
+				FoliageChunk& chunk = chunks[c];
+				chunk.instanceBounds.resize(chunk.worlds.size());
+				chunk.bounds.reset();
+				for (size_t i = 0; i < chunk.worlds.size(); i++) {
+					chunk.instanceBounds[i] = modelBounds.transformed(chunk.worlds[i]);
+					chunk.bounds.extend(chunk.instanceBounds[i].min);
+					chunk.bounds.extend(chunk.instanceBounds[i].max);
+				}
+			}
+		};
+		if (jobs) jobs->parallelFor(chunks.size(), 1, bound);
+		else bound(0, chunks.size());
+		for (size_t c = 0; c < chunks.size(); c++)
+			chunkBounds[c] = chunks[c].bounds;
+	}
+
+	size_t instanceCount() const { return stats.instances; }
+
+	// clears the bits of the chunks past the layer's draw distance
+	void cullDistance(const mathLib::Vec3& camera, VisibilitySet& visible) const {
+		if (layer.drawDistance <= 0.0f) return;
+		for (size_t c = 0; c < chunks.size() && c < visible.size; c++)
+			if (visible.test(c) && distanceSquared(c, camera) > layer.drawDistance * layer.drawDistance) visible.set(c, false);
+	}
+
+	// from point to the nearest chunk with instances, the streaming priority
+	float distanceTo(const mathLib::Vec3& point) const {
+		float nearest = FLT_MAX;
+		for (size_t c = 0; c < chunks.size(); c++) {
+			if (chunks[c].positions.empty()) continue;
+			float d = distanceSquared(c, point);
+			if (d < nearest) nearest = d;
+		}
+		return nearest == FLT_MAX ? nearest : sqrtf(nearest);
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "foliage: " << stats.instances << " instances (" << stats.candidates << " candidates) in " << stats.chunks << " chunks, " << stats.ms << " ms";
+		return out.str();
+	}
+
+private:
+	// to the chunk's square on the ground, so it works before the bounds are known
+	float distanceSquared(size_t c, const mathLib::Vec3& point) const {
+		float x0 = layer.minX + chunks[c].x * layer.chunkSize, z0 = layer.minZ + chunks[c].z * layer.chunkSize;
+		float dx = point.x < x0 ? x0 - point.x : (point.x > x0 + layer.chunkSize ? point.x - x0 - layer.chunkSize : 0.0f);
+		float dz = point.z < z0 ? z0 - point.z : (point.z > z0 + layer.chunkSize ? point.z - z0 - layer.chunkSize : 0.0f);
+		return dx * dx + dz * dz;
+	}
+
+	// the generator of one chunk: an LCG started from the layer's seed and the chunk
+	struct Random {
+		uint32_t state;
+		Random(uint32_t seed, int x, int z) {
+			state = seed * 2654435761u ^ (uint32_t)x * 374761393u ^ (uint32_t)z * 668265263u;
+			state = (state ^ (state >> 13)) * 1274126177u;
+		}
+		float next(float lo = 0.0f, float hi = 1.0f) {
+			state = state * 1664525u + 1013904223u;
+			return lo + (hi - lo) * ((state >> 8) * (1.0f / 16777216.0f));
+		}
+	};
+
+	// Bridson: darts around the points already in, 30 tries each, on a grid of cells
+	// spacing / sqrt(2) wide so every cell holds at most one point
+	void poissonDisk(int cx, int cz, std::vector<mathLib::Vec3>& points) const {
+		const int Tries = 30;
+		float x0 = layer.minX + cx * layer.chunkSize, z0 = layer.minZ + cz * layer.chunkSize;
+		float x1 = x0 + layer.chunkSize, z1 = z0 + layer.chunkSize;
+		x1 = x1 < layer.maxX ? x1 : layer.maxX;
+		z1 = z1 < layer.maxZ ? z1 : layer.maxZ;
+		float r = layer.spacing;
+		float cell = r / sqrtf(2.0f);
+		int gw = (int)ceilf((x1 - x0) / cell), gd = (int)ceilf((z1 - z0) / cell);
+		if (gw < 1 || gd < 1) return;
+		std::vector<int> grid((size_t)gw * gd, -1);
+		std::vector<int> active;
+		Random random(layer.seed, cx, cz);
+		auto add = [&](float x, float z) {
+			int gx = (int)((x - x0) / cell), gz = (int)((z - z0) / cell);
+			gx = gx < gw ? gx : gw - 1;
+			gz = gz < gd ? gz : gd - 1;
+			grid[(size_t)gz * gw + gx] = (int)points.size();
+			active.push_back((int)points.size());
+			points.push_back(mathLib::Vec3(x, 0.0f, z));
+		};
+		auto roomAt = [&](float x, float z) {
+			int gx = (int)((x - x0) / cell), gz = (int)((z - z0) / cell);
+			for (int nz = gz - 2; nz <= gz + 2; nz++) {
+				for (int nx = gx - 2; nx <= gx + 2; nx++) {
+					if (nx < 0 || nz < 0 || nx >= gw || nz >= gd) continue;
+					int p = grid[(size_t)nz * gw + nx];
+					if (p < 0) continue;
+					float dx = points[p].x - x, dz = points[p].z - z;
+					if (dx * dx + dz * dz < r * r) return false;
+				}
+			}
+			return true;
+		};
+		add(random.next(x0, x1), random.next(z0, z1));
+		while (!active.empty()) {
+			size_t pick = (size_t)(random.next() * active.size());
+			pick = pick < active.size() ? pick : active.size() - 1;
+			mathLib::Vec3 from = points[active[pick]];
+			bool found = false;
+			for (int t = 0; t < Tries; t++) {
+				float angle = random.next(0.0f, 6.28318531f);
+				float distance = random.next(r, 2.0f * r);
+				float x = from.x + cosf(angle) * distance, z = from.z + sinf(angle) * distance;
+				if (x < x0 || x >= x1 || z < z0 || z >= z1 || !roomAt(x, z)) continue;
+				add(x, z);
+				found = true;
+				break;
+			}
+			if (!found) {
+				active[pick] = active.back();
+				active.pop_back();
+			}
+		}
+	}
+
+	void thinDensity(size_t c, const std::vector<mathLib::Vec3>& points, std::vector<uint8_t>& keep) const {
+		const FoliageChunk& chunk = chunks[c];
+		keep.assign(points.size(), 1);
+		// a second stream for the density test, so the map does not move the points
+		Random random(layer.seed ^ 0x9e3779b9u, chunk.x, chunk.z);
+		for (size_t i = 0; i < points.size(); i++) {
+			float density = layer.density ? layer.density->at(points[i].x, points[i].z) : 1.0f;
+			if (random.next() >= density) keep[i] = 0;
+		}
+	}
+
+	// reads keep of the neighbours with a lower index, writes only keep[c]
+	void thinSeams(size_t c, const std::vector<std::vector<mathLib::Vec3>>& candidates, std::vector<std::vector<uint8_t>>& keep) const {
+		const FoliageChunk& chunk = chunks[c];
+		const std::vector<mathLib::Vec3>& points = candidates[c];
+		float r2 = layer.spacing * layer.spacing;
+		for (size_t i = 0; i < points.size(); i++) {
+			for (int nz = chunk.z - 1; nz <= chunk.z && keep[c][i]; nz++) {
+				for (int nx = chunk.x - 1; nx <= chunk.x + 1 && keep[c][i]; nx++) {
+					if (nx < 0 || nz < 0 || nx >= chunksX) continue;
+					size_t n = (size_t)nz * chunksX + nx;
+					if (n >= c) continue;
+					const std::vector<mathLib::Vec3>& others = candidates[n];
+					for (size_t j = 0; j < others.size(); j++) {
+						if (!keep[n][j]) continue;
+						float dx = others[j].x - points[i].x, dz = others[j].z - points[i].z;
+						if (dx * dx + dz * dz < r2) {
+							keep[c][i] = 0;
+							break;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void place(FoliageChunk& chunk, const std::vector<mathLib::Vec3>& points, const std::vector<uint8_t>& keep) const {
+		Random random(layer.seed ^ 0x85ebca6bu, chunk.x, chunk.z);
+		for (size_t i = 0; i < points.size(); i++) {
+			// drawn for every point, so a point's scale and rotation do not depend on the density
+			float scale = random.next(layer.minScale, layer.maxScale);
+			float rotation = random.next(0.0f, 6.28318531f);
+			if (!keep[i]) continue;
+			mathLib::Vec3 position = points[i];
+			position.y = layer.ground ? layer.ground->heightAt(position.x, position.z) : 0.0f;
+			chunk.positions.push_back(position);
+			chunk.worlds.push_back(mathLib::Matrix::scaling(mathLib::Vec3(scale, scale, scale)) * mathLib::Matrix::rotateY(rotation) *
+				mathLib::Matrix::translation(position));
+		}
+	}
+};
+
+// WinMain's grass and bamboo. The densities come from Resources/Textures/grassDensity.png
+// and bambooDensity.png when they are there, from noise and the ground's slope
+// otherwise; the pool stays clear either way. Grass is only drawn near the camera.
+static void createFoliage(const Heightfield& field, DensityMap& grassDensity, DensityMap& bambooDensity, FoliageLayer& grass, FoliageLayer& bamboo,
+	const std::string& resources = "Resources") {
+	if (!grassDensity.loadImage(resources + "/Textures/grassDensity.png", -60.0f, -60.0f, 60.0f, 60.0f)) {
+		grassDensity.init(121, 121, -60.0f, -60.0f, 60.0f, 60.0f);
+		grassDensity.fromGround(field, 11, 12.0f, 0.05f, 0.2f);
+	}
+	grassDensity.clear(0.0f, 0.0f, 5.0f);
+	if (!bambooDensity.loadImage(resources + "/Textures/bambooDensity.png", -50.0f, -50.0f, 50.0f, 50.0f)) {
+		bambooDensity.init(51, 51, -50.0f, -50.0f, 50.0f, 50.0f);
+		bambooDensity.fromGround(field, 12, 30.0f, 0.1f, 0.3f);
+	}
+	bambooDensity.clear(0.0f, 0.0f, 6.0f);
+
+	grass = FoliageLayer();
+	grass.seed = 1;
+	grass.spacing = 1.5f;
+	grass.minX = grass.minZ = -60.0f;
+	grass.maxX = grass.maxZ = 60.0f;
+	grass.chunkSize = 12.0f;
+	grass.drawDistance = 30.0f;
+	grass.density = &grassDensity;
+	grass.ground = &field;
+
+	bamboo = FoliageLayer();
+	bamboo.seed = 2;
+	bamboo.spacing = 8.0f;
+	bamboo.chunkSize = 25.0f;
+	bamboo.density = &bambooDensity;
+	bamboo.ground = &field;
+}
@@ -0,0 +1,204 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <type_traits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Linear allocator for data that lives for one frame: culling lists, render packets,
+// per-draw scratch. Allocation is a bump of an atomic offset, so any thread can
+// allocate without a lock. When the block is full another one is chained on under a
+// mutex; reset() folds the chain into one block of the combined size, so after the
+// first few frames the arena never touches the heap again. Nothing is destructed,
+// only put trivially destructible data (or containers using FrameAllocator) in it.
+class FrameArena {
+public:
+	explicit FrameArena(size_t _blockSize = 1 << 20) : blockSize(_blockSize) {}
+
+	~FrameArena() { release(); }
+
+	FrameArena(const FrameArena&) = delete;
+	FrameArena& operator=(const FrameArena&) = delete;
+
+	// align must be a power of two
+	void* allocate(size_t size, size_t align = 16) {
+		for (;;) {
+			Block* block = current.load(std::memory_order_acquire);
+			if (block) {
+				// reserve enough for the worst case padding, the unused part is lost until reset
+				size_t start = block->used.fetch_add(size + align - 1, std::memory_order_relaxed);
+				uintptr_t address = ((uintptr_t)(block->data + start) + align - 1) & ~(uintptr_t)(align - 1);
+				if (address + size <= (uintptr_t)(block->data + block->size))
+					return (void*)address;
+			}
+			grow(block, size + align - 1);
+		}
+	}
+
+	template<typename T>
+	T* allocateArray(size_t count) {
+		return (T*)allocate(count * sizeof(T), alignof(T) > 16 ? alignof(T) : 16);
+	}
+
+	// copy of a string that stays valid until reset
+	const char* copy(const char* text) {
+		size_t n = strlen(text) + 1;
+		char* p = (char*)allocate(n, 1);
+		memcpy(p, text, n);
+		return p;
+	}
+
+	// call when no thread is allocating, everything handed out becomes invalid
+	void reset() {
+		size_t used = bytesUsed();
+		if (used > highWater) highWater = used;
+		if (blocks.size() > 1) {
+			size_t total = 0;
+			for (auto& b : blocks) total += b->size;
+			release();
+			addBlock(total);
+		}
+		else if (!blocks.empty())
+			blocks[0]->used.store(0, std::memory_order_relaxed);
+	}
+
+	// make the first block big enough up front, e.g. from last run's highWater
+	void reserve(size_t bytes) {
+		if (capacity() >= bytes) return;
+		release();
+		addBlock(bytes);
+	}
+
+	size_t bytesUsed() const {
+		size_t used = 0;
+		for (auto& b : blocks) {
+			size_t u = b->used.load(std::memory_order_relaxed);
+			used += u < b->size ? u : b->size;
+		}
+		return used;
+	}
+
+	size_t capacity() const {
+		size_t total = 0;
+		for (auto& b : blocks) total += b->size;
+		return total;
+	}
+
+	size_t blockCount() const { return blocks.size(); }
+	size_t peakBytes() const { return highWater; }
+
+private:
+	struct Block {
+		unsigned char* data;
+		size_t size;
+		std::atomic<size_t> used;
+	};
+
+	size_t blockSize;
+	std::atomic<Block*> current{ nullptr };
+	std::vector<std::unique_ptr<Block>> blocks;
+	std::mutex mutex;
+	size_t highWater = 0;
+
+	// another thread may have chained a block already, then only retry
+	void grow(Block* full, size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (current.load(std::memory_order_acquire) != full) return;
+		addBlock(size > blockSize ? size : blockSize);
+	}
+
+	void addBlock(size_t size) {
+		Block* block = new Block;
+		block->data = (unsigned char*)malloc(size);
+		block->size = size;
+		block->used.store(0, std::memory_order_relaxed);
+		blocks.emplace_back(block);
+		current.store(block, std::memory_order_release);
+	}
+
+	void release() {
+		for (auto& b : blocks) free(b->data);
+		blocks.clear();
+		current.store(nullptr, std::memory_order_release);
+	}
+};
+
+// STL allocator on a FrameArena. deallocate does nothing, memory comes back on reset,
+// so reserve() containers up front: every regrowth leaves the old buffer behind. A
+// default constructed one has no arena yet, a container kept across frames gets the
+// arena of each frame by move assignment (the allocator moves along with the buffer).
+template<typename T>
+class FrameAllocator {
+public:
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	FrameArena* arena = nullptr;
+
+	FrameAllocator() {}
+	FrameAllocator(FrameArena& _arena) : arena(&_arena) {}
+
+	template<typename U>
+	FrameAllocator(const FrameAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n) { return arena->allocateArray<T>(n); }
+	void deallocate(T*, size_t) {}
+
+	template<typename U>
+	bool operator==(const FrameAllocator<U>& other) const { return arena == other.arena; }
+	template<typename U>
+	bool operator!=(const FrameAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template<typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+// The engine's per-frame arenas, two of them so data built for frame N (the render
+// snapshot) stays valid while frame N+1 is simulated. beginFrame() flips and resets
+// the one that is about to be reused; call it on the main thread between frames.
+class FrameMemory {
+public:
+	static const int FramesInFlight = 2;
+
+	static void beginFrame() {
+		State& s = state();
+		s.index = (s.index + 1) % FramesInFlight;
+		s.arenas[s.index].reset();
+	}
+
+	static FrameArena& current() {
+		State& s = state();
+		return s.arenas[s.index];
+	}
+
+	// what the previous frame allocated, valid until the next beginFrame()
+	static FrameArena& previous() {
+		State& s = state();
+		return s.arenas[(s.index + FramesInFlight - 1) % FramesInFlight];
+	}
+
+	static void reserve(size_t bytes) {
+		for (FrameArena& arena : state().arenas)
+			arena.reserve(bytes);
+	}
+
+	template<typename T>
+	static FrameAllocator<T> allocator() {
+		return FrameAllocator<T>(current());
+	}
+
+private:
+	struct State {
+		FrameArena arenas[FramesInFlight];
+		int index = 0;
+	};
+
+	static State& state() {
+		static State s;
+		return s;
+	}
+};
@@ -0,0 +1,177 @@
+#pragma once
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstdint>
+#include "mathLib.h"
+#include "timer.h"
+#include "profiler.h"
+#include "frameArena.h"
+
+// What the render stage needs from one simulated frame, copied out so the simulation
+// can move on while it is drawn. Scenes add their own culling results on top, their
+// lists in memory: the arena of the frame, which the render stage may allocate from too.
+struct RenderSnapshot {
+	static const int MaxBones = 256;
+
+	FrameArena* memory = nullptr;       // FrameMemory::current() of the simulated frame
+	uint64_t frame = 0;
+	float time = 0.0f;                  // seconds since start, drives sky and water
+	mathLib::Matrix vp;
+	mathLib::Vec3 cameraPosition;
+	mathLib::Matrix playerWorld;
+	mathLib::Matrix bones[MaxBones];    // the player's final bone palette
+	int boneCount = 0;
+
+	void copyBones(const mathLib::Matrix* palette, int count) {
+		boneCount = count < MaxBones ? count : MaxBones;
+		memcpy(bones, palette, sizeof(mathLib::Matrix) * boneCount);
+	}
+};
+
+struct PipelineStats {
+	uint64_t frames = 0;            // rendered and released
+	double latencyMs = 0.0;         // sum over frames, simulation start to render end
+	double maxLatencyMs = 0.0;
+	double simulateMs = 0.0;        // sum, beginWrite to publish
+	double renderMs = 0.0;          // sum, acquire to release
+	double simulateWaitMs = 0.0;    // simulation blocked because every slot was in use
+	double renderWaitMs = 0.0;      // render stage starved
+	uint64_t firstStart = 0;        // ns, for the throughput
+	uint64_t lastEnd = 0;
+
+	double averageLatencyMs() const { return frames ? latencyMs / frames : 0.0; }
+
+	double framesPerSecond() const {
+		return frames > 1 && lastEnd > firstStart ? frames / ((lastEnd - firstStart) * 1e-9) : 0.0;
+	}
+};
+
+// Hand-off between the simulation and the render stage. Each slot holds one T, the
+// simulation fills one with beginWrite() / publish() while the render stage draws an
+// older one between acquire() / release(). With 2 slots the simulation runs at most
+// one frame ahead, 3 lets it run two ahead at the cost of a frame more latency.
+// The simulation calls beginWrite() at the start of its frame, so with 2 slots it never
+// overlaps more than one frame being drawn (what FrameMemory's two arenas allow). A
+// snapshot may point into the arena of its frame, so the depth is capped at
+// FrameMemory::FramesInFlight; a third slot would let the simulation reset that arena
+// while the render stage still reads it.
+// Depth 0: both stages are the same thread, one slot and every hand-off is immediate.
+template<typename T>
+class FramePipeline {
+public:
+	static const int MaxDepth = FrameMemory::FramesInFlight;
+
+	explicit FramePipeline(int depth = 2) : slots(depth < 1 ? 1 : (depth > MaxDepth ? MaxDepth : depth)), sameThread(depth < 1) {}
+
+	int depth() const { return (int)slots.size(); }
+	bool singleThreaded() const { return sameThread; }
+
+	// blocks while every slot is written or waiting to be drawn
+	T& beginWrite() {
+		PROFILE_SCOPE("pipeline: wait for slot");
+		uint64_t start = Timer::now();
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [this] { return begun - released < slots.size(); });
+		Slot& slot = slots[begun % slots.size()];
+		begun++;
+		slot.simulateStart = Timer::now();
+		stats.simulateWaitMs += (slot.simulateStart - start) * 1e-6;
+		if (stats.firstStart == 0) stats.firstStart = slot.simulateStart;
+		return slot.data;
+	}
+
+	void publish() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			Slot& slot = slots[published % slots.size()];
+			slot.published = Timer::now();
+			stats.simulateMs += (slot.published - slot.simulateStart) * 1e-6;
+			published++;
+		}
+		condition.notify_all();
+	}
+
+	// oldest published frame, nullptr once close() was called and everything is drawn
+	const T* acquire() {
+		PROFILE_SCOPE("pipeline: wait for frame");
+		uint64_t start = Timer::now();
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [this] { return acquired < published || closed; });
+		if (acquired == published) return nullptr;
+		Slot& slot = slots[acquired % slots.size()];
+		acquired++;
+		slot.renderStart = Timer::now();
+		stats.renderWaitMs += (slot.renderStart - start) * 1e-6;
+		return &slot.data;
+	}
+
+	void release() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			Slot& slot = slots[released % slots.size()];
+			uint64_t end = Timer::now();
+			double latency = (end - slot.simulateStart) * 1e-6;
+			stats.renderMs += (end - slot.renderStart) * 1e-6;
+			stats.latencyMs += latency;
+			if (latency > stats.maxLatencyMs) stats.maxLatencyMs = latency;
+			stats.lastEnd = end;
+			stats.frames++;
+			released++;
+		}
+		condition.notify_all();
+	}
+
+	// no more frames, acquire() returns nullptr after the last published one
+	void close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		condition.notify_all();
+	}
+
+	PipelineStats getStats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+	void resetStats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		stats = PipelineStats();
+	}
+
+	// one line: throughput, latency and where each stage waited
+	std::string report() {
+		PipelineStats s = getStats();
+		std::ostringstream out;
+		double n = s.frames ? (double)s.frames : 1.0;
+		if (sameThread) out << "pipeline (single-threaded): ";
+		else out << "pipeline (" << depth() << " slots): ";
+		out << s.frames << " frames, " << s.framesPerSecond() << " fps, latency avg "
+			<< s.averageLatencyMs() << " ms max " << s.maxLatencyMs << " ms, simulate " << s.simulateMs / n << " ms (waited "
+			<< s.simulateWaitMs / n << "), render " << s.renderMs / n << " ms (waited " << s.renderWaitMs / n << ") per frame";
+		return out.str();
+	}
+
+private:
+	struct Slot {
+		T data;
+		uint64_t simulateStart = 0;
+		uint64_t published = 0;
+		uint64_t renderStart = 0;
+	};
+
+	std::vector<Slot> slots;
+	bool sameThread;
+	std::mutex mutex;
+	std::condition_variable condition;
+	uint64_t begun = 0;
+	uint64_t published = 0;
+	uint64_t acquired = 0;
+	uint64_t released = 0;
+	bool closed = false;
+	PipelineStats stats;
+};
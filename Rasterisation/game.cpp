@@ -2,19 +2,29 @@
 #include "dxCore.h"
 #include "shader.h"
 #include "mesh.h"
-#include "GamesEngineeringBase.h"
+#include "timer.h"
+#include "profiler.h"
 #include "camera.h"
 #include "texture.h"
 #include "shooting.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "frameArena.h"
+#include "jobSystem.h"
+#include "framePipeline.h"
+#include "assetStreamer.h"
+#include "transformHierarchy.h"
+#include "water.h"
+#include <thread>
+#include <new>
 
-static void renderWater(float dt, river water, Shader* waterShader, mathLib::Matrix planeWorld, mathLib::Matrix vp, DxCore* core, textureManager textures, sampler sam) {
-	float waveFrequency = 1.f;
-	float waveSpeed = 1.0f;
-	float waveAmplitude = 0.5f;
-	waterShader->updateConstantVS("waterParams", "waveSpeed", &waveSpeed);
-	waterShader->updateConstantVS("waterParams", "waveAmplitude", &waveAmplitude);
-	waterShader->updateConstantVS("waterParams", "waveFrequency", &waveFrequency);
-	waterShader->updateConstantVS("waterParams", "time", &dt);
+// waves are the ones the simulation's WaterSurface answers height queries with
+static void renderWater(const WaveParams& waves, river& water, Shader* waterShader, mathLib::Matrix& planeWorld, mathLib::Matrix& vp, DxCore* core, textureManager& textures, sampler& sam) {
+	WaveParams params = waves;
+	waterShader->updateConstantVS("waterParams", "waveSpeed", &params.speed);
+	waterShader->updateConstantVS("waterParams", "waveAmplitude", &params.amplitude);
+	waterShader->updateConstantVS("waterParams", "waveFrequency", &params.frequency);
+	waterShader->updateConstantVS("waterParams", "time", &params.time);
 	water.draw(core, waterShader, textures, sam, planeWorld, vp);
 }
 
@@ -37,41 +47,65 @@ static void renderLight(DxCore* core, Shader* lightShader, mathLib::Vec3 cameraP
 	lightShader->applyLight(core);
 }
 
-static void loadAssets(textureManager& textures, DxCore* core) {
-	textures.load(core, "Resources/Textures/Textures1.png");
-	textures.load(core, "Resources/Textures/grass_003_Mesh.2387_normals.bmp");
-	textures.load(core, "Resources/Textures/plant02.png");
-	textures.load(core, "Resources/Textures/plant02_Normal.png");
-	textures.load(core, "Resources/Textures/bamboo branch.png");
-	textures.load(core, "Resources/Textures/bamboo branch_Normal.png");
-	textures.load(core, "Resources/Textures/T-rex_Base_Color.png");
-	textures.load(core, "Resources/Textures/T-rex_Normal_OpenGL.png");
-	textures.load(core, "Resources/Textures/MaleDuty_3_OBJ_Serious_Packed0_Diffuse.png");
-	textures.load(core, "Resources/Textures/MaleDuty_3_OBJ_Serious_Packed0_Normal.png");
-	textures.load(core, "Resources/Textures/arms_1_Albedo.png");
-	textures.load(core, "Resources/Textures/arms_1_Normal.png");
-	textures.load(core, "Resources/Textures/AC5_Albedo.png");
-	textures.load(core, "Resources/Textures/AC5_Normal.png");
-	textures.load(core, "Resources/Textures/AC5_Collimator_Albedo.png");
-	textures.load(core, "Resources/Textures/AC5_Collimator_Normal.png");
-	textures.load(core, "Resources/Textures/AC5_Collimator_Glass_Albedo.png");
-	textures.load(core, "Resources/Textures/Automatic_Carbine_5_Collimator_normals.bmp");
-	textures.load(core, "Resources/Textures/AC5_Bullet_Shell_Albedo.png");
-	textures.load(core, "Resources/Textures/AC5_Bullet_Shell_Normal.png");
-	textures.load(core, "Resources/Textures/sunsetSky.png");
-	textures.load(core, "Resources/Textures/grass.png");
-	textures.load(core, "Resources/Textures/grass_Normal.png");
-	textures.load(core, "Resources/Textures/Water_002_COLOR.png");
-	textures.load(core, "Resources/Textures/Water_002_NORM.png");
-	textures.load(core, "Resources/Textures/Bricks097_1K-PNG_Color.png");
-	textures.load(core, "Resources/Textures/Bricks097_1K-PNG_NormalDX.png");
+// Textures nothing else asks for, streamed in with placeholders until they are in. The
+// priority is roughly the distance from the start position to where they are used; the
+// weapon set is not drawn yet and comes last. Models queue their own textures.
+static void streamAssets(textureManager& textures, AssetStreamer& streamer, DxCore* core, JobSystem& jobs) {
+	struct StreamedTexture {
+		const char* filename;
+		float priority;
+		bool normalMap;
+	};
+	const StreamedTexture files[] = {
+		{ "Resources/Textures/sunsetSky.png", 0.0f, false },
+		{ "Resources/Textures/grass.png", 0.0f, false },
+		{ "Resources/Textures/grass_Normal.png", 0.0f, true },
+		{ "Resources/Textures/Water_002_COLOR.png", 1.0f, false },
+		{ "Resources/Textures/Water_002_NORM.png", 1.0f, true },
+		{ "Resources/Textures/Bricks097_1K-PNG_Color.png", 3.0f, false },
+		{ "Resources/Textures/Bricks097_1K-PNG_NormalDX.png", 3.0f, true },
+		{ "Resources/Textures/MaleDuty_3_OBJ_Serious_Packed0_Diffuse.png", 100.0f, false },
+		{ "Resources/Textures/MaleDuty_3_OBJ_Serious_Packed0_Normal.png", 100.0f, true },
+		{ "Resources/Textures/arms_1_Albedo.png", 100.0f, false },
+		{ "Resources/Textures/arms_1_Normal.png", 100.0f, true },
+		{ "Resources/Textures/AC5_Albedo.png", 100.0f, false },
+		{ "Resources/Textures/AC5_Normal.png", 100.0f, true },
+		{ "Resources/Textures/AC5_Collimator_Albedo.png", 100.0f, false },
+		{ "Resources/Textures/AC5_Collimator_Normal.png", 100.0f, true },
+		{ "Resources/Textures/AC5_Collimator_Glass_Albedo.png", 100.0f, false },
+		{ "Resources/Textures/Automatic_Carbine_5_Collimator_normals.bmp", 100.0f, true },
+		{ "Resources/Textures/AC5_Bullet_Shell_Albedo.png", 100.0f, false },
+		{ "Resources/Textures/AC5_Bullet_Shell_Normal.png", 100.0f, true },
+	};
+	for (auto& file : files)
+		textures.stream(streamer, jobs, core, file.filename, file.priority, file.normalMap);
 }
 
+// what the render thread needs to draw one frame, filled in by the simulation
+struct GameSnapshot : RenderSnapshot {
+	mathLib::Matrix cubeWorld;
+	mathLib::Matrix waterWorld;
+	WaveParams waves;
+	VisibilitySet groundVisible;
+	bool cubeVisible = false;
+	bool playerVisible = false;
+	VisibilitySet grassVisible;     // per foliage chunk
+	VisibilitySet treeVisible;
+	VisibilitySet poolVisible;
+	const TerrainChunkUpdate* groundUpdates = nullptr;     // the chunks rebuilt this frame, in memory
+	int groundUpdateCount = 0;
+	bool printStats = false;    // the render thread adds its own stats to the once a second output
+};
+
 void debugOutput(const std::string& message) {
 	OutputDebugStringA(message.c_str());
 }
 
 int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR lpCmdLine, int nCmdShow) {
+	Profiler::setThreadName("main");
+	// this thread is worker 0 and the only one that talks to the device
+	JobSystem jobs;
+	jobs.init();
 	Window canvas;
 	ShaderManager shaders;
 	canvas.Init("MyWindow", 1024, 768);
@@ -88,19 +122,30 @@ int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR lpCmdLine, int nC
 	std::string lightPS = "Resources/Shader/lightPixelShader.hlsl";
 	std::string shaderName = "MyShader";
 	std::string staticShaderName = "staticShader";
+	std::string modelShaderName = "modelShader";
 	std::string skyShaderName = "skyShader";
 	std::string waterShaderName = "waterShader";
+	std::string lightShaderName = "lightShader";
 
 	/* defer shading - light shader*/
-	Shader* lightShader = new Shader();
-	lightShader->loadVS(lightVS, dx);
-	lightShader->loadPS(lightPS, dx);
-	lightShader->Init(dx->device);
+	shaders.load(lightShaderName, lightVS, lightPS, dx);
+	Shader* lightShader = shaders.getShader(lightShaderName);
+	// textures and the forests load in the background, the world starts with placeholders
+	AssetStreamer streamer;
+	streamer.init(&jobs, 512u << 20);
+	// the GPU copies are kept under their own budget, what is not drawn for a while drops
+	// mips and then goes
 	textureManager textures;
-	loadAssets(textures, dx);
+	textures.init(dx, streamer, jobs, 256u << 20);
+	streamAssets(textures, streamer, dx, jobs);
 
-	plane pl;
-	pl.init(dx);
+	// the heightfield stays with the simulation, the chunks' meshes with the device
+	Heightfield heightfield;
+	createGround(heightfield);
+	TerrainMesh terrainMesh;
+	terrainMesh.build(heightfield);
+	terrain ground;
+	ground.init(dx, terrainMesh);
 
 	river water;
 	water.init(dx);
@@ -111,31 +156,56 @@ int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR lpCmdLine, int nC
 	Pool pool;
 	pool.init(dx, mathLib::Vec3(5, 0, 5), 1);
 
+	// grass and bamboo are scattered over the ground by their density maps, chunk by chunk
+	DensityMap grassDensity, treeDensity;
+	FoliageLayer grassLayer, treeLayer;
+	createFoliage(heightfield, grassDensity, treeDensity, grassLayer, treeLayer);
+	// chunk culling batches fill in when the models arrive, update() runs the callbacks on this thread
+	BoundsBatch grassBatch;
+	BoundsBatch treeBatch;
+	// loaded models go to the GPU in the compact vertex layout, the generated meshes
+	// (terrain, cube, pool, sky, water) are small and stay full
 	forest grasses;
-	grasses.init("Resources/GemModel/grass_003.gem", dx, 30);
+	grasses.tree.vertexFormat = VertexFormat::Packed;
+	AssetHandle grassAsset = grasses.stream(streamer, jobs, textures, dx, "Resources/GemModel/grass_003.gem", grassLayer, 0.0f,
+		[&] { grassBatch.build(grasses.foliage.chunkBounds); });
 
 	forest trees;
-	trees.init("Resources/GemModel/bamboo.gem", dx, 30);
+	trees.tree.vertexFormat = VertexFormat::Packed;
+	AssetHandle treeAsset = trees.stream(streamer, jobs, textures, dx, "Resources/GemModel/bamboo.gem", treeLayer, 0.0f,
+		[&] { treeBatch.build(trees.foliage.chunkBounds); });
+	debugOutput("grass " + grasses.foliage.report() + "\nbamboo " + trees.foliage.report() + "\n");
 
+	// the player needs its skeleton on the first frame, so the TRex still loads here
 	animatedModel trex;
+	trex.vertexFormat = VertexFormat::Packed;
 	trex.init("Resources/GemModel/TRex.gem", dx);
+	for (size_t i = 0; i < trex.meshes.size(); i++) {
+		textures.stream(streamer, jobs, dx, "Resources/" + trex.textureFilenames[i], 0.0f);
+		textures.stream(streamer, jobs, dx, "Resources/" + trex.textureNormalFilenames[i], 0.0f, true);
+	}
 
 	SkyDome sky;
 	sky.init(dx, 20, 20, 50.0f, "Textures/sunsetSky.png");
 
-	shaders.load(shaderName, avs, normalPS, dx);
+	shaders.load(shaderName, avs, normalPS, dx, VertexFormat::Packed);
 	shaders.load(staticShaderName, vs, normalPS, dx);
+	shaders.load(modelShaderName, vs, normalPS, dx, VertexFormat::Packed);
 	shaders.load(waterShaderName, waterVS, normalPS, dx);
 	shaders.load(skyShaderName, vs, normalPS, dx);
+	debugOutput(shaders.cache.report() + "\n");
+	// edited .hlsl files are recompiled in the background and swapped in between frames
+	shaders.startWatching(dx);
 	Shader* animatedShader = shaders.getShader(shaderName);
 	Shader* staticShader = shaders.getShader(staticShaderName);
+	Shader* modelShader = shaders.getShader(modelShaderName);
 	Shader* skyShader = shaders.getShader(skyShaderName);
 	Shader* waterShader = shaders.getShader(waterShaderName);
-	GamesEngineeringBase::Timer tim;
+	Timer tim;
+	bool traceKeyDown = false;
 	float t = 0;
 	float elapsedTime = 0.0f;
 	int frameCount = 0;
-	mathLib::Matrix planeWorld;
 	mathLib::Matrix vp;
 	mathLib::Vec3 to(0, 1, 0);
 	mathLib::Vec3 up(0, 1, 0);
@@ -144,57 +214,263 @@ int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR lpCmdLine, int nC
 	Player player(mathLib::Vec3(0.0f, 1.0f, 0.0f), 5.0f, &trex);
 	TPSCamera camera(&player, 5.0f);
 
+	// world matrices of the things that move or sit in the scene, rebuilt only when they change
+	TransformHierarchy transforms;
+	TransformId cubeNode = transforms.add(NoTransform, mathLib::Vec3(13.f, 1.f, 0.f));
+	TransformId waterNode = transforms.add(NoTransform, mathLib::Vec3(0.f, 1.f, 0.f));
+	// the river's surface for gameplay, level with its node and as wide as its grid
+	WaterSurface waterSurface;
+	waterSurface.level = 1.0f;
+	waterSurface.setArea(0.0f, 0.0f, 3.0f);
+	player.attach(transforms);
+
 	sampler sam;
 	sam.init(dx);
 
-	while (true) {
-		dx->clear();
-		// defer shading	
-		dx->geometryPass();
+	// opaque geometry goes through the sorted draw list, sky and water still draw directly
+	RenderQueue renderQueue;
+	DxRenderBackend renderBackend;
+	renderBackend.init(dx);
+	// evicted and reduced textures give their handles back, packets register the new SRV
+	textures.backend.onRelease = [&renderBackend](ID3D11ShaderResourceView* srv) { renderBackend.removeTexture(srv); };
+	// per-draw constants from one ring buffer bound by offset, where the driver offsets constant buffers
+	renderBackend.enableUploadRing(4 << 20);
+
+	// frustum culling first, then ground and walls hide grass, trees and the far side of the pool
+	FrustumCuller frustum;
+	BoundsBatch poolBatch;
+	poolBatch.build(pool.bounds);
+	BoundsBatch groundBatch;
+	groundBatch.build(terrainMesh.bounds);
+	OcclusionCuller occlusion;
+	occlusion.init(256, 128);
+	occlusion.reserve(2048);
+	ClusterCuller clusterCuller;
+
+	// placeholders in before the first frame, from here on the render thread drains this queue
+	jobs.runMainThreadJobs();
+
+	// The render thread owns the device from here on and draws frame N from its snapshot
+	// while this thread simulates frame N+1
+	FramePipeline<GameSnapshot> pipeline(2);
+	std::thread renderThread([&] {
+		Profiler::setThreadName("render");
+		while (const GameSnapshot* frame = pipeline.acquire()) {
+			const GameSnapshot& s = *frame;
+			std::string reloads = shaders.applyReloads();
+			if (!reloads.empty())
+				debugOutput(reloads);
+			mathLib::Matrix vp = s.vp;
+			mathLib::Matrix playerWorld = s.playerWorld;
+			mathLib::Matrix cubeWorld = s.cubeWorld;
+			mathLib::Matrix waterWorld = s.waterWorld;
+			for (int i = 0; i < s.groundUpdateCount; i++)
+				ground.updateChunk(dx, s.groundUpdates[i]);
+			{
+				PROFILE_SCOPE("draw: clear + geometry pass");
+				dx->clear();
+				// defer shading	
+				dx->geometryPass();
+			}
+			// draw sky dome
+			{
+				PROFILE_SCOPE("draw: sky");
+				sky.update(s.time);
+				sky.draw(dx, skyShader, textures, sam, s.cameraPosition, vp);
+			}
+			{
+				PROFILE_SCOPE("draw: record");
+				renderQueue.begin();
+				// the trees drawn in full only draw their clusters in view
+				clusterCuller.begin(vp, s.cameraPosition);
+				if (s.cubeVisible)
+					cube.record(renderQueue, renderBackend, staticShader, textures, sam, cubeWorld, vp);
+				// ground chunks, grass and trees drop to coarser levels while their error stays under a pixel
+				LodSelector lods;
+				lods.init(s.cameraPosition, 60.0f * M_PI / 180.0f, 768.0f);
+				ground.record(renderQueue, renderBackend, staticShader, textures, sam, vp, &s.groundVisible, &lods);
+				grasses.record(renderQueue, renderBackend, textures, modelShader, sam, vp, &s.grassVisible, &lods, &clusterCuller, s.memory);
+				trees.record(renderQueue, renderBackend, textures, modelShader, sam, vp, &s.treeVisible, &lods, &clusterCuller, s.memory);
+				if (s.playerVisible)
+					trex.record(renderQueue, renderBackend, animatedShader, textures, sam, playerWorld, vp, s.bones);
+				pool.record(renderQueue, renderBackend, staticShader, textures, sam, vp, &s.poolVisible);
+			}
+			{
+				PROFILE_SCOPE("draw: render queue");
+				renderQueue.sort();
+				renderQueue.execute(renderBackend);
+			}
+			{
+				PROFILE_SCOPE("draw: water");
+				renderWater(s.waves, water, waterShader, waterWorld, vp, dx, textures, sam);
+			}
+
+			/* defer Shading implementation*/
+			{
+				PROFILE_SCOPE("draw: lighting pass");
+				renderLight(dx, lightShader, s.cameraPosition);
+				dx->lightingPass();
+			}
+			jobs.runMainThreadJobs();
+			textures.endFrame();
+			{
+				PROFILE_SCOPE("present");
+				dx->present();
+			}
+			if (s.printStats) {
+				const RenderQueueStats& rs = renderQueue.stats;
+				debugOutput("render queue: " + std::to_string(rs.draws) + " draws, " + std::to_string(rs.shaderBinds) + " shader, "
+					+ std::to_string(rs.textureBinds) + " texture, " + std::to_string(rs.meshBinds) + " mesh binds, "
+					+ std::to_string(rs.constantUploads) + " constant uploads, " + std::to_string(rs.skippedBinds) + " skipped\n");
+				debugOutput(textures.report() + "\n");
+				debugOutput(clusterCuller.report() + "\n");
+			}
+			pipeline.release();
+		}
+	});
+
+	uint64_t frameIndex = 0;
+	while (!canvas.quit) {
+		Profiler::beginFrame();
+		// hand-off: blocks while the render thread still has the previous snapshot in this slot
+		GameSnapshot& snapshot = pipeline.beginWrite();
+		FrameMemory::beginFrame();
+		// the snapshot's lists are taken from this frame's arena, it lives until the frame is drawn
+		snapshot.memory = &FrameMemory::current();
+		for (VisibilitySet* visible : { &snapshot.groundVisible, &snapshot.grassVisible, &snapshot.treeVisible, &snapshot.poolVisible })
+			visible->arena = snapshot.memory;
 		float dt = tim.dt();
 		t += dt;
 
 		elapsedTime += dt;
 		frameCount++;
+		snapshot.printStats = false;
 		// update FPS each second
 		if (elapsedTime >= 1.0f) {
 			float fps = frameCount / elapsedTime;
 			frameCount = 0;
 			elapsedTime = 0.0f;
+			snapshot.printStats = true;
 
 			std::string message = "FPS: " + std::to_string(fps) + "\n";
 			debugOutput(message);
+			debugOutput(Profiler::formatSummary(Profiler::lastFrame()));
+			debugOutput("frustum: " + std::to_string(frustum.stats.visible) + "/" + std::to_string(frustum.stats.tested) + " visible, "
+				+ std::to_string(frustum.stats.ms) + " ms\n");
+			const OcclusionStats& os = occlusion.stats;
+			debugOutput("occlusion: " + std::to_string(os.visible) + "/" + std::to_string(os.tested) + " visible, "
+				+ std::to_string(os.occluded) + " occluded, " + std::to_string(os.offscreen) + " off screen, raster "
+				+ std::to_string(os.rasterMs) + " ms, pyramid " + std::to_string(os.pyramidMs) + " ms, test "
+				+ std::to_string(os.testMs) + " ms\n");
+			JobSystemStats js = jobs.stats();
+			std::string workers;
+			for (size_t i = 0; i < js.workers.size(); i++)
+				workers += " " + std::to_string(js.workers[i].executed) + "/" + std::to_string(js.workers[i].steals) + "/" + std::to_string((int)js.workers[i].idleMs);
+			debugOutput("jobs: " + std::to_string(js.executed()) + " run, " + std::to_string(js.steals()) + " stolen, per worker run/stolen/idle ms" + workers + "\n");
+			jobs.resetStats();
+			debugOutput(pipeline.report() + "\n");
+			pipeline.resetStats();
+			debugOutput(streamer.report() + "\n");
+			debugOutput(transforms.report() + "\n");
+			debugOutput(terrainMesh.report() + "\n");
 		}
 
-		// draw sky dome
-		sky.update(t);
-		sky.draw(dx, skyShader, textures, sam, camera.position, vp);
+		// P writes everything still in the profiler rings to profile.json
+		if (canvas.keys['P'] && !traceKeyDown) {
+			Profiler::exportChromeTrace("profile.json");
+			debugOutput("wrote profile.json\n");
+		}
+		traceKeyDown = canvas.keys['P'];
 
-		handleInput(player, camera, canvas, dt, cube.boundingBox);
+		{
+			PROFILE_SCOPE("simulate: input + player");
+			handleInput(player, camera, canvas, dt, cube.boundingBox, &heightfield);
+		}
+		// K digs into the ground in front of the player; the chunks it touched are rebuilt
+		// a few a frame and their vertices go to the render thread in the snapshot
+		if (canvas.keyDown('K')) {
+			mathLib::Vec3 forward = camera.target - camera.position;
+			forward.y = 0.0f;
+			mathLib::Vec3 at = player.position + forward.normalize() * 4.0f;
+			terrainMesh.markDirty(heightfield.edit(at.x, at.z, 3.0f, -2.0f * dt));
+		}
+		snapshot.groundUpdateCount = (int)terrainMesh.rebuildDirty(4);
+		if (snapshot.groundUpdateCount > 0) {
+			TerrainChunkUpdate* updates = snapshot.memory->allocateArray<TerrainChunkUpdate>(snapshot.groundUpdateCount);
+			for (int i = 0; i < snapshot.groundUpdateCount; i++) {
+				uint32_t c = terrainMesh.rebuilt()[i];
+				new (&updates[i]) TerrainChunkUpdate;
+				updates[i].fill(c, terrainMesh.chunks[c]);
+			}
+			snapshot.groundUpdates = updates;
+			groundBatch.build(terrainMesh.bounds);
+		}
 		mathLib::Matrix cv = camera.getViewMatrix();
 		vp = cv * p;
 
+		{
+			PROFILE_SCOPE("stream: priorities");
+			streamer.setPriority(grassAsset, grasses.distanceTo(camera.position));
+			streamer.setPriority(treeAsset, trees.distanceTo(camera.position));
+		}
+		// a few loads per frame, their device work goes to the render thread's queue
+		streamer.update(4);
+
 		// world Matrix
-		mathLib::Matrix cubeWorld = mathLib::Matrix::translation(mathLib::Vec3(13.f, 1.f, 0.f));
-		mathLib::Matrix waterWorld = mathLib::Matrix::translation(mathLib::Vec3(0.f, 1.f, 0.f));
-
-		cube.updateBoundingBox(cubeWorld);
-		cube.draw(dx, staticShader, textures, sam, cubeWorld, vp);
-		pl.draw(dx, staticShader, textures, sam, planeWorld, vp);
-		grasses.draw(dx, textures, staticShader, sam, vp);
-		trees.draw(dx, textures, staticShader, sam, vp);
-		player.draw(dx, animatedShader, textures, sam, vp);
-		pool.draw(dx, staticShader, textures, sam, vp);
-		renderWater(t, water, waterShader, waterWorld, vp, dx, textures, sam);
-
-		/* defer Shading implementation*/
-		renderLight(dx, lightShader, camera.position);
-		dx->lightingPass();
+		transforms.update();
+		player.syncBounds();
+		mathLib::Matrix cubeWorld = transforms.world(cubeNode);
+		if (transforms.changed(cubeNode))
+			cube.updateBoundingBox(cubeWorld);
+		mathLib::Matrix playerWorld = player.getWorldMatrix();
+		{
+			PROFILE_SCOPE("cull: frustum");
+			frustum.begin(vp);
+			frustum.cull(groundBatch, snapshot.groundVisible, &jobs);
+			snapshot.cubeVisible = frustum.isVisible(cube.boundingBox);
+			snapshot.playerVisible = frustum.isVisible(trex.bounds.transformed(playerWorld));
+			frustum.cull(grassBatch, snapshot.grassVisible, &jobs);
+			frustum.cull(treeBatch, snapshot.treeVisible, &jobs);
+			grasses.foliage.cullDistance(camera.position, snapshot.grassVisible);
+			frustum.cull(poolBatch, snapshot.poolVisible, &jobs);
+		}
+		{
+			PROFILE_SCOPE("cull: occlusion");
+			occlusion.begin(vp);
+			occlusion.addOccluder(terrainMesh.occluderVertices, terrainMesh.occluderIndices, mathLib::Matrix());
+			occlusion.addOccluder(cube.boundingBox);
+			for (auto& box : pool.bounds)
+				occlusion.addOccluder(box);
+			occlusion.finish();
+			occlusion.refine(grasses.foliage.chunkBounds, snapshot.grassVisible);
+			occlusion.refine(trees.foliage.chunkBounds, snapshot.treeVisible);
+			occlusion.refine(pool.bounds, snapshot.poolVisible);
+		}
+
+		snapshot.frame = frameIndex++;
+		snapshot.time = t;
+		snapshot.vp = vp;
+		snapshot.cameraPosition = camera.position;
+		snapshot.playerWorld = playerWorld;
+		snapshot.copyBones(trex.instance.matrices, RenderSnapshot::MaxBones);
+		snapshot.cubeWorld = cubeWorld;
+		snapshot.waterWorld = transforms.world(waterNode);
+		waterSurface.setTime(t);
+		snapshot.waves = waterSurface.waves;
+		pipeline.publish();
 
 		canvas.processMessages();
-		dx->present();
+		Profiler::endFrame();
 	}
+	// the render thread draws what was published and stops, then the threads that still
+	// use the device, the frame arenas or the jobs, before any of it is destroyed
+	pipeline.close();
+	renderThread.join();
+	shaders.stopWatching();
+	streamer.shutdown();
+	jobs.shutdown();
 
 	textures.unload("Resources/Textures/T-rex_Base_Color.png");
 	textures.unload("Resources/Textures/MaleDuty_3_OBJ_Happy_Packed0_Diffuse.png");
+	return 0;
 }
@@ -0,0 +1,1091 @@
+// Headless driver: loads .gem assets and steps the gameplay simulation without a
+// window or a D3D device, so the core can be built and profiled on Linux.
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include "mathLib.h"
+#include "GEMLoader.h"
+#include "animatedRig.h"
+#include "collision.h"
+#include "player.h"
+#include "camera.h"
+#include "shooting.h"
+#include "input.h"
+#include "timer.h"
+#include "profiler.h"
+#include "vertex.h"
+#include "rasterizer.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "renderQueue.h"
+#include "renderDevice.h"
+#include "headlessScene.h"
+#include "frameArena.h"
+#include "jobSystem.h"
+#include "framePipeline.h"
+#include "assetStreamer.h"
+#include "modelAsset.h"
+#include "meshOptimizer.h"
+#include "textureResidency.h"
+#include "transformHierarchy.h"
+#include "terrain.h"
+#include "water.h"
+#include "shaderCache.h"
+#include <thread>
+#define GE_ALLOCATION_COUNTER_IMPLEMENTATION
+#include "allocationCounter.h"
+
+struct HeadlessOptions {
+	std::string resources = "Resources";
+	std::vector<std::string> models;
+	int frames = 600;
+	float dt = 1.0f / 60.0f;
+	std::string trace;      // Chrome trace JSON written at exit
+	std::string raster;     // last frame rendered with the software rasterizer, written as PPM
+	int rasterWidth = 1024;
+	int rasterHeight = 768;
+	int rasterThreads = 0;
+	std::string capture;    // device command stream of the last frame, binary
+	std::string compare;    // reference stream to diff the last frame against
+	int jobThreads = 0;     // 0 = every hardware thread
+	int crowd = 16;         // extra TRex instances animated on the job workers
+	int pipeline = 2;       // snapshot slots between simulation and render thread (at most FrameMemory::FramesInFlight), 0 = both on one thread
+	int warmupFrames = 30;  // the persistent containers have grown by then, per-frame lists come from FrameMemory
+	size_t streamBudget = 0; // bytes the model loads may keep resident, 0 = no limit
+	size_t textureBudget = 0; // runs the texture residency simulation with this budget
+	int ocean = 0;          // FFT ocean grid size for the water queries, 0 = the shader's waves
+	int uploadRing = 4;     // MB of the per-draw constant ring, 0 = a constant buffer per shader
+	bool shaderCache = false; // list the compiled shaders WinMain left beside the .hlsl files
+	bool checkAllocations = false;
+};
+
+static void printUsage() {
+	std::cout << "usage: headless [--resources dir] [--frames n] [--dt seconds] [--trace out.json]\n"
+		"                [--raster out.ppm] [--raster-size WxH] [--raster-threads n]\n"
+		"                [--capture out.gecs] [--compare reference.gecs] [--warmup n] [--check-allocations]\n"
+		"                [--job-threads n] [--crowd n] [--pipeline slots] [--stream-budget MB]\n"
+		"                [--texture-budget MB] [--ocean n] [--upload-ring MB] [--shader-cache]\n"
+		"                [model.gem ...]" << std::endl;
+}
+
+static bool parseOptions(int argc, char** argv, HeadlessOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--resources" && i + 1 < argc) options.resources = argv[++i];
+		else if (arg == "--frames" && i + 1 < argc) options.frames = atoi(argv[++i]);
+		else if (arg == "--dt" && i + 1 < argc) options.dt = (float)atof(argv[++i]);
+		else if (arg == "--trace" && i + 1 < argc) options.trace = argv[++i];
+		else if (arg == "--raster" && i + 1 < argc) options.raster = argv[++i];
+		else if (arg == "--raster-size" && i + 1 < argc) sscanf(argv[++i], "%dx%d", &options.rasterWidth, &options.rasterHeight);
+		else if (arg == "--raster-threads" && i + 1 < argc) options.rasterThreads = atoi(argv[++i]);
+		else if (arg == "--capture" && i + 1 < argc) options.capture = argv[++i];
+		else if (arg == "--compare" && i + 1 < argc) options.compare = argv[++i];
+		else if (arg == "--warmup" && i + 1 < argc) options.warmupFrames = atoi(argv[++i]);
+		else if (arg == "--check-allocations") options.checkAllocations = true;
+		else if (arg == "--job-threads" && i + 1 < argc) options.jobThreads = atoi(argv[++i]);
+		else if (arg == "--crowd" && i + 1 < argc) options.crowd = atoi(argv[++i]);
+		else if (arg == "--pipeline" && i + 1 < argc) options.pipeline = atoi(argv[++i]);
+		else if (arg == "--stream-budget" && i + 1 < argc) options.streamBudget = (size_t)atoi(argv[++i]) << 20;
+		else if (arg == "--texture-budget" && i + 1 < argc) options.textureBudget = (size_t)atoi(argv[++i]) << 20;
+		else if (arg == "--ocean" && i + 1 < argc) options.ocean = atoi(argv[++i]);
+		else if (arg == "--upload-ring" && i + 1 < argc) options.uploadRing = atoi(argv[++i]);
+		else if (arg == "--shader-cache") options.shaderCache = true;
+		else if (arg == "--help" || arg == "-h") return false;
+		else options.models.push_back(arg);
+	}
+	return true;
+}
+
+// what VertexFormat::Packed makes of a model: vertex bytes before and after, and the
+// largest errors of the CPU decode against the float vertices
+struct PackingSummary {
+	size_t fullBytes = 0;
+	size_t packedBytes = 0;
+	float normalDegrees = 0.0f;     // normals and tangents
+	float uvError = 0.0f;
+	float weightError = 0.0f;       // against the weights normalized to sum to 1
+	size_t badWeightSums = 0;       // packed weights that do not add up to 255
+};
+
+struct ModelSummary {
+	size_t meshes = 0;
+	size_t vertices = 0;
+	size_t triangles = 0;
+	size_t bones = 0;
+	size_t animations = 0;
+	double ms = 0.0;        // request to load callback
+	PackingSummary packing;
+	std::vector<MeshOptimizerStats> optimization;
+	std::vector<std::vector<MeshLod>> lods;     // per mesh
+	bool lodsFromSidecar = false;
+	std::vector<MeshletMesh> meshlets;          // per mesh
+	bool failed = false;                        // not readable or not a .gem
+};
+
+static float angleDegrees(mathLib::Vec3 a, mathLib::Vec3 b) {
+	float la = a.getLength();
+	float lb = b.getLength();
+	if (la == 0.0f || lb == 0.0f) return 0.0f;
+	float d = (a.x * b.x + a.y * b.y + a.z * b.z) / (la * lb);
+	d = d > 1.0f ? 1.0f : (d < -1.0f ? -1.0f : d);
+	return acosf(d) * 180.0f / (float)M_PI;
+}
+
+static void measureDirections(PackingSummary& out, const mathLib::Vec3& normal, const mathLib::Vec3& tangent, const mathLib::Vec3& decodedNormal,
+	const mathLib::Vec3& decodedTangent) {
+	float e = angleDegrees(normal, decodedNormal);
+	if (e > out.normalDegrees) out.normalDegrees = e;
+	e = angleDegrees(tangent, decodedTangent);
+	if (e > out.normalDegrees) out.normalDegrees = e;
+}
+
+static void measureUV(PackingSummary& out, float u, float v, float du, float dv) {
+	float e = fabsf(u - du) > fabsf(v - dv) ? fabsf(u - du) : fabsf(v - dv);
+	if (e > out.uvError) out.uvError = e;
+}
+
+static void measurePacking(const ModelAsset& asset, PackingSummary& out) {
+	for (auto& mesh : asset.meshes) {
+		for (auto& gv : mesh.verticesStatic) {
+			STATIC_VERTEX v = toVertex(gv);
+			STATIC_VERTEX_PACKED p = packVertex(v);
+			STATIC_VERTEX d = unpackVertex(p);
+			out.fullBytes += sizeof(STATIC_VERTEX);
+			out.packedBytes += sizeof(STATIC_VERTEX_PACKED);
+			measureDirections(out, v.normal, v.tangent, d.normal, d.tangent);
+			measureUV(out, v.tu, v.tv, d.tu, d.tv);
+		}
+		for (auto& gv : mesh.verticesAnimated) {
+			ANIMATED_VERTEX v = toVertex(gv);
+			ANIMATED_VERTEX_PACKED p = packVertex(v);
+			ANIMATED_VERTEX d = unpackVertex(p);
+			out.fullBytes += sizeof(ANIMATED_VERTEX);
+			out.packedBytes += sizeof(ANIMATED_VERTEX_PACKED);
+			measureDirections(out, v.normal, v.tangent, d.normal, d.tangent);
+			measureUV(out, v.tu, v.tv, d.tu, d.tv);
+			float sum = 0.0f;
+			int packedSum = 0;
+			for (int i = 0; i < 4; i++) {
+				sum += v.boneWeights[i];
+				packedSum += p.boneWeights[i];
+			}
+			if (packedSum != 255) out.badWeightSums++;
+			for (int i = 0; i < 4 && sum > 0.0f; i++) {
+				float e = fabsf(v.boneWeights[i] / sum - d.boneWeights[i]);
+				if (e > out.weightError) out.weightError = e;
+			}
+		}
+	}
+}
+
+// load every model through the asset streamer and print what is inside, this is what
+// model::init / animatedModel::init read. The I/O thread reads the files in the order
+// given, the job workers decode them and prepare their LODs (written next to each
+// model the first time), the summaries are printed in order. Nothing is
+// kept, so each model can be evicted when the budget needs its room.
+static void loadModels(std::vector<std::string>& models, JobSystem& jobs, size_t budget) {
+	std::vector<ModelSummary> summaries(models.size());
+	Timer total;
+	AssetStreamer streamer;
+	streamer.init(&jobs, budget);
+	for (size_t i = 0; i < models.size(); i++) {
+		uint64_t requested = Timer::now();
+		ModelSummary* summary = &summaries[i];
+		std::string filename = models[i];
+		streamer.request<ModelAsset>(models[i], (float)i,
+			[filename](const std::vector<unsigned char>& file, ModelAsset& asset) {
+				if (!asset.decode(file)) return (size_t)0;
+				asset.prepareLods(filename);
+				asset.buildMeshlets();
+				return asset.sizeInBytes();
+			},
+			[summary, requested](ModelAsset& asset) {
+				summary->ms = (Timer::now() - requested) * 1e-6;
+				summary->meshes = asset.meshes.size();
+				summary->vertices = asset.vertexCount();
+				summary->triangles = asset.triangleCount();
+				summary->bones = asset.animation.bones.size();
+				summary->animations = asset.animation.animations.size();
+				measurePacking(asset, summary->packing);
+				summary->optimization = asset.optimization;
+				for (auto& chain : asset.lods)
+					summary->lods.push_back(chain.levels);
+				summary->lodsFromSidecar = asset.lodsFromSidecar;
+				summary->meshlets = asset.meshlets;
+			},
+			[] {},
+			[summary, requested] {
+				summary->ms = (Timer::now() - requested) * 1e-6;
+				summary->failed = true;
+			});
+	}
+	while (!streamer.idle()) {
+		streamer.update();
+		if (streamer.stats().stalled) break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	streamer.update();
+	double ms = total.elapsed() * 1000.0;
+
+	for (size_t i = 0; i < models.size(); i++) {
+		const ModelSummary& summary = summaries[i];
+		if (summary.failed) {
+			std::cout << models[i] << ": could not be read or decoded (" << summary.ms << " ms)" << std::endl;
+			continue;
+		}
+		std::cout << models[i] << ": " << summary.meshes << " meshes, " << summary.vertices << " vertices, " << summary.triangles << " triangles";
+		if (summary.bones > 0)
+			std::cout << ", " << summary.bones << " bones, " << summary.animations << " animations";
+		std::cout << " (" << summary.ms << " ms)" << std::endl;
+		for (size_t m = 0; m < summary.optimization.size(); m++) {
+			const MeshOptimizerStats& o = summary.optimization[m];
+			std::cout << "  mesh " << m << ": ACMR " << o.before.acmr << " -> " << o.after.acmr << ", ATVR " << o.before.atvr << " -> " << o.after.atvr
+				<< ", " << o.clusters << " clusters " << (o.overdrawSorted ? "sorted" : "kept in cache order") << ", "
+				<< (fitsIndex16(o.vertices) ? 16 : 32) << " bit indices" << std::endl;
+			if (m >= summary.lods.size()) continue;
+			std::cout << "    LODs" << (summary.lodsFromSidecar ? " (from .lod)" : "") << ":";
+			for (auto& level : summary.lods[m])
+				std::cout << " " << level.indexCount / 3 << " tris/" << level.error;
+			std::cout << std::endl;
+			if (m >= summary.meshlets.size() || summary.meshlets[m].empty()) continue;
+			const MeshletMesh& meshlets = summary.meshlets[m];
+			size_t vertices = 0, triangles = 0;
+			for (auto& meshlet : meshlets.meshlets) {
+				vertices += meshlet.vertexCount;
+				triangles += meshlet.triangleCount;
+			}
+			std::cout << "    meshlets: " << meshlets.size() << ", " << (float)vertices / meshlets.size() << " vertices and "
+				<< (float)triangles / meshlets.size() << " triangles each, " << (meshlets.closed ? "closed" : "open") << std::endl;
+		}
+		const PackingSummary& packing = summary.packing;
+		std::cout << "  packed vertices: " << packing.fullBytes / 1024 << " KB -> " << packing.packedBytes / 1024 << " KB, max error "
+			<< packing.normalDegrees << " deg, uv " << packing.uvError;
+		if (summary.bones > 0)
+			std::cout << ", weights " << packing.weightError << " (" << packing.badWeightSums << " sums off 255)";
+		std::cout << std::endl;
+	}
+	std::cout << "loaded " << models.size() << " models in " << ms << " ms on " << jobs.workerCount() << " threads" << std::endl;
+	std::cout << streamer.report() << std::endl;
+}
+
+// every shader cache sidecar in the directory with its key and reflection, and whether
+// the .hlsl next to it still hashes to the source it was compiled from
+static void inspectShaderCache(const std::string& directory) {
+	std::vector<std::string> files;
+	for (auto& entry : std::filesystem::directory_iterator(directory))
+		if (entry.path().extension() == ".gsc")
+			files.push_back(entry.path().string());
+	std::sort(files.begin(), files.end());
+	int current = 0;
+	for (auto& filename : files) {
+		ShaderCacheEntry entry;
+		if (!ShaderCache::read(filename, entry)) {
+			std::cout << filename << ": not a shader cache file of this version" << std::endl;
+			continue;
+		}
+		std::ifstream source(ShaderCache::sourceOf(filename), std::ios::binary);
+		std::string text((std::istreambuf_iterator<char>(source)), std::istreambuf_iterator<char>());
+		bool upToDate = source && ShaderCache::hash(text.data(), text.size()) == entry.key.sourceHash;
+		if (upToDate) current++;
+		std::cout << filename << (upToDate ? "" : " (stale, the source changed)") << ": " << ShaderCache::describe(entry);
+	}
+	std::cout << "shader cache: " << files.size() << " compiled shaders in " << directory << ", " << current << " up to date" << std::endl;
+}
+
+// textureManager's residency policy on the fake backend: every texture in the directory
+// is decoded and mipped on the job workers, then each frame uses half of them, a window
+// that slides along by one texture every 10 frames. What was evicted or reduced comes
+// back a frame later from the kept chains, the way a streamed reload does. Fails if the
+// backend's live bytes and the residency manager's accounting disagree.
+static bool simulateTextures(const std::string& directory, JobSystem& jobs, size_t budget, int frames) {
+	std::vector<std::string> files;
+	for (auto& entry : std::filesystem::directory_iterator(directory)) {
+		std::string extension = entry.path().extension().string();
+		if (extension == ".png" || extension == ".bmp" || extension == ".jpg" || extension == ".tga")
+			files.push_back(entry.path().string());
+	}
+	std::sort(files.begin(), files.end());
+	std::vector<MipChain> chains(files.size());
+	jobs.parallelFor(files.size(), 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			Image image;
+			if (image.load(files[i]))
+				chains[i].build(image);
+		}
+	});
+
+	NullTextureBackend backend;
+	TextureResidency residency;
+	residency.init(&backend, budget);
+	std::vector<TextureId> reloads;
+	residency.onReload = [&reloads](TextureId id) { reloads.push_back(id); };
+	// ids index the chains, files that did not decode get an empty chain and are not used
+	std::vector<TextureId> ids;
+	for (size_t i = 0; i < files.size(); i++) {
+		TextureId id = residency.add(files[i]);
+		if (chains[i].levelCount() == 0) continue;
+		residency.upload(id, chains[i]);
+		ids.push_back(id);
+	}
+	bool consistent = true;
+	size_t window = (ids.size() + 1) / 2;
+	for (int frame = 0; frame < frames && !ids.empty(); frame++) {
+		for (TextureId id : reloads)
+			residency.upload(id, chains[id]);
+		reloads.clear();
+		size_t first = (size_t)(frame / 10) % ids.size();
+		for (size_t i = 0; i < window; i++)
+			residency.use(ids[(first + i) % ids.size()]);
+		residency.endFrame();
+		if (backend.counters.liveBytes != residency.stats().residentBytes)
+			consistent = false;
+	}
+	const TextureBackendCounters& c = backend.counters;
+	std::cout << residency.report() << std::endl;
+	std::cout << "texture backend: " << c.creates << " creates, " << c.drops << " level drops, " << c.releases << " releases, "
+		<< c.bytesUploaded / (1024 * 1024) << " MB uploaded, " << c.liveTextures << " live, " << c.liveBytes / (1024 * 1024) << " MB" << std::endl;
+	if (!consistent)
+		std::cout << "texture residency and backend disagree on the resident bytes" << std::endl;
+	return consistent;
+}
+
+// one startup self-check: every failed expect() prints a line under the check's name,
+// report() prints the summary, marked FAILED when anything failed, and returns whether
+// everything held
+struct SelfCheck {
+	const char* name;
+	bool ok = true;
+	std::ostringstream summary;
+
+	SelfCheck(const char* _name) : name(_name) {}
+
+	void expect(bool condition, const char* what) {
+		if (condition) return;
+		std::cout << name << ": " << what << std::endl;
+		ok = false;
+	}
+
+	bool report() {
+		std::cout << name << ": " << summary.str() << (ok ? "" : ", FAILED") << std::endl;
+		return ok;
+	}
+};
+
+// random unit normals and tangents, UVs over a few wraps and bone weights through
+// packVertex / unpackVertex. A SNORM16 octahedral pair is good to about 7e-5 radians,
+// a half float to half an ulp (2^-11 relative, 2^-25 below the normal range), and the
+// packed weights have to sum to exactly 255 with none off by more than one step.
+static bool checkVertexPacking(int count) {
+	uint32_t state = 1;
+	auto random = [&]() {
+		state = state * 1664525u + 1013904223u;
+		return (state >> 8) * (1.0f / 16777216.0f);
+	};
+	auto unitVector = [&]() {
+		while (true) {
+			mathLib::Vec3 v(random() * 2.0f - 1.0f, random() * 2.0f - 1.0f, random() * 2.0f - 1.0f);
+			float length = v.getLength();
+			if (length > 0.1f && length <= 1.0f) return v / length;
+		}
+	};
+	auto angle = [](const mathLib::Vec3& a, const mathLib::Vec3& b) {
+		// asin of the cross product, acos loses everything this small to float rounding
+		float s = mathLib::cross(a, b).getLength();
+		return asinf(s < 1.0f ? s : 1.0f);
+	};
+	auto halfError = [](float original, float decoded) {
+		float bound = fabsf(original) * (1.0f / 2048.0f);
+		return fabsf(decoded - original) <= (bound > 1.0f / 33554432.0f ? bound : 1.0f / 33554432.0f);
+	};
+	float worstAngle = 0.0f;
+	int uvErrors = 0;
+	int weightErrors = 0;
+	for (int i = 0; i < count; i++) {
+		ANIMATED_VERTEX v;
+		v.pos = mathLib::Vec3(random(), random(), random());
+		v.normal = unitVector();
+		v.tangent = unitVector();
+		v.tu = random() * 8.0f - 4.0f;
+		v.tv = (random() - 0.5f) * 1e-4f;
+		float sum = 0.0f;
+		for (int j = 0; j < 4; j++) {
+			v.bonesIDs[j] = (unsigned int)(random() * 256.0f);
+			// a quarter of the weights are unused
+			v.boneWeights[j] = random() < 0.25f ? 0.0f : random();
+			sum += v.boneWeights[j];
+		}
+		ANIMATED_VERTEX_PACKED p = packVertex(v);
+		ANIMATED_VERTEX u = unpackVertex(p);
+		float a = angle(v.normal, u.normal);
+		float b = angle(v.tangent, u.tangent);
+		worstAngle = a > worstAngle ? a : worstAngle;
+		worstAngle = b > worstAngle ? b : worstAngle;
+		if (!halfError(v.tu, u.tu) || !halfError(v.tv, u.tv))
+			uvErrors++;
+		int total = 0;
+		bool weightsOk = true;
+		for (int j = 0; j < 4; j++) {
+			total += p.boneWeights[j];
+			float expected = sum > 0.0f ? v.boneWeights[j] / sum : (j == 0 ? 1.0f : 0.0f);
+			if (fabsf(u.boneWeights[j] - expected) > 1.0f / 255.0f) weightsOk = false;
+			if (p.bonesIDs[j] != v.bonesIDs[j]) weightsOk = false;
+		}
+		if (total != 255 || !weightsOk)
+			weightErrors++;
+	}
+	SelfCheck check("vertex packing");
+	check.expect(worstAngle <= 1e-4f, "a normal or tangent off by more than 1e-4 rad");
+	check.expect(uvErrors == 0, "a UV off by more than half a half float ulp");
+	check.expect(weightErrors == 0, "bone weights not summing to 255 or off by more than a step");
+	check.summary << count << " vertices, worst direction error " << worstAngle << " rad, " << uvErrors << " UVs and "
+		<< weightErrors << " weight sets off";
+	return check.report();
+}
+
+// A grid of quads written the way some exporters do, every triangle its own three
+// vertices and the triangles shuffled, through the optimizer passes one by one and
+// then all of them: welding has to find the shared corners, the cache order may not
+// raise ACMR, and after every renumbering the same triangles (as grid corners, same
+// winding) have to be there.
+static bool checkMeshOptimizer(int quads) {
+	const int side = quads + 1;
+	std::vector<STATIC_VERTEX> vertices;
+	std::vector<unsigned int> indices;
+	for (int z = 0; z < quads; z++) {
+		for (int x = 0; x < quads; x++) {
+			int corners[6][2] = { { x, z }, { x, z + 1 }, { x + 1, z + 1 }, { x, z }, { x + 1, z + 1 }, { x + 1, z } };
+			for (auto& c : corners) {
+				indices.push_back((unsigned int)vertices.size());
+				vertices.push_back(addVertex(mathLib::Vec3((float)c[0], 0.0f, (float)c[1]), mathLib::Vec3(0.0f, 1.0f, 0.0f), c[0] / (float)quads, c[1] / (float)quads));
+			}
+		}
+	}
+	uint32_t state = 7;
+	for (size_t t = indices.size() / 3 - 1; t > 0; t--) {
+		state = state * 1664525u + 1013904223u;
+		size_t u = (state >> 8) % (t + 1);
+		for (int k = 0; k < 3; k++)
+			std::swap(indices[t * 3 + k], indices[u * 3 + k]);
+	}
+	// each triangle as its grid corners, rotated to start at the lowest, sorted
+	auto triangles = [side](const std::vector<STATIC_VERTEX>& v, const std::vector<unsigned int>& idx) {
+		std::vector<uint64_t> keys;
+		for (size_t t = 0; t + 2 < idx.size(); t += 3) {
+			uint64_t id[3];
+			for (int k = 0; k < 3; k++)
+				id[k] = (uint64_t)(v[idx[t + k]].pos.z * side + v[idx[t + k]].pos.x);
+			int first = id[1] < id[0] ? (id[2] < id[1] ? 2 : 1) : (id[2] < id[0] ? 2 : 0);
+			keys.push_back(id[first] << 42 | id[(first + 1) % 3] << 21 | id[(first + 2) % 3]);
+		}
+		std::sort(keys.begin(), keys.end());
+		return keys;
+	};
+	SelfCheck check("mesh optimizer");
+	std::vector<uint64_t> original = triangles(vertices, indices);
+	std::vector<STATIC_VERTEX> allVertices = vertices;
+	std::vector<unsigned int> allIndices = indices;
+
+	weldVertices(vertices, indices);
+	check.expect(vertices.size() == (size_t)side * side, "weld did not merge the shared corners");
+	check.expect(triangles(vertices, indices) == original, "weld changed the triangles");
+	VertexCacheStats before = analyzeVertexCache(indices, vertices.size());
+	optimizeVertexCache(indices, vertices.size());
+	VertexCacheStats after = analyzeVertexCache(indices, vertices.size());
+	check.expect(after.acmr <= before.acmr, "the cache order raised ACMR");
+	check.expect(triangles(vertices, indices) == original, "the cache order changed the triangles");
+	optimizeVertexFetch(vertices, indices);
+	check.expect(triangles(vertices, indices) == original, "the fetch order changed the triangles");
+	unsigned int next = 0;
+	for (unsigned int index : indices) {
+		if (index > next) {
+			check.expect(false, "vertices not in the order the indices fetch them");
+			break;
+		}
+		if (index == next) next++;
+	}
+
+	MeshOptimizerStats stats = optimizeMesh(allVertices, allIndices, [](const STATIC_VERTEX& v) { return v.pos; },
+		[](const STATIC_VERTEX& v) { return v.normal; });
+	check.expect(stats.vertices == (size_t)side * side && stats.after.acmr <= stats.before.acmr, "optimizeMesh stats");
+	check.expect(triangles(allVertices, allIndices) == original, "optimizeMesh changed the triangles");
+	check.summary << quads << "x" << quads << " grid, ACMR " << before.acmr << " shuffled, " << after.acmr
+		<< " in cache order, " << stats.after.acmr << " after all passes";
+	return check.report();
+}
+
+// UploadRing on fake fences: offsets 256-aligned one after the other, a frame that
+// does not fit before the end wrapping to 0 once the oldest frame retired and failing
+// until then, no more than MaxFrames in flight. Then DeviceBackend on a ring that holds
+// one frame of constants, which has to wait for the NullDevice's fence every frame.
+static bool checkUploadRing() {
+	SelfCheck check("upload ring");
+	UploadRing ring;
+	ring.init(4096, 256);
+	uint32_t a = 1, b = 1, c = 1, d = 1;
+	ring.beginFrame();
+	check.expect(ring.allocate(100, a) && ring.allocate(300, b), "first frame did not fit");
+	check.expect(a == 0 && b == 256, "offsets of the first frame");
+	check.expect(ring.endFrame(1), "first frame not accepted");
+	ring.beginFrame();
+	check.expect(ring.allocate(1000, a) && ring.allocate(2048, b), "second frame did not fit");
+	check.expect(a == 768 && b == 1792 && ring.bytesInUse() == 3840, "offsets of the second frame");
+	check.expect(ring.endFrame(2), "second frame not accepted");
+	ring.beginFrame();
+	check.expect(!ring.allocate(512, c), "allocated over bytes still in flight");
+	ring.retire(0);
+	check.expect(ring.framesInFlight() == 2, "retired a frame before its fence");
+	ring.retire(1);
+	check.expect(ring.framesInFlight() == 1 && ring.bytesInUse() == 3072, "fence 1 did not free the first frame");
+	check.expect(ring.allocate(512, c) && c == 0 && ring.stats.wraps == 1, "no wrap to the start");
+	check.expect(ring.allocate(200, d) && d == 512 && ring.bytesInUse() == 4096, "skipped bytes not charged to the frame");
+	check.expect(!ring.allocate(1, a), "allocated from a full ring");
+	check.expect(ring.endFrame(3), "third frame not accepted");
+	ring.retire(2);
+	check.expect(ring.bytesInUse() == 1024 && ring.oldestFence() == 3, "fence 2 freed the wrong bytes");
+	ring.retire(3);
+	check.expect(ring.bytesInUse() == 0 && ring.framesInFlight() == 0, "fence 3 left bytes in use");
+	ring.beginFrame();
+	check.expect(ring.allocate(64, a) && a == 0, "an empty ring does not start at the front");
+	check.expect(!ring.allocate(8192, b) && ring.stats.failures == 1, "an allocation larger than the ring");
+	for (int i = 0; i < UploadRing::MaxFrames; i++)
+		ring.endFrame(10 + i);
+	check.expect(ring.full() && !ring.endFrame(100), "more than MaxFrames in flight");
+
+	NullDevice device;
+	DeviceBackend backend;
+	backend.init(&device);
+	backend.enableUploadRing(1024);
+	static const unsigned char constants[600] = {};
+	int frames = 4;
+	for (int i = 0; i < frames; i++) {
+		check.expect(backend.beginConstants(constants, sizeof(constants)), "DeviceBackend fell back with a ring that fits a frame");
+		backend.endConstants();
+	}
+	check.expect(backend.uploadRing().stats.waits == (uint64_t)(frames - 1), "DeviceBackend did not wait for the previous frame");
+	check.expect(!backend.enableUploadRing(2048), "DeviceBackend replaced a ring with frames in flight");
+	check.expect(backend.enableUploadRing(1024) && backend.uploadRing().framesInFlight() == 1, "switching the ring on again dropped its fences");
+	check.summary << "offsets, wrap, fences and " << backend.uploadRing().stats.waits << " stalls on a full ring";
+	return check.report();
+}
+
+// boxes placed from the camera's own position and target, so the frustum planes taken
+// from the VP have to agree with them: one straight ahead and one across the right
+// edge of the 60 degree view are visible, one behind, one past the far plane and one
+// well off to the side are not. perspectiveProjection keeps the identity's 1 in a[3][3],
+// which moves the far plane from 200 out to about 1200, so that probe is further still.
+static const int FrustumProbes = 5;
+static const uint64_t FrustumProbesVisible = 0x3;
+
+static AABB probeBox(mathLib::Vec3 centre, float halfExtent) {
+	AABB box;
+	mathLib::Vec3 extent(halfExtent, halfExtent, halfExtent);
+	box.extend(centre - extent);
+	box.extend(centre + extent);
+	return box;
+}
+
+static void frustumProbes(const TPSCamera& camera, AABB* probes) {
+	mathLib::Vec3 eye = camera.position;
+	mathLib::Vec3 target = camera.target;
+	mathLib::Vec3 up = camera.up;
+	mathLib::Vec3 forward = (target - eye).normalize();
+	mathLib::Vec3 right = forward.cross(up).normalize();
+	float edge = 10.0f * tanf(30.0f * (float)M_PI / 180.0f);
+	probes[0] = probeBox(eye + forward * 10.0f, 1.0f);
+	probes[1] = probeBox(eye + forward * 10.0f + right * edge, 1.0f);
+	probes[2] = probeBox(eye - forward * 10.0f, 1.0f);
+	probes[3] = probeBox(eye + forward * 2000.0f, 1.0f);
+	probes[4] = probeBox(eye + forward * 10.0f + right * 12.0f, 1.0f);
+}
+
+// A fixed view across the flattened ground at the obstacle, at boxes whose fate is
+// known: one in front of the obstacle, one behind it, one buried in the hills further
+// out, one beside the obstacle with nothing in the way and one behind the camera that
+// the frustum removes before the Hi-Z test sees it. Same culler setup as the frame loop.
+static bool checkOcclusion(const TerrainMesh& terrain, const AABB& obstacle) {
+	mathLib::Vec3 from(2.0f, 1.0f, 0.0f);
+	mathLib::Vec3 to(13.0f, 1.0f, 0.0f);
+	mathLib::Vec3 up(0.0f, 1.0f, 0.0f);
+	mathLib::Matrix vp = mathLib::lookAt(from, to, up) * mathLib::Matrix::perspectiveProjection(1.f, 60.0f * M_PI / 180.0f, 200.f, 0.1f);
+	AABB probes[5] = {
+		probeBox(mathLib::Vec3(8.0f, 1.0f, 0.0f), 0.3f),
+		probeBox(mathLib::Vec3(20.0f, 1.0f, 0.0f), 0.3f),
+		probeBox(mathLib::Vec3(40.0f, -4.0f, 3.0f), 0.5f),
+		probeBox(mathLib::Vec3(12.0f, 1.0f, 4.0f), 0.3f),
+		probeBox(mathLib::Vec3(-5.0f, 1.0f, 0.0f), 0.3f)
+	};
+	const uint64_t expected = 0x9;
+	BoundsBatch batch;
+	batch.build(probes, 5);
+	VisibilitySet visible;
+	FrustumCuller frustum;
+	frustum.begin(vp);
+	frustum.cull(batch, visible);
+	OcclusionCuller occlusion;
+	occlusion.init(256, 128);
+	occlusion.begin(vp);
+	occlusion.addOccluder(terrain.occluderVertices, terrain.occluderIndices, mathLib::Matrix());
+	occlusion.addOccluder(obstacle);
+	occlusion.finish();
+	occlusion.refine(probes, 5, visible);
+	SelfCheck check("occlusion probes");
+	check.expect(occlusion.stats.tested == 4, "the box behind the camera reached the Hi-Z test");
+	check.expect(occlusion.stats.occluded == 2 && visible.words[0] == expected, "expected the boxes in front and beside visible, the other two occluded");
+	check.summary << occlusion.stats.visible << "/" << occlusion.stats.tested << " visible, " << occlusion.stats.occluded << " occluded";
+	return check.report();
+}
+
+// unit cube centred on the origin, scaled and moved onto the box
+static mathLib::Matrix boxWorld(const AABB& box) {
+	mathLib::Vec3 mn = box.min;
+	mathLib::Vec3 mx = box.max;
+	return mathLib::Matrix::scaling(mx - mn) * mathLib::Matrix::translation((mn + mx) * 0.5f);
+}
+
+// render the final frame on the CPU: ground, obstacle, enemies and the skinned player
+static void renderFrame(const HeadlessOptions& options, const std::string& gemDirectory, AnimatedRig& trex, mathLib::Matrix playerWorld,
+	mathLib::Matrix vp, const AABB& obstacle, ShootingSystem& shooting, const TerrainMesh& terrain, JobSystem& jobs) {
+	SoftwareRasterizer raster;
+	raster.init(options.rasterWidth, options.rasterHeight, &jobs, options.rasterThreads);
+	raster.clear(mathLib::Color(0.45f, 0.6f, 0.85f, 1.0f));
+
+	// every terrain chunk at full detail
+	std::vector<unsigned int> chunkIndices(terrain.chain.indices.begin(), terrain.chain.indices.begin() + terrain.chain.levels[0].indexCount);
+	RasterMaterial ground;
+	ground.colour = mathLib::Color(0.3f, 0.55f, 0.25f, 1.0f);
+
+	// unit cube, scaled onto each box
+	std::vector<STATIC_VERTEX> cubeVertices;
+	std::vector<unsigned int> cubeIndices;
+	mathLib::Vec3 normals[6] = { mathLib::Vec3(1, 0, 0), mathLib::Vec3(-1, 0, 0), mathLib::Vec3(0, 1, 0), mathLib::Vec3(0, -1, 0), mathLib::Vec3(0, 0, 1), mathLib::Vec3(0, 0, -1) };
+	for (int f = 0; f < 6; f++) {
+		mathLib::Vec3 n = normals[f];
+		mathLib::Vec3 u = f < 2 ? mathLib::Vec3(0, 1, 0) : (f < 4 ? mathLib::Vec3(0, 0, 1) : mathLib::Vec3(1, 0, 0));
+		mathLib::Vec3 v = n.cross(u);
+		unsigned int base = (unsigned int)cubeVertices.size();
+		cubeVertices.push_back(addVertex((n + u + v) * 0.5f, n, 1, 1));
+		cubeVertices.push_back(addVertex((n + u - v) * 0.5f, n, 1, 0));
+		cubeVertices.push_back(addVertex((n - u - v) * 0.5f, n, 0, 0));
+		cubeVertices.push_back(addVertex((n - u + v) * 0.5f, n, 0, 1));
+		cubeIndices.insert(cubeIndices.end(), { base, base + 1, base + 2, base, base + 2, base + 3 });
+	}
+	RasterMaterial stone;
+	stone.colour = mathLib::Color(0.6f, 0.55f, 0.5f, 1.0f);
+	RasterMaterial enemyAlive;
+	enemyAlive.colour = mathLib::Color(0.8f, 0.2f, 0.2f, 1.0f);
+	RasterMaterial enemyDead;
+	enemyDead.colour = mathLib::Color(0.25f, 0.25f, 0.25f, 1.0f);
+
+	// the player mesh in its current pose
+	GEMLoader::GEMModelLoader loader;
+	std::vector<GEMLoader::GEMMesh> gemmeshes;
+	GEMLoader::GEMAnimation gemanimation;
+	loader.load(gemDirectory + "/TRex.gem", gemmeshes, gemanimation);
+	RasterMaterial skin;
+	skin.colour = mathLib::Color(0.55f, 0.45f, 0.3f, 1.0f);
+
+	Timer timer;
+	{
+		PROFILE_SCOPE("raster: frame");
+		mathLib::Matrix identity;
+		for (auto& chunk : terrain.chunks)
+			raster.drawIndexed(chunk.vertices, chunkIndices, identity, vp, ground);
+		raster.drawIndexed(cubeVertices, cubeIndices, boxWorld(obstacle), vp, stone);
+		shooting.enemies.each([&](Entity, Transform&, Bounds& bounds, Health& health) {
+			raster.drawIndexed(cubeVertices, cubeIndices, boxWorld(bounds.box), vp, health.alive() ? enemyAlive : enemyDead);
+		});
+		for (auto& mesh : gemmeshes) {
+			std::vector<ANIMATED_VERTEX> vertices = toVertices<ANIMATED_VERTEX>(mesh.verticesAnimated);
+			raster.drawIndexed(vertices, mesh.indices, trex.instance.matrices, playerWorld, vp, skin);
+		}
+		raster.flush();
+	}
+	double ms = timer.elapsed() * 1000.0;
+
+	std::cout << "raster " << raster.target.width << "x" << raster.target.height << " on " << raster.threadCount << " threads: "
+		<< raster.stats.trianglesSubmitted << " triangles, " << raster.stats.trianglesBinned << " binned, "
+		<< raster.stats.trianglesCulled << " culled, " << raster.stats.pixelsShaded << " pixels shaded (" << ms << " ms)" << std::endl;
+	if (raster.target.savePPM(options.raster))
+		std::cout << "wrote " << options.raster << std::endl;
+	else
+		std::cout << "could not write " << options.raster << std::endl;
+}
+
+// the terrain chunks rebuilt this frame ride along to the render stage, which owns the device
+struct HeadlessSnapshot : RenderSnapshot {
+	static const int MaxGroundUpdates = 4;     // chunks rebuilt a frame
+
+	const TerrainChunkUpdate* groundUpdates = nullptr;     // in memory
+	int groundUpdateCount = 0;
+};
+
+// same input every run: walk, turn, stop, attack
+static void scriptInput(ScriptedInput& input, int frame) {
+	input.clear();
+	int phase = frame % 240;
+	if (phase < 120) input.keys['W'] = true;
+	else if (phase < 150) input.keys['A'] = true;
+	else if (phase < 180) input.mouseDeltaX = 2.0f;
+	else if (phase == 200) input.keys['J'] = true;
+}
+
+int main(int argc, char** argv) {
+	Profiler::setThreadName("main");
+	HeadlessOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage();
+		return 0;
+	}
+	if (options.pipeline < 0 || options.pipeline > FramePipeline<HeadlessSnapshot>::MaxDepth) {
+		std::cout << "--pipeline " << options.pipeline << ": 0 to " << FramePipeline<HeadlessSnapshot>::MaxDepth
+			<< " slots, FrameMemory keeps " << FrameMemory::FramesInFlight << " frames" << std::endl;
+		return 1;
+	}
+	std::string gemDirectory = options.resources + "/GemModel";
+	if (options.models.empty()) {
+		for (auto& entry : std::filesystem::directory_iterator(gemDirectory)) {
+			if (entry.path().extension() == ".gem")
+				options.models.push_back(entry.path().string());
+		}
+	}
+	JobSystem jobs;
+	jobs.init(options.jobThreads);
+	loadModels(options.models, jobs, options.streamBudget);
+	bool texturesConsistent = true;
+	if (options.textureBudget > 0)
+		texturesConsistent = simulateTextures(options.resources + "/Textures", jobs, options.textureBudget, options.frames);
+	if (options.shaderCache)
+		inspectShaderCache(options.resources + "/Shader");
+
+	// the same scene setup WinMain uses, minus everything that draws
+	AnimatedRig trex;
+	trex.load(gemDirectory + "/TRex.gem");
+
+	AABB obstacle;
+	obstacle.extend(mathLib::Vec3(12.f, 0.f, -1.f));
+	obstacle.extend(mathLib::Vec3(14.f, 2.f, 1.f));
+
+	Heightfield heightfield;
+	createGround(heightfield, options.resources);
+	TerrainMesh terrainMesh;
+	terrainMesh.build(heightfield);
+	uint64_t impacts = 0;
+	bool occlusionConsistent = checkOcclusion(terrainMesh, obstacle);
+	bool packingConsistent = checkVertexPacking(65536);
+	bool ringConsistent = checkUploadRing();
+	bool optimizerConsistent = checkMeshOptimizer(32);
+
+	Player player(mathLib::Vec3(0.0f, 1.0f, 0.0f), 5.0f, &trex);
+	TransformHierarchy transforms;
+	player.attach(transforms);
+	transforms.update();
+	player.updateBoundingBox();
+	uint64_t transformsRecomputed = 0;
+	TPSCamera camera(&player, 5.0f);
+	ScriptedInput input;
+
+	// a crowd sharing the player's skeleton, at different points of its first clip
+	std::vector<AnimationInstance> crowd(options.crowd);
+	std::string crowdClip = trex.animation.animations.empty() ? "" : trex.animation.animations.begin()->first;
+	for (size_t i = 0; i < crowd.size(); i++) {
+		crowd[i].animation = &trex.animation;
+		crowd[i].update(crowdClip, 0.1f * i);
+	}
+
+	EntityWorld world;
+	ShootingSystem shooting(world, nullptr, 0.25f);
+	shooting.ground = &heightfield;
+	// the river at the origin; with --ocean the queries follow an FFT ocean tile instead
+	// of the shader's waves
+	WaterSurface water;
+	water.level = 1.0f;
+	water.setArea(0.0f, 0.0f, 3.0f);
+	OceanSpectrum ocean;
+	if (options.ocean > 0) {
+		int size = 1;
+		while (size < options.ocean) size <<= 1;
+		ocean.init(size, 32.0f, 8.0f, 1.0f, 0.5f, 0.3f);
+		ocean.choppiness = 1.0f;
+		water.ocean = &ocean;
+	}
+	shooting.water = &water;
+	uint64_t splashes = 0;
+	for (int i = 0; i < 8; i++) {
+		mathLib::Vec3 centre(-20.0f + i * 5.0f, 0.0f, 20.0f);
+		centre.y = heightfield.heightAt(centre.x, centre.z) + 1.0f;
+		shooting.addEnemy(centre - mathLib::Vec3(1, 1, 1), centre + mathLib::Vec3(1, 1, 1), 100);
+	}
+
+	mathLib::Matrix p = mathLib::Matrix::perspectiveProjection(1.f, 60.0f * M_PI / 180.0f, 200.f, 0.1f);
+	mathLib::Matrix vp;
+	int shots = 0;
+
+	// enemies outside the view or hidden by the ground and the obstacle are culled, like forest and Pool in WinMain
+	FrustumCuller frustum;
+	BoundsBatch enemyBatch;
+	uint64_t frustumTested = 0;
+	uint64_t frustumVisible = 0;
+	double frustumMs = 0.0;
+	OcclusionCuller occlusion;
+	occlusion.init(256, 128);
+	occlusion.reserve(2048);
+	VisibilitySet enemyVisible;
+	AABB probes[FrustumProbes];
+	BoundsBatch probeBatch;
+	VisibilitySet probeVisible;
+	int probeMismatches = 0;
+	uint64_t enemiesTested = 0;
+	uint64_t enemiesVisible = 0;
+	double occlusionMs = 0.0;
+
+	// WinMain's scene recorded every frame into a null device instead of D3D
+	NullDevice device;
+	DeviceBackend renderBackend;
+	renderBackend.init(&device);
+	DensityMap grassDensity, bambooDensity;
+	FoliageLayer grassLayer, bambooLayer;
+	createFoliage(heightfield, grassDensity, bambooDensity, grassLayer, bambooLayer, options.resources);
+	HeadlessScene scene;
+	if (!scene.init(renderBackend, device, gemDirectory, terrainMesh, grassLayer, bambooLayer, &jobs)) {
+		std::cout << "could not load the scene from " << gemDirectory << std::endl;
+		return 1;
+	}
+	// the ground's chunks come and go with the view, so the draw list gets its room up front
+	RenderQueue renderQueue;
+	renderQueue.reserve(512, 256 << 10);
+	renderBackend.enableUploadRing((uint32_t)options.uploadRing << 20);
+	ClusterCuller clusterCuller;
+	double recordMs = 0.0;
+
+	// the render stage only sees the snapshot, so it can draw frame N while frame N+1 is simulated
+	FramePipeline<HeadlessSnapshot> pipeline(options.pipeline);
+	auto render = [&](const HeadlessSnapshot& snapshot) {
+		PROFILE_SCOPE("draw: record");
+		Timer recordTimer;
+		device.stream.clear();
+		device.resetCounters();
+		for (int i = 0; i < snapshot.groundUpdateCount; i++)
+			scene.updateGround(snapshot.groundUpdates[i]);
+		mathLib::Matrix snapshotVP = snapshot.vp;
+		mathLib::Matrix playerWorld = snapshot.playerWorld;
+		LodSelector lods;
+		lods.init(snapshot.cameraPosition, 60.0f * M_PI / 180.0f, 768.0f);
+		clusterCuller.begin(snapshotVP, snapshot.cameraPosition);
+		scene.record(renderQueue, *snapshot.memory, snapshotVP, snapshot.cameraPosition, playerWorld, snapshot.bones, &lods, &clusterCuller);
+		renderQueue.sort();
+		renderQueue.execute(renderBackend);
+		recordMs += recordTimer.elapsed() * 1000.0;
+	};
+	std::thread renderThread;
+	if (options.pipeline > 0) {
+		renderThread = std::thread([&] {
+			Profiler::setThreadName("render");
+			while (const HeadlessSnapshot* snapshot = pipeline.acquire()) {
+				render(*snapshot);
+				pipeline.release();
+			}
+		});
+	}
+
+	// after the warm-up a frame should not touch the heap, per-frame lists come from FrameMemory
+	uint64_t steadyAllocations = 0;
+	uint64_t steadyBytes = 0;
+	int steadyFrames = 0;
+
+	Timer timer;
+	for (int frame = 0; frame < options.frames; frame++) {
+		AllocationScope frameAllocations;
+		Profiler::beginFrame();
+		HeadlessSnapshot& snapshot = pipeline.beginWrite();
+		FrameMemory::beginFrame();
+		snapshot.memory = &FrameMemory::current();
+		scriptInput(input, frame);
+		{
+			PROFILE_SCOPE("simulate: input + player");
+			handleInput(player, camera, input, options.dt, obstacle, &heightfield);
+		}
+		transformsRecomputed += transforms.update();
+		player.syncBounds();
+		vp = camera.getViewMatrix() * p;
+
+		if (frame % 20 == 0) {
+			mathLib::Vec3 origin = player.position + mathLib::Vec3(0.0f, 1.0f, 0.0f);
+			// every other shot goes into the ground
+			mathLib::Vec3 direction(0.0f, frame % 40 == 20 ? -0.2f : 0.0f, 1.0f);
+			shooting.shoot(origin, direction);
+			shots++;
+		}
+		water.setTime(frame * options.dt);
+		if (water.ocean)
+			ocean.update(frame * options.dt, &jobs);
+		shooting.update(options.dt, &jobs);
+		// every bullet that hits the ground leaves a small crater, its chunks are rebuilt
+		// a few a frame and handed to the render stage
+		for (const BulletImpact& impact : shooting.impacts) {
+			if (impact.water) {
+				splashes++;
+				continue;
+			}
+			terrainMesh.markDirty(heightfield.edit(impact.position.x, impact.position.z, 1.5f, -0.4f));
+			impacts++;
+		}
+		snapshot.groundUpdateCount = (int)terrainMesh.rebuildDirty(HeadlessSnapshot::MaxGroundUpdates);
+		TerrainChunkUpdate* groundUpdates = snapshot.memory->allocateArray<TerrainChunkUpdate>(snapshot.groundUpdateCount);
+		for (int i = 0; i < snapshot.groundUpdateCount; i++) {
+			uint32_t c = terrainMesh.rebuilt()[i];
+			new (&groundUpdates[i]) TerrainChunkUpdate;
+			groundUpdates[i].fill(c, terrainMesh.chunks[c]);
+		}
+		snapshot.groundUpdates = groundUpdates;
+		{
+			PROFILE_SCOPE("simulate: crowd animation");
+			float dt = options.dt;
+			jobs.parallelFor(crowd.size(), 4, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++)
+					crowd[i].update(crowdClip, dt);
+			});
+		}
+
+		FrameVector<AABB> enemyBounds(FrameMemory::allocator<AABB>());
+		enemyVisible.arena = snapshot.memory;
+		probeVisible.arena = snapshot.memory;
+		enemyBounds.reserve(shooting.enemyCount());
+		shooting.enemies.eachChunk([&](size_t count, const Entity*, Transform*, Bounds* bounds, Health*) {
+			for (size_t i = 0; i < count; i++)
+				enemyBounds.push_back(bounds[i].box);
+		});
+		{
+			PROFILE_SCOPE("cull: frustum");
+			frustum.begin(vp);
+			enemyBatch.build(enemyBounds.data(), enemyBounds.size());
+			frustum.cull(enemyBatch, enemyVisible, &jobs);
+			frustumTested += frustum.stats.tested;
+			frustumVisible += frustum.stats.visible;
+			frustumMs += frustum.stats.ms;
+			frustumProbes(camera, probes);
+			probeBatch.build(probes, FrustumProbes);
+			frustum.cull(probeBatch, probeVisible);
+			if (probeVisible.words[0] != FrustumProbesVisible) {
+				if (probeMismatches == 0)
+					std::cout << "frame " << frame << ": frustum probes visible 0x" << std::hex << probeVisible.words[0] << std::dec
+						<< ", expected 0x" << std::hex << FrustumProbesVisible << std::dec << std::endl;
+				probeMismatches++;
+			}
+		}
+		{
+			PROFILE_SCOPE("cull: occlusion");
+			occlusion.begin(vp);
+			occlusion.addOccluder(terrainMesh.occluderVertices, terrainMesh.occluderIndices, mathLib::Matrix());
+			occlusion.addOccluder(obstacle);
+			occlusion.finish();
+			occlusion.refine(enemyBounds.data(), enemyBounds.size(), enemyVisible);
+			enemiesTested += occlusion.stats.tested;
+			enemiesVisible += occlusion.stats.visible;
+			occlusionMs += occlusion.stats.rasterMs + occlusion.stats.pyramidMs + occlusion.stats.testMs;
+		}
+		snapshot.frame = frame;
+		snapshot.time = frame * options.dt;
+		snapshot.vp = vp;
+		snapshot.cameraPosition = camera.position;
+		snapshot.playerWorld = player.getWorldMatrix();
+		snapshot.copyBones(trex.instance.matrices, RenderSnapshot::MaxBones);
+		pipeline.publish();
+		if (options.pipeline == 0) {
+			render(*pipeline.acquire());
+			pipeline.release();
+		}
+		Profiler::endFrame();
+		if (frame >= options.warmupFrames) {
+			steadyAllocations += frameAllocations.allocations();
+			steadyBytes += frameAllocations.bytes();
+			steadyFrames++;
+		}
+	}
+	pipeline.close();
+	if (renderThread.joinable())
+		renderThread.join();
+	double ms = timer.elapsed() * 1000.0;
+
+	std::cout << "simulated " << options.frames << " frames in " << ms << " ms ("
+		<< (options.frames > 0 ? ms / options.frames : 0.0) << " ms/frame)" << std::endl;
+	std::cout << "player " << player.position << ", animation " << player.currentAnimation << std::endl;
+	std::cout << "shots " << shots << ", bullets in flight " << shooting.bulletCount()
+		<< ", enemies alive " << shooting.enemiesAlive() << "/" << shooting.enemyCount() << " (" << world.size() << " entities in "
+		<< world.chunkCount() << " chunks)" << std::endl;
+	std::cout << "transforms: " << transformsRecomputed << " recomputed over " << options.frames << " frames" << std::endl;
+	std::cout << terrainMesh.report() << ", " << impacts << " bullet impacts, ground under the player " << heightfield.heightAt(player.position.x, player.position.z) << std::endl;
+	std::cout << "grass " << scene.grassFoliage.report() << std::endl;
+	std::cout << "bamboo " << scene.bambooFoliage.report() << std::endl;
+	std::cout << "water: " << splashes << " splashes, surface at the origin " << water.heightAt(0.0f, 0.0f);
+	if (water.ocean) std::cout << ", " << ocean.report();
+	std::cout << std::endl;
+	std::cout << "frustum: " << frustumVisible << "/" << frustumTested << " enemy tests visible, "
+		<< (options.frames > 0 ? frustumMs / options.frames : 0.0) << " ms/frame, " << probeMismatches << " frames with the probes wrong" << std::endl;
+	std::cout << "occlusion: " << enemiesVisible << "/" << enemiesTested << " enemy tests visible, "
+		<< (options.frames > 0 ? occlusionMs / options.frames : 0.0) << " ms/frame (" << occlusion.stats.occluderTriangles << " occluder triangles)" << std::endl;
+	const RenderQueueStats& rs = renderQueue.stats;
+	const DeviceCounters& dc = device.counters;
+	std::cout << "frame build: " << (options.frames > 0 ? recordMs / options.frames : 0.0) << " ms/frame, last frame "
+		<< rs.draws << " draws, " << rs.skippedBinds << " binds skipped, device " << dc.binds << " binds, "
+		<< dc.bytesUploaded << " bytes uploaded, " << device.stream.size() << " byte stream, " << scene.reducedInstances() << " instances at a coarser LOD" << std::endl;
+	if (renderBackend.uploadRingEnabled())
+		std::cout << renderBackend.uploadRing().report() << std::endl;
+	std::cout << clusterCuller.report() << std::endl;
+	std::cout << pipeline.report() << std::endl;
+	JobSystemStats js = jobs.stats();
+	std::cout << "jobs: " << js.executed() << " run, " << js.steals() << " stolen on " << js.workers.size() << " threads, idle ms";
+	for (auto& worker : js.workers)
+		std::cout << " " << worker.idleMs;
+	std::cout << std::endl;
+	std::cout << "heap allocations: " << steadyAllocations << " (" << steadyBytes << " bytes) in " << steadyFrames
+		<< " frames after " << options.warmupFrames << " warm-up frames, frame arena peak " << FrameMemory::current().peakBytes()
+		<< " bytes" << std::endl;
+	std::cout << Profiler::formatSummary(Profiler::lastFrame());
+	if (!options.raster.empty())
+		renderFrame(options, gemDirectory, trex, player.getWorldMatrix(), vp, obstacle, shooting, terrainMesh, jobs);
+	if (!options.capture.empty()) {
+		if (device.stream.save(options.capture))
+			std::cout << "wrote " << options.capture << std::endl;
+		else
+			std::cout << "could not write " << options.capture << std::endl;
+	}
+	int result = texturesConsistent ? 0 : 1;
+	if (!occlusionConsistent || !packingConsistent || !ringConsistent || !optimizerConsistent)
+		result = 1;
+	if (probeMismatches > 0) {
+		std::cout << "frustum culling disagrees with the camera on " << probeMismatches << " frames" << std::endl;
+		result = 1;
+	}
+	if (options.checkAllocations && steadyAllocations > 0) {
+		std::cout << "steady-state frames allocated on the heap" << std::endl;
+		result = 1;
+	}
+	if (!options.compare.empty()) {
+		CommandStream reference;
+		std::string what;
+		if (!reference.load(options.compare)) {
+			std::cout << "could not read " << options.compare << std::endl;
+			result = 1;
+		}
+		else {
+			int index = CommandStream::firstDifference(reference, device.stream, what);
+			if (index < 0)
+				std::cout << "last frame matches " << options.compare << std::endl;
+			else {
+				std::cout << "last frame differs from " << options.compare << " at command " << index << ": " << what << std::endl;
+				result = 1;
+			}
+		}
+	}
+	if (!options.trace.empty()) {
+		if (Profiler::exportChromeTrace(options.trace))
+			std::cout << "wrote " << options.trace << std::endl;
+		else
+			std::cout << "could not write " << options.trace << std::endl;
+	}
+	return result;
+}
@@ -0,0 +1,381 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <map>
+#include "mathLib.h"
+#include "modelAsset.h"
+#include "vertex.h"
+#include "collision.h"
+#include "culling.h"
+#include "renderQueue.h"
+#include "renderDevice.h"
+#include "clusterCulling.h"
+#include "terrain.h"
+#include "foliage.h"
+
+// WinMain's drawable scene rebuilt on a RenderDevice: the terrain chunks, the brick
+// cube, the pool walls, the grass and bamboo foliage and the TRex, with the same
+// meshes, materials and per-draw constants. Recording a frame of it costs the CPU what
+// a WinMain frame costs up to the D3D calls, so headless and bench can measure and
+// capture it. Grass and bamboo are scattered from the layers WinMain uses, carry their
+// LOD chains and meshlets like the streamed forests and are culled by chunk; the
+// terrain chunks pick their levels like terrain::record.
+class HeadlessScene {
+public:
+	FrustumCuller frustum;
+
+	FoliageField grassFoliage, bambooFoliage;
+
+	// terrain: the ground, built by the caller (createGround, TerrainMesh::build);
+	// grassLayer and bambooLayer from createFoliage, generated here on jobs when given
+	bool init(DeviceBackend& backend, RenderDevice& device, const std::string& gemDirectory, const TerrainMesh& terrain,
+		const FoliageLayer& grassLayer, const FoliageLayer& bambooLayer, JobSystem* jobs = nullptr) {
+		staticShader = backend.addShader(0, sizeof(mathLib::Matrix) * 2);
+		animatedShader = backend.addShader(1, sizeof(mathLib::Matrix) * (2 + 256));
+		sampler = backend.addSampler(0);
+
+		addGround(backend, device, terrain);
+		std::vector<STATIC_VERTEX> vertices;
+		std::vector<unsigned int> indices;
+		buildCube(vertices, indices);
+		addMesh(backend, device, cube, vertices, indices, staticShader, "Textures/Bricks097_1K-PNG_Color.png", "Textures/Bricks097_1K-PNG_NormalDX.png");
+
+		// every instance may be drawn at level 0, the cluster lists get room for all of them
+		grassFoliage.generate(grassLayer, jobs);
+		bambooFoliage.generate(bambooLayer, jobs);
+		if (!loadModel(backend, device, gemDirectory + "/grass_003.gem", grass, grassFoliage.instanceCount()) ||
+			!loadModel(backend, device, gemDirectory + "/bamboo.gem", bamboo, bambooFoliage.instanceCount()) ||
+			!loadModel(backend, device, gemDirectory + "/TRex.gem", trex))
+			return false;
+		grassFoliage.setBounds(grass.bounds, jobs);
+		bambooFoliage.setBounds(bamboo.bounds, jobs);
+		grassBatch.build(grassFoliage.chunkBounds);
+		bambooBatch.build(bambooFoliage.chunkBounds);
+
+		// Pool::init(dx, Vec3(5, 0, 5), 1): four walls of unit cubes
+		for (int wall = 0; wall < 4; wall++) {
+			mathLib::Vec3 start(wall == 1 ? 2.5f : -2.5f, 1.0f, wall == 2 ? 2.5f : -2.5f);
+			for (int i = 0; i < 5; i++) {
+				mathLib::Vec3 offset = wall < 2 ? mathLib::Vec3(0.0f, 0.0f, (float)i) : mathLib::Vec3((float)i, 0.0f, 0.0f);
+				mathLib::Matrix world = mathLib::Matrix::translation(start + offset);
+				poolWorld.push_back(world);
+				poolBounds.push_back(cube.bounds.transformed(world));
+			}
+		}
+		poolBatch.build(poolBounds);
+		cubeWorld = mathLib::Matrix::translation(mathLib::Vec3(13.f, 1.f, 0.f));
+		return true;
+	}
+
+	// a chunk TerrainMesh::rebuildDirty rebuilt: its vertex buffer is rewritten and its
+	// bounds and errors replaced
+	void updateGround(const TerrainChunkUpdate& update) {
+		if (update.chunk >= groundChunks.size()) return;
+		GroundChunk& chunk = groundChunks[update.chunk];
+		void* vertices = device->map(chunk.vertexBuffer);
+		if (vertices) memcpy(vertices, update.vertices, sizeof(update.vertices));
+		device->unmap(chunk.vertexBuffer);
+		chunk.bounds = update.bounds;
+		memcpy(chunk.lodErrors, update.lodErrors, sizeof(update.lodErrors));
+		groundBounds[update.chunk] = update.bounds;
+		groundBatch.build(groundBounds);
+	}
+
+	// frustum cull and record one frame into queue, bones is the TRex palette (256 matrices).
+	// memory is the frame's arena, the visibility sets and cluster lists are taken from it
+	// and have to stay until the queue executed. camera drops the grass chunks past their
+	// draw distance. lods picks the terrain, grass and bamboo levels, nullptr draws level 0.
+	// clusters culls the meshlets of the instances drawn at level 0, begun by the caller
+	void record(RenderQueue& queue, FrameArena& memory, mathLib::Matrix& vp, const mathLib::Vec3& camera, mathLib::Matrix& playerWorld,
+		const mathLib::Matrix* bones, const LodSelector* lods = nullptr, ClusterCuller* clusters = nullptr) {
+		for (VisibilitySet* visible : { &groundVisible, &grassVisible, &bambooVisible, &poolVisible })
+			visible->arena = &memory;
+		frustum.begin(vp);
+		frustum.cull(groundBatch, groundVisible);
+		frustum.cull(grassBatch, grassVisible);
+		frustum.cull(bambooBatch, bambooVisible);
+		frustum.cull(poolBatch, poolVisible);
+		grassFoliage.cullDistance(camera, grassVisible);
+
+		queue.begin();
+		reduced = 0;
+		mathLib::Matrix identity;
+		for (Model* model : { &grass, &bamboo })
+			for (auto& part : model->parts) part.clusters.begin(memory);
+		submitGround(queue, identity, vp, lods);
+		if (frustum.isVisible(cube.bounds.transformed(cubeWorld)))
+			submit(queue, cube, cubeWorld, vp);
+		submitFoliage(queue, grass, grassFoliage, grassVisible, vp, lods, clusters);
+		submitFoliage(queue, bamboo, bambooFoliage, bambooVisible, vp, lods, clusters);
+		for (Model* model : { &grass, &bamboo })
+			for (auto& part : model->parts) part.upload();
+		if (frustum.isVisible(trex.bounds.transformed(playerWorld))) {
+			uint32_t size = sizeof(mathLib::Matrix) * (2 + 256);
+			uint32_t offset;
+			unsigned char* constants = queue.allocConstants(size, offset);
+			memcpy(constants, &playerWorld, sizeof(mathLib::Matrix));
+			memcpy(constants + sizeof(mathLib::Matrix), &vp, sizeof(mathLib::Matrix));
+			memcpy(constants + sizeof(mathLib::Matrix) * 2, bones, sizeof(mathLib::Matrix) * 256);
+			submit(queue, trex, offset, size, depthOf(vp, playerWorld));
+		}
+		for (size_t i = 0; i < poolWorld.size(); i++)
+			if (poolVisible.test(i)) submit(queue, cube, poolWorld[i], vp);
+	}
+
+	size_t meshCount() const { return meshes; }
+	// terrain chunks, grass and bamboo instances drawn below level 0 in the last record
+	size_t reducedInstances() const { return reduced; }
+
+private:
+	// level 0 of a mesh with meshlets and the per-frame buffer of its kept clusters
+	struct ClusteredPart {
+		MeshletMesh meshlets;
+		std::vector<unsigned int> indices;
+		ClusterDrawList clusters;
+		void upload() { if (!meshlets.empty()) clusters.upload(); }
+	};
+
+	// packets of one model, per mesh and level, with everything but the constants filled in
+	struct Model {
+		std::vector<DrawPacket> packets;        // mesh i level l at i * levels + l
+		std::vector<ClusteredPart> parts;       // per mesh
+		std::vector<float> lodErrors = { 0.0f };
+		AABB bounds;
+		int levels() const { return (int)lodErrors.size(); }
+	};
+
+	// a terrain chunk: its own vertex buffer, written again when it is edited, over the
+	// index buffer every chunk shares
+	struct GroundChunk {
+		DeviceHandle vertexBuffer = 0;
+		RenderHandle meshes[TerrainLevels] = {};
+		AABB bounds;
+		float lodErrors[TerrainLevels] = {};
+	};
+
+	RenderHandle staticShader = 0;
+	RenderHandle animatedShader = 0;
+	RenderHandle sampler = 0;
+	std::map<std::string, RenderHandle> textures;
+	size_t meshes = 0;
+	size_t reduced = 0;
+	RenderDevice* device = nullptr;
+	std::vector<GroundChunk> groundChunks;
+	std::vector<AABB> groundBounds;
+	BoundsBatch groundBatch;
+	VisibilitySet groundVisible;
+	DrawPacket groundPacket;
+	Model cube, grass, bamboo, trex;
+	mathLib::Matrix cubeWorld;
+	std::vector<mathLib::Matrix> poolWorld;
+	std::vector<AABB> poolBounds;
+	BoundsBatch grassBatch, bambooBatch, poolBatch;
+	VisibilitySet grassVisible, bambooVisible, poolVisible;
+
+	static float depthOf(const mathLib::Matrix& vp, const mathLib::Matrix& world) {
+		return vp.a[3][0] * world.a[0][3] + vp.a[3][1] * world.a[1][3] + vp.a[3][2] * world.a[2][3] + vp.a[3][3];
+	}
+
+	int lodOf(const Model& model, const AABB& bounds, const LodSelector* lods) {
+		int lod = lods ? lods->select(model.lodErrors.data(), model.levels(), bounds) : 0;
+		if (lod > 0) reduced++;
+		return lod;
+	}
+
+	void addGround(DeviceBackend& backend, RenderDevice& renderDevice, const TerrainMesh& terrain) {
+		device = &renderDevice;
+		const std::vector<unsigned int>& indices = terrain.chain.indices;
+		std::vector<uint16_t> shortIndices(indices.begin(), indices.end());
+		BufferDesc desc;
+		desc.binding = BindIndexBuffer;
+		desc.size = (uint32_t)(shortIndices.size() * sizeof(uint16_t));
+		DeviceHandle ib = device->createBuffer(desc, shortIndices.data());
+		desc.binding = BindVertexBuffer;
+		desc.size = (uint32_t)(TerrainChunkVertices * sizeof(STATIC_VERTEX));
+		desc.dynamic = true;
+		groundChunks.resize(terrain.chunks.size());
+		for (size_t c = 0; c < terrain.chunks.size(); c++) {
+			GroundChunk& chunk = groundChunks[c];
+			chunk.vertexBuffer = device->createBuffer(desc, terrain.chunks[c].vertices.data());
+			for (int level = 0; level < TerrainLevels; level++)
+				chunk.meshes[level] = backend.addMesh(chunk.vertexBuffer, ib, sizeof(STATIC_VERTEX), terrain.chain.levels[level].indexCount, Index16,
+					terrain.chain.levels[level].firstIndex);
+			chunk.bounds = terrain.chunks[c].bounds;
+			memcpy(chunk.lodErrors, terrain.chunks[c].lodErrors, sizeof(chunk.lodErrors));
+		}
+		groundBounds = terrain.bounds;
+		groundBatch.build(groundBounds);
+		groundPacket.shader = staticShader;
+		groundPacket.textures[0] = texture(backend, "Textures/grass.png");
+		groundPacket.textures[1] = texture(backend, "Textures/grass_Normal.png");
+		groundPacket.sampler = sampler;
+		meshes += groundChunks.size();
+	}
+
+	// the chunks in view at their levels, one constant block for all of them
+	void submitGround(RenderQueue& queue, mathLib::Matrix& world, mathLib::Matrix& vp, const LodSelector* lods) {
+		mathLib::Matrix constants[2] = { world, vp };
+		uint32_t offset = queue.pushConstants(constants, sizeof(constants));
+		for (size_t c = 0; c < groundChunks.size(); c++) {
+			if (!groundVisible.test(c)) continue;
+			GroundChunk& chunk = groundChunks[c];
+			int lod = lods ? lods->select(chunk.lodErrors, TerrainLevels, chunk.bounds) : 0;
+			if (lod > 0) reduced++;
+			DrawPacket packet = groundPacket;
+			packet.mesh = chunk.meshes[lod];
+			packet.constantOffset = offset;
+			packet.constantSize = sizeof(constants);
+			packet.depth = depthOf(vp, mathLib::Matrix::translation((chunk.bounds.min + chunk.bounds.max) * 0.5f));
+			queue.submit(packet);
+		}
+	}
+
+	// every instance of the chunks in view, at its own level
+	void submitFoliage(RenderQueue& queue, Model& model, FoliageField& foliage, const VisibilitySet& visible, mathLib::Matrix& vp, const LodSelector* lods,
+		ClusterCuller* clusters) {
+		for (size_t c = 0; c < foliage.chunks.size(); c++) {
+			if (!visible.test(c)) continue;
+			FoliageChunk& chunk = foliage.chunks[c];
+			for (size_t i = 0; i < chunk.worlds.size(); i++)
+				submit(queue, model, chunk.worlds[i], vp, lodOf(model, chunk.instanceBounds[i], lods), clusters);
+		}
+	}
+
+	// clusters that face away are culled for closed meshes
+	void submit(RenderQueue& queue, Model& model, mathLib::Matrix& world, mathLib::Matrix& vp, int lod = 0, ClusterCuller* clusters = nullptr) {
+		mathLib::Matrix constants[2] = { world, vp };
+		uint32_t offset = queue.pushConstants(constants, sizeof(constants));
+		float depth = depthOf(vp, world);
+		submit(queue, model, offset, sizeof(constants), depth, lod, clusters != nullptr);
+		if (lod != 0 || !clusters) return;
+		for (size_t m = 0; m < model.parts.size(); m++) {
+			ClusteredPart& part = model.parts[m];
+			if (part.meshlets.empty()) continue;
+			DrawPacket packet = model.packets[m * model.levels()];
+			packet.constantOffset = offset;
+			packet.constantSize = sizeof(constants);
+			packet.depth = depth;
+			if (part.clusters.add(*clusters, part.meshlets, part.indices, world, packet.firstIndex, packet.indexCount, part.meshlets.closed)) {
+				packet.mesh = part.clusters.mesh;
+				queue.submit(packet);
+			}
+		}
+	}
+
+	// the packets of one level, meshes with clusters are left to the culled submit
+	void submit(RenderQueue& queue, Model& model, uint32_t offset, uint32_t size, float depth, int lod = 0, bool culled = false) {
+		for (size_t i = lod, m = 0; i < model.packets.size(); i += model.levels(), m++) {
+			if (culled && lod == 0 && m < model.parts.size() && !model.parts[m].meshlets.empty()) continue;
+			DrawPacket& packet = model.packets[i];
+			packet.constantOffset = offset;
+			packet.constantSize = size;
+			packet.depth = depth;
+			queue.submit(packet);
+		}
+	}
+
+	// texture handles stand in for the SRVs textureManager would create, one per file
+	RenderHandle texture(DeviceBackend& backend, const std::string& filename) {
+		auto it = textures.find(filename);
+		if (it != textures.end())
+			return it->second;
+		RenderHandle handle = backend.addTexture((DeviceHandle)textures.size());
+		textures[filename] = handle;
+		return handle;
+	}
+
+	// one packet per level of the model, from chain when there is one (indices is then
+	// ignored), a mesh with fewer levels repeats its last. meshlets split level 0 for
+	// cluster culling, with room for that many instances a frame
+	template<typename V>
+	void addMesh(DeviceBackend& backend, RenderDevice& device, Model& model, const std::vector<V>& vertices, const std::vector<unsigned int>& meshIndices,
+		RenderHandle shader, const std::string& albedo, const std::string& normals, const LodChain* chain = nullptr,
+		const MeshletMesh* meshlets = nullptr, size_t instances = 0) {
+		const std::vector<unsigned int>& indices = chain ? chain->indices : meshIndices;
+		BufferDesc desc;
+		desc.binding = BindVertexBuffer;
+		desc.size = (uint32_t)(vertices.size() * sizeof(V));
+		DeviceHandle vb = device.createBuffer(desc, vertices.data());
+		// 16 bit indices when they fit, like Mesh::init
+		IndexFormat format = fitsIndex16(vertices.size()) ? Index16 : Index32;
+		std::vector<uint16_t> shortIndices;
+		if (format == Index16)
+			shortIndices.assign(indices.begin(), indices.end());
+		desc.binding = BindIndexBuffer;
+		desc.size = (uint32_t)(indices.size() * (format == Index16 ? sizeof(uint16_t) : sizeof(unsigned int)));
+		DeviceHandle ib = device.createBuffer(desc, format == Index16 ? (const void*)shortIndices.data() : (const void*)indices.data());
+		DrawPacket packet;
+		packet.shader = shader;
+		packet.textures[0] = texture(backend, albedo);
+		packet.textures[1] = texture(backend, normals);
+		packet.sampler = sampler;
+		for (int level = 0; level < model.levels(); level++) {
+			if (!chain)
+				packet.mesh = level == 0 ? backend.addMesh(vb, ib, sizeof(V), (uint32_t)indices.size(), format) : packet.mesh;
+			else if (level < (int)chain->levels.size())
+				packet.mesh = backend.addMesh(vb, ib, sizeof(V), chain->levels[level].indexCount, format, chain->levels[level].firstIndex);
+			model.packets.push_back(packet);
+		}
+		model.parts.emplace_back();
+		if (meshlets && !meshlets->empty()) {
+			ClusteredPart& part = model.parts.back();
+			part.meshlets = *meshlets;
+			part.indices.assign(indices.begin(), indices.begin() + (chain ? chain->levels[0].indexCount : indices.size()));
+			part.clusters.init(backend, device, vb, sizeof(V), format, instances * part.indices.size());
+		}
+		for (auto& v : vertices)
+			model.bounds.extend(v.pos);
+		meshes++;
+	}
+
+	// instances > 0 adds the LODs and meshlets of forest::stream, for that many instances
+	bool loadModel(DeviceBackend& backend, RenderDevice& device, const std::string& filename, Model& model, size_t instances = 0) {
+		// optimized on load, like model::init
+		ModelAsset asset;
+		if (!asset.load(filename) || asset.meshes.empty())
+			return false;
+		bool withLods = instances > 0;
+		if (withLods) {
+			asset.prepareLods(filename);
+			asset.buildMeshlets();
+			model.lodErrors.assign(asset.lodCount(), 0.0f);
+			for (auto& chain : asset.lods)
+				for (size_t level = 1; level < chain.levels.size(); level++)
+					if (chain.levels[level].error > model.lodErrors[level]) model.lodErrors[level] = chain.levels[level].error;
+		}
+		for (size_t m = 0; m < asset.meshes.size(); m++) {
+			auto& gem = asset.meshes[m];
+			const LodChain* chain = withLods ? &asset.lods[m] : nullptr;
+			const MeshletMesh* meshlets = withLods ? &asset.meshlets[m] : nullptr;
+			std::string albedo = gem.material.find("diffuse").getValue();
+			std::string normals = gem.material.find("normals").getValue();
+			if (gem.isAnimated()) {
+				std::vector<ANIMATED_VERTEX> vertices = toVertices<ANIMATED_VERTEX>(gem.verticesAnimated);
+				addMesh(backend, device, model, vertices, gem.indices, animatedShader, albedo, normals, chain, meshlets, instances);
+			}
+			else {
+				std::vector<STATIC_VERTEX> vertices = toVertices<STATIC_VERTEX>(gem.verticesStatic);
+				addMesh(backend, device, model, vertices, gem.indices, staticShader, albedo, normals, chain, meshlets, instances);
+			}
+		}
+		return true;
+	}
+
+	// cube::init: 24 vertices over [-1, 1]
+	static void buildCube(std::vector<STATIC_VERTEX>& vertices, std::vector<unsigned int>& indices) {
+		vertices.clear();
+		indices.clear();
+		mathLib::Vec3 normals[6] = { mathLib::Vec3(1, 0, 0), mathLib::Vec3(-1, 0, 0), mathLib::Vec3(0, 1, 0), mathLib::Vec3(0, -1, 0), mathLib::Vec3(0, 0, 1), mathLib::Vec3(0, 0, -1) };
+		for (int f = 0; f < 6; f++) {
+			mathLib::Vec3 n = normals[f];
+			mathLib::Vec3 u = f < 2 ? mathLib::Vec3(0, 1, 0) : (f < 4 ? mathLib::Vec3(0, 0, 1) : mathLib::Vec3(1, 0, 0));
+			mathLib::Vec3 v = n.cross(u);
+			unsigned int base = (unsigned int)vertices.size();
+			vertices.push_back(addVertex(n + u + v, n, 1, 1));
+			vertices.push_back(addVertex(n + u - v, n, 1, 0));
+			vertices.push_back(addVertex(n - u - v, n, 0, 0));
+			vertices.push_back(addVertex(n - u + v, n, 0, 1));
+			indices.insert(indices.end(), { base, base + 1, base + 2, base, base + 2, base + 3 });
+		}
+	}
+};
@@ -0,0 +1,119 @@
+#pragma once
+#include <string>
+#include <vector>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+// CPU side of texture::load: decodes an image file with stb_image and expands
+// RGB to RGBA, since D3D11 has no 24 bit texture format. No D3D in here so the
+// decode can run headless (benchmarks, loaders on worker threads).
+class Image {
+public:
+	int width = 0;
+	int height = 0;
+	int channels = 0;
+	std::vector<unsigned char> texels;
+
+	bool load(const std::string& filename) {
+		int w = 0;
+		int h = 0;
+		int c = 0;
+		unsigned char* data = stbi_load(filename.c_str(), &w, &h, &c, 0);
+		return take(data, w, h, c);
+	}
+
+	// same from a file already read into memory, e.g. by the asset streamer's I/O thread
+	bool decode(const std::vector<unsigned char>& file) {
+		int w = 0;
+		int h = 0;
+		int c = 0;
+		unsigned char* data = stbi_load_from_memory(file.data(), (int)file.size(), &w, &h, &c, 0);
+		return take(data, w, h, c);
+	}
+
+	size_t sizeInBytes() const {
+		return texels.size();
+	}
+
+private:
+	bool take(unsigned char* data, int w, int h, int c) {
+		if (data == nullptr) return false;
+		width = w;
+		height = h;
+		if (c == 3) {
+			channels = 4;
+			texels.resize((size_t)width * height * 4);
+			for (int i = 0; i < (width * height); i++) {
+				texels[i * 4] = data[i * 3];
+				texels[(i * 4) + 1] = data[(i * 3) + 1];
+				texels[(i * 4) + 2] = data[(i * 3) + 2];
+				texels[(i * 4) + 3] = 255;
+			}
+		}
+		else {
+			channels = c;
+			texels.assign(data, data + (size_t)width * height * c);
+		}
+		stbi_image_free(data);
+		return true;
+	}
+};
+
+// An image and its mip levels, each half the size of the one before down to 1x1, box
+// filtered on the CPU (in the stored colour space, sRGB textures come out slightly dark).
+// build() takes the texels of the image, so decoding and the chain cost one copy.
+class MipChain {
+public:
+	int width = 0;
+	int height = 0;
+	int channels = 0;
+	std::vector<std::vector<unsigned char>> levels;     // level 0 is the full image
+
+	void build(Image& image) {
+		width = image.width;
+		height = image.height;
+		channels = image.channels;
+		levels.clear();
+		levels.push_back(std::move(image.texels));
+		image.width = 0;
+		image.height = 0;
+		while (levelWidth(levelCount() - 1) > 1 || levelHeight(levelCount() - 1) > 1)
+			downsample(levelCount() - 1);
+	}
+
+	int levelCount() const { return (int)levels.size(); }
+	int levelWidth(int level) const { return (width >> level) > 1 ? width >> level : 1; }
+	int levelHeight(int level) const { return (height >> level) > 1 ? height >> level : 1; }
+
+	size_t sizeInBytes(int firstLevel = 0) const {
+		size_t n = 0;
+		for (int i = firstLevel; i < levelCount(); i++)
+			n += levels[i].size();
+		return n;
+	}
+
+private:
+	void downsample(int level) {
+		int w = levelWidth(level);
+		int h = levelHeight(level);
+		int nw = levelWidth(level + 1);
+		int nh = levelHeight(level + 1);
+		const std::vector<unsigned char>& src = levels[level];
+		std::vector<unsigned char> dst((size_t)nw * nh * channels);
+		for (int y = 0; y < nh; y++) {
+			// a side that is already 1 texel wide repeats the texel instead of reading past it
+			int y0 = y * 2 < h ? y * 2 : h - 1;
+			int y1 = y * 2 + 1 < h ? y * 2 + 1 : h - 1;
+			for (int x = 0; x < nw; x++) {
+				int x0 = x * 2 < w ? x * 2 : w - 1;
+				int x1 = x * 2 + 1 < w ? x * 2 + 1 : w - 1;
+				for (int c = 0; c < channels; c++) {
+					int sum = src[((size_t)y0 * w + x0) * channels + c] + src[((size_t)y0 * w + x1) * channels + c]
+						+ src[((size_t)y1 * w + x0) * channels + c] + src[((size_t)y1 * w + x1) * channels + c];
+					dst[((size_t)y * nw + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+		levels.push_back(std::move(dst));
+	}
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+// Input seen by the gameplay code. Window implements it on Win32, the headless
+// driver feeds it from a script, so player/camera logic never touches Windows.h.
+class InputSource {
+public:
+	virtual ~InputSource() {}
+
+	// is the key (virtual-key code, 'W', 'A', ...) held down
+	virtual bool keyDown(int key) = 0;
+	// 0 = left, 1 = right, 2 = middle
+	virtual bool mouseButtonDown(int button) = 0;
+	// mouse movement since the last call
+	virtual void getMouseMovement(float& deltaX, float& deltaY) = 0;
+};
+
+// Input driven by code: set keys and queue mouse movement directly
+class ScriptedInput : public InputSource {
+public:
+	bool keys[256];
+	bool mouseButtons[3];
+	float mouseDeltaX;
+	float mouseDeltaY;
+
+	ScriptedInput() {
+		clear();
+	}
+
+	void clear() {
+		for (int i = 0; i < 256; i++) keys[i] = false;
+		for (int i = 0; i < 3; i++) mouseButtons[i] = false;
+		mouseDeltaX = 0.0f;
+		mouseDeltaY = 0.0f;
+	}
+
+	bool keyDown(int key) override {
+		return keys[key & 0xFF];
+	}
+
+	bool mouseButtonDown(int button) override {
+		return mouseButtons[button];
+	}
+
+	void getMouseMovement(float& deltaX, float& deltaY) override {
+		deltaX = mouseDeltaX;
+		deltaY = mouseDeltaY;
+		mouseDeltaX = 0.0f;
+		mouseDeltaY = 0.0f;
+	}
+};
@@ -0,0 +1,479 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <string>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstdint>
+#include "timer.h"
+#include "profiler.h"
+
+// Work-stealing job scheduler. Every worker thread (the thread that called init() is
+// worker 0) owns a deque: it pushes and pops its own jobs at the bottom, idle workers
+// steal the oldest job from the top of someone else's. Jobs are small closures copied
+// into preallocated slots, so starting one does not touch the heap.
+//
+// Finishing is tracked with JobCounter: a job started with a counter adds one to it
+// and takes it off when done. wait(counter) runs other jobs until it reaches zero,
+// runAfter(counter, ...) starts a job once it has. Device calls go through
+// runOnMainThread(), the thread that owns the device runs them in runMainThreadJobs().
+
+struct Job {
+	static const size_t DataSize = 64;
+
+	void (*function)(Job&) = nullptr;   // runs and destroys the closure in data
+	class JobCounter* counter = nullptr;
+	Job* next = nullptr;                // in the list of a counter it waits for
+	std::atomic<bool> busy{ false };    // queued, waiting or running, the slot can't be reused
+	alignas(16) unsigned char data[DataSize];
+};
+
+class JobCounter {
+public:
+	JobCounter() {}
+	JobCounter(const JobCounter&) = delete;
+	JobCounter& operator=(const JobCounter&) = delete;
+
+	bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+	int value() const { return pending.load(std::memory_order_acquire); }
+
+private:
+	friend class JobSystem;
+	std::atomic<int> pending{ 0 };
+	// held while the count drops and while a job is parked, so wait() can tell the last
+	// finisher has let go of the counter before the owner destroys it
+	std::mutex mutex;
+	Job* waiting = nullptr;
+};
+
+// Chase-Lev deque of fixed size. push / pop only from the owning thread, steal from any.
+class JobDeque {
+public:
+	static const int64_t Capacity = 2048;
+
+	bool push(Job* job) {
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		if (b - t >= Capacity) return false;
+		items[b & (Capacity - 1)].store(job, std::memory_order_relaxed);
+		bottom.store(b + 1, std::memory_order_release);
+		return true;
+	}
+
+	Job* pop() {
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+		if (t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		Job* job = items[b & (Capacity - 1)].load(std::memory_order_relaxed);
+		if (t == b) {
+			// last one, race the thieves for it
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				job = nullptr;
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return job;
+	}
+
+	// can come back empty while another thief wins the same job, callers just try again
+	Job* steal() {
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+		if (t >= b) return nullptr;
+		Job* job = items[t & (Capacity - 1)].load(std::memory_order_relaxed);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return nullptr;
+		return job;
+	}
+
+	bool empty() const {
+		return bottom.load(std::memory_order_acquire) <= top.load(std::memory_order_acquire);
+	}
+
+private:
+	std::atomic<int64_t> top{ 0 };
+	std::atomic<int64_t> bottom{ 0 };
+	std::atomic<Job*> items[Capacity];
+};
+
+struct WorkerStats {
+	uint64_t executed = 0;
+	uint64_t steals = 0;        // jobs taken from another worker's deque
+	double idleMs = 0.0;        // spinning or asleep with nothing to run
+};
+
+struct JobSystemStats {
+	std::vector<WorkerStats> workers;   // worker 0 is the thread that called init()
+	uint64_t external = 0;              // jobs run by threads that are not workers, while waiting
+
+	uint64_t executed() const {
+		uint64_t n = external;
+		for (auto& w : workers) n += w.executed;
+		return n;
+	}
+
+	uint64_t steals() const {
+		uint64_t n = 0;
+		for (auto& w : workers) n += w.steals;
+		return n;
+	}
+};
+
+class JobSystem {
+public:
+	JobSystem() {}
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+	~JobSystem() { shutdown(); }
+
+	// threads counts the calling thread, 0 uses every hardware thread. With 1 there are
+	// no worker threads and jobs run on the caller while it waits.
+	void init(int threads = 0) {
+		shutdown();
+		int count = threadCount(threads);
+		running.store(true);
+		for (int i = 0; i < count; i++)
+			workers.emplace_back(new Worker());
+		threadSlot() = { this, 0, 0x9e3779b9u };
+		for (int i = 1; i < count; i++)
+			workers[i]->thread = std::thread([this, i] { workerLoop(i); });
+	}
+
+	// the workerCount() init(threads) gives
+	static int threadCount(int threads = 0) {
+		int count = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+		return count < 1 ? 1 : count;
+	}
+
+	// jobs still queued are run on the calling thread, so every counter reaches zero
+	void shutdown() {
+		if (workers.empty()) return;
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			running.store(false);
+		}
+		sleepCondition.notify_all();
+		for (size_t i = 1; i < workers.size(); i++)
+			workers[i]->thread.join();
+		while (runOne(workerIndex())) {}
+		workers.clear();
+		if (threadSlot().system == this)
+			threadSlot() = { nullptr, -1, 0 };
+	}
+
+	int workerCount() const { return workers.empty() ? 1 : (int)workers.size(); }
+
+	// captures must fit Job::DataSize, capture pointers to bigger data
+	template<typename F>
+	void run(F&& function, JobCounter* counter = nullptr) {
+		schedule(makeJob(std::forward<F>(function), counter));
+	}
+
+	// starts once dependency has reached zero
+	template<typename F>
+	void runAfter(JobCounter& dependency, F&& function, JobCounter* counter = nullptr) {
+		Job* job = makeJob(std::forward<F>(function), counter);
+		{
+			std::lock_guard<std::mutex> lock(dependency.mutex);
+			if (!dependency.done()) {
+				job->next = dependency.waiting;
+				dependency.waiting = job;
+				return;
+			}
+		}
+		schedule(job);
+	}
+
+	// runs queued jobs on this thread until the counter is zero
+	void wait(JobCounter& counter) {
+		int index = workerIndex();
+		while (!counter.done()) {
+			if (!runOne(index))
+				std::this_thread::yield();
+		}
+		std::lock_guard<std::mutex> lock(counter.mutex);
+	}
+
+	// function(begin, end) over [0, count) in chunks of grain, returns when all are done.
+	// Chunk bounds are multiples of grain, so e.g. grain 64 gives whole visibility words.
+	template<typename F>
+	void parallelFor(size_t count, size_t grain, F&& function) {
+		if (grain < 1) grain = 1;
+		if (count <= grain || workerCount() == 1) {
+			for (size_t begin = 0; begin < count; begin += grain)
+				function(begin, begin + grain < count ? begin + grain : count);
+			return;
+		}
+		typedef typename std::remove_reference<F>::type Function;
+		Function* f = &function;
+		JobCounter counter;
+		for (size_t begin = grain; begin < count; begin += grain) {
+			size_t end = begin + grain < count ? begin + grain : count;
+			run([f, begin, end] { (*f)(begin, end); }, &counter);
+		}
+		function(0, grain);
+		wait(counter);
+	}
+
+	// queued from any thread, run by the device thread in runMainThreadJobs()
+	void runOnMainThread(std::function<void()> function) {
+		std::lock_guard<std::mutex> lock(mainMutex);
+		mainQueue.push_back(std::move(function));
+	}
+
+	// call once per frame (and after waiting for loads) on the thread that owns the device,
+	// the main thread or the render thread when frames are pipelined
+	int runMainThreadJobs() {
+		{
+			std::lock_guard<std::mutex> lock(mainMutex);
+			mainRunning.swap(mainQueue);
+		}
+		int n = (int)mainRunning.size();
+		for (auto& function : mainRunning)
+			function();
+		mainRunning.clear();
+		return n;
+	}
+
+	void stats(JobSystemStats& out) const {
+		out.workers.resize(workers.size());
+		for (size_t i = 0; i < workers.size(); i++) {
+			out.workers[i].executed = workers[i]->executed.load(std::memory_order_relaxed);
+			out.workers[i].steals = workers[i]->steals.load(std::memory_order_relaxed);
+			out.workers[i].idleMs = workers[i]->idleNs.load(std::memory_order_relaxed) * 1e-6;
+		}
+		out.external = external.executed.load(std::memory_order_relaxed);
+	}
+
+	JobSystemStats stats() const {
+		JobSystemStats out;
+		stats(out);
+		return out;
+	}
+
+	void resetStats() {
+		for (auto& w : workers) {
+			w->executed.store(0);
+			w->steals.store(0);
+			w->idleNs.store(0);
+		}
+		external.executed.store(0);
+	}
+
+private:
+	// ring of job slots, only the owning thread takes slots, any thread frees them
+	struct JobPool {
+		static const uint32_t Capacity = 2048;
+		std::unique_ptr<Job[]> jobs{ new Job[Capacity] };
+		uint32_t next = 0;
+
+		Job* acquire() {
+			Job& job = jobs[next & (Capacity - 1)];
+			if (job.busy.load(std::memory_order_acquire)) return nullptr;
+			next++;
+			job.busy.store(true, std::memory_order_relaxed);
+			return &job;
+		}
+	};
+
+	struct Worker {
+		JobDeque deque;
+		JobPool pool;
+		std::thread thread;
+		std::atomic<uint64_t> executed{ 0 };
+		std::atomic<uint64_t> steals{ 0 };
+		std::atomic<uint64_t> idleNs{ 0 };
+	};
+
+	struct ThreadSlot {
+		JobSystem* system;
+		int index;
+		uint32_t random;    // picks the first victim to steal from
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	// jobs started by threads that are not workers (loader threads), pushed under the
+	// mutex and only ever stolen
+	Worker external;
+	std::mutex externalMutex;
+	std::atomic<bool> running{ false };
+	std::mutex sleepMutex;
+	std::condition_variable sleepCondition;
+	std::atomic<int> sleepers{ 0 };
+	std::mutex mainMutex;
+	std::vector<std::function<void()>> mainQueue;
+	std::vector<std::function<void()>> mainRunning;
+
+	static ThreadSlot& threadSlot() {
+		thread_local ThreadSlot slot = { nullptr, -1, 0 };
+		return slot;
+	}
+
+	int workerIndex() const {
+		ThreadSlot& slot = threadSlot();
+		return slot.system == this ? slot.index : -1;
+	}
+
+	template<typename F>
+	Job* makeJob(F&& function, JobCounter* counter) {
+		typedef typename std::decay<F>::type Function;
+		static_assert(sizeof(Function) <= Job::DataSize, "job closure too big, capture a pointer instead");
+		static_assert(alignof(Function) <= 16, "job closure over-aligned");
+		Job* job = acquireJob();
+		new (job->data) Function(std::forward<F>(function));
+		job->function = [](Job& j) {
+			Function* f = (Function*)j.data;
+			(*f)();
+			f->~Function();
+		};
+		job->counter = counter;
+		job->next = nullptr;
+		if (counter) counter->pending.fetch_add(1, std::memory_order_relaxed);
+		return job;
+	}
+
+	// every slot still queued or running means a flood of jobs, help run them until one frees up
+	Job* acquireJob() {
+		int index = workerIndex();
+		for (;;) {
+			Job* job;
+			if (index >= 0)
+				job = workers[index]->pool.acquire();
+			else {
+				std::lock_guard<std::mutex> lock(externalMutex);
+				job = external.pool.acquire();
+			}
+			if (job) return job;
+			if (!runOne(index))
+				std::this_thread::yield();
+		}
+	}
+
+	void schedule(Job* job) {
+		int index = workerIndex();
+		bool queued;
+		if (index >= 0)
+			queued = workers[index]->deque.push(job);
+		else {
+			std::lock_guard<std::mutex> lock(externalMutex);
+			queued = external.deque.push(job);
+		}
+		if (!queued) {
+			// deque full, running it now keeps the order of a depth-first walk anyway
+			execute(job, index);
+			return;
+		}
+		wake();
+	}
+
+	void execute(Job* job, int index) {
+		job->function(*job);
+		JobCounter* counter = job->counter;
+		job->busy.store(false, std::memory_order_release);
+		(index >= 0 ? *workers[index] : external).executed.fetch_add(1, std::memory_order_relaxed);
+		if (counter) finish(*counter);
+	}
+
+	void finish(JobCounter& counter) {
+		Job* waiting = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(counter.mutex);
+			if (counter.pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				waiting = counter.waiting;
+				counter.waiting = nullptr;
+			}
+		}
+		while (waiting) {
+			Job* next = waiting->next;
+			schedule(waiting);
+			waiting = next;
+		}
+	}
+
+	Job* findJob(int index) {
+		if (index >= 0) {
+			if (Job* job = workers[index]->deque.pop())
+				return job;
+		}
+		if (Job* job = external.deque.steal())
+			return job;
+		int n = (int)workers.size();
+		if (n == 0) return nullptr;
+		ThreadSlot& slot = threadSlot();
+		slot.random ^= slot.random << 13;
+		slot.random ^= slot.random >> 17;
+		slot.random ^= slot.random << 5;
+		int first = (int)(slot.random % (uint32_t)n);
+		for (int i = 0; i < n; i++) {
+			int victim = (first + i) % n;
+			if (victim == index) continue;
+			if (Job* job = workers[victim]->deque.steal()) {
+				if (index >= 0) workers[index]->steals.fetch_add(1, std::memory_order_relaxed);
+				return job;
+			}
+		}
+		return nullptr;
+	}
+
+	bool runOne(int index) {
+		Job* job = findJob(index);
+		if (!job) return false;
+		execute(job, index);
+		return true;
+	}
+
+	bool hasWork() const {
+		if (!external.deque.empty()) return true;
+		for (auto& w : workers)
+			if (!w->deque.empty()) return true;
+		return false;
+	}
+
+	void wake() {
+		// pairs with the fence in sleep(): either the sleeper sees the job or we see the sleeper
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_relaxed) > 0) {
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			sleepCondition.notify_one();
+		}
+	}
+
+	void sleep() {
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleepers.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (running.load() && !hasWork())
+			sleepCondition.wait(lock);
+		sleepers.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void workerLoop(int index) {
+		threadSlot() = { this, index, 0x9e3779b9u * (uint32_t)(index + 1) };
+		Profiler::setThreadName("job worker " + std::to_string(index));
+		Worker& self = *workers[index];
+		while (running.load(std::memory_order_acquire)) {
+			if (runOne(index)) continue;
+			uint64_t idleStart = Timer::now();
+			// work tends to come in bursts, look again a few times before going to sleep
+			Job* job = nullptr;
+			for (int spin = 0; spin < 64 && !job; spin++) {
+				std::this_thread::yield();
+				job = findJob(index);
+			}
+			if (!job) sleep();
+			self.idleNs.fetch_add(Timer::now() - idleStart, std::memory_order_relaxed);
+			if (job) execute(job, index);
+		}
+	}
+};
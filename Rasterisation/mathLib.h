@@ -2,10 +2,34 @@
 #pragma once
 #define _USE_MATH_DEFINES
 #include <cmath>
+#include <cfloat>
 #include <memory.h>
 #include <ostream>
 #include <algorithm>
 #include <iostream>
+#include <stdexcept>
+// std headers whose templates call std::min/std::max must be seen before the macros below
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <limits>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+// SSE2 is always there on x64, the batch tests fall back to scalar code elsewhere
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MATHLIB_SSE2 1
+#else
+#define MATHLIB_SSE2 0
+#endif
 
 namespace mathLib {
 #define SQ(x) (x) * (x)
@@ -576,16 +600,16 @@ namespace mathLib {
 		// 从笛卡尔坐标转换为球坐标
 		static SphericalCoordinates fromCartesian(float x, float y, float z) {
 			float r = sqrtf(SQ(x) + SQ(y) + SQ(z));
-			float theta = std::acosf(z / r);
-			float phi = std::atan2f(y, x);
+			float theta = acosf(z / r);
+			float phi = atan2f(y, x);
 			return SphericalCoordinates(r, theta, phi);
 		}
 
 		// 从球坐标转换为笛卡尔坐标
 		void toCartesian(float& x, float& y, float& z) const {
-			x = r * std::sinf(theta) * std::cosf(phi);
-			y = r * std::sinf(theta) * std::sinf(phi);
-			z = r * std::cosf(theta);
+			x = r * sinf(theta) * cosf(phi);
+			y = r * sinf(theta) * sinf(phi);
+			z = r * cosf(theta);
 		}
 
 		// 打印球坐标
@@ -849,4 +873,117 @@ namespace mathLib {
 		return ((attrib[0] + attrib[1] + attrib[2]) / frag_w);
 	}
 
+	// plane n.p + d = 0, points with n.p + d >= 0 are on the inside
+	class Plane {
+	public:
+		Vec3 n;
+		float d;
+
+		Plane(const Vec3& _n = Vec3(0, 1, 0), float _d = 0) : n(_n), d(_d) {}
+
+		float distance(const Vec3& p) const { return n.dot(p) + d; }
+
+		void normalize() {
+			float len = n.getLength();
+			if (len > 0) {
+				n = n / len;
+				d /= len;
+			}
+		}
+	};
+
+	// six planes of a view frustum, extracted from a view-projection matrix (Gribb / Hartmann).
+	// Uses -w <= z <= w for near/far, which also contains D3D's 0 <= z <= w, so culling stays conservative.
+	class Frustum {
+	public:
+		enum { Left, Right, Bottom, Top, Near, Far };
+		Plane planes[6];
+
+		Frustum() {}
+		Frustum(const Matrix& vp) { extract(vp); }
+
+		// vp as built in WinMain (view * projection), clip = vp.mulPointP(p)
+		void extract(const Matrix& vp) {
+			for (int i = 0; i < 3; i++) {
+				Vec3 r3(vp.a[3][0], vp.a[3][1], vp.a[3][2]);
+				Vec3 ri(vp.a[i][0], vp.a[i][1], vp.a[i][2]);
+				planes[i * 2] = Plane(r3 + ri, vp.a[3][3] + vp.a[i][3]);
+				planes[i * 2 + 1] = Plane(r3 - ri, vp.a[3][3] - vp.a[i][3]);
+				planes[i * 2].normalize();
+				planes[i * 2 + 1].normalize();
+			}
+		}
+
+		// true when the box is inside or crosses the frustum
+		bool containsAABB(const Vec3& bmin, const Vec3& bmax) const {
+			Vec3 c((bmin.x + bmax.x) * 0.5f, (bmin.y + bmax.y) * 0.5f, (bmin.z + bmax.z) * 0.5f);
+			Vec3 e((bmax.x - bmin.x) * 0.5f, (bmax.y - bmin.y) * 0.5f, (bmax.z - bmin.z) * 0.5f);
+			for (int i = 0; i < 6; i++) {
+				const Vec3& n = planes[i].n;
+				float r = fabsf(n.x) * e.x + fabsf(n.y) * e.y + fabsf(n.z) * e.z;
+				if (planes[i].distance(c) + r < 0) return false;
+			}
+			return true;
+		}
+
+		bool containsSphere(const Vec3& centre, float radius) const {
+			for (int i = 0; i < 6; i++)
+				if (planes[i].distance(centre) + radius < 0) return false;
+			return true;
+		}
+
+		// Batch test of count boxes given as centre / half extent arrays. Writes one bit per box
+		// into visible (64 per word, (count + 63) / 64 words), 4 boxes per step with SSE2.
+		void cullAABBs(const float* cx, const float* cy, const float* cz, const float* ex, const float* ey, const float* ez, size_t count, uint64_t* visible) const {
+			memset(visible, 0, ((count + 63) / 64) * sizeof(uint64_t));
+			size_t i = 0;
+#if MATHLIB_SSE2
+			const __m128 zero = _mm_setzero_ps();
+			const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+			for (; i + 4 <= count; i += 4) {
+				__m128 x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i), z = _mm_loadu_ps(cz + i);
+				__m128 hx = _mm_loadu_ps(ex + i), hy = _mm_loadu_ps(ey + i), hz = _mm_loadu_ps(ez + i);
+				__m128 outside = zero;
+				for (int p = 0; p < 6; p++) {
+					__m128 nx = _mm_set1_ps(planes[p].n.x), ny = _mm_set1_ps(planes[p].n.y), nz = _mm_set1_ps(planes[p].n.z);
+					__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, x), _mm_mul_ps(ny, y)), _mm_add_ps(_mm_mul_ps(nz, z), _mm_set1_ps(planes[p].d)));
+					__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_and_ps(nx, absMask), hx), _mm_mul_ps(_mm_and_ps(ny, absMask), hy)), _mm_mul_ps(_mm_and_ps(nz, absMask), hz));
+					outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(dist, r), zero));
+				}
+				uint64_t mask = (uint64_t)(~_mm_movemask_ps(outside) & 0xf);
+				visible[i >> 6] |= mask << (i & 63);
+			}
+#endif
+			for (; i < count; i++) {
+				Vec3 bmin(cx[i] - ex[i], cy[i] - ey[i], cz[i] - ez[i]);
+				Vec3 bmax(cx[i] + ex[i], cy[i] + ey[i], cz[i] + ez[i]);
+				if (containsAABB(bmin, bmax))
+					visible[i >> 6] |= 1ull << (i & 63);
+			}
+		}
+
+		// same for spheres
+		void cullSpheres(const float* x, const float* y, const float* z, const float* radius, size_t count, uint64_t* visible) const {
+			memset(visible, 0, ((count + 63) / 64) * sizeof(uint64_t));
+			size_t i = 0;
+#if MATHLIB_SSE2
+			const __m128 zero = _mm_setzero_ps();
+			for (; i + 4 <= count; i += 4) {
+				__m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+				__m128 r = _mm_loadu_ps(radius + i);
+				__m128 outside = zero;
+				for (int p = 0; p < 6; p++) {
+					__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes[p].n.x), px), _mm_mul_ps(_mm_set1_ps(planes[p].n.y), py)),
+						_mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes[p].n.z), pz), _mm_set1_ps(planes[p].d)));
+					outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(dist, r), zero));
+				}
+				uint64_t mask = (uint64_t)(~_mm_movemask_ps(outside) & 0xf);
+				visible[i >> 6] |= mask << (i & 63);
+			}
+#endif
+			for (; i < count; i++)
+				if (containsSphere(Vec3(x[i], y[i], z[i]), radius[i]))
+					visible[i >> 6] |= 1ull << (i & 63);
+		}
+	};
 }
\ No newline at end of file
@@ -4,31 +4,34 @@
 #include <corecrt_math_defines.h>
 #include "GEMLoader.h"
 #include "animation.h"
+#include "animatedRig.h"
 #include "dxCore.h"
 #include "shader.h"
 #include "texture.h"
 #include "collision.h"
-
-struct STATIC_VERTEX
-{
-	mathLib::Vec3 pos;
-	mathLib::Vec3 normal;
-	mathLib::Vec3 tangent;
-	float tu;
-	float tv;
-};
-
-struct ANIMATED_VERTEX
-{
-	mathLib::Vec3 pos;
-	mathLib::Vec3 normal;
-	mathLib::Vec3 tangent;
-	float tu;
-	float tv;
-	unsigned int bonesIDs[4];
-	float boneWeights[4];
+#include "profiler.h"
+#include "vertex.h"
+#include "visibility.h"
+#include "renderQueue.h"
+#include "dxRenderBackend.h"
+#include "modelAsset.h"
+#include "assetStreamer.h"
+#include "clusterCulling.h"
+#include "terrain.h"
+#include "foliage.h"
+#include <functional>
+#include <memory>
+
+// per-draw cbuffers of vertexShader.hlsl and animationVertexShader.hlsl, in declaration order
+struct StaticMeshConstants {
+	mathLib::Matrix W;
+	mathLib::Matrix VP;
 };
 
+// view distance of the object origin, used as the sort depth of its packets
+static float drawDepth(const mathLib::Matrix& vp, const mathLib::Matrix& world) {
+	return vp.a[3][0] * world.a[0][3] + vp.a[3][1] * world.a[1][3] + vp.a[3][2] * world.a[2][3] + vp.a[3][3];
+}
 
 struct Vertex
 {
@@ -37,20 +40,6 @@ struct Vertex
 	mathLib::Color color;
 };
 
-static STATIC_VERTEX addVertex(mathLib::Vec3 p, mathLib::Vec3 n, float tu, float tv)
-{
-	STATIC_VERTEX v;
-	v.pos = p;
-	v.normal = n;
-	//Frame frame;
-	//frame.fromVector(n);
-	//v.tangent = frame.u; // For now
-	v.tangent = mathLib::Vec3(1, 0, 0);
-	v.tu = tu;
-	v.tv = tv;
-	return v;
-}
-
 class Triangle {
 	Vertex vertices[3];
 public:
@@ -98,18 +87,28 @@ public:
 	ID3D11Buffer* vertexBuffer;
 	int indicesSize;
 	UINT strides;
+	IndexFormat indexFormat = Index32;
 	std::vector<ANIMATED_VERTEX> animatedVertices;
 	std::vector<STATIC_VERTEX> staticVertices;
+	std::vector<unsigned int> cpuIndices;    // CPU copies of the buffers, used by the software rasterizer
+	std::vector<MeshLod> lods;               // levels in the index buffer, empty when it only holds the mesh
+	MeshletMesh meshlets;                    // clusters of level 0 (cpuIndices), empty when it is drawn whole
+	RenderHandle handle = InvalidRenderHandle;
 
+	// the index buffer is 16 bit when every index fits
 	void init(DxCore* core, void* vertices, int vertexSizeInBytes, int numVertices, unsigned int* indices, int numIndices) {
+		std::vector<uint16_t> shortIndices;
+		indexFormat = fitsIndex16(numVertices) ? Index16 : Index32;
+		if (indexFormat == Index16)
+			shortIndices.assign(indices, indices + numIndices);
 		D3D11_BUFFER_DESC bd;
 		memset(&bd, 0, sizeof(D3D11_BUFFER_DESC));
 		bd.Usage = D3D11_USAGE_DEFAULT;
-		bd.ByteWidth = sizeof(unsigned int) * numIndices;
+		bd.ByteWidth = (indexFormat == Index16 ? sizeof(uint16_t) : sizeof(unsigned int)) * numIndices;
 		bd.BindFlags = D3D11_BIND_INDEX_BUFFER;
 		D3D11_SUBRESOURCE_DATA data;
 		memset(&data, 0, sizeof(D3D11_SUBRESOURCE_DATA));
-		data.pSysMem = indices;
+		data.pSysMem = indexFormat == Index16 ? (void*)shortIndices.data() : (void*)indices;
 		core->device->CreateBuffer(&bd, &data, &indexBuffer);
 		bd.ByteWidth = vertexSizeInBytes * numVertices;
 		bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
@@ -119,80 +118,165 @@ public:
 		strides = vertexSizeInBytes;
 	}
 
-	void init(DxCore* core, std::vector<STATIC_VERTEX> vertices, std::vector<unsigned int> indices)
+	void init(DxCore* core, std::vector<STATIC_VERTEX> vertices, std::vector<unsigned int> indices, VertexFormat format = VertexFormat::Full)
 	{
 		staticVertices = vertices;
+		cpuIndices = indices;
+		if (format == VertexFormat::Packed) {
+			std::vector<STATIC_VERTEX_PACKED> packed(vertices.size());
+			for (size_t i = 0; i < vertices.size(); i++)
+				packed[i] = packVertex(vertices[i]);
+			init(core, &packed[0], sizeof(STATIC_VERTEX_PACKED), packed.size(), &indices[0], indices.size());
+			return;
+		}
 		init(core, &vertices[0], sizeof(STATIC_VERTEX), vertices.size(), &indices[0], indices.size());
 	}
 
-	void init(DxCore* core, std::vector<ANIMATED_VERTEX> vertices, std::vector<unsigned int> indices)
+	void init(DxCore* core, std::vector<ANIMATED_VERTEX> vertices, std::vector<unsigned int> indices, VertexFormat format = VertexFormat::Full)
 	{
 		animatedVertices = vertices;
+		cpuIndices = indices;
+		if (format == VertexFormat::Packed) {
+			std::vector<ANIMATED_VERTEX_PACKED> packed(vertices.size());
+			for (size_t i = 0; i < vertices.size(); i++)
+				packed[i] = packVertex(vertices[i]);
+			init(core, &packed[0], sizeof(ANIMATED_VERTEX_PACKED), packed.size(), &indices[0], indices.size());
+			return;
+		}
 		init(core, &vertices[0], sizeof(ANIMATED_VERTEX), vertices.size(), &indices[0], indices.size());
 	}
 
+	// every level of the chain in one index buffer; draw() and cpuIndices are level 0
+	template<typename V>
+	void init(DxCore* core, std::vector<V> vertices, const LodChain& chain, VertexFormat format = VertexFormat::Full) {
+		init(core, vertices, chain.indices, format);
+		lods = chain.levels;
+		indicesSize = lods[0].indexCount;
+		cpuIndices.resize(indicesSize);
+	}
+
+	int lodCount() const { return lods.empty() ? 1 : (int)lods.size(); }
+
+	// registers the buffers with the render queue backend on first use, one handle per level
+	RenderHandle drawHandle(DxRenderBackend& backend, int lod = 0) {
+		if (lod <= 0 || lods.empty()) {
+			if (handle == InvalidRenderHandle)
+				handle = backend.addMesh(vertexBuffer, indexBuffer, strides, indicesSize, indexFormat);
+			return handle;
+		}
+		if (lod >= (int)lods.size()) lod = (int)lods.size() - 1;
+		if (lodHandles.size() < lods.size())
+			lodHandles.resize(lods.size(), InvalidRenderHandle);
+		if (lodHandles[lod] == InvalidRenderHandle)
+			lodHandles[lod] = backend.addMesh(vertexBuffer, indexBuffer, strides, lods[lod].indexCount, indexFormat, lods[lod].firstIndex);
+		return lodHandles[lod];
+	}
+
+	// rewrites the vertex buffer of a Full format mesh with as many new vertices, e.g.
+	// an edited terrain chunk; device thread only
+	void updateVertices(DxCore* core, const STATIC_VERTEX* vertices, size_t count) {
+		staticVertices.assign(vertices, vertices + count);
+		core->devicecontext->UpdateSubresource(vertexBuffer, 0, nullptr, vertices, 0, 0);
+	}
 
 	void draw(DxCore* core) {
 		UINT offsets = 0;
 		core->devicecontext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 		core->devicecontext->IASetVertexBuffers(0, 1, &vertexBuffer, &strides, &offsets);
-		core->devicecontext->IASetIndexBuffer(indexBuffer, DXGI_FORMAT_R32_UINT, 0);
+		core->devicecontext->IASetIndexBuffer(indexBuffer, indexFormat == Index16 ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT, 0);
 		core->devicecontext->DrawIndexed(indicesSize, 0, 0);
 	}
-};
 
-class plane {
-public:
-	Mesh mesh;
-
-	void init(DxCore* core) {
-		std::vector<STATIC_VERTEX> vertices;
-		std::vector<unsigned int> indices;
-		int gridSize = 10;
-		float planeSize = 100.0f;
-		float step = planeSize * 2.0f / gridSize;
-
-		float textureScale = 10.0f; // Control the proportion of texture repeats
-		// Generate Vertices
-		for (int z = 0; z <= gridSize; ++z) {
-			for (int x = 0; x <= gridSize; ++x) {
-				float posX = -planeSize + x * step;
-				float posZ = -planeSize + z * step;
-				float u = static_cast<float>(x) / gridSize * textureScale;
-				float v = static_cast<float>(z) / gridSize * textureScale;
-				vertices.push_back(addVertex(mathLib::Vec3(posX, 0.0f, posZ), mathLib::Vec3(0, 1, 0), u, v));
-			}
+	// Culled draws of level 0: beginClusters() once a frame with how many instances may
+	// be drawn and the frame's arena, addClusters() per instance points packet at the
+	// kept clusters (false when none are left), endClusters() uploads them before the
+	// queue executes. cones: cull clusters that face away, see ClusterCuller
+	void beginClusters(DxRenderBackend& backend, size_t instances, FrameArena& memory) {
+		if (!clusters.ready() || clusterInstances < instances) {
+			clusterInstances = instances;
+			clusters.init(backend, backend.dxDevice, backend.dxDevice.addBuffer(vertexBuffer), strides, indexFormat, instances * cpuIndices.size());
 		}
+		clusters.begin(memory);
+	}
 
-		// Generate indices
-		for (int z = 0; z < gridSize; ++z) {
-			for (int x = 0; x < gridSize; ++x) {
-				int topLeft = z * (gridSize + 1) + x;
-				int topRight = topLeft + 1;
-				int bottomLeft = (z + 1) * (gridSize + 1) + x;
-				int bottomRight = bottomLeft + 1;
+	bool addClusters(ClusterCuller& culler, const mathLib::Matrix& world, DrawPacket& packet, bool cones) {
+		if (!clusters.add(culler, meshlets, cpuIndices, world, packet.firstIndex, packet.indexCount, cones)) return false;
+		packet.mesh = clusters.mesh;
+		return true;
+	}
 
-				indices.push_back(topLeft);
-				indices.push_back(bottomLeft);
-				indices.push_back(topRight);
+	void endClusters() { clusters.upload(); }
 
-				indices.push_back(topRight);
-				indices.push_back(bottomLeft);
-				indices.push_back(bottomRight);
-			}
+private:
+	std::vector<RenderHandle> lodHandles;
+	ClusterDrawList clusters;
+	size_t clusterInstances = 0;
+};
+
+// The heightfield ground: a Mesh per chunk over TerrainMesh's shared chain, each
+// drawn at the coarsest level LodSelector allows for its bounds. Bounds and errors are
+// this class's own copy, so the simulation can edit the heightfield while the device
+// thread draws; init, updateChunk and record run on the device thread.
+class terrain {
+public:
+	std::vector<Mesh> chunks;
+	std::vector<AABB> bounds;           // world space, per chunk
+	std::vector<float> lodErrors;       // TerrainLevels per chunk
+
+	void init(DxCore* core, const TerrainMesh& ground) {
+		chunks.resize(ground.chunks.size());
+		bounds = ground.bounds;
+		lodErrors.resize(ground.chunks.size() * TerrainLevels);
+		for (size_t c = 0; c < ground.chunks.size(); c++) {
+			chunks[c].init(core, ground.chunks[c].vertices, ground.chain);
+			memcpy(&lodErrors[c * TerrainLevels], ground.chunks[c].lodErrors, sizeof(float) * TerrainLevels);
 		}
-		mesh.init(core, vertices, indices);
 	}
 
-	// ask the GPU to draw a plane
-	void draw(DxCore* core, Shader* shader, textureManager textures, sampler sam, mathLib::Matrix worldMatrix, mathLib::Matrix vp) {
-		shader->updateConstantVS("staticMeshBuffer", "W", &worldMatrix);
-		shader->updateConstantVS("staticMeshBuffer", "VP", &vp);
-		shader->apply(core);
-		shader->updateTexturePS(core, "tex", textures.find("Textures/grass.png"), sam.state);
-		shader->updateTexturePS(core, "normalMap", textures.find("Textures/grass_Normal.png"), sam.state);
-		mesh.draw(core);
+	// a chunk TerrainMesh::rebuildDirty rebuilt
+	void updateChunk(DxCore* core, const TerrainChunkUpdate& update) {
+		if (update.chunk >= chunks.size()) return;
+		chunks[update.chunk].updateVertices(core, update.vertices, TerrainChunkVertices);
+		bounds[update.chunk] = update.bounds;
+		memcpy(&lodErrors[update.chunk * TerrainLevels], update.lodErrors, sizeof(update.lodErrors));
+	}
+
+	// visible: skip chunks whose bit is clear, nullptr draws everything. lods picks each
+	// chunk's level, nullptr draws level 0
+	void record(RenderQueue& queue, DxRenderBackend& backend, Shader* shader, textureManager& textures, sampler& sam, mathLib::Matrix& vp,
+		const VisibilitySet* visible = nullptr, const LodSelector* lods = nullptr) {
+		if (packets.empty() || packetGeneration != textures.generation()) {
+			DrawPacket packet;
+			packet.shader = backend.addShader(shader);
+			packet.textures[0] = backend.addTexture(textures.find("Textures/grass.png"));
+			packet.textures[1] = backend.addTexture(textures.find("Textures/grass_Normal.png"));
+			packet.sampler = backend.addSampler(sam.state);
+			textureIds[0] = textures.id("Textures/grass.png");
+			textureIds[1] = textures.id("Textures/grass_Normal.png");
+			packets.assign(chunks.size(), packet);
+			packetGeneration = textures.generation();
+		}
+		textures.touch(textureIds[0]);
+		textures.touch(textureIds[1]);
+		mathLib::Matrix identity;
+		StaticMeshConstants constants = { identity, vp };
+		uint32_t offset = queue.pushConstants(&constants, sizeof(constants));
+		for (size_t c = 0; c < chunks.size(); c++) {
+			if (visible && (c >= visible->size || !visible->test(c))) continue;
+			int lod = lods ? lods->select(&lodErrors[c * TerrainLevels], TerrainLevels, bounds[c]) : 0;
+			DrawPacket& packet = packets[c];
+			packet.mesh = chunks[c].drawHandle(backend, lod);
+			packet.constantOffset = offset;
+			packet.constantSize = sizeof(constants);
+			packet.depth = drawDepth(vp, mathLib::Matrix::translation((bounds[c].min + bounds[c].max) * 0.5f));
+			queue.submit(packet);
+		}
 	}
+
+private:
+	std::vector<DrawPacket> packets;   // per chunk, the mesh set to its level
+	TextureId textureIds[2] = { InvalidTextureId, InvalidTextureId };
+	uint64_t packetGeneration = 0;
 };
 
 class cube {
@@ -272,20 +356,37 @@ public:
 		}
 	}
 
-	// ask the GPU to draw a cube
-	void draw(DxCore* core, Shader* shader, textureManager textures, sampler sam, mathLib::Matrix& worldMatrix, mathLib::Matrix& vp) {
-		shader->updateConstantVS("staticMeshBuffer", "W", &worldMatrix);
-		shader->updateConstantVS("staticMeshBuffer", "VP", &vp);
-		shader->apply(core);
-		shader->updateTexturePS(core, "tex", textures.find("Textures/Bricks097_1K-PNG_Color.png"), sam.state);
-		shader->updateTexturePS(core, "normalMap", textures.find("Textures/Bricks097_1K-PNG_NormalDX.png"), sam.state);
-		mesh.draw(core);
+	// queue a draw of the cube
+	void record(RenderQueue& queue, DxRenderBackend& backend, Shader* shader, textureManager& textures, sampler& sam, mathLib::Matrix& worldMatrix, mathLib::Matrix& vp) {
+		if (packet.mesh == InvalidRenderHandle || packetGeneration != textures.generation()) {
+			packet.shader = backend.addShader(shader);
+			packet.mesh = mesh.drawHandle(backend);
+			packet.textures[0] = backend.addTexture(textures.find("Textures/Bricks097_1K-PNG_Color.png"));
+			packet.textures[1] = backend.addTexture(textures.find("Textures/Bricks097_1K-PNG_NormalDX.png"));
+			packet.sampler = backend.addSampler(sam.state);
+			textureIds[0] = textures.id("Textures/Bricks097_1K-PNG_Color.png");
+			textureIds[1] = textures.id("Textures/Bricks097_1K-PNG_NormalDX.png");
+			packetGeneration = textures.generation();
+		}
+		textures.touch(textureIds[0]);
+		textures.touch(textureIds[1]);
+		StaticMeshConstants constants = { worldMatrix, vp };
+		packet.constantOffset = queue.pushConstants(&constants, sizeof(constants));
+		packet.constantSize = sizeof(constants);
+		packet.depth = drawDepth(vp, worldMatrix);
+		queue.submit(packet);
 	}
+
+private:
+	DrawPacket packet;
+	TextureId textureIds[2] = { InvalidTextureId, InvalidTextureId };
+	uint64_t packetGeneration = 0;
 };
 
 class Pool {
 public:
 	std::vector<cube> cubes; // cubes
+	std::vector<AABB> bounds; // world bounds of each cube, for culling
 	mathLib::Vec3 poolSize;  // pool size
 	float cubeSize;          // single cube size
 
@@ -300,9 +401,11 @@ public:
 		generateWall(core, mathLib::Vec3(-poolSize.x / 2.0f, 1.0f, -poolSize.z / 2.0f), false);  // backward
 	}
 
-	void draw(DxCore* core, Shader* shader, textureManager textures, sampler sam, mathLib::Matrix& vp) {
-		for (auto& c : cubes) {
-			c.draw(core, shader, textures, sam, c.worldMatrix, vp);
+	// visible: skip cubes whose bit is clear, nullptr draws everything
+	void record(RenderQueue& queue, DxRenderBackend& backend, Shader* shader, textureManager& textures, sampler& sam, mathLib::Matrix& vp, const VisibilitySet* visible = nullptr) {
+		for (size_t i = 0; i < cubes.size(); i++) {
+			if (visible && !visible->test(i)) continue;
+			cubes[i].record(queue, backend, shader, textures, sam, cubes[i].worldMatrix, vp);
 		}
 	}
 
@@ -321,6 +424,7 @@ private:
 			mathLib::Matrix translation = mathLib::Matrix::translation(startPos + offset);
 			c.updateBoundingBox(translation);
 			c.worldMatrix = translation;
+			bounds.push_back(c.boundingBox);
 			cubes.push_back(c);
 		}
 	}
@@ -428,7 +532,7 @@ public:
 	}
 
 	// ask the GPU to draw a plane
-	void draw(DxCore* core, Shader* shader, textureManager textures, sampler sam, mathLib::Matrix worldMatrix, mathLib::Matrix vp) {
+	void draw(DxCore* core, Shader* shader, textureManager& textures, sampler& sam, mathLib::Matrix& worldMatrix, mathLib::Matrix& vp) {
 		shader->updateConstantVS("staticMeshBuffer", "W", &worldMatrix);
 		shader->updateConstantVS("staticMeshBuffer", "VP", &vp);
 		shader->apply(core);
@@ -444,11 +548,23 @@ public:
 	std::vector<Mesh> meshes;
 	std::vector<std::string> textureFilenames;
 	std::vector<std::string> textureNormalFilenames;
+	AABB bounds; // model space
+	VertexFormat vertexFormat = VertexFormat::Full; // of the GPU meshes, set before init
+	std::vector<float> lodErrors;   // per level, the largest of its meshes'; one entry without LODs
 
 	void init(std::string filename, DxCore* core) {
-		GEMLoader::GEMModelLoader loader;
-		std::vector<GEMLoader::GEMMesh> gemmeshes;
-		loader.load(filename, gemmeshes);
+		PROFILE_SCOPE("asset load: model");
+		ModelAsset asset;
+		asset.load(filename);
+		init(core, asset);
+	}
+
+	// GPU meshes from a model already in memory, e.g. a streamed ModelAsset. Its LOD
+	// chains (prepareLods) go into the meshes' index buffers, its meshlets
+	// (buildMeshlets) let level 0 draw only the clusters in view.
+	void init(DxCore* core, ModelAsset& asset) {
+		std::vector<GEMLoader::GEMMesh>& gemmeshes = asset.meshes;
+		const std::vector<LodChain>* lods = &asset.lods;
 		for (int i = 0; i < gemmeshes.size(); i++) {
 			Mesh mesh;
 			std::vector<STATIC_VERTEX> vertices;
@@ -456,80 +572,179 @@ public:
 				STATIC_VERTEX v;
 				memcpy(&v, &gemmeshes[i].verticesStatic[j], sizeof(STATIC_VERTEX));
 				vertices.push_back(v);
+				bounds.extend(v.pos);
 			}
 
 			textureFilenames.push_back(gemmeshes[i].material.find("diffuse").getValue());
 			textureNormalFilenames.push_back(gemmeshes[i].material.find("normals").getValue());
-			mesh.init(core, vertices, gemmeshes[i].indices);
+			if (i < lods->size())
+				mesh.init(core, vertices, (*lods)[i], vertexFormat);
+			else
+				mesh.init(core, vertices, gemmeshes[i].indices, vertexFormat);
+			if (i < asset.meshlets.size())
+				mesh.meshlets = asset.meshlets[i];
 			meshes.push_back(mesh);
 		}
+		lodErrors.assign(1, 0.0f);
+		for (auto& mesh : meshes)
+			for (size_t level = 1; level < mesh.lods.size(); level++) {
+				if (level >= lodErrors.size()) lodErrors.push_back(0.0f);
+				if (mesh.lods[level].error > lodErrors[level]) lodErrors[level] = mesh.lods[level].error;
+			}
 	}
 
-	void draw(DxCore* core, Shader* shader, textureManager textures, sampler sam, mathLib::Matrix worldMatrix, mathLib::Matrix& vp) {
-		shader->updateConstantVS("staticMeshBuffer", "W", &worldMatrix);
-		shader->updateConstantVS("staticMeshBuffer", "VP", &vp);
-		shader->apply(core);
-		for (int i = 0; i < meshes.size(); i++)
-		{
-			shader->updateTexturePS(core, "tex", textures.find(textureFilenames[i]), sam.state);
-			shader->updateTexturePS(core, "normalMap", textures.find(textureNormalFilenames[i]), sam.state);
-			meshes[i].draw(core);
+	int lodCount() const { return lodErrors.empty() ? 1 : (int)lodErrors.size(); }
+
+	// around the records of a frame that pass a cluster culler, see Mesh::beginClusters
+	void beginClusters(DxRenderBackend& backend, size_t instances, FrameArena& memory) {
+		for (auto& mesh : meshes)
+			if (!mesh.meshlets.empty()) mesh.beginClusters(backend, instances, memory);
+	}
+
+	void endClusters() {
+		for (auto& mesh : meshes)
+			if (!mesh.meshlets.empty()) mesh.endClusters();
+	}
+
+	// one packet per mesh, all sharing one constant block. lod: the level to draw, a mesh
+	// with fewer levels draws its last. At level 0 with clusters, meshes with meshlets
+	// only draw the clusters in view; cones are culled for closed meshes only
+	void record(RenderQueue& queue, DxRenderBackend& backend, Shader* shader, textureManager& textures, sampler& sam, mathLib::Matrix& worldMatrix, mathLib::Matrix& vp,
+		int lod = 0, ClusterCuller* clusters = nullptr) {
+		if (packets.empty() || packetGeneration != textures.generation()) {
+			packets.clear();
+			textureIds.clear();
+			packetGeneration = textures.generation();
+			for (int level = 0; level < lodCount(); level++)
+				for (int i = 0; i < meshes.size(); i++) {
+					DrawPacket packet;
+					packet.shader = backend.addShader(shader);
+					packet.mesh = meshes[i].drawHandle(backend, level);
+					packet.textures[0] = backend.addTexture(textures.find(textureFilenames[i]));
+					packet.textures[1] = backend.addTexture(textures.find(textureNormalFilenames[i]));
+					packet.sampler = backend.addSampler(sam.state);
+					packets.push_back(packet);
+				}
+			for (int i = 0; i < meshes.size(); i++) {
+				textureIds.push_back(textures.id(textureFilenames[i].c_str()));
+				textureIds.push_back(textures.id(textureNormalFilenames[i].c_str()));
+			}
+		}
+		for (TextureId id : textureIds)
+			textures.touch(id);
+		if (lod < 0) lod = 0;
+		if (lod >= lodCount()) lod = lodCount() - 1;
+		StaticMeshConstants constants = { worldMatrix, vp };
+		uint32_t offset = queue.pushConstants(&constants, sizeof(constants));
+		float depth = drawDepth(vp, worldMatrix);
+		for (size_t i = 0; i < meshes.size(); i++) {
+			DrawPacket& packet = packets[lod * meshes.size() + i];
+			packet.constantOffset = offset;
+			packet.constantSize = sizeof(constants);
+			packet.depth = depth;
+			if (lod == 0 && clusters && !meshes[i].meshlets.empty()) {
+				DrawPacket culled = packet;
+				if (meshes[i].addClusters(*clusters, worldMatrix, culled, meshes[i].meshlets.closed))
+					queue.submit(culled);
+				continue;
+			}
+			queue.submit(packet);
 		}
 	}
+
+private:
+	std::vector<DrawPacket> packets;       // per level, one per mesh
+	std::vector<TextureId> textureIds;     // what the packets hold, touched every frame
+	uint64_t packetGeneration = 0;
 };
 
+// One model scattered by a FoliageLayer: the instances live in the field's chunks, the
+// draw walks the chunks that passed culling and picks a level per instance.
 class forest {
 public:
-	std::vector<mathLib::Matrix> transforms; // Transformation matrix for each tree
+	FoliageField foliage;
 	model tree; // single tree
 
-	void init(const std::string& modelFilename, DxCore* dx, int treeCount) {
+	void init(const std::string& modelFilename, DxCore* dx, const FoliageLayer& layer, JobSystem* jobs = nullptr) {
 		tree.init(modelFilename, dx);
-
-		// Randomized Spanning Tree Transformations
-		for (int i = 0; i < treeCount; ++i) {
-			float x = randFloat(-50.0f, 50.0f); // random x
-			float z = randFloat(-50.0f, 50.0f); // random z
-			float y = 0.0f;                     // fixed y
-
-			float scale = randFloat(0.01f, 0.03f); // random scaling
-			float rotation = randFloat(0.0f, 360.0f); // random rotation
-
-			mathLib::Matrix worldMatrix =
-				mathLib::Matrix::scaling(mathLib::Vec3(scale, scale, scale)) *
-				mathLib::Matrix::rotateY(rotation) *
-				mathLib::Matrix::translation(mathLib::Vec3(x, y, z));
-
-			transforms.push_back(worldMatrix);
+		foliage.generate(layer, jobs);
+		foliage.setBounds(tree.bounds, jobs);
+	}
+
+	// Places the instances now and loads the model on the streamer. Until it is in, the
+	// chunk bounds are empty and nothing is drawn. The load callback fills the bounds and
+	// queues the model's textures on the thread that runs streamer.update(), then
+	// onLoaded runs there; the meshes are created on the device thread, the only one
+	// that touches tree.
+	AssetHandle stream(AssetStreamer& streamer, JobSystem& jobs, textureManager& textures, DxCore* dx, const std::string& modelFilename,
+		const FoliageLayer& layer, float priority, std::function<void()> onLoaded = nullptr) {
+		foliage.generate(layer, &jobs);
+		return streamer.request<ModelAsset>(modelFilename, priority,
+			[modelFilename](const std::vector<unsigned char>& file, ModelAsset& asset) {
+				if (!asset.decode(file)) return (size_t)0;
+				asset.prepareLods(modelFilename);
+				asset.buildMeshlets();
+				return asset.sizeInBytes();
+			},
+			[this, &streamer, &jobs, &textures, dx, priority, onLoaded](ModelAsset& asset) {
+				foliage.setBounds(asset.bounds, &jobs);
+				for (auto& mesh : asset.meshes) {
+					textures.stream(streamer, jobs, dx, "Resources/" + mesh.material.find("diffuse").getValue(), priority);
+					textures.stream(streamer, jobs, dx, "Resources/" + mesh.material.find("normals").getValue(), priority, true);
+				}
+				std::shared_ptr<ModelAsset> decoded = std::make_shared<ModelAsset>(std::move(asset));
+				jobs.runOnMainThread([this, dx, decoded] { tree.init(dx, *decoded); });
+				if (onLoaded) onLoaded();
+			});
+	}
+
+	// to the nearest chunk with instances, the streaming priority
+	float distanceTo(const mathLib::Vec3& point) const { return foliage.distanceTo(point); }
+
+	// visibleChunks: skip chunks whose bit is clear, nullptr draws everything. lods picks
+	// each instance's level from its bounds, nullptr draws level 0. clusters culls the
+	// meshlets of the instances drawn at level 0, their index lists go into memory (the
+	// frame's arena, needed with clusters)
+	void record(RenderQueue& queue, DxRenderBackend& backend, textureManager& textures, Shader* shader, sampler& sam, mathLib::Matrix& vp,
+		const VisibilitySet* visibleChunks = nullptr, const LodSelector* lods = nullptr, ClusterCuller* clusters = nullptr, FrameArena* memory = nullptr) {
+		if (tree.meshes.empty()) return;
+		auto drawn = [&](size_t c) { return !visibleChunks || (c < visibleChunks->size && visibleChunks->test(c)); };
+		if (clusters) {
+			size_t instances = 0;
+			for (size_t c = 0; c < foliage.chunks.size(); c++)
+				if (drawn(c)) instances += foliage.chunks[c].worlds.size();
+			tree.beginClusters(backend, instances, *memory);
 		}
+		for (size_t c = 0; c < foliage.chunks.size(); c++) {
+			if (!drawn(c)) continue;
+			FoliageChunk& chunk = foliage.chunks[c];
+			for (size_t i = 0; i < chunk.worlds.size(); i++) {
+				int lod = lods && i < chunk.instanceBounds.size() ? lods->select(tree.lodErrors.data(), tree.lodCount(), chunk.instanceBounds[i]) : 0;
+				tree.record(queue, backend, shader, textures, sam, chunk.worlds[i], vp, lod, clusters);
+			}
+		}
+		if (clusters) tree.endClusters();
 	}
 
-	void draw(DxCore* dx, textureManager& textures, Shader* shader, sampler& sam, mathLib::Matrix& vp) {
-		for (auto& transform : transforms)
-			tree.draw(dx, shader, textures, sam, transform, vp);
-	}
-
-private:
-	float randFloat(float min, float max) {
-		return min + static_cast<float>(rand()) / (static_cast<float>(RAND_MAX / (max - min)));
-	}
+	size_t treeCount() const { return foliage.instanceCount(); }
 };
 
-class animatedModel {
+class animatedModel : public AnimatedRig {
 public:
 	std::vector<Mesh> meshes;
-	Animation animation;
-	AnimationInstance instance;
 	std::vector<std::string> textureFilenames;
 	std::vector<std::string> textureNormalFilenames;
-	AABB bounds;
-
+	VertexFormat vertexFormat = VertexFormat::Full; // of the GPU meshes, set before init
 
 	void init(std::string filename, DxCore* core) {
-		GEMLoader::GEMModelLoader loader;
-		std::vector<GEMLoader::GEMMesh> gemmeshes;
-		GEMLoader::GEMAnimation gemanimation;
-		loader.load(filename, gemmeshes, gemanimation);
+		PROFILE_SCOPE("asset load: animated model");
+		ModelAsset asset;
+		asset.load(filename);
+		init(core, asset.meshes, asset.animation);
+	}
+
+	// from a model already in memory, e.g. a streamed ModelAsset
+	void init(DxCore* core, std::vector<GEMLoader::GEMMesh>& gemmeshes, GEMLoader::GEMAnimation& gemanimation) {
 		for (int i = 0; i < gemmeshes.size(); i++) {
 			Mesh mesh;
 			std::vector<ANIMATED_VERTEX> vertices;
@@ -542,89 +757,55 @@ public:
 			// Load texture with filename: gemmeshes[i].material.find("diffuse").getValue()
 			textureFilenames.push_back(gemmeshes[i].material.find("diffuse").getValue());
 			textureNormalFilenames.push_back(gemmeshes[i].material.find("normals").getValue());
-			mesh.init(core, vertices, gemmeshes[i].indices);
+			mesh.init(core, vertices, gemmeshes[i].indices, vertexFormat);
 			meshes.push_back(mesh);
 		}
 
-		// init Bones
-		for (int i = 0; i < gemanimation.bones.size(); i++)
-		{
-			Bone bone;
-			bone.name = gemanimation.bones[i].name;
-			memcpy(&bone.offset, &gemanimation.bones[i].offset, 16 * sizeof(float));
-			bone.parentIndex = gemanimation.bones[i].parentIndex;
-			animation.skeleton.bones.push_back(bone);
-		}
-
-		// animation copy data
-		for (int i = 0; i < gemanimation.animations.size(); i++)
-		{
-			std::string name = gemanimation.animations[i].name;
-			AnimationSequence aseq;
-			aseq.ticksPerSecond = gemanimation.animations[i].ticksPerSecond;
-			for (int n = 0; n < gemanimation.animations[i].frames.size(); n++)
-			{
-				AnimationFrame frame;
-				for (int index = 0; index < gemanimation.animations[i].frames[n].positions.size(); index++)
-				{
-					mathLib::Vec3 p;
-					mathLib::Quaternion q;
-					mathLib::Vec3 s;
-					memcpy(&p, &gemanimation.animations[i].frames[n].positions[index], sizeof(mathLib::Vec3));
-					frame.positions.push_back(p);
-					memcpy(&q, &gemanimation.animations[i].frames[n].rotations[index], sizeof(mathLib::Quaternion));
-					frame.rotations.push_back(q);
-					memcpy(&s, &gemanimation.animations[i].frames[n].scales[index], sizeof(mathLib::Vec3));
-					frame.scales.push_back(s);
-				}
-				aseq.frames.push_back(frame);
+		// skeleton, animations and bounds
+		initRig(gemmeshes, gemanimation);
+	}
+
+	// one packet per mesh, all sharing W, VP and the bone palette. bones replaces
+	// instance.matrices, e.g. with the palette of a render snapshot
+	void record(RenderQueue& queue, DxRenderBackend& backend, Shader* shader, textureManager& textures, sampler& sam, mathLib::Matrix& worldMatrix, mathLib::Matrix& vp,
+		const mathLib::Matrix* bones = nullptr) {
+		if (packets.empty() || packetGeneration != textures.generation()) {
+			packets.clear();
+			textureIds.clear();
+			packetGeneration = textures.generation();
+			for (int i = 0; i < meshes.size(); i++) {
+				DrawPacket packet;
+				packet.shader = backend.addShader(shader);
+				packet.mesh = meshes[i].drawHandle(backend);
+				packet.textures[0] = backend.addTexture(textures.find(textureFilenames[i]));
+				packet.textures[1] = backend.addTexture(textures.find(textureNormalFilenames[i]));
+				packet.sampler = backend.addSampler(sam.state);
+				packets.push_back(packet);
+				textureIds.push_back(textures.id(textureFilenames[i].c_str()));
+				textureIds.push_back(textures.id(textureNormalFilenames[i].c_str()));
 			}
-			animation.animations.insert({ name, aseq });
 		}
-
-		instance.animation = &animation;
-		calculateBoundingBox();
-	}
-
-	void calculateBoundingBox() {
-		if (meshes.empty()) return;
-
-		mathLib::Vec3 minPos(FLT_MAX, FLT_MAX, FLT_MAX);
-		mathLib::Vec3 maxPos(-FLT_MAX, -FLT_MAX, -FLT_MAX);
-
-		for (const auto& mesh : meshes) {
-			std::vector<ANIMATED_VERTEX> vertices;
-			for (const auto& vertex : mesh.animatedVertices) {
-				const mathLib::Vec3& pos = vertex.pos;
-
-				if (pos.x < minPos.x) minPos.x = pos.x;
-				if (pos.y < minPos.y) minPos.y = pos.y;
-				if (pos.z < minPos.z) minPos.z = pos.z;
-
-				if (pos.x > maxPos.x) maxPos.x = pos.x;
-				if (pos.y > maxPos.y) maxPos.y = pos.y;
-				if (pos.z > maxPos.z) maxPos.z = pos.z;
-			}
+		for (TextureId id : textureIds)
+			textures.touch(id);
+		uint32_t size = sizeof(mathLib::Matrix) * 2 + sizeof(instance.matrices);
+		uint32_t offset;
+		unsigned char* constants = queue.allocConstants(size, offset);
+		memcpy(constants, &worldMatrix, sizeof(mathLib::Matrix));
+		memcpy(constants + sizeof(mathLib::Matrix), &vp, sizeof(mathLib::Matrix));
+		memcpy(constants + sizeof(mathLib::Matrix) * 2, bones ? bones : instance.matrices, sizeof(instance.matrices));
+		float depth = drawDepth(vp, worldMatrix);
+		for (auto& packet : packets) {
+			packet.constantOffset = offset;
+			packet.constantSize = size;
+			packet.depth = depth;
+			queue.submit(packet);
 		}
-
-		bounds.min = minPos;
-		bounds.max = maxPos;
 	}
 
-	void draw(DxCore* core, Shader* shader, textureManager textures, sampler sam, mathLib::Matrix& worldMatrix, mathLib::Matrix& vp) {
-		shader->updateConstantVS("animatedMeshBuffer", "W", &worldMatrix);
-		shader->updateConstantVS("animatedMeshBuffer", "VP", &vp);
-		shader->updateConstantVS("animatedMeshBuffer", "bones", &(this->instance.matrices));
-		shader->apply(core);
-		for (int i = 0; i < meshes.size(); i++)
-		{
-			shader->updateTexturePS(core, "tex", textures.find(textureFilenames[i]), sam.state);
-			shader->updateTexturePS(core, "normalMap", textures.find(textureNormalFilenames[i]), sam.state);
-			meshes[i].draw(core);
-		}
-
-		//core->lightingPassInit();
-	}
+private:
+	std::vector<DrawPacket> packets;
+	std::vector<TextureId> textureIds;     // what the packets hold, touched every frame
+	uint64_t packetGeneration = 0;
 };
 
 class SkyDome {
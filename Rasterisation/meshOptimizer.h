@@ -0,0 +1,314 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "mathLib.h"
+
+// Reorders index and vertex buffers for the GPU, the way the .gem exporter does not:
+// duplicate vertices merged, triangles for the post-transform vertex cache, then
+// clusters of them so the outside of a mesh draws first (less overdraw), then vertices
+// in the order the indices fetch them. No D3D in here, ModelAsset runs it when a
+// model is decoded.
+
+struct VertexCacheStats {
+	float acmr = 0.0f;      // vertex shader runs per triangle: 3 is no reuse, ~0.6 is a good grid
+	float atvr = 0.0f;      // runs per vertex used: 1 is every vertex transformed once
+};
+
+struct MeshOptimizerStats {
+	VertexCacheStats before;
+	VertexCacheStats after;
+	size_t vertices = 0;            // after, unused vertices are dropped
+	size_t triangles = 0;
+	size_t clusters = 0;            // the overdraw pass sorted this many
+	bool overdrawSorted = false;    // false when sorting would have cost too much cache
+};
+
+// FIFO cache of cacheSize entries, close enough to how GPUs behave to compare orders
+static VertexCacheStats analyzeVertexCache(const std::vector<unsigned int>& indices, size_t vertexCount, int cacheSize = 16) {
+	VertexCacheStats stats;
+	if (indices.empty()) return stats;
+	// a vertex is cached while fewer than cacheSize misses happened since it was loaded
+	std::vector<uint32_t> loadedAt(vertexCount, 0);
+	std::vector<bool> used(vertexCount, false);
+	uint32_t misses = 0;
+	size_t unique = 0;
+	for (unsigned int v : indices) {
+		if (!used[v]) {
+			used[v] = true;
+			unique++;
+		}
+		if (loadedAt[v] == 0 || misses - loadedAt[v] >= (uint32_t)cacheSize) {
+			misses++;
+			loadedAt[v] = misses;
+		}
+	}
+	stats.acmr = (float)misses / (indices.size() / 3);
+	stats.atvr = unique ? (float)misses / unique : 0.0f;
+	return stats;
+}
+
+// Tom Forsyth's linear-speed vertex cache optimisation. Triangles are emitted greedily
+// by score: a vertex scores for sitting near the front of a simulated LRU cache and
+// for having few triangles left, so the order does not strand lone triangles. Only the
+// triangles of vertices in the cache are rescored after each step.
+static void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount) {
+	const int cacheSize = 32;
+	size_t triangleCount = indices.size() / 3;
+	if (triangleCount == 0) return;
+
+	auto vertexScore = [](int cachePosition, int remaining) {
+		if (remaining == 0) return -1.0f;
+		float score = 0.0f;
+		if (cachePosition >= 0) {
+			// the last triangle's vertices score the same, it does not matter which goes first
+			if (cachePosition < 3)
+				score = 0.75f;
+			else
+				score = powf(1.0f - (float)(cachePosition - 3) / (cacheSize - 3), 1.5f);
+		}
+		return score + 2.0f / sqrtf((float)remaining);
+	};
+
+	// triangles of each vertex, packed
+	std::vector<unsigned int> remaining(vertexCount, 0);
+	for (unsigned int v : indices)
+		remaining[v]++;
+	std::vector<unsigned int> offsets(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++)
+		offsets[v + 1] = offsets[v] + remaining[v];
+	std::vector<unsigned int> adjacency(indices.size());
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t t = 0; t < triangleCount; t++)
+		for (int k = 0; k < 3; k++)
+			adjacency[fill[indices[t * 3 + k]]++] = (unsigned int)t;
+
+	std::vector<int> cachePosition(vertexCount, -1);
+	std::vector<float> score(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++)
+		score[v] = vertexScore(-1, remaining[v]);
+	std::vector<bool> emitted(triangleCount, false);
+
+	std::vector<unsigned int> cache;
+	std::vector<unsigned int> nextCache;
+	cache.reserve(cacheSize + 3);
+	nextCache.reserve(cacheSize + 3);
+	std::vector<unsigned int> result;
+	result.reserve(indices.size());
+
+	size_t cursor = 0;          // for restarts: first triangle that may not be emitted yet
+	int best = -1;
+	while (result.size() < indices.size()) {
+		if (best < 0) {
+			// nothing in the cache has triangles left, carry on in input order
+			while (emitted[cursor]) cursor++;
+			best = (int)cursor;
+		}
+		unsigned int tri[3] = { indices[best * 3], indices[best * 3 + 1], indices[best * 3 + 2] };
+		emitted[best] = true;
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = tri[k];
+			result.push_back(v);
+			// take the triangle off the vertex's list
+			unsigned int* begin = &adjacency[offsets[v]];
+			unsigned int* end = begin + remaining[v];
+			*std::find(begin, end, (unsigned int)best) = *(end - 1);
+			remaining[v]--;
+		}
+
+		// the triangle's vertices go to the front, the rest move back, the last three fall out
+		nextCache.assign(tri, tri + 3);
+		for (unsigned int v : cache)
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				nextCache.push_back(v);
+		for (size_t i = cacheSize; i < nextCache.size(); i++) {
+			cachePosition[nextCache[i]] = -1;
+			score[nextCache[i]] = vertexScore(-1, remaining[nextCache[i]]);
+		}
+		if (nextCache.size() > (size_t)cacheSize)
+			nextCache.resize(cacheSize);
+		cache.swap(nextCache);
+		for (size_t i = 0; i < cache.size(); i++) {
+			cachePosition[cache[i]] = (int)i;
+			score[cache[i]] = vertexScore((int)i, remaining[cache[i]]);
+		}
+
+		// rescore what the cached vertices still touch and take the best of it
+		best = -1;
+		float bestScore = -1.0f;
+		for (unsigned int v : cache) {
+			for (unsigned int i = 0; i < remaining[v]; i++) {
+				unsigned int t = adjacency[offsets[v] + i];
+				float s = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+				if (s > bestScore) {
+					bestScore = s;
+					best = (int)t;
+				}
+			}
+		}
+	}
+	indices.swap(result);
+}
+
+// Overdraw after Sander, Nehab and Barczak (2007): the cache-ordered list is cut into
+// clusters where the simulated cache starts over (a triangle with three misses), so
+// moving whole clusters costs little reuse. Clusters facing away from the mesh centre
+// go first, they tend to hide the rest. The new order is kept only if ACMR grows by
+// less than threshold. position(vertex) and normal(vertex) give the model space
+// attributes; the vertex normals say which way a cluster faces whatever the winding.
+template<typename V, typename Position, typename Normal>
+static bool optimizeOverdraw(std::vector<unsigned int>& indices, const std::vector<V>& vertices, Position position, Normal normal, float threshold,
+	size_t& clusterCount) {
+	size_t triangleCount = indices.size() / 3;
+	clusterCount = 0;
+	if (triangleCount < 2) return false;
+	const int cacheSize = 16;
+
+	std::vector<size_t> clusterStart;
+	std::vector<uint32_t> loadedAt(vertices.size(), 0);
+	uint32_t misses = 0;
+	for (size_t t = 0; t < triangleCount; t++) {
+		int triangleMisses = 0;
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = indices[t * 3 + k];
+			if (loadedAt[v] == 0 || misses - loadedAt[v] >= (uint32_t)cacheSize) {
+				misses++;
+				loadedAt[v] = misses;
+				triangleMisses++;
+			}
+		}
+		if (t == 0 || triangleMisses == 3)
+			clusterStart.push_back(t);
+	}
+	clusterCount = clusterStart.size();
+	if (clusterCount < 2) return false;
+	clusterStart.push_back(triangleCount);
+
+	// area weighted centroid and normal of each cluster
+	struct Cluster {
+		size_t first;
+		size_t count;
+		mathLib::Vec3 centroid;
+		mathLib::Vec3 normal;
+		float area;
+		float key;
+	};
+	std::vector<Cluster> clusters(clusterCount);
+	mathLib::Vec3 meshCentroid(0.0f, 0.0f, 0.0f);
+	float meshArea = 0.0f;
+	for (size_t c = 0; c < clusterCount; c++) {
+		Cluster& cluster = clusters[c];
+		cluster.first = clusterStart[c];
+		cluster.count = clusterStart[c + 1] - clusterStart[c];
+		cluster.centroid = mathLib::Vec3(0.0f, 0.0f, 0.0f);
+		cluster.normal = mathLib::Vec3(0.0f, 0.0f, 0.0f);
+		cluster.area = 0.0f;
+		for (size_t t = cluster.first; t < cluster.first + cluster.count; t++) {
+			const V& va = vertices[indices[t * 3]];
+			const V& vb = vertices[indices[t * 3 + 1]];
+			const V& vc = vertices[indices[t * 3 + 2]];
+			mathLib::Vec3 a = position(va);
+			mathLib::Vec3 ab = position(vb) - a;
+			mathLib::Vec3 ac = position(vc) - a;
+			float area = ab.cross(ac).getLength() * 0.5f;
+			cluster.normal += (normal(va) + normal(vb) + normal(vc)) * area;
+			cluster.centroid += (a + position(vb) + position(vc)) * (area / 3.0f);
+			cluster.area += area;
+		}
+		if (cluster.area > 0.0f)
+			cluster.centroid /= cluster.area;
+		meshCentroid += cluster.centroid * cluster.area;
+		meshArea += cluster.area;
+	}
+	if (meshArea > 0.0f)
+		meshCentroid /= meshArea;
+	for (auto& cluster : clusters) {
+		float length = cluster.normal.getLength();
+		mathLib::Vec3 facing = length > 0.0f ? cluster.normal / length : cluster.normal;
+		mathLib::Vec3 offset = cluster.centroid - meshCentroid;
+		cluster.key = offset.x * facing.x + offset.y * facing.y + offset.z * facing.z;
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.key > b.key; });
+
+	std::vector<unsigned int> sorted;
+	sorted.reserve(indices.size());
+	for (auto& cluster : clusters)
+		sorted.insert(sorted.end(), indices.begin() + cluster.first * 3, indices.begin() + (cluster.first + cluster.count) * 3);
+	float before = analyzeVertexCache(indices, vertices.size()).acmr;
+	float after = analyzeVertexCache(sorted, vertices.size()).acmr;
+	if (after > before * threshold)
+		return false;
+	indices.swap(sorted);
+	return true;
+}
+
+// Merges vertices that are byte for byte the same, some exporters write every triangle
+// its own three (ACMR 3 whatever the order). Open addressing on an FNV-1a hash.
+template<typename V>
+static void weldVertices(std::vector<V>& vertices, std::vector<unsigned int>& indices) {
+	const unsigned int empty = 0xffffffff;
+	size_t tableSize = 1;
+	while (tableSize < vertices.size() * 2) tableSize <<= 1;
+	std::vector<unsigned int> table(tableSize, empty);
+	std::vector<unsigned int> remap(vertices.size());
+	std::vector<V> unique;
+	unique.reserve(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++) {
+		const unsigned char* bytes = (const unsigned char*)&vertices[i];
+		uint32_t h = 2166136261u;
+		for (size_t b = 0; b < sizeof(V); b++)
+			h = (h ^ bytes[b]) * 16777619u;
+		size_t slot = h & (tableSize - 1);
+		while (table[slot] != empty && memcmp(&unique[table[slot]], &vertices[i], sizeof(V)) != 0)
+			slot = (slot + 1) & (tableSize - 1);
+		if (table[slot] == empty) {
+			table[slot] = (unsigned int)unique.size();
+			unique.push_back(vertices[i]);
+		}
+		remap[i] = table[slot];
+	}
+	for (unsigned int& index : indices)
+		index = remap[index];
+	vertices.swap(unique);
+}
+
+// Renumbers the vertices in the order the indices first use them, so vertex fetches
+// walk forward through memory. Vertices no index uses are dropped.
+template<typename V>
+static void optimizeVertexFetch(std::vector<V>& vertices, std::vector<unsigned int>& indices) {
+	const unsigned int unused = 0xffffffff;
+	std::vector<unsigned int> remap(vertices.size(), unused);
+	std::vector<V> reordered;
+	reordered.reserve(vertices.size());
+	for (unsigned int& index : indices) {
+		if (remap[index] == unused) {
+			remap[index] = (unsigned int)reordered.size();
+			reordered.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+	vertices.swap(reordered);
+}
+
+// the passes in the order they depend on each other
+template<typename V, typename Position, typename Normal>
+static MeshOptimizerStats optimizeMesh(std::vector<V>& vertices, std::vector<unsigned int>& indices, Position position, Normal normal,
+	float overdrawThreshold = 1.05f) {
+	MeshOptimizerStats stats;
+	stats.triangles = indices.size() / 3;
+	stats.before = analyzeVertexCache(indices, vertices.size());
+	weldVertices(vertices, indices);
+	optimizeVertexCache(indices, vertices.size());
+	stats.overdrawSorted = optimizeOverdraw(indices, vertices, position, normal, overdrawThreshold, stats.clusters);
+	optimizeVertexFetch(vertices, indices);
+	stats.vertices = vertices.size();
+	stats.after = analyzeVertexCache(indices, vertices.size());
+	return stats;
+}
+
+// 16-bit index buffers halve the index fetch, every index has to fit
+static bool fitsIndex16(size_t vertexCount) {
+	return vertexCount <= 65536;
+}
@@ -0,0 +1,413 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "mathLib.h"
+#include "collision.h"
+#include "meshOptimizer.h"
+
+// Level of detail by edge collapse with quadric error metrics (Garland and Heckbert).
+// The simplified meshes are index lists over the original vertices, so every level
+// of a mesh shares one vertex buffer and only the index range differs.
+//
+// Collapses work on positions: every vertex on a position (one per side of a UV or
+// normal seam) moves to a vertex on the neighbour position it shares an edge with,
+// and if one of them has none the collapse would tear the seam and is not made. The
+// cost is the position's plane quadric at the neighbour plus how far the UVs and
+// normals move. Open border positions only collapse along the border; border and
+// seam edges add planes at right angles to their faces, which keeps outlines and
+// seams in place. Corners and non-manifold positions stay.
+// Errors are distances relative to the mesh's largest extent.
+
+struct SimplifyVertex {
+	mathLib::Vec3 position;
+	mathLib::Vec3 normal;
+	float u = 0.0f;
+	float v = 0.0f;
+};
+
+// plane distance squared summed over planes, area weighted: 4x4 symmetric matrix
+struct Quadric {
+	double a2 = 0, b2 = 0, c2 = 0, d2 = 0, ab = 0, ac = 0, ad = 0, bc = 0, bd = 0, cd = 0;
+	double w = 0;
+
+	void addPlane(double a, double b, double c, double d, double weight) {
+		a2 += a * a * weight; b2 += b * b * weight; c2 += c * c * weight; d2 += d * d * weight;
+		ab += a * b * weight; ac += a * c * weight; ad += a * d * weight;
+		bc += b * c * weight; bd += b * d * weight; cd += c * d * weight;
+		w += weight;
+	}
+
+	void add(const Quadric& q) {
+		a2 += q.a2; b2 += q.b2; c2 += q.c2; d2 += q.d2;
+		ab += q.ab; ac += q.ac; ad += q.ad; bc += q.bc; bd += q.bd; cd += q.cd;
+		w += q.w;
+	}
+
+	double error(const mathLib::Vec3& p) const {
+		double x = p.x, y = p.y, z = p.z;
+		double e = a2 * x * x + b2 * y * y + c2 * z * z + d2
+			+ 2.0 * (ab * x * y + ac * x * z + ad * x + bc * y * z + bd * y + cd * z);
+		return e > 0.0 ? e : 0.0;
+	}
+};
+
+struct SimplifySettings {
+	float uvWeight = 0.01f;          // collapse order cost per unit of squared UV distance
+	float normalWeight = 0.005f;     // and per unit of squared normal difference
+	float borderWeight = 10.0f;     // border planes against face planes
+};
+
+// Collapses edges until at most targetIndexCount indices are left or no collapse within
+// targetError is left. attributes(vertex, SimplifyVertex&) reads a vertex. Returns the
+// new indices; error gets the largest distance error of the collapses made, the
+// attribute part of the cost only decides the order.
+template<typename V, typename Attributes>
+static std::vector<unsigned int> simplifyMesh(const std::vector<V>& vertices, const std::vector<unsigned int>& sourceIndices, Attributes attributes,
+	size_t targetIndexCount, float targetError, float& error, const SimplifySettings& settings = SimplifySettings()) {
+	enum Kind : uint8_t { Interior, Border, Locked };
+	const unsigned int none = 0xffffffff;
+	size_t n = vertices.size();
+	std::vector<unsigned int> indices = sourceIndices;
+	error = 0.0f;
+	if (indices.size() <= targetIndexCount || n == 0)
+		return indices;
+
+	// positions scaled into the unit cube, so errors are relative to the mesh
+	std::vector<SimplifyVertex> v(n);
+	AABB box;
+	box.reset();
+	for (size_t i = 0; i < n; i++) {
+		attributes(vertices[i], v[i]);
+		box.extend(v[i].position);
+	}
+	mathLib::Vec3 size = box.max - box.min;
+	float extent = size.x > size.y ? (size.x > size.z ? size.x : size.z) : (size.y > size.z ? size.y : size.z);
+	float scale = extent > 0.0f ? 1.0f / extent : 1.0f;
+	for (auto& vertex : v)
+		vertex.position = (vertex.position - box.min) * scale;
+
+	// vertices on the same position share an id, and through it their quadric
+	std::vector<unsigned int> positionId(n);
+	{
+		size_t tableSize = 1;
+		while (tableSize < n * 2) tableSize <<= 1;
+		std::vector<unsigned int> table(tableSize, none);
+		for (size_t i = 0; i < n; i++) {
+			uint32_t h = 2166136261u;
+			const unsigned char* bytes = (const unsigned char*)&v[i].position;
+			for (size_t b = 0; b < sizeof(mathLib::Vec3); b++)
+				h = (h ^ bytes[b]) * 16777619u;
+			size_t slot = h & (tableSize - 1);
+			while (table[slot] != none && memcmp(&v[table[slot]].position, &v[i].position, sizeof(mathLib::Vec3)) != 0)
+				slot = (slot + 1) & (tableSize - 1);
+			if (table[slot] == none) table[slot] = (unsigned int)i;
+			positionId[i] = table[slot];
+		}
+	}
+
+	auto edgeKey = [](unsigned int a, unsigned int b) { return ((uint64_t)a << 32) | b; };
+	auto planeOf = [&](unsigned int i0, unsigned int i1, unsigned int i2, mathLib::Vec3& normal, float& area) {
+		mathLib::Vec3 e1 = v[i1].position - v[i0].position;
+		mathLib::Vec3 e2 = v[i2].position - v[i0].position;
+		normal = e1.cross(e2);
+		float length = normal.getLength();
+		area = length * 0.5f;
+		if (length > 0.0f) normal /= length;
+	};
+
+	std::vector<Quadric> quadrics(n);
+	{
+		std::vector<uint64_t> edges;
+		for (size_t t = 0; t < indices.size(); t += 3)
+			for (int k = 0; k < 3; k++)
+				edges.push_back(edgeKey(indices[t + k], indices[t + (k + 1) % 3]));
+		std::sort(edges.begin(), edges.end());
+		for (size_t t = 0; t < indices.size(); t += 3) {
+			mathLib::Vec3 normal;
+			float area;
+			planeOf(indices[t], indices[t + 1], indices[t + 2], normal, area);
+			mathLib::Vec3 p = v[indices[t]].position;
+			double d = -(normal.x * p.x + normal.y * p.y + normal.z * p.z);
+			for (int k = 0; k < 3; k++)
+				quadrics[positionId[indices[t + k]]].addPlane(normal.x, normal.y, normal.z, d, area);
+			// borders and seams: a plane through the edge, at right angles to the face
+			for (int k = 0; k < 3; k++) {
+				unsigned int a = indices[t + k];
+				unsigned int b = indices[t + (k + 1) % 3];
+				if (std::binary_search(edges.begin(), edges.end(), edgeKey(b, a))) continue;
+				mathLib::Vec3 edge = v[b].position - v[a].position;
+				float length = edge.getLength();
+				if (length == 0.0f) continue;
+				mathLib::Vec3 side = edge.cross(normal);
+				float sideLength = side.getLength();
+				if (sideLength == 0.0f) continue;
+				side /= sideLength;
+				double sd = -(side.x * v[a].position.x + side.y * v[a].position.y + side.z * v[a].position.z);
+				double weight = length * length * settings.borderWeight;
+				quadrics[positionId[a]].addPlane(side.x, side.y, side.z, sd, weight);
+				quadrics[positionId[b]].addPlane(side.x, side.y, side.z, sd, weight);
+			}
+		}
+	}
+
+	struct Collapse {
+		unsigned int from;              // position ids
+		unsigned int to;
+		float cost;                     // with the attributes, the order collapses are made in
+		float error;                    // distance only, what targetError bounds
+	};
+
+	std::vector<uint64_t> edges;
+	std::vector<unsigned int> borderCount(n), groupOffsets(n + 1), groupList, triangleOffsets(n + 1), triangleList, fill;
+	std::vector<uint8_t> kind(n), locked(n);
+	std::vector<Collapse> best(n), collapses;
+	std::vector<unsigned int> remap(n), partners;
+
+	// the vertex each vertex on from's position goes to, one on to's position it shares
+	// an edge with; false when one of them has none (the collapse would open a seam)
+	auto findPartners = [&](unsigned int from, unsigned int to, std::vector<unsigned int>& out) {
+		out.clear();
+		for (unsigned int g = groupOffsets[from]; g < groupOffsets[from + 1]; g++) {
+			unsigned int m = groupList[g];
+			unsigned int partner = none;
+			for (unsigned int i = triangleOffsets[m]; i < triangleOffsets[m + 1] && partner == none; i++) {
+				size_t t = (size_t)triangleList[i] * 3;
+				for (int k = 0; k < 3; k++)
+					if (positionId[indices[t + k]] == to) partner = indices[t + k];
+			}
+			if (partner == none) return false;
+			out.push_back(partner);
+		}
+		return true;
+	};
+	auto attributeCost = [&](unsigned int a, unsigned int b, double weight) {
+		float du = v[a].u - v[b].u;
+		float dv = v[a].v - v[b].v;
+		mathLib::Vec3 dn = v[a].normal - v[b].normal;
+		return weight * ((du * du + dv * dv) * settings.uvWeight + dn.getLengthSquare() * settings.normalWeight);
+	};
+	auto isBorderEdge = [&](unsigned int a, unsigned int b) {
+		return !std::binary_search(edges.begin(), edges.end(), edgeKey(b, a)) || !std::binary_search(edges.begin(), edges.end(), edgeKey(a, b));
+	};
+
+	while (indices.size() > targetIndexCount) {
+		// edges between positions, a border edge has no reverse twin
+		edges.clear();
+		for (size_t t = 0; t < indices.size(); t += 3)
+			for (int k = 0; k < 3; k++)
+				edges.push_back(edgeKey(positionId[indices[t + k]], positionId[indices[t + (k + 1) % 3]]));
+		std::sort(edges.begin(), edges.end());
+		std::fill(borderCount.begin(), borderCount.end(), 0);
+		std::fill(triangleOffsets.begin(), triangleOffsets.end(), 0);
+		std::fill(groupOffsets.begin(), groupOffsets.end(), 0);
+		for (size_t t = 0; t < indices.size(); t += 3)
+			for (int k = 0; k < 3; k++) {
+				unsigned int a = positionId[indices[t + k]];
+				unsigned int b = positionId[indices[t + (k + 1) % 3]];
+				triangleOffsets[indices[t + k] + 1]++;
+				if (!std::binary_search(edges.begin(), edges.end(), edgeKey(b, a))) {
+					borderCount[a]++;
+					borderCount[b]++;
+				}
+			}
+		for (size_t i = 0; i < n; i++)
+			triangleOffsets[i + 1] += triangleOffsets[i];
+		triangleList.resize(indices.size());
+		fill.assign(triangleOffsets.begin(), triangleOffsets.end() - 1);
+		for (size_t t = 0; t < indices.size(); t += 3)
+			for (int k = 0; k < 3; k++)
+				triangleList[fill[indices[t + k]]++] = (unsigned int)(t / 3);
+
+		// the vertices still in use on each position
+		for (size_t i = 0; i < n; i++)
+			if (triangleOffsets[i + 1] > triangleOffsets[i])
+				groupOffsets[positionId[i] + 1]++;
+		for (size_t i = 0; i < n; i++)
+			groupOffsets[i + 1] += groupOffsets[i];
+		groupList.resize(groupOffsets[n]);
+		fill.assign(groupOffsets.begin(), groupOffsets.end() - 1);
+		for (size_t i = 0; i < n; i++)
+			if (triangleOffsets[i + 1] > triangleOffsets[i])
+				groupList[fill[positionId[i]]++] = (unsigned int)i;
+		for (size_t id = 0; id < n; id++)
+			kind[id] = groupOffsets[id + 1] == groupOffsets[id] ? Locked : borderCount[id] == 0 ? Interior : borderCount[id] == 2 ? Border : Locked;
+
+		// the cheapest allowed collapse of every position
+		for (size_t i = 0; i < n; i++)
+			best[i] = { none, none, FLT_MAX, FLT_MAX };
+		for (size_t e = 0; e < edges.size(); e++) {
+			unsigned int from = (unsigned int)(edges[e] >> 32);
+			unsigned int to = (unsigned int)(edges[e] & 0xffffffff);
+			for (int direction = 0; direction < 2; direction++, std::swap(from, to)) {
+				if (from == to || kind[from] == Locked) continue;
+				if (kind[from] == Border && !isBorderEdge(from, to)) continue;
+				if (!findPartners(from, to, partners)) continue;
+				const Quadric& q = quadrics[from];
+				double weight = q.w > 0.0 ? q.w : 1.0;
+				double distance = q.error(v[to].position);
+				double cost = distance;
+				for (unsigned int g = groupOffsets[from]; g < groupOffsets[from + 1]; g++)
+					cost += attributeCost(groupList[g], partners[g - groupOffsets[from]], q.w);
+				float e = (float)sqrt(distance / weight);
+				if (e <= targetError && cost / weight < best[from].cost)
+					best[from] = { from, to, (float)(cost / weight), e };
+			}
+		}
+		collapses.clear();
+		for (size_t i = 0; i < n; i++)
+			if (best[i].from != none)
+				collapses.push_back(best[i]);
+		if (collapses.empty())
+			break;
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+		// apply the cheapest ones that do not touch each other or fold a triangle over
+		for (size_t i = 0; i < n; i++)
+			remap[i] = (unsigned int)i;
+		std::fill(locked.begin(), locked.end(), 0);
+		size_t triangles = indices.size() / 3;
+		size_t targetTriangles = targetIndexCount / 3;
+		bool applied = false;
+		auto foldsOver = [&](unsigned int from, unsigned int to, size_t& removed) {
+			for (unsigned int i = triangleOffsets[from]; i < triangleOffsets[from + 1]; i++) {
+				size_t t = (size_t)triangleList[i] * 3;
+				unsigned int corner[3] = { indices[t], indices[t + 1], indices[t + 2] };
+				bool degenerate = false;
+				for (int k = 0; k < 3; k++)
+					if (positionId[corner[k]] == positionId[to]) degenerate = true;
+				if (degenerate) {
+					removed++;
+					continue;
+				}
+				for (int k = 0; k < 3; k++)
+					if (corner[k] != from && locked[positionId[corner[k]]]) return true;
+				mathLib::Vec3 before, after;
+				float areaBefore, areaAfter;
+				planeOf(corner[0], corner[1], corner[2], before, areaBefore);
+				for (int k = 0; k < 3; k++)
+					if (corner[k] == from) corner[k] = to;
+				planeOf(corner[0], corner[1], corner[2], after, areaAfter);
+				if (before.x * after.x + before.y * after.y + before.z * after.z < 0.25f) return true;
+			}
+			return false;
+		};
+		for (auto& c : collapses) {
+			if (triangles <= targetTriangles) break;
+			if (locked[c.from] || locked[c.to]) continue;
+			findPartners(c.from, c.to, partners);
+			size_t removed = 0;
+			bool folds = false;
+			for (unsigned int g = groupOffsets[c.from]; g < groupOffsets[c.from + 1] && !folds; g++)
+				folds = foldsOver(groupList[g], partners[g - groupOffsets[c.from]], removed);
+			if (folds) continue;
+			for (unsigned int g = groupOffsets[c.from]; g < groupOffsets[c.from + 1]; g++)
+				remap[groupList[g]] = partners[g - groupOffsets[c.from]];
+			quadrics[c.to].add(quadrics[c.from]);
+			locked[c.from] = 1;
+			locked[c.to] = 1;
+			triangles -= removed < triangles ? removed : triangles;
+			if (c.error > error) error = c.error;
+			applied = true;
+		}
+		if (!applied)
+			break;
+
+		// drop the triangles that collapsed
+		size_t out = 0;
+		for (size_t t = 0; t < indices.size(); t += 3) {
+			unsigned int a = remap[indices[t]];
+			unsigned int b = remap[indices[t + 1]];
+			unsigned int c = remap[indices[t + 2]];
+			if (positionId[a] == positionId[b] || positionId[b] == positionId[c] || positionId[a] == positionId[c]) continue;
+			indices[out++] = a;
+			indices[out++] = b;
+			indices[out++] = c;
+		}
+		indices.resize(out);
+	}
+	return indices;
+}
+
+// one level of a mesh in its LodChain's index list
+struct MeshLod {
+	uint32_t firstIndex = 0;
+	uint32_t indexCount = 0;
+	float error = 0.0f;             // relative to the mesh extent, 0 for level 0
+};
+
+// every level of one mesh back to back, level 0 first and complete
+struct LodChain {
+	std::vector<unsigned int> indices;
+	std::vector<MeshLod> levels;
+};
+
+struct LodSettings {
+	int maxLevels = 4;              // level 0 included
+	float ratio = 0.5f;             // triangles each level keeps of the one before
+	float maxError = 0.05f;         // no level goes past this
+	size_t minTriangles = 32;       // nor below this
+};
+
+// level 0 is the mesh, each next level simplifies the one before until it is too
+// coarse, too small or did not get much smaller; each level is cache optimized
+template<typename V, typename Attributes>
+static LodChain buildLodChain(const std::vector<V>& vertices, const std::vector<unsigned int>& indices, Attributes attributes,
+	const LodSettings& settings = LodSettings()) {
+	LodChain chain;
+	chain.indices = indices;
+	MeshLod base;
+	base.indexCount = (uint32_t)indices.size();
+	chain.levels.push_back(base);
+	std::vector<unsigned int> current = indices;
+	float error = 0.0f;
+	while ((int)chain.levels.size() < settings.maxLevels) {
+		size_t target = (size_t)(current.size() / 3 * settings.ratio) * 3;
+		if (target / 3 < settings.minTriangles) break;
+		float levelError = 0.0f;
+		std::vector<unsigned int> next = simplifyMesh(vertices, current, attributes, target, settings.maxError, levelError);
+		// less than 10% gone, the simplifier is stuck on locked vertices or the error bound
+		if (next.empty() || next.size() > current.size() * 9 / 10) break;
+		optimizeVertexCache(next, vertices.size());
+		error = levelError > error ? levelError : error;
+		MeshLod level;
+		level.firstIndex = (uint32_t)chain.indices.size();
+		level.indexCount = (uint32_t)next.size();
+		level.error = error;
+		chain.indices.insert(chain.indices.end(), next.begin(), next.end());
+		chain.levels.push_back(level);
+		current.swap(next);
+	}
+	return chain;
+}
+
+// Picks a level per instance from how large it is on screen: the coarsest level whose
+// error, scaled by the instance's projected size, stays under maxPixelError.
+struct LodSelector {
+	mathLib::Vec3 camera;
+	float pixelsPerUnit = 0.0f;     // size on screen of 1 unit at distance 1: viewport height / (2 tan(fov / 2))
+	float maxPixelError = 1.0f;
+
+	void init(const mathLib::Vec3& cameraPosition, float fovRadians, float viewportHeight, float pixelError = 1.0f) {
+		camera = cameraPosition;
+		pixelsPerUnit = viewportHeight / (2.0f * tanf(fovRadians * 0.5f));
+		maxPixelError = pixelError;
+	}
+
+	// bounds in world space; errors[level], level 0 first
+	int select(const float* errors, int levels, const AABB& bounds) const {
+		if (levels <= 1) return 0;
+		mathLib::Vec3 upper = bounds.max;
+		mathLib::Vec3 center = (bounds.min + bounds.max) * 0.5f;
+		mathLib::Vec3 half = (upper - bounds.min) * 0.5f;
+		float radius = half.getLength();
+		float distance = (center - camera).getLength() - radius;
+		if (distance <= 0.0f) return 0;
+		float pixels = 2.0f * radius / distance * pixelsPerUnit;
+		for (int level = levels - 1; level > 0; level--)
+			if (errors[level] * pixels <= maxPixelError) return level;
+		return 0;
+	}
+};
@@ -0,0 +1,234 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cfloat>
+#include <algorithm>
+#include "mathLib.h"
+#include "collision.h"
+
+// Meshlets: a mesh cut into clusters of at most 64 vertices and 124 triangles (the
+// limits mesh shaders use), each with a bounding sphere and a normal cone, so a
+// cluster culler can skip the parts of a large mesh that are off screen or face away.
+// No D3D in here; the builder runs when a model loads, like the mesh optimizer.
+//
+// A cluster is a run of the mesh's index list: buildMeshlets reorders the triangles
+// cluster by cluster, so drawing the whole list still draws the mesh, and a culled
+// draw copies the runs of the clusters that are kept.
+
+struct Meshlet {
+	uint32_t firstIndex = 0;        // into the reordered index list
+	uint32_t triangleCount = 0;
+	uint32_t vertexCount = 0;       // distinct vertices
+};
+
+// Everything in the mesh's model space. A cluster faces away from a camera at c when
+// dot(center - c, coneAxis) >= coneCutoff * |center - c| + radius; coneCutoff 1 is a
+// cluster whose normals spread too far to ever pass.
+struct MeshletBounds {
+	mathLib::Vec3 center;
+	float radius = 0.0f;
+	mathLib::Vec3 coneAxis;
+	float coneCutoff = 1.0f;
+};
+
+struct MeshletMesh {
+	std::vector<Meshlet> meshlets;
+	std::vector<MeshletBounds> bounds;
+	bool closed = false;            // every edge has a twin: never seen from behind, cones apply
+
+	size_t size() const { return meshlets.size(); }
+	bool empty() const { return meshlets.empty(); }
+};
+
+const size_t MeshletMaxVertices = 64;
+const size_t MeshletMaxTriangles = 124;
+
+// Grows one cluster at a time from the first triangle left: the next triangle is
+// the neighbour that adds the fewest new vertices, ties go to the one that bends the
+// cluster's normal cone the least. When nothing adjacent fits, the nearest of the next
+// triangles in index order that does is taken, so loose leaf cards still fill clusters.
+// Reorders indices cluster by cluster. Normals only orient the triangles, so the cone
+// follows the authored facing whatever the winding.
+template<typename V, typename Position, typename Normal>
+static MeshletMesh buildMeshlets(const std::vector<V>& vertices, std::vector<unsigned int>& indices, Position position, Normal normal,
+	size_t maxVertices = MeshletMaxVertices, size_t maxTriangles = MeshletMaxTriangles) {
+	const unsigned int none = 0xffffffff;
+	const size_t islandWindow = 256;
+	size_t n = vertices.size();
+	size_t triangleCount = indices.size() / 3;
+	MeshletMesh out;
+	if (triangleCount == 0) return out;
+
+	// geometric normals, turned to the side the vertex normals point to
+	std::vector<mathLib::Vec3> faceNormals(triangleCount);
+	for (size_t t = 0; t < triangleCount; t++) {
+		mathLib::Vec3 a = position(vertices[indices[t * 3]]);
+		mathLib::Vec3 b = position(vertices[indices[t * 3 + 1]]);
+		mathLib::Vec3 c = position(vertices[indices[t * 3 + 2]]);
+		mathLib::Vec3 ab = b - a;
+		mathLib::Vec3 ac = c - a;
+		mathLib::Vec3 f(ab.y * ac.z - ab.z * ac.y, ab.z * ac.x - ab.x * ac.z, ab.x * ac.y - ab.y * ac.x);
+		mathLib::Vec3 authored = normal(vertices[indices[t * 3]]) + normal(vertices[indices[t * 3 + 1]]) + normal(vertices[indices[t * 3 + 2]]);
+		if (f.x * authored.x + f.y * authored.y + f.z * authored.z < 0.0f) f = -f;
+		float length = f.getLength();
+		faceNormals[t] = length > 0.0f ? f / length : mathLib::Vec3(0.0f, 0.0f, 0.0f);
+	}
+
+	// triangles around each vertex
+	std::vector<unsigned int> offsets(n + 1, 0), adjacency(triangleCount * 3);
+	for (unsigned int index : indices)
+		offsets[index + 1]++;
+	for (size_t i = 0; i < n; i++)
+		offsets[i + 1] += offsets[i];
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t t = 0; t < triangleCount; t++)
+		for (int k = 0; k < 3; k++)
+			adjacency[fill[indices[t * 3 + k]]++] = (unsigned int)t;
+
+	std::vector<uint8_t> used(triangleCount, 0);
+	std::vector<unsigned int> local(n, none);       // vertex -> slot in the current cluster
+	std::vector<unsigned int> clusterVertices, clusterTriangles;
+	std::vector<unsigned int> reordered;
+	reordered.reserve(indices.size());
+	size_t seed = 0;
+	mathLib::Vec3 normalSum;
+
+	auto newVertices = [&](size_t t) {
+		int count = 0;
+		for (int k = 0; k < 3; k++)
+			if (local[indices[t * 3 + k]] == none) count++;
+		return count;
+	};
+	auto addTriangle = [&](size_t t) {
+		for (int k = 0; k < 3; k++) {
+			unsigned int v = indices[t * 3 + k];
+			if (local[v] == none) {
+				local[v] = (unsigned int)clusterVertices.size();
+				clusterVertices.push_back(v);
+			}
+		}
+		clusterTriangles.push_back((unsigned int)t);
+		normalSum += faceNormals[t];
+		used[t] = 1;
+	};
+	auto finish = [&]() {
+		Meshlet meshlet;
+		meshlet.firstIndex = (uint32_t)reordered.size();
+		meshlet.triangleCount = (uint32_t)clusterTriangles.size();
+		meshlet.vertexCount = (uint32_t)clusterVertices.size();
+		AABB box;
+		box.reset();
+		for (unsigned int v : clusterVertices)
+			box.extend(position(vertices[v]));
+		MeshletBounds b;
+		b.center = (box.min + box.max) * 0.5f;
+		for (unsigned int v : clusterVertices) {
+			float d = (position(vertices[v]) - b.center).getLength();
+			if (d > b.radius) b.radius = d;
+		}
+		float length = normalSum.getLength();
+		if (length > 0.0f) {
+			b.coneAxis = normalSum / length;
+			float minDot = 1.0f;
+			for (unsigned int t : clusterTriangles) {
+				float d = faceNormals[t].x * b.coneAxis.x + faceNormals[t].y * b.coneAxis.y + faceNormals[t].z * b.coneAxis.z;
+				if (d < minDot) minDot = d;
+			}
+			// past about 84 degrees the cone would hardly ever cull
+			b.coneCutoff = minDot <= 0.1f ? 1.0f : sqrtf(1.0f - minDot * minDot);
+		}
+		for (unsigned int t : clusterTriangles)
+			for (int k = 0; k < 3; k++)
+				reordered.push_back(indices[t * 3 + k]);
+		for (unsigned int v : clusterVertices)
+			local[v] = none;
+		clusterVertices.clear();
+		clusterTriangles.clear();
+		normalSum = mathLib::Vec3(0.0f, 0.0f, 0.0f);
+		out.meshlets.push_back(meshlet);
+		out.bounds.push_back(b);
+	};
+
+	while (true) {
+		while (seed < triangleCount && used[seed]) seed++;
+		if (seed == triangleCount) break;
+		addTriangle(seed);
+		while (clusterTriangles.size() < maxTriangles) {
+			size_t best = none;
+			int bestNew = 4;
+			float bestSpread = FLT_MAX;
+			float length = normalSum.getLength();
+			mathLib::Vec3 axis = length > 0.0f ? normalSum / length : mathLib::Vec3(0.0f, 0.0f, 0.0f);
+			for (unsigned int v : clusterVertices) {
+				for (unsigned int a = offsets[v]; a < offsets[v + 1]; a++) {
+					unsigned int t = adjacency[a];
+					if (used[t]) continue;
+					int added = newVertices(t);
+					if (clusterVertices.size() + added > maxVertices) continue;
+					float spread = 1.0f - (faceNormals[t].x * axis.x + faceNormals[t].y * axis.y + faceNormals[t].z * axis.z);
+					if (added < bestNew || (added == bestNew && spread < bestSpread)) {
+						best = t;
+						bestNew = added;
+						bestSpread = spread;
+					}
+				}
+			}
+			if (best == none) {
+				// islands: the closest unused triangle among the next few, by centroid, kept
+				// apart from the ones that would widen the cone
+				AABB box;
+				box.reset();
+				for (unsigned int v : clusterVertices)
+					box.extend(position(vertices[v]));
+				mathLib::Vec3 center = (box.min + box.max) * 0.5f;
+				float extent = (box.max - box.min).getLengthSquare();
+				float bestDistance = FLT_MAX;
+				size_t scanned = 0;
+				for (size_t t = seed; t < triangleCount && scanned < islandWindow; t++) {
+					if (used[t]) continue;
+					scanned++;
+					if (clusterVertices.size() + newVertices(t) > maxVertices) continue;
+					mathLib::Vec3 centroid = (position(vertices[indices[t * 3]]) + position(vertices[indices[t * 3 + 1]]) + position(vertices[indices[t * 3 + 2]])) / 3.0f;
+					float spread = 1.0f - (faceNormals[t].x * axis.x + faceNormals[t].y * axis.y + faceNormals[t].z * axis.z);
+					float distance = (centroid - center).getLengthSquare() + 4.0f * spread * extent;
+					if (distance < bestDistance) {
+						best = t;
+						bestDistance = distance;
+					}
+				}
+				if (best == none) break;
+			}
+			addTriangle(best);
+		}
+		finish();
+	}
+	indices.swap(reordered);
+
+	// closed when every edge between positions is used both ways (seams split vertices,
+	// not positions)
+	std::vector<unsigned int> byPosition(n);
+	for (size_t i = 0; i < n; i++) byPosition[i] = (unsigned int)i;
+	auto less = [&](unsigned int a, unsigned int b) {
+		mathLib::Vec3 pa = position(vertices[a]);
+		mathLib::Vec3 pb = position(vertices[b]);
+		return pa.x != pb.x ? pa.x < pb.x : (pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z);
+	};
+	std::sort(byPosition.begin(), byPosition.end(), less);
+	std::vector<unsigned int> positionId(n);
+	for (size_t i = 0; i < n; i++)
+		positionId[byPosition[i]] = i > 0 && !less(byPosition[i - 1], byPosition[i]) ? positionId[byPosition[i - 1]] : byPosition[i];
+	std::vector<uint64_t> edges;
+	edges.reserve(indices.size());
+	for (size_t t = 0; t < indices.size(); t += 3)
+		for (int k = 0; k < 3; k++)
+			edges.push_back(((uint64_t)positionId[indices[t + k]] << 32) | positionId[indices[t + (k + 1) % 3]]);
+	std::sort(edges.begin(), edges.end());
+	out.closed = true;
+	for (uint64_t e : edges)
+		if (!std::binary_search(edges.begin(), edges.end(), (e << 32) | (e >> 32))) {
+			out.closed = false;
+			break;
+		}
+	return out;
+}
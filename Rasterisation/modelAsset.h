@@ -0,0 +1,273 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <istream>
+#include <streambuf>
+#include <cstring>
+#include <cstdint>
+#include <iterator>
+#include "GEMLoader.h"
+#include "collision.h"
+#include "vertex.h"
+#include "meshOptimizer.h"
+#include "meshSimplifier.h"
+#include "meshlet.h"
+
+// Reads a buffer in place through std::istream, so GEMLoader can parse a file that is
+// already in memory without copying it into a stringstream.
+class MemoryStreamBuffer : public std::streambuf {
+public:
+	MemoryStreamBuffer(const unsigned char* data, size_t size) {
+		char* begin = (char*)data;
+		setg(begin, begin, begin + size);
+	}
+};
+
+// CPU side of model::init / animatedModel::init: a .gem parsed into meshes, skeleton
+// and animations, plus the model space bounds of the bind pose. No D3D in here (like
+// Image), so it decodes on a job worker and headless can use it. Each mesh goes
+// through the mesh optimizer as it is read, optimization has what that did.
+// prepareLods() adds the mesh simplifier's LOD chains, kept in a sidecar file, and
+// buildMeshlets() cuts level 0 into clusters for the cluster culler.
+class ModelAsset {
+public:
+	std::vector<GEMLoader::GEMMesh> meshes;
+	GEMLoader::GEMAnimation animation;
+	AABB bounds;
+	std::vector<MeshOptimizerStats> optimization;     // per mesh
+	std::vector<LodChain> lods;                         // per mesh, empty until prepareLods
+	std::vector<MeshletMesh> meshlets;                  // per mesh, empty until buildMeshlets
+	uint32_t sourceHash = 0;                            // of the .gem bytes
+	bool lodsFromSidecar = false;
+
+	bool load(const std::string& filename) {
+		std::ifstream file(filename, std::ios::binary);
+		if (!file) return false;
+		std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		return decode(bytes);
+	}
+
+	bool decode(const std::vector<unsigned char>& file) {
+		sourceHash = hash(file.data(), file.size(), 2166136261u);
+		MemoryStreamBuffer buffer(file.data(), file.size());
+		std::istream stream(&buffer);
+		return read(stream);
+	}
+
+	// LOD chains for every mesh: from <filename>.lod when it was made from this .gem
+	// with these settings, otherwise built and written there. Indices are into the
+	// optimized vertices, so the sidecar is only valid together with the optimizer.
+	void prepareLods(const std::string& filename, const LodSettings& settings = LodSettings()) {
+		std::string sidecar = filename + ".lod";
+		uint32_t key = lodKey(settings);
+		lodsFromSidecar = readLods(sidecar, key);
+		if (lodsFromSidecar) return;
+		buildLods(settings);
+		writeLods(sidecar, key);
+	}
+
+	// reorders each mesh's triangles cluster by cluster, and level 0 of its LOD chain
+	// with them, so prepareLods goes first
+	void buildMeshlets() {
+		meshlets.clear();
+		for (size_t m = 0; m < meshes.size(); m++) {
+			GEMLoader::GEMMesh& mesh = meshes[m];
+			if (mesh.isAnimated())
+				meshlets.push_back(::buildMeshlets(mesh.verticesAnimated, mesh.indices, position<GEMLoader::GEMAnimatedVertex>, normal<GEMLoader::GEMAnimatedVertex>));
+			else
+				meshlets.push_back(::buildMeshlets(mesh.verticesStatic, mesh.indices, position<GEMLoader::GEMStaticVertex>, normal<GEMLoader::GEMStaticVertex>));
+			if (m < lods.size())
+				std::copy(mesh.indices.begin(), mesh.indices.end(), lods[m].indices.begin());
+		}
+	}
+
+	int lodCount() const {
+		int n = 0;
+		for (auto& chain : lods)
+			n = (int)chain.levels.size() > n ? (int)chain.levels.size() : n;
+		return n;
+	}
+
+	bool isAnimated() {
+		return !meshes.empty() && meshes[0].isAnimated();
+	}
+
+	size_t vertexCount() const {
+		size_t n = 0;
+		for (auto& mesh : meshes)
+			n += mesh.verticesStatic.size() + mesh.verticesAnimated.size();
+		return n;
+	}
+
+	size_t triangleCount() const {
+		size_t n = 0;
+		for (auto& mesh : meshes)
+			n += mesh.indices.size() / 3;
+		return n;
+	}
+
+	// vertex and index data, what the GPU copy will take
+	size_t sizeInBytes() const {
+		size_t n = 0;
+		for (auto& mesh : meshes) {
+			n += mesh.verticesStatic.size() * sizeof(GEMLoader::GEMStaticVertex);
+			n += mesh.verticesAnimated.size() * sizeof(GEMLoader::GEMAnimatedVertex);
+			n += mesh.indices.size() * sizeof(unsigned int);
+		}
+		return n;
+	}
+
+private:
+	bool read(std::istream& stream) {
+		GEMLoader::GEMModelLoader loader;
+		if (!loader.load(stream, meshes, animation)) return false;
+		optimize();
+		bounds.reset();
+		for (auto& mesh : meshes) {
+			for (auto& v : mesh.verticesStatic)
+				bounds.extend(mathLib::Vec3(v.position.x, v.position.y, v.position.z));
+			for (auto& v : mesh.verticesAnimated)
+				bounds.extend(mathLib::Vec3(v.position.x, v.position.y, v.position.z));
+		}
+		return true;
+	}
+
+	void optimize() {
+		optimization.clear();
+		for (auto& mesh : meshes) {
+			if (mesh.isAnimated())
+				optimization.push_back(optimizeMesh(mesh.verticesAnimated, mesh.indices, position<GEMLoader::GEMAnimatedVertex>,
+					normal<GEMLoader::GEMAnimatedVertex>));
+			else
+				optimization.push_back(optimizeMesh(mesh.verticesStatic, mesh.indices, position<GEMLoader::GEMStaticVertex>,
+					normal<GEMLoader::GEMStaticVertex>));
+		}
+	}
+
+	static const uint32_t lodMagic = 0x444f4c47;       // "GLOD"
+	static const uint32_t lodVersion = 1;              // bump when the simplifier or the optimizer change their output
+
+	static uint32_t hash(const void* data, size_t size, uint32_t h) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++)
+			h = (h ^ bytes[i]) * 16777619u;
+		return h;
+	}
+
+	uint32_t lodKey(const LodSettings& settings) const {
+		uint32_t h = hash(&sourceHash, sizeof(sourceHash), 2166136261u);
+		h = hash(&settings.maxLevels, sizeof(settings.maxLevels), h);
+		h = hash(&settings.ratio, sizeof(settings.ratio), h);
+		h = hash(&settings.maxError, sizeof(settings.maxError), h);
+		uint64_t minTriangles = settings.minTriangles;
+		return hash(&minTriangles, sizeof(minTriangles), h);
+	}
+
+	void buildLods(const LodSettings& settings) {
+		lods.clear();
+		for (auto& mesh : meshes) {
+			if (mesh.isAnimated())
+				lods.push_back(buildLodChain(mesh.verticesAnimated, mesh.indices, attributes<GEMLoader::GEMAnimatedVertex>, settings));
+			else
+				lods.push_back(buildLodChain(mesh.verticesStatic, mesh.indices, attributes<GEMLoader::GEMStaticVertex>, settings));
+		}
+	}
+
+	// "GLOD", version, key, mesh count, then per mesh: level count, the levels
+	// (first index, index count, error), index count and the indices
+	bool readLods(const std::string& filename, uint32_t key) {
+		std::ifstream file(filename, std::ios::binary);
+		if (!file) return false;
+		uint32_t header[4] = {};
+		file.read((char*)header, sizeof(header));
+		if (!file || header[0] != lodMagic || header[1] != lodVersion || header[2] != key || header[3] != meshes.size())
+			return false;
+		std::vector<LodChain> chains(meshes.size());
+		for (size_t m = 0; m < meshes.size(); m++) {
+			LodChain& chain = chains[m];
+			uint32_t levels = 0;
+			file.read((char*)&levels, sizeof(levels));
+			if (!file || levels == 0 || levels > 64) return false;
+			chain.levels.resize(levels);
+			file.read((char*)chain.levels.data(), levels * sizeof(MeshLod));
+			uint32_t count = 0;
+			file.read((char*)&count, sizeof(count));
+			if (!file || count > (1u << 28)) return false;
+			chain.indices.resize(count);
+			file.read((char*)chain.indices.data(), count * sizeof(unsigned int));
+			if (!file) return false;
+			size_t vertexCount = meshes[m].verticesStatic.size() + meshes[m].verticesAnimated.size();
+			for (unsigned int index : chain.indices)
+				if (index >= vertexCount) return false;
+			for (auto& level : chain.levels)
+				if ((size_t)level.firstIndex + level.indexCount > count || level.indexCount % 3 != 0) return false;
+		}
+		lods.swap(chains);
+		return true;
+	}
+
+	void writeLods(const std::string& filename, uint32_t key) const {
+		std::ofstream file(filename, std::ios::binary);
+		if (!file) return;
+		uint32_t header[4] = { lodMagic, lodVersion, key, (uint32_t)meshes.size() };
+		file.write((const char*)header, sizeof(header));
+		for (auto& chain : lods) {
+			uint32_t levels = (uint32_t)chain.levels.size();
+			file.write((const char*)&levels, sizeof(levels));
+			file.write((const char*)chain.levels.data(), levels * sizeof(MeshLod));
+			uint32_t count = (uint32_t)chain.indices.size();
+			file.write((const char*)&count, sizeof(count));
+			file.write((const char*)chain.indices.data(), count * sizeof(unsigned int));
+		}
+	}
+
+	template<typename V>
+	static void attributes(const V& v, SimplifyVertex& out) {
+		out.position = mathLib::Vec3(v.position.x, v.position.y, v.position.z);
+		out.normal = mathLib::Vec3(v.normal.x, v.normal.y, v.normal.z);
+		out.u = v.u;
+		out.v = v.v;
+	}
+
+	template<typename V>
+	static mathLib::Vec3 position(const V& v) { return mathLib::Vec3(v.position.x, v.position.y, v.position.z); }
+
+	template<typename V>
+	static mathLib::Vec3 normal(const V& v) { return mathLib::Vec3(v.normal.x, v.normal.y, v.normal.z); }
+};
+
+// the engine's vertices from the .gem ones, field by field rather than a memcpy of the
+// same layout, the engine's hold mathLib::Vec3s
+inline STATIC_VERTEX toVertex(const GEMLoader::GEMStaticVertex& g) {
+	STATIC_VERTEX v;
+	v.pos = mathLib::Vec3(g.position.x, g.position.y, g.position.z);
+	v.normal = mathLib::Vec3(g.normal.x, g.normal.y, g.normal.z);
+	v.tangent = mathLib::Vec3(g.tangent.x, g.tangent.y, g.tangent.z);
+	v.tu = g.u;
+	v.tv = g.v;
+	return v;
+}
+
+inline ANIMATED_VERTEX toVertex(const GEMLoader::GEMAnimatedVertex& g) {
+	ANIMATED_VERTEX v;
+	v.pos = mathLib::Vec3(g.position.x, g.position.y, g.position.z);
+	v.normal = mathLib::Vec3(g.normal.x, g.normal.y, g.normal.z);
+	v.tangent = mathLib::Vec3(g.tangent.x, g.tangent.y, g.tangent.z);
+	v.tu = g.u;
+	v.tv = g.v;
+	for (int i = 0; i < 4; i++) {
+		v.bonesIDs[i] = g.bonesIDs[i];
+		v.boneWeights[i] = g.boneWeights[i];
+	}
+	return v;
+}
+
+template<typename V, typename G>
+inline std::vector<V> toVertices(const std::vector<G>& gem) {
+	std::vector<V> vertices;
+	vertices.reserve(gem.size());
+	for (const G& g : gem)
+		vertices.push_back(toVertex(g));
+	return vertices;
+}
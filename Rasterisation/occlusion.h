@@ -0,0 +1,252 @@
+#pragma once
+#include <vector>
+#include "mathLib.h"
+#include "vertex.h"
+#include "collision.h"
+#include "rasterizer.h"
+#include "visibility.h"
+#include "timer.h"
+#include "profiler.h"
+
+struct OcclusionStats {
+	uint64_t occluderTriangles = 0;
+	int tested = 0;
+	int visible = 0;
+	int occluded = 0;
+	int offscreen = 0;          // outside the screen or beyond the far plane
+	double rasterMs = 0.0;
+	double pyramidMs = 0.0;
+	double testMs = 0.0;
+};
+
+// Software occlusion culling. A few large occluders (walls, ground) are rasterised
+// depth only into a small buffer with SoftwareRasterizer, then reduced into a Hi-Z
+// pyramid that keeps the nearest and farthest depth of every texel. Instance AABBs
+// are tested against the pyramid and come out as a VisibilitySet.
+//
+// Usage per frame: begin(vp), addOccluder(...), finish(), then test(boxes, visible),
+// or refine(boxes, visible) on a set FrustumCuller already filled in.
+// Occluders are sampled at pixel centres, so an occluder can cover up to half a
+// pixel of the low resolution buffer more than it really does at its silhouette.
+class OcclusionCuller {
+public:
+	OcclusionStats stats;
+	int maxDescend = 3;         // levels below the first test level before giving up as visible
+
+	void init(int width = 256, int height = 128) {
+		raster.init(width, height);
+		occluderMaterial.depthOnly = true;
+		occluderMaterial.alphaTest = false;
+		levelWidth.clear();
+		levelHeight.clear();
+		int w = width;
+		int h = height;
+		while (true) {
+			levelWidth.push_back(w);
+			levelHeight.push_back(h);
+			if (w == 1 && h == 1) break;
+			w = (w + 1) / 2;
+			h = (h + 1) / 2;
+		}
+		minDepth.assign(levelWidth.size(), std::vector<float>());
+		maxDepth.assign(levelWidth.size(), std::vector<float>());
+		for (size_t l = 1; l < levelWidth.size(); l++) {
+			minDepth[l].resize((size_t)levelWidth[l] * levelHeight[l]);
+			maxDepth[l].resize((size_t)levelWidth[l] * levelHeight[l]);
+		}
+		buildBoxMesh();
+	}
+
+	// occluder triangles a frame may bring without the rasterizer allocating
+	void reserve(size_t triangleCount) { raster.reserve(triangleCount); }
+
+	int width() const { return raster.target.width; }
+	int height() const { return raster.target.height; }
+
+	void begin(const mathLib::Matrix& _vp) {
+		vp = _vp;
+		stats = OcclusionStats();
+		raster.clear(mathLib::Color(0.0f, 0.0f, 0.0f, 1.0f), 1.0f);
+	}
+
+	void addOccluder(const std::vector<STATIC_VERTEX>& vertices, const std::vector<unsigned int>& indices, const mathLib::Matrix& world) {
+		raster.drawIndexed(vertices, indices, world, vp, occluderMaterial);
+		stats.occluderTriangles += indices.size() / 3;
+	}
+
+	void addOccluder(const AABB& box) {
+		mathLib::Vec3 mn = box.min;
+		mathLib::Vec3 mx = box.max;
+		mathLib::Matrix world = mathLib::Matrix::scaling(mx - mn) * mathLib::Matrix::translation(mn);
+		addOccluder(boxVertices, boxIndices, world);
+	}
+
+	// rasterise the occluders and build the pyramid, call before test()
+	void finish() {
+		Timer timer;
+		{
+			PROFILE_SCOPE("occlusion: rasterise");
+			raster.flush();
+		}
+		stats.rasterMs = timer.elapsed() * 1000.0;
+		timer.reset();
+		{
+			PROFILE_SCOPE("occlusion: pyramid");
+			buildPyramid();
+		}
+		stats.pyramidMs = timer.elapsed() * 1000.0;
+	}
+
+	void test(const std::vector<AABB>& boxes, VisibilitySet& visible) {
+		PROFILE_SCOPE("occlusion: test");
+		Timer timer;
+		visible.resize(boxes.size(), false);
+		for (size_t i = 0; i < boxes.size(); i++)
+			visible.set(i, isVisible(boxes[i]));
+		stats.testMs += timer.elapsed() * 1000.0;
+	}
+
+	// like test() but only for the bits still set, e.g. after frustum culling
+	void refine(const std::vector<AABB>& boxes, VisibilitySet& visible) {
+		refine(boxes.data(), boxes.size(), visible);
+	}
+
+	void refine(const AABB* boxes, size_t count, VisibilitySet& visible) {
+		PROFILE_SCOPE("occlusion: test");
+		Timer timer;
+		for (size_t i = 0; i < count; i++)
+			if (visible.test(i))
+				visible.set(i, isVisible(boxes[i]));
+		stats.testMs += timer.elapsed() * 1000.0;
+	}
+
+	bool isVisible(const AABB& box) {
+		stats.tested++;
+		int result = classify(box);
+		if (result > 0) stats.visible++;
+		else if (result == 0) stats.occluded++;
+		else stats.offscreen++;
+		return result > 0;
+	}
+
+	// depth at level 0, for debugging / image dumps
+	const std::vector<float>& depthBuffer() const {
+		return raster.target.depth;
+	}
+
+private:
+	SoftwareRasterizer raster;
+	RasterMaterial occluderMaterial;
+	mathLib::Matrix vp;
+	std::vector<int> levelWidth;
+	std::vector<int> levelHeight;
+	std::vector<std::vector<float>> minDepth;   // level 0 is the depth buffer itself
+	std::vector<std::vector<float>> maxDepth;
+	std::vector<STATIC_VERTEX> boxVertices;
+	std::vector<unsigned int> boxIndices;
+
+	const float* levelMin(int level) const {
+		return level == 0 ? raster.target.depth.data() : minDepth[level].data();
+	}
+
+	const float* levelMax(int level) const {
+		return level == 0 ? raster.target.depth.data() : maxDepth[level].data();
+	}
+
+	// unit box from (0,0,0) to (1,1,1), scaled onto each AABB occluder
+	void buildBoxMesh() {
+		boxVertices.clear();
+		boxIndices.clear();
+		for (int i = 0; i < 8; i++)
+			boxVertices.push_back(addVertex(mathLib::Vec3((float)(i & 1), (float)((i >> 1) & 1), (float)((i >> 2) & 1)), mathLib::Vec3(0, 1, 0), 0, 0));
+		unsigned int faces[6][4] = { { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 6, 7, 5 } };
+		for (auto& f : faces)
+			boxIndices.insert(boxIndices.end(), { f[0], f[1], f[2], f[0], f[2], f[3] });
+	}
+
+	// every texel of level l holds the min and max of the 2x2 texels under it in level l - 1
+	void buildPyramid() {
+		for (size_t l = 1; l < levelWidth.size(); l++) {
+			int w = levelWidth[l];
+			int h = levelHeight[l];
+			int pw = levelWidth[l - 1];
+			int ph = levelHeight[l - 1];
+			const float* pmin = levelMin((int)l - 1);
+			const float* pmax = levelMax((int)l - 1);
+			float* cmin = minDepth[l].data();
+			float* cmax = maxDepth[l].data();
+			for (int y = 0; y < h; y++) {
+				int y0 = y * 2;
+				int y1 = min(y0 + 1, ph - 1);
+				for (int x = 0; x < w; x++) {
+					int x0 = x * 2;
+					int x1 = min(x0 + 1, pw - 1);
+					float a = min(min(pmin[y0 * pw + x0], pmin[y0 * pw + x1]), min(pmin[y1 * pw + x0], pmin[y1 * pw + x1]));
+					float b = max(max(pmax[y0 * pw + x0], pmax[y0 * pw + x1]), max(pmax[y1 * pw + x0], pmax[y1 * pw + x1]));
+					cmin[y * w + x] = a;
+					cmax[y * w + x] = b;
+				}
+			}
+		}
+	}
+
+	// 1 visible, 0 occluded, -1 off screen
+	int classify(const AABB& box) {
+		float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+		float nearZ = FLT_MAX, farZ = -FLT_MAX;
+		mathLib::Vec4 clip[8];
+		int behind = 0;
+		for (int i = 0; i < 8; i++) {
+			mathLib::Vec4 corner((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y, (i & 4) ? box.max.z : box.min.z, 1.0f);
+			clip[i] = vp.mulPointP(corner);
+			if (clip[i].z < -clip[i].w || clip[i].w <= 0.0f) behind++;
+		}
+		if (behind == 8) return -1;
+		// crosses the near plane, the projected rectangle is meaningless
+		if (behind > 0) return 1;
+		for (int i = 0; i < 8; i++) {
+			float invW = 1.0f / clip[i].w;
+			float x = (clip[i].x * invW + 1.0f) * 0.5f * width();
+			float y = (1.0f - clip[i].y * invW) * 0.5f * height();
+			float z = clip[i].z * invW * 0.5f + 0.5f;
+			minX = min(minX, x);
+			maxX = max(maxX, x);
+			minY = min(minY, y);
+			maxY = max(maxY, y);
+			nearZ = min(nearZ, z);
+			farZ = max(farZ, z);
+		}
+		if (maxX < 0.0f || maxY < 0.0f || minX >= width() || minY >= height() || nearZ > 1.0f) return -1;
+		int x0 = minX < 0.0f ? 0 : (int)minX;
+		int y0 = minY < 0.0f ? 0 : (int)minY;
+		int x1 = maxX >= width() ? width() - 1 : (int)maxX;
+		int y1 = maxY >= height() ? height() - 1 : (int)maxY;
+
+		// start at the finest level where the rectangle touches at most 2x2 texels
+		int level = 0;
+		while (level + 1 < (int)levelWidth.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+			level++;
+		for (int ty = y0 >> level; ty <= y1 >> level; ty++)
+			for (int tx = x0 >> level; tx <= x1 >> level; tx++)
+				if (texelVisible(level, tx, ty, x0, y0, x1, y1, nearZ, farZ, maxDescend))
+					return 1;
+		return 0;
+	}
+
+	// is any part of the rectangle (level 0 pixels) under this texel in front of the occluders
+	bool texelVisible(int level, int tx, int ty, int x0, int y0, int x1, int y1, float nearZ, float farZ, int descend) const {
+		size_t i = (size_t)ty * levelWidth[level] + tx;
+		if (nearZ > levelMax(level)[i]) return false;   // behind everything in the texel
+		if (farZ < levelMin(level)[i] || level == 0 || descend == 0) return true;
+		int child = level - 1;
+		int cx0 = max(tx * 2, x0 >> child);
+		int cy0 = max(ty * 2, y0 >> child);
+		int cx1 = min(tx * 2 + 1, min(x1 >> child, levelWidth[child] - 1));
+		int cy1 = min(ty * 2 + 1, min(y1 >> child, levelHeight[child] - 1));
+		for (int cy = cy0; cy <= cy1; cy++)
+			for (int cx = cx0; cx <= cx1; cx++)
+				if (texelVisible(child, cx, cy, x0, y0, x1, y1, nearZ, farZ, descend - 1))
+					return true;
+		return false;
+	}
+};
@@ -1,5 +1,9 @@
 ﻿#pragma once
 #include "mathLib.h"
+#include "collision.h"
+#include "animatedRig.h"
+#include "profiler.h"
+#include "transformHierarchy.h"
 
 class Player {
 public:
@@ -7,20 +11,37 @@ public:
 	mathLib::Vec3 velocity;    // player's velocity(with direction)
 	float speed;               // movement speed
 	mathLib::Quaternion rotation; // player's orientation
-	animatedModel* model;
+	AnimatedRig* model;          // skeleton and animation state, drawn by the renderer
 	AABB boundingBox;
 	std::string currentAnimation;
 	bool isAttacking = false; // Whether or not the attack animation is playing
 	float attackAnimationTime = 0.0f; // Current attack animation play time
 	float attackDuration = 1.0f; // Total duration of the attack animation
+	mathLib::Vec3 scale;         // of the model
+	// node in a scene's transforms once attached, see attach()
+	TransformHierarchy* transforms = nullptr;
+	TransformId node = NoTransform;
 
 
-	Player(const mathLib::Vec3& startPos, float moveSpeed, animatedModel* _model)
-		: position(startPos), velocity(0.0f, 0.0f, 0.0f), speed(moveSpeed), model(_model) {
+	Player(const mathLib::Vec3& startPos, float moveSpeed, AnimatedRig* _model)
+		: position(startPos), velocity(0.0f, 0.0f, 0.0f), speed(moveSpeed), model(_model), scale(0.3f, 0.3f, 0.3f) {
 		rotation = mathLib::Quaternion::fromAxisAngle(mathLib::Vec3(1, 0, 0), M_PI);
 	}
 
-	void update(mathLib::Vec3 direction, mathLib::Vec3 forward, AABB& obstacle, float deltaTime) {
+	// From here on position and rotation are mirrored into a node of hierarchy and the
+	// world matrix comes from its update(); call syncBounds() after each update
+	void attach(TransformHierarchy& hierarchy, TransformId parent = NoTransform) {
+		transforms = &hierarchy;
+		node = hierarchy.add(parent, position, rotation, scale);
+	}
+
+	// refreshes the bounding box when the last update moved the player
+	void syncBounds() {
+		if (transforms && transforms->changed(node))
+			updateBoundingBox();
+	}
+
+	void update(mathLib::Vec3 direction, AABB& obstacle, float deltaTime) {
 		// Update the animation status
 		if (direction.getLengthSquare() > 0.0f) {
 			updateRotation(direction);
@@ -34,6 +55,7 @@ public:
 
 	// update player position
 	void move(mathLib::Vec3& direction, float deltaTime, AABB& obstacle) {
+		PROFILE_SCOPE("collision: player vs obstacle");
 		velocity = direction * speed;
 
 		if (direction.getLengthSquare() > 0.0f) {
@@ -73,13 +95,13 @@ public:
 				// check again
 				if (!newBoundingBox.intersects(obstacle)) {
 					position = newPosition;
-					updateBoundingBox();
+					transformChanged();
 				}
 			}
 			else {
 				// if no collision, move
 				position = newPosition;
-				updateBoundingBox();
+				transformChanged();
 			}
 		}
 	}
@@ -89,6 +111,7 @@ public:
 			float angle = atan2(-moveDirection.x, -moveDirection.z);
 			rotation = mathLib::Quaternion::fromAxisAngle(mathLib::Vec3(0, 1, 0), angle);
 			rotation = rotation * mathLib::Quaternion::fromAxisAngle(mathLib::Vec3(1, 0, 0), M_PI); // 修正 X 轴翻转
+			if (transforms) transforms->setRotation(node, rotation);
 		}
 	}
 
@@ -127,10 +150,7 @@ public:
 		mathLib::Vec3 transformedMin(FLT_MAX, FLT_MAX, FLT_MAX);
 		mathLib::Vec3 transformedMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 
-		mathLib::Matrix scaling = mathLib::Matrix::scaling(mathLib::Vec3(0.3f, 0.3f, 0.3f));
-		mathLib::Matrix translation = mathLib::Matrix::translation(position);
-		mathLib::Matrix rotationMatrix = rotation.toMatrix();
-		mathLib::Matrix worldMatrix = scaling * rotationMatrix * translation;
+		mathLib::Matrix worldMatrix = getWorldMatrix();
 
 		// transform each vertex
 		for (auto& corner : corners) {
@@ -150,21 +170,24 @@ public:
 		boundingBox.max = transformedMax;
 	}
 
-	// render player
-	void draw(DxCore* core, Shader* shader, textureManager textures, sampler sam, mathLib::Matrix& vp) {
-		if (model) {
-			// compute matrix
-			mathLib::Matrix scaling = mathLib::Matrix::scaling(mathLib::Vec3(0.3f, 0.3f, 0.3f));
-			mathLib::Matrix translation = mathLib::Matrix::translation(position);
-			mathLib::Matrix rotationMatrix = rotation.toMatrix();
-			mathLib::Matrix worldMatrix = scaling * rotationMatrix * translation;
-
-			model->draw(core, shader, textures, sam, worldMatrix, vp);
-		}
+	// world matrix used to draw the player, as of the last update once attached
+	mathLib::Matrix getWorldMatrix() {
+		if (transforms) return transforms->world(node);
+		mathLib::Matrix scaling = mathLib::Matrix::scaling(scale);
+		mathLib::Matrix translation = mathLib::Matrix::translation(position);
+		mathLib::Matrix rotationMatrix = rotation.toMatrix();
+		return scaling * rotationMatrix * translation;
 	}
 
 	void stayOnGround(float groundHeight) {
 		position.y = groundHeight;
+		if (transforms) transforms->setPosition(node, position);
+	}
+
+	// attached: the bounds follow after the next update, otherwise right away
+	void transformChanged() {
+		if (transforms) transforms->setPosition(node, position);
+		else updateBoundingBox();
 	}
 
 	// compute normal(AABB)
@@ -179,7 +202,7 @@ public:
 		float dz1 = obstacle.max.z - boundingBox.min.z;
 		float dz2 = boundingBox.max.z - obstacle.min.z;
 
-		float minDist = min(min(dx1, dx2), min(dy1, dy2), min(dz1, dz2));
+		float minDist = min(min(dx1, dx2), min(min(dy1, dy2), min(dz1, dz2)));
 		if (minDist == dx1) normal = mathLib::Vec3(-1, 0, 0); // left
 		else if (minDist == dx2) normal = mathLib::Vec3(1, 0, 0); // right
 		else if (minDist == dy1) normal = mathLib::Vec3(0, -1, 0); // bottom
@@ -0,0 +1,293 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <cstdint>
+#include "timer.h"
+
+// Frame profiler. Zones are opened with PROFILE_SCOPE("name") and closed at the end
+// of the C++ scope. Each thread writes finished zones into its own ring buffer, so
+// recording never takes a lock. Build with GE_PROFILE=0 to compile all zones out.
+#ifndef GE_PROFILE
+#define GE_PROFILE 1
+#endif
+
+struct ProfileEvent {
+	const char* name = nullptr;     // string literal, never copied
+	uint64_t start = 0;             // ns, Timer::now()
+	uint64_t end = 0;
+	uint32_t frame = 0;             // Profiler::currentFrame() when the zone opened
+	uint32_t depth = 0;
+};
+
+// ring buffer of finished zones, only written by the thread that owns it
+class ProfileThreadBuffer {
+public:
+	std::vector<ProfileEvent> events;
+	std::atomic<uint64_t> written;  // number of events ever written, the ring index is written & mask
+	uint32_t threadId;
+	std::string threadName;
+	uint32_t depth;
+	// only touched by the thread that calls Profiler::endFrame(): the events summarised so
+	// far, and per depth the time of finished children whose parent is still open
+	uint64_t summarised = 0;
+	double openChildMs[64] = {};
+
+	ProfileThreadBuffer(size_t capacity, uint32_t id) : events(capacity), written(0), threadId(id), depth(0) {
+		threadName = "thread " + std::to_string(id);
+	}
+
+	void push(const ProfileEvent& e) {
+		uint64_t i = written.load(std::memory_order_relaxed);
+		events[i & (events.size() - 1)] = e;
+		written.store(i + 1, std::memory_order_release);
+	}
+
+	// index of the oldest event still in the ring
+	uint64_t oldest() const {
+		uint64_t n = written.load(std::memory_order_acquire);
+		return n > events.size() ? n - events.size() : 0;
+	}
+};
+
+struct ZoneStats {
+	const char* name;
+	uint32_t calls;
+	double totalMs;     // inclusive
+	double selfMs;      // exclusive of child zones
+};
+
+struct FrameSummary {
+	uint32_t frame = 0;
+	double frameMs = 0.0;
+	std::vector<ZoneStats> zones;   // sorted by inclusive time, largest first
+	bool overrun = false;           // a ring wrapped over events not summarised yet, some zones are missing
+};
+
+class Profiler {
+public:
+	static const size_t ringCapacity = 1 << 16; // events per thread, power of two
+
+	static ProfileThreadBuffer& threadBuffer() {
+		thread_local ProfileThreadBuffer* buffer = registerThread();
+		return *buffer;
+	}
+
+	static void setThreadName(const std::string& name) {
+		ProfileThreadBuffer& buffer = threadBuffer();
+		std::lock_guard<std::mutex> lock(state().mutex);
+		buffer.threadName = name;
+	}
+
+	static bool enabled() {
+		return state().enabled.load(std::memory_order_relaxed);
+	}
+
+	static void setEnabled(bool on) {
+		state().enabled.store(on);
+	}
+
+	static uint32_t currentFrame() {
+		return state().frame.load(std::memory_order_relaxed);
+	}
+
+	// mark the start of a frame, call from the main thread
+	static void beginFrame() {
+		state().frameStart = Timer::now();
+	}
+
+	// close the frame, build its summary and move on to the next frame index. The summary
+	// holds the zones that finished since the last endFrame(), on every thread: a zone
+	// still open on another thread is not in it and counts, whole, in the frame it
+	// finishes in. Call from one thread only.
+	static void endFrame() {
+		State& s = state();
+		uint64_t frameEnd = Timer::now();
+		uint32_t frame = s.frame.load();
+		// built in a summary kept from two frames ago, so a steady frame does not allocate
+		FrameSummary& summary = s.nextSummary;
+		summarise(frame, summary);
+		summary.frameMs = (frameEnd - s.frameStart) * 1e-6;
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			std::swap(s.lastSummary, summary);
+		}
+		s.frame.store(frame + 1);
+	}
+
+	// summary of the last frame closed with endFrame()
+	static FrameSummary lastFrame() {
+		std::lock_guard<std::mutex> lock(state().mutex);
+		return state().lastSummary;
+	}
+
+	// aggregate the zones finished since the previous call, across all threads. Each ring
+	// is read up to the count of events written when it is reached, those events are
+	// complete; a ring that wrapped over them meanwhile is reported as an overrun.
+	static void summarise(uint32_t frame, FrameSummary& summary) {
+		summary.frame = frame;
+		summary.frameMs = 0.0;
+		summary.zones.clear();
+		summary.overrun = false;
+		// buffers are only ever appended, read the list entries under the lock instead of copying it
+		size_t threadCount;
+		{
+			std::lock_guard<std::mutex> lock(state().mutex);
+			threadCount = state().buffers.size();
+		}
+		for (size_t t = 0; t < threadCount; t++) {
+			ProfileThreadBuffer* buffer;
+			{
+				std::lock_guard<std::mutex> lock(state().mutex);
+				buffer = state().buffers[t];
+			}
+			uint64_t end = buffer->written.load(std::memory_order_acquire);
+			uint64_t first = buffer->summarised;
+			if (end - first > ringCapacity) {
+				first = end - ringCapacity;
+				summary.overrun = true;
+				for (double& ms : buffer->openChildMs) ms = 0.0;
+			}
+			double* childMs = buffer->openChildMs;
+			for (uint64_t i = first; i < end; i++) {
+				const ProfileEvent& e = buffer->events[i & (ringCapacity - 1)];
+				double ms = (e.end - e.start) * 1e-6;
+				uint32_t d = e.depth < 62 ? e.depth : 62;
+				// children finish before their parent, so their time is already accumulated one
+				// level down, also when they finished in an earlier frame
+				double self = ms - childMs[d + 1];
+				childMs[d + 1] = 0.0;
+				childMs[d] += ms;
+				addZone(summary, e.name, ms, self);
+			}
+			buffer->summarised = end;
+			// the owner kept writing while this ran, it must not have come round to first
+			if (buffer->written.load(std::memory_order_acquire) - first > ringCapacity)
+				summary.overrun = true;
+		}
+		std::sort(summary.zones.begin(), summary.zones.end(), [](const ZoneStats& a, const ZoneStats& b) {
+			return a.totalMs > b.totalMs;
+		});
+	}
+
+	// write every event still in the rings as Chrome trace JSON (chrome://tracing, Perfetto).
+	// Call between frames, zones still being written on other threads may be skipped.
+	static bool exportChromeTrace(const std::string& filename) {
+		std::ofstream file(filename);
+		if (!file.is_open()) return false;
+		uint64_t epoch = state().epoch;
+		file << "{\"traceEvents\":[\n";
+		bool first = true;
+		for (ProfileThreadBuffer* buffer : threads()) {
+			file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+				<< ",\"args\":{\"name\":\"" << buffer->threadName << "\"}}";
+			first = false;
+			uint64_t end = buffer->written.load(std::memory_order_acquire);
+			for (uint64_t i = buffer->oldest(); i < end; i++) {
+				const ProfileEvent& e = buffer->events[i & (ringCapacity - 1)];
+				file << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+					<< ",\"ts\":" << (e.start - epoch) / 1000.0 << ",\"dur\":" << (e.end - e.start) / 1000.0
+					<< ",\"args\":{\"frame\":" << e.frame << "}}";
+			}
+		}
+		file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+		return true;
+	}
+
+	// one line per zone, for the debug output / console
+	static std::string formatSummary(const FrameSummary& summary, size_t maxZones = 8) {
+		std::string text = "frame " + std::to_string(summary.frame) + ": " + std::to_string(summary.frameMs) + " ms"
+			+ (summary.overrun ? " (profiler ring overrun, zones missing)" : "") + "\n";
+		for (size_t i = 0; i < summary.zones.size() && i < maxZones; i++) {
+			const ZoneStats& z = summary.zones[i];
+			text += "  " + std::string(z.name) + " x" + std::to_string(z.calls) + ": " + std::to_string(z.totalMs)
+				+ " ms (self " + std::to_string(z.selfMs) + " ms)\n";
+		}
+		return text;
+	}
+
+private:
+	struct State {
+		std::mutex mutex;
+		std::vector<ProfileThreadBuffer*> buffers;
+		std::atomic<bool> enabled{ true };
+		std::atomic<uint32_t> frame{ 0 };
+		uint64_t epoch = Timer::now();
+		uint64_t frameStart = Timer::now();
+		FrameSummary lastSummary;
+		FrameSummary nextSummary;
+	};
+
+	static State& state() {
+		static State s;
+		return s;
+	}
+
+	// buffers live until the process exits so traces can still be exported after a thread finishes
+	static ProfileThreadBuffer* registerThread() {
+		State& s = state();
+		std::lock_guard<std::mutex> lock(s.mutex);
+		ProfileThreadBuffer* buffer = new ProfileThreadBuffer(ringCapacity, (uint32_t)s.buffers.size());
+		s.buffers.push_back(buffer);
+		return buffer;
+	}
+
+	static std::vector<ProfileThreadBuffer*> threads() {
+		std::lock_guard<std::mutex> lock(state().mutex);
+		return state().buffers;
+	}
+
+	static void addZone(FrameSummary& summary, const char* name, double ms, double self) {
+		for (auto& z : summary.zones) {
+			if (z.name == name || strcmp(z.name, name) == 0) {
+				z.calls++;
+				z.totalMs += ms;
+				z.selfMs += self;
+				return;
+			}
+		}
+		summary.zones.push_back({ name, 1, ms, self });
+	}
+};
+
+// RAII zone, prefer the PROFILE_SCOPE macro
+class ProfileScope {
+public:
+	explicit ProfileScope(const char* _name) : name(_name) {
+		active = Profiler::enabled();
+		if (!active) return;
+		ProfileThreadBuffer& buffer = Profiler::threadBuffer();
+		depth = buffer.depth++;
+		frame = Profiler::currentFrame();
+		start = Timer::now();
+	}
+
+	~ProfileScope() {
+		if (!active) return;
+		uint64_t end = Timer::now();
+		ProfileThreadBuffer& buffer = Profiler::threadBuffer();
+		buffer.depth--;
+		buffer.push({ name, start, end, frame, depth });
+	}
+
+private:
+	const char* name;
+	uint64_t start = 0;
+	uint32_t frame = 0;
+	uint32_t depth = 0;
+	bool active = false;
+};
+
+#if GE_PROFILE
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_SCOPE(__FUNCTION__)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_FUNCTION()
+#endif
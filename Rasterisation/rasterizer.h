@@ -0,0 +1,504 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <atomic>
+#include <fstream>
+#include <cstdint>
+#include "mathLib.h"
+#include "vertex.h"
+#include "image.h"
+#include "profiler.h"
+#include "jobSystem.h"
+
+// Software rasterizer. Renders the same STATIC_VERTEX / ANIMATED_VERTEX + index data
+// the D3D meshes use into a colour and depth buffer on the CPU, so scenes can be
+// rendered headless (image tests on Linux) or without a GPU.
+//
+// drawIndexed() runs the vertex stage (skinning, W and VP, near plane clipping) and
+// bins the triangles into 64x64 tiles. flush() rasterises the tiles in parallel on the
+// job system's workers, each tile is owned by one thread so no locking is needed, and
+// triangles are drawn in submission order within a tile. Coverage and depth are evaluated 8 pixels at a time.
+
+// colour + depth target, colour is RGBA8 with red in the low byte
+class FrameBuffer {
+public:
+	int width = 0;
+	int height = 0;
+	std::vector<uint32_t> colour;
+	std::vector<float> depth;   // 0 near plane, 1 far plane
+
+	void resize(int w, int h) {
+		width = w;
+		height = h;
+		colour.assign((size_t)w * h, 0);
+		depth.assign((size_t)w * h, 1.0f);
+	}
+
+	void clear(const mathLib::Color& c, float d = 1.0f) {
+		std::fill(colour.begin(), colour.end(), pack(c.color.x, c.color.y, c.color.z, c.color.w));
+		std::fill(depth.begin(), depth.end(), d);
+	}
+
+	uint32_t pixel(int x, int y) const {
+		return colour[(size_t)y * width + x];
+	}
+
+	// binary PPM, readable by most image viewers and trivial to diff in tests
+	bool savePPM(const std::string& filename) const {
+		std::ofstream file(filename, std::ios::binary);
+		if (!file.is_open()) return false;
+		file << "P6\n" << width << " " << height << "\n255\n";
+		std::vector<unsigned char> row((size_t)width * 3);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				uint32_t c = pixel(x, y);
+				row[x * 3] = c & 0xff;
+				row[x * 3 + 1] = (c >> 8) & 0xff;
+				row[x * 3 + 2] = (c >> 16) & 0xff;
+			}
+			file.write((const char*)row.data(), row.size());
+		}
+		return true;
+	}
+
+	static uint32_t pack(float r, float g, float b, float a) {
+		return (uint32_t)toByte(r) | ((uint32_t)toByte(g) << 8) | ((uint32_t)toByte(b) << 16) | ((uint32_t)toByte(a) << 24);
+	}
+
+	static unsigned char toByte(float v) {
+		v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+		return (unsigned char)(v * 255.0f + 0.5f);
+	}
+};
+
+// what the pixel stage needs to know about a draw, the CPU side of Shader + textures
+struct RasterMaterial {
+	const Image* albedo = nullptr;      // nullptr uses colour, must stay alive until flush()
+	mathLib::Color colour = mathLib::Color(1.0f, 1.0f, 1.0f, 1.0f);
+	bool alphaTest = true;              // discard texels with alpha < 0.5, as normalPixelShader does
+	bool depthOnly = false;             // occluders: write depth, leave colour alone
+};
+
+struct RasterStats {
+	uint64_t trianglesSubmitted = 0;
+	uint64_t trianglesClipped = 0;      // produced extra triangles at the near plane
+	uint64_t trianglesCulled = 0;       // behind the near plane, off screen or zero area
+	uint64_t trianglesBinned = 0;
+	uint64_t tileEntries = 0;           // triangle x tile pairs
+	std::atomic<uint64_t> pixelsShaded{ 0 };
+
+	void reset() {
+		trianglesSubmitted = trianglesClipped = trianglesCulled = trianglesBinned = tileEntries = 0;
+		pixelsShaded = 0;
+	}
+};
+
+class SoftwareRasterizer {
+public:
+	static const int tileSize = 64;     // multiple of the 8 pixel span width
+
+	FrameBuffer target;
+	RasterStats stats;
+	JobSystem* jobs = nullptr;
+	int threadCount = 1;                // threads taking tiles in flush(), the caller included
+	mathLib::Vec3 lightDirection = mathLib::Vec3(0.0f, 1.0f, 0.5f).normalize();
+	float ambient = 0.3f;
+
+	// tiles are spread over up to threads of the job system's workers (0: all of them),
+	// without jobs flush() runs on the calling thread
+	void init(int width, int height, JobSystem* jobSystem = nullptr, int threads = 0) {
+		target.resize(width, height);
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		bins.assign(tilesX * tilesY, std::vector<uint32_t>());
+		jobs = jobSystem;
+		int workers = jobs ? jobs->workerCount() : 1;
+		threadCount = threads > 0 && threads < workers ? threads : workers;
+	}
+
+	// room for that many triangles a frame, in any tile, so binning them does not allocate
+	void reserve(size_t triangleCount) {
+		triangles.reserve(triangleCount);
+		for (auto& bin : bins)
+			bin.reserve(triangleCount);
+	}
+
+	void clear(const mathLib::Color& c, float depth = 1.0f) {
+		target.clear(c, depth);
+	}
+
+	void drawIndexed(const std::vector<STATIC_VERTEX>& vertices, const std::vector<unsigned int>& indices,
+		mathLib::Matrix world, mathLib::Matrix vp, const RasterMaterial& material) {
+		PROFILE_SCOPE("raster: vertex + bin");
+		mathLib::Matrix wvp = world * vp;
+		clipVertices.resize(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++) {
+			const STATIC_VERTEX& v = vertices[i];
+			mathLib::Vec4 p(v.pos.x, v.pos.y, v.pos.z, 1.0f);
+			mathLib::Vec3 n = v.normal;
+			clipVertices[i].position = wvp.mulPointP(p);
+			clipVertices[i].normal = world.mulVec(n);
+			clipVertices[i].uv = mathLib::Vec2(v.tu, v.tv);
+		}
+		assemble(indices, material);
+	}
+
+	// bones are AnimationInstance::matrices, skinned the same way animationVertexShader does
+	void drawIndexed(const std::vector<ANIMATED_VERTEX>& vertices, const std::vector<unsigned int>& indices, const mathLib::Matrix* bones,
+		mathLib::Matrix world, mathLib::Matrix vp, const RasterMaterial& material) {
+		PROFILE_SCOPE("raster: vertex + bin");
+		mathLib::Matrix wvp = world * vp;
+		clipVertices.resize(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++) {
+			const ANIMATED_VERTEX& v = vertices[i];
+			mathLib::Matrix transform;
+			for (int j = 0; j < 16; j++)
+				transform.m[j] = bones[v.bonesIDs[0]].m[j] * v.boneWeights[0] + bones[v.bonesIDs[1]].m[j] * v.boneWeights[1]
+					+ bones[v.bonesIDs[2]].m[j] * v.boneWeights[2] + bones[v.bonesIDs[3]].m[j] * v.boneWeights[3];
+			mathLib::Vec4 p(v.pos.x, v.pos.y, v.pos.z, 1.0f);
+			mathLib::Vec3 n = v.normal;
+			mathLib::Vec4 skinned = transform.mulPointP(p);
+			mathLib::Vec3 skinnedNormal = transform.mulVec(n);
+			clipVertices[i].position = wvp.mulPointP(skinned);
+			clipVertices[i].normal = world.mulVec(skinnedNormal);
+			clipVertices[i].uv = mathLib::Vec2(v.tu, v.tv);
+		}
+		assemble(indices, material);
+	}
+
+	// rasterise everything drawn since the last flush, tiles are spread over threadCount
+	// threads: jobs that take tiles until none are left, and the caller until they are done
+	void flush() {
+		PROFILE_SCOPE("raster: tiles");
+		std::atomic<int> nextTile(0);
+		auto worker = [this, &nextTile]() {
+			PROFILE_SCOPE("raster: tile worker");
+			int tile;
+			while ((tile = nextTile.fetch_add(1)) < (int)bins.size())
+				rasteriseTile(tile);
+		};
+		int workers = threadCount < (int)bins.size() ? threadCount : (int)bins.size();
+		if (jobs && workers > 1) {
+			JobCounter done;
+			auto* f = &worker;
+			for (int i = 1; i < workers; i++)
+				jobs->run([f] { (*f)(); }, &done);
+			worker();
+			jobs->wait(done);
+		}
+		else
+			worker();
+
+		triangles.clear();
+		materials.clear();
+		for (auto& bin : bins)
+			bin.clear();
+	}
+
+private:
+	struct ClipVertex {
+		mathLib::Vec4 position;     // clip space
+		mathLib::Vec3 normal;       // world space
+		mathLib::Vec2 uv;
+	};
+
+	// set up triangle, edges and attributes in pixels
+	struct RasterTriangle {
+		float edgeX[3], edgeY[3];               // first vertex of the edge opposite vertex i
+		float edgeA[3], edgeB[3];               // E(p) = a * (p.x - x) + b * (p.y - y), divide by area for the barycentric
+		bool edgeInclusive[3];                  // pixels exactly on the edge belong to this triangle
+		float invArea;
+		float z[3];                             // depth, linear in screen space
+		float invW[3];
+		mathLib::Vec3 normal[3];
+		mathLib::Vec2 uv[3];
+		int minX, minY, maxX, maxY;             // inclusive pixel bounds, clamped to the target
+		uint32_t material;
+	};
+
+	int tilesX = 0;
+	int tilesY = 0;
+	std::vector<ClipVertex> clipVertices;
+	std::vector<RasterTriangle> triangles;
+	std::vector<RasterMaterial> materials;
+	std::vector<std::vector<uint32_t>> bins;    // triangle indices per tile, in submission order
+
+	void assemble(const std::vector<unsigned int>& indices, const RasterMaterial& material) {
+		uint32_t materialIndex = (uint32_t)materials.size();
+		materials.push_back(material);
+		ClipVertex polygon[4];
+		for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+			stats.trianglesSubmitted++;
+			int count = clipNear(clipVertices[indices[i]], clipVertices[indices[i + 1]], clipVertices[indices[i + 2]], polygon);
+			if (count == 0) {
+				stats.trianglesCulled++;
+				continue;
+			}
+			if (count == 4) stats.trianglesClipped++;
+			for (int j = 1; j + 1 < count; j++)
+				setupTriangle(polygon[0], polygon[j], polygon[j + 1], materialIndex);
+		}
+	}
+
+	static ClipVertex lerpVertex(const ClipVertex& a, const ClipVertex& b, float t) {
+		ClipVertex v;
+		v.position = a.position + (b.position - a.position) * t;
+		mathLib::Vec3 na = a.normal;
+		mathLib::Vec3 nb = b.normal;
+		mathLib::Vec2 ua = a.uv;
+		mathLib::Vec2 ub = b.uv;
+		v.normal = na * (1.0f - t) + nb * t;
+		v.uv = ua * (1.0f - t) + ub * t;
+		return v;
+	}
+
+	// clip against the near plane (z >= -w, the projection is OpenGL style), returns 0, 3 or 4 vertices.
+	// The other planes are handled by clamping the screen bounds and the depth test.
+	static int clipNear(const ClipVertex& v0, const ClipVertex& v1, const ClipVertex& v2, ClipVertex* out) {
+		const ClipVertex* in[3] = { &v0, &v1, &v2 };
+		float d[3];
+		for (int i = 0; i < 3; i++)
+			d[i] = in[i]->position.z + in[i]->position.w;
+		int count = 0;
+		for (int i = 0; i < 3; i++) {
+			int j = (i + 1) % 3;
+			if (d[i] >= 0.0f) out[count++] = *in[i];
+			if ((d[i] >= 0.0f) != (d[j] >= 0.0f))
+				out[count++] = lerpVertex(*in[i], *in[j], d[i] / (d[i] - d[j]));
+		}
+		return count >= 3 ? count : 0;
+	}
+
+	void setupTriangle(const ClipVertex& c0, const ClipVertex& c1, const ClipVertex& c2, uint32_t material) {
+		const ClipVertex* v[3] = { &c0, &c1, &c2 };
+		mathLib::Vec2 s[3];
+		float z[3];
+		float invW[3];
+		for (int i = 0; i < 3; i++) {
+			invW[i] = 1.0f / v[i]->position.w;
+			// NDC to pixels, same mapping as MapToScreenSpace
+			s[i] = mathLib::Vec2((v[i]->position.x * invW[i] + 1.0f) * 0.5f * target.width,
+				(1.0f - v[i]->position.y * invW[i]) * 0.5f * target.height);
+			z[i] = v[i]->position.z * invW[i] * 0.5f + 0.5f;
+			// snap to 1/256 pixel so edge products stay exact in double (see edgeAt)
+			s[i].x = snap(s[i].x);
+			s[i].y = snap(s[i].y);
+		}
+
+		// rasterizer state is CULL_NONE, so flip clockwise triangles instead of dropping them
+		float area = mathLib::edgeFunction(s[0], s[1], s[2]);
+		if (area < 0.0f) {
+			std::swap(v[1], v[2]);
+			std::swap(s[1], s[2]);
+			std::swap(z[1], z[2]);
+			std::swap(invW[1], invW[2]);
+			area = -area;
+		}
+		if (!(area > 0.0f)) {
+			stats.trianglesCulled++;
+			return;
+		}
+
+		RasterTriangle t;
+		float minXf = min(s[0].x, min(s[1].x, s[2].x));
+		float maxXf = max(s[0].x, max(s[1].x, s[2].x));
+		float minYf = min(s[0].y, min(s[1].y, s[2].y));
+		float maxYf = max(s[0].y, max(s[1].y, s[2].y));
+		if (maxXf < 0.0f || maxYf < 0.0f || minXf >= target.width || minYf >= target.height) {
+			stats.trianglesCulled++;
+			return;
+		}
+		t.minX = minXf < 0.0f ? 0 : (int)minXf;
+		t.minY = minYf < 0.0f ? 0 : (int)minYf;
+		t.maxX = maxXf >= target.width ? target.width - 1 : (int)maxXf;
+		t.maxY = maxYf >= target.height ? target.height - 1 : (int)maxYf;
+
+		// barycentric i is mathLib::edgeFunction of the edge opposite vertex i over the area. The
+		// plane is kept relative to the edge's first vertex: the neighbour sharing the edge then
+		// computes exactly the negated value, so shared edges have no cracks and no double hits.
+		for (int i = 0; i < 3; i++) {
+			mathLib::Vec2& a = s[(i + 1) % 3];
+			mathLib::Vec2& b = s[(i + 2) % 3];
+			t.edgeX[i] = a.x;
+			t.edgeY[i] = a.y;
+			t.edgeA[i] = b.y - a.y;
+			t.edgeB[i] = a.x - b.x;
+			// exactly one of the two triangles sharing an edge owns the pixels on it
+			t.edgeInclusive[i] = t.edgeA[i] > 0.0f || (t.edgeA[i] == 0.0f && t.edgeB[i] > 0.0f);
+		}
+		t.invArea = 1.0f / area;
+		for (int i = 0; i < 3; i++) {
+			t.z[i] = z[i];
+			t.invW[i] = invW[i];
+			t.normal[i] = v[i]->normal;
+			t.uv[i] = v[i]->uv;
+		}
+		t.material = material;
+
+		uint32_t index = (uint32_t)triangles.size();
+		triangles.push_back(t);
+		stats.trianglesBinned++;
+		for (int ty = t.minY / tileSize; ty <= t.maxY / tileSize; ty++) {
+			for (int tx = t.minX / tileSize; tx <= t.maxX / tileSize; tx++) {
+				bins[ty * tilesX + tx].push_back(index);
+				stats.tileEntries++;
+			}
+		}
+	}
+
+	static float snap(float v) {
+		return fabsf(v) < 32768.0f ? floorf(v * 256.0f + 0.5f) * (1.0f / 256.0f) : v;
+	}
+
+	// edge i at the centre of pixel (x, y). With snapped vertices the products are exact in
+	// double, so the neighbour sharing the edge gets exactly the negated value.
+	static float edgeAt(const RasterTriangle& t, int i, double px, double py) {
+		return (float)((double)t.edgeA[i] * (px - t.edgeX[i]) + (double)t.edgeB[i] * (py - t.edgeY[i]));
+	}
+
+	// coverage and depth test for the 8 pixels starting at (x, y). Fills the barycentrics and
+	// depth of every lane and returns a bit mask of the lanes that pass.
+	int coverSpan(const RasterTriangle& t, int x, int y, int lanes, float* l0, float* l1, float* l2, float* z) const {
+		double px = x + 0.5;
+		double py = y + 0.5;
+		const float* depth = &target.depth[(size_t)y * target.width + x];
+		float* out[3] = { l0, l1, l2 };
+#if MATHLIB_SSE2
+		const __m128 offsetLo = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+		const __m128 offsetHi = _mm_setr_ps(4.0f, 5.0f, 6.0f, 7.0f);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 invArea = _mm_set1_ps(t.invArea);
+		__m128 maskLo = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		__m128 maskHi = maskLo;
+		__m128 zLo = zero;
+		__m128 zHi = zero;
+		for (int i = 0; i < 3; i++) {
+			__m128 a = _mm_set1_ps(t.edgeA[i]);
+			__m128 base = _mm_set1_ps(edgeAt(t, i, px, py));
+			__m128 eLo = _mm_add_ps(base, _mm_mul_ps(a, offsetLo));
+			__m128 eHi = _mm_add_ps(base, _mm_mul_ps(a, offsetHi));
+			if (t.edgeInclusive[i]) {
+				maskLo = _mm_and_ps(maskLo, _mm_cmpge_ps(eLo, zero));
+				maskHi = _mm_and_ps(maskHi, _mm_cmpge_ps(eHi, zero));
+			}
+			else {
+				maskLo = _mm_and_ps(maskLo, _mm_cmpgt_ps(eLo, zero));
+				maskHi = _mm_and_ps(maskHi, _mm_cmpgt_ps(eHi, zero));
+			}
+			eLo = _mm_mul_ps(eLo, invArea);
+			eHi = _mm_mul_ps(eHi, invArea);
+			_mm_storeu_ps(out[i], eLo);
+			_mm_storeu_ps(out[i] + 4, eHi);
+			__m128 zi = _mm_set1_ps(t.z[i]);
+			zLo = _mm_add_ps(zLo, _mm_mul_ps(eLo, zi));
+			zHi = _mm_add_ps(zHi, _mm_mul_ps(eHi, zi));
+		}
+		int mask = _mm_movemask_ps(maskLo) | (_mm_movemask_ps(maskHi) << 4);
+		mask &= (1 << lanes) - 1;
+		if (mask == 0) return 0;
+		_mm_storeu_ps(z, zLo);
+		_mm_storeu_ps(z + 4, zHi);
+		if (lanes == 8) {
+			__m128 dLo = _mm_loadu_ps(depth);
+			__m128 dHi = _mm_loadu_ps(depth + 4);
+			mask &= _mm_movemask_ps(_mm_cmplt_ps(zLo, dLo)) | (_mm_movemask_ps(_mm_cmplt_ps(zHi, dHi)) << 4);
+		}
+		else {
+			for (int k = 0; k < lanes; k++)
+				if (!(z[k] < depth[k])) mask &= ~(1 << k);
+		}
+		return mask;
+#else
+		int mask = 0;
+		float base[3];
+		for (int i = 0; i < 3; i++)
+			base[i] = edgeAt(t, i, px, py);
+		for (int k = 0; k < lanes; k++) {
+			bool inside = true;
+			z[k] = 0.0f;
+			for (int i = 0; i < 3; i++) {
+				float e = base[i] + t.edgeA[i] * k;
+				inside = inside && (t.edgeInclusive[i] ? e >= 0.0f : e > 0.0f);
+				out[i][k] = e * t.invArea;
+				z[k] += out[i][k] * t.z[i];
+			}
+			if (inside && z[k] < depth[k]) mask |= 1 << k;
+		}
+		return mask;
+#endif
+	}
+
+	void rasteriseTile(int tile) {
+		std::vector<uint32_t>& bin = bins[tile];
+		if (bin.empty()) return;
+		int tileX0 = (tile % tilesX) * tileSize;
+		int tileY0 = (tile / tilesX) * tileSize;
+		int tileX1 = min(tileX0 + tileSize, target.width) - 1;
+		int tileY1 = min(tileY0 + tileSize, target.height) - 1;
+		float l0[8], l1[8], l2[8], z[8];
+		uint64_t shaded = 0;
+		for (uint32_t index : bin) {
+			const RasterTriangle& t = triangles[index];
+			const RasterMaterial& material = materials[t.material];
+			int x0 = max(t.minX, tileX0) & ~7;
+			int x1 = min(t.maxX, tileX1);
+			int y0 = max(t.minY, tileY0);
+			int y1 = min(t.maxY, tileY1);
+			for (int y = y0; y <= y1; y++) {
+				for (int x = x0; x <= x1; x += 8) {
+					int lanes = target.width - x < 8 ? target.width - x : 8;
+					int mask = coverSpan(t, x, y, lanes, l0, l1, l2, z);
+					while (mask) {
+						int k = lowestBit(mask);
+						mask &= mask - 1;
+						if (shadePixel(t, material, x + k, y, l0[k], l1[k], l2[k], z[k]))
+							shaded++;
+					}
+				}
+			}
+		}
+		stats.pixelsShaded += shaded;
+	}
+
+	bool shadePixel(const RasterTriangle& t, const RasterMaterial& material, int x, int y, float alpha, float beta, float gamma, float z) {
+		if (material.depthOnly) {
+			target.depth[(size_t)y * target.width + x] = z;
+			return true;
+		}
+		mathLib::Vec2 uv = mathLib::perspectiveCorrectInterpolateAttribute(t.uv[0], t.uv[1], t.uv[2], t.invW[0], t.invW[1], t.invW[2], alpha, beta, gamma);
+		mathLib::Color albedo = material.colour;
+		if (material.albedo != nullptr)
+			albedo = albedo * sample(*material.albedo, uv.x, uv.y);
+		if (material.alphaTest && albedo.color.w < 0.5f)
+			return false;
+		mathLib::Vec3 normal = mathLib::perspectiveCorrectInterpolateAttribute(t.normal[0], t.normal[1], t.normal[2], t.invW[0], t.invW[1], t.invW[2], alpha, beta, gamma);
+		float lenSq = normal.getLengthSquare();
+		float diffuse = lenSq > 0.0f ? max(normal.dot(lightDirection) / sqrtf(lenSq), 0.0f) : 1.0f;
+		float light = ambient + (1.0f - ambient) * diffuse;
+		size_t i = (size_t)y * target.width + x;
+		target.colour[i] = FrameBuffer::pack(albedo.color.x * light, albedo.color.y * light, albedo.color.z * light, 1.0f);
+		target.depth[i] = z;
+		return true;
+	}
+
+	// nearest texel with wrap addressing
+	static mathLib::Color sample(const Image& image, float u, float v) {
+		if (image.width == 0 || image.height == 0) return mathLib::Color(1.0f, 1.0f, 1.0f, 1.0f);
+		u -= floorf(u);
+		v -= floorf(v);
+		int x = min((int)(u * image.width), image.width - 1);
+		int y = min((int)(v * image.height), image.height - 1);
+		const unsigned char* texel = &image.texels[((size_t)y * image.width + x) * image.channels];
+		switch (image.channels) {
+		case 1: return mathLib::Color(texel[0], texel[0], texel[0], (unsigned char)255);
+		case 2: return mathLib::Color(texel[0], texel[0], texel[0], texel[1]);
+		default: return mathLib::Color(texel[0], texel[1], texel[2], texel[3]);
+		}
+	}
+
+	static int lowestBit(int mask) {
+		int k = 0;
+		while (!(mask & (1 << k))) k++;
+		return k;
+	}
+};
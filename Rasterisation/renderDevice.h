@@ -0,0 +1,591 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <initializer_list>
+#include <cstdint>
+#include <cstring>
+#include "renderQueue.h"
+#include "uploadRing.h"
+
+// The part of D3D11 the frame building code needs: buffers, map/unmap, binds and
+// draws. DxDevice implements it on a real device, NullDevice records it so the CPU
+// side of a frame can run and be checked without a GPU.
+//
+// Shaders, textures and samplers are created by the platform code and only bound
+// through this interface; their handles are whatever the device hands out.
+typedef uint32_t DeviceHandle;
+const DeviceHandle InvalidDeviceHandle = 0xffffffff;
+
+enum BufferBinding {
+	BindVertexBuffer = 0,
+	BindIndexBuffer = 1,
+	BindConstantBuffer = 2
+};
+
+// element size of an index buffer, 16 bits when every vertex index fits
+enum IndexFormat {
+	Index32 = 0,
+	Index16 = 1
+};
+
+enum DeviceStage {
+	StageVertex = 0,
+	StagePixel = 1
+};
+
+struct BufferDesc {
+	BufferBinding binding = BindVertexBuffer;
+	uint32_t size = 0;
+	bool dynamic = false;       // written with map/unmap every frame
+};
+
+class RenderDevice {
+public:
+	virtual ~RenderDevice() {}
+	virtual DeviceHandle createBuffer(const BufferDesc& desc, const void* data) = 0;
+	// write-discard, the whole buffer is rewritten before unmap
+	virtual void* map(DeviceHandle buffer) = 0;
+	virtual void unmap(DeviceHandle buffer) = 0;
+	virtual void bindShader(DeviceHandle shader) = 0;
+	virtual void bindVertexBuffer(DeviceHandle buffer, uint32_t stride) = 0;
+	virtual void bindIndexBuffer(DeviceHandle buffer, IndexFormat format) = 0;
+	virtual void bindConstantBuffer(DeviceStage stage, int slot, DeviceHandle buffer) = 0;
+	virtual void bindTexture(int slot, DeviceHandle texture) = 0;
+	virtual void bindSampler(int slot, DeviceHandle sampler) = 0;
+	virtual void drawIndexed(uint32_t indexCount, uint32_t startIndex, int32_t baseVertex) = 0;
+	virtual void draw(uint32_t vertexCount, uint32_t startVertex) = 0;
+
+	// Constant buffer ranges (D3D11.1): one dynamic buffer holds the constants of many
+	// draws, each bind points at its own block. Offsets are multiples of 256 bytes.
+	virtual bool supportsConstantRanges() const = 0;
+	// no-overwrite, the caller only writes bytes the GPU is done with and says which in unmapRange
+	virtual void* mapNoOverwrite(DeviceHandle buffer) = 0;
+	virtual void unmapRange(DeviceHandle buffer, uint32_t offset, uint32_t size) = 0;
+	virtual void bindConstantRange(DeviceStage stage, int slot, DeviceHandle buffer, uint32_t offset, uint32_t size) = 0;
+	// fence values count up: signalFence marks everything issued so far, completedFence
+	// is the last one the GPU got past, waitForFence blocks until it gets past value
+	virtual uint64_t signalFence() = 0;
+	virtual uint64_t completedFence() = 0;
+	virtual void waitForFence(uint64_t value) = 0;
+};
+
+// Binary log of device calls: an opcode byte followed by little endian 32-bit
+// arguments. Buffer contents (initial data, bytes written between map and unmap)
+// are stored in full so a replay reproduces the frame exactly.
+class CommandStream {
+public:
+	enum Op : uint8_t {
+		OpCreateBuffer,         // handle, binding, size, dynamic, hasData, [size bytes]
+		OpMap,                  // buffer
+		OpUnmap,                // buffer, size, [size bytes]
+		OpBindShader,           // shader
+		OpBindVertexBuffer,     // buffer, stride
+		OpBindIndexBuffer,      // buffer, format
+		OpBindConstantBuffer,   // stage, slot, buffer
+		OpBindTexture,          // slot, texture
+		OpBindSampler,          // slot, sampler
+		OpDrawIndexed,          // indexCount, startIndex, baseVertex
+		OpDraw,                 // vertexCount, startVertex
+		OpMapNoOverwrite,       // buffer
+		OpUnmapRange,           // buffer, offset, size, [size bytes]
+		OpBindConstantRange,    // stage, slot, buffer, offset, size
+		OpCount
+	};
+
+	// one decoded command, data points into the stream
+	struct Command {
+		Op op;
+		uint32_t args[5];
+		const uint8_t* data;
+		uint32_t dataSize;
+	};
+
+	std::vector<uint8_t> bytes;
+
+	void clear() { bytes.clear(); }
+	size_t size() const { return bytes.size(); }
+
+	void write(Op op, std::initializer_list<uint32_t> args, const void* data = nullptr, uint32_t dataSize = 0) {
+		bytes.push_back(op);
+		for (uint32_t a : args)
+			writeU32(a);
+		if (dataSize > 0) {
+			size_t at = bytes.size();
+			bytes.resize(at + dataSize);
+			memcpy(&bytes[at], data, dataSize);
+		}
+	}
+
+	// decode the command at offset and advance it, false at the end or on a broken stream
+	bool next(size_t& offset, Command& c) const {
+		if (offset >= bytes.size() || bytes[offset] >= OpCount) return false;
+		c.op = (Op)bytes[offset];
+		int count = argCount(c.op);
+		if (offset + 1 + count * 4 > bytes.size()) return false;
+		for (int i = 0; i < count; i++)
+			memcpy(&c.args[i], &bytes[offset + 1 + i * 4], 4);
+		offset += 1 + count * 4;
+		c.data = nullptr;
+		c.dataSize = 0;
+		if (c.op == OpCreateBuffer && c.args[4]) c.dataSize = c.args[2];
+		if (c.op == OpUnmap) c.dataSize = c.args[1];
+		if (c.op == OpUnmapRange) c.dataSize = c.args[2];
+		if (c.dataSize > 0) {
+			if (offset + c.dataSize > bytes.size()) return false;
+			c.data = &bytes[offset];
+			offset += c.dataSize;
+		}
+		return true;
+	}
+
+	std::vector<Command> decode() const {
+		std::vector<Command> commands;
+		size_t offset = 0;
+		Command c;
+		while (next(offset, c))
+			commands.push_back(c);
+		return commands;
+	}
+
+	// issue every command again on another device. Buffers created in the stream get
+	// new handles there, everything else is passed through as recorded.
+	void replay(RenderDevice& device) const {
+		std::vector<std::pair<uint32_t, DeviceHandle>> remap;
+		auto buffer = [&](uint32_t recorded) {
+			for (auto& r : remap)
+				if (r.first == recorded) return r.second;
+			return (DeviceHandle)recorded;
+		};
+		std::vector<std::pair<DeviceHandle, void*>> mapped;
+		size_t offset = 0;
+		Command c;
+		while (next(offset, c)) {
+			switch (c.op) {
+			case OpCreateBuffer: {
+				BufferDesc desc;
+				desc.binding = (BufferBinding)c.args[1];
+				desc.size = c.args[2];
+				desc.dynamic = c.args[3] != 0;
+				remap.push_back({ c.args[0], device.createBuffer(desc, c.data) });
+				break;
+			}
+			case OpMap:
+				mapped.push_back({ buffer(c.args[0]), device.map(buffer(c.args[0])) });
+				break;
+			case OpUnmap: {
+				DeviceHandle b = buffer(c.args[0]);
+				for (size_t i = 0; i < mapped.size(); i++) {
+					if (mapped[i].first != b) continue;
+					if (mapped[i].second) memcpy(mapped[i].second, c.data, c.dataSize);
+					mapped.erase(mapped.begin() + i);
+					break;
+				}
+				device.unmap(b);
+				break;
+			}
+			case OpMapNoOverwrite:
+				mapped.push_back({ buffer(c.args[0]), device.mapNoOverwrite(buffer(c.args[0])) });
+				break;
+			case OpUnmapRange: {
+				DeviceHandle b = buffer(c.args[0]);
+				for (size_t i = 0; i < mapped.size(); i++) {
+					if (mapped[i].first != b) continue;
+					if (mapped[i].second) memcpy((uint8_t*)mapped[i].second + c.args[1], c.data, c.dataSize);
+					mapped.erase(mapped.begin() + i);
+					break;
+				}
+				device.unmapRange(b, c.args[1], c.args[2]);
+				break;
+			}
+			case OpBindShader: device.bindShader(c.args[0]); break;
+			case OpBindVertexBuffer: device.bindVertexBuffer(buffer(c.args[0]), c.args[1]); break;
+			case OpBindIndexBuffer: device.bindIndexBuffer(buffer(c.args[0]), (IndexFormat)c.args[1]); break;
+			case OpBindConstantBuffer: device.bindConstantBuffer((DeviceStage)c.args[0], (int)c.args[1], buffer(c.args[2])); break;
+			case OpBindTexture: device.bindTexture((int)c.args[0], c.args[1]); break;
+			case OpBindSampler: device.bindSampler((int)c.args[0], c.args[1]); break;
+			case OpDrawIndexed: device.drawIndexed(c.args[0], c.args[1], (int32_t)c.args[2]); break;
+			case OpDraw: device.draw(c.args[0], c.args[1]); break;
+			case OpBindConstantRange: device.bindConstantRange((DeviceStage)c.args[0], (int)c.args[1], buffer(c.args[2]), c.args[3], c.args[4]); break;
+			default: break;
+			}
+		}
+	}
+
+	// one line per command, buffer contents as size and hash
+	std::string disassemble() const {
+		std::ostringstream out;
+		for (auto& c : decode())
+			out << describe(c) << "\n";
+		return out.str();
+	}
+
+	static std::string describe(const Command& c) {
+		static const char* names[] = { "createBuffer", "map", "unmap", "bindShader", "bindVertexBuffer", "bindIndexBuffer",
+			"bindConstantBuffer", "bindTexture", "bindSampler", "drawIndexed", "draw", "mapNoOverwrite", "unmapRange", "bindConstantRange" };
+		std::ostringstream out;
+		out << names[c.op];
+		for (int i = 0; i < argCount(c.op); i++)
+			out << " " << c.args[i];
+		if (c.dataSize > 0)
+			out << " [" << c.dataSize << " bytes " << std::hex << hash(c.data, c.dataSize) << std::dec << "]";
+		return out.str();
+	}
+
+	// index of the first command that differs, -1 when the streams match. what gets a
+	// line from each side (or "<end>") for the report.
+	static int firstDifference(const CommandStream& a, const CommandStream& b, std::string& what) {
+		std::vector<Command> ca = a.decode();
+		std::vector<Command> cb = b.decode();
+		size_t n = ca.size() > cb.size() ? ca.size() : cb.size();
+		for (size_t i = 0; i < n; i++) {
+			bool same = i < ca.size() && i < cb.size() && equal(ca[i], cb[i]);
+			if (same) continue;
+			what = (i < ca.size() ? describe(ca[i]) : std::string("<end>")) + "  vs  " + (i < cb.size() ? describe(cb[i]) : std::string("<end>"));
+			return (int)i;
+		}
+		what.clear();
+		return -1;
+	}
+
+	bool save(const std::string& filename) const {
+		std::ofstream file(filename, std::ios::binary);
+		if (!file) return false;
+		file.write(magic, 4);
+		file.write((const char*)bytes.data(), bytes.size());
+		return (bool)file;
+	}
+
+	bool load(const std::string& filename) {
+		std::ifstream file(filename, std::ios::binary);
+		char header[4];
+		if (!file.read(header, 4) || memcmp(header, magic, 4) != 0) return false;
+		bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+	// FNV-1a
+	static uint32_t hash(const uint8_t* data, uint32_t size) {
+		uint32_t h = 2166136261u;
+		for (uint32_t i = 0; i < size; i++)
+			h = (h ^ data[i]) * 16777619u;
+		return h;
+	}
+
+private:
+	static constexpr const char* magic = "GECS";
+
+	static int argCount(Op op) {
+		static const int counts[] = { 5, 1, 2, 1, 2, 2, 3, 2, 2, 3, 2, 1, 3, 5 };
+		return counts[op];
+	}
+
+	static bool equal(const Command& a, const Command& b) {
+		if (a.op != b.op || a.dataSize != b.dataSize) return false;
+		for (int i = 0; i < argCount(a.op); i++)
+			if (a.args[i] != b.args[i]) return false;
+		return a.dataSize == 0 || memcmp(a.data, b.data, a.dataSize) == 0;
+	}
+
+	void writeU32(uint32_t v) {
+		uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+		bytes.insert(bytes.end(), b, b + 4);
+	}
+};
+
+struct DeviceCounters {
+	uint64_t draws = 0;
+	uint64_t binds = 0;
+	uint64_t bytesUploaded = 0;     // initial buffer data plus everything written through map
+	uint64_t buffersCreated = 0;
+	uint64_t maps = 0;
+};
+
+// Device without a GPU. Buffers live in system memory so map/unmap do the same copies
+// a driver would see, every call is counted and appended to stream when recording.
+// Its "GPU" finishes a fence fenceLatency signals after it was issued, so code that
+// reuses memory behind fences has to cope with frames in flight here too.
+class NullDevice : public RenderDevice {
+public:
+	CommandStream stream;
+	DeviceCounters counters;
+	bool recording = true;
+	bool constantRanges = true;
+	uint64_t fenceLatency = 2;
+
+	void resetCounters() { counters = DeviceCounters(); }
+
+	DeviceHandle createBuffer(const BufferDesc& desc, const void* data) override {
+		DeviceHandle handle = (DeviceHandle)buffers.size();
+		buffers.push_back(std::vector<uint8_t>(desc.size));
+		if (data) {
+			memcpy(buffers.back().data(), data, desc.size);
+			counters.bytesUploaded += desc.size;
+		}
+		counters.buffersCreated++;
+		if (recording)
+			stream.write(CommandStream::OpCreateBuffer, { handle, (uint32_t)desc.binding, desc.size, desc.dynamic ? 1u : 0u, data ? 1u : 0u }, data, data ? desc.size : 0);
+		return handle;
+	}
+
+	void* map(DeviceHandle buffer) override {
+		counters.maps++;
+		if (recording)
+			stream.write(CommandStream::OpMap, { buffer });
+		return buffer < buffers.size() ? buffers[buffer].data() : nullptr;
+	}
+
+	void unmap(DeviceHandle buffer) override {
+		if (buffer >= buffers.size()) return;
+		std::vector<uint8_t>& b = buffers[buffer];
+		counters.bytesUploaded += b.size();
+		if (recording)
+			stream.write(CommandStream::OpUnmap, { buffer, (uint32_t)b.size() }, b.data(), (uint32_t)b.size());
+	}
+
+	void bindShader(DeviceHandle shader) override { bind(CommandStream::OpBindShader, { shader }); }
+	void bindVertexBuffer(DeviceHandle buffer, uint32_t stride) override { bind(CommandStream::OpBindVertexBuffer, { buffer, stride }); }
+	void bindIndexBuffer(DeviceHandle buffer, IndexFormat format) override { bind(CommandStream::OpBindIndexBuffer, { buffer, (uint32_t)format }); }
+	void bindConstantBuffer(DeviceStage stage, int slot, DeviceHandle buffer) override { bind(CommandStream::OpBindConstantBuffer, { (uint32_t)stage, (uint32_t)slot, buffer }); }
+	void bindTexture(int slot, DeviceHandle texture) override { bind(CommandStream::OpBindTexture, { (uint32_t)slot, texture }); }
+	void bindSampler(int slot, DeviceHandle sampler) override { bind(CommandStream::OpBindSampler, { (uint32_t)slot, sampler }); }
+
+	bool supportsConstantRanges() const override { return constantRanges; }
+
+	void* mapNoOverwrite(DeviceHandle buffer) override {
+		counters.maps++;
+		if (recording)
+			stream.write(CommandStream::OpMapNoOverwrite, { buffer });
+		return buffer < buffers.size() ? buffers[buffer].data() : nullptr;
+	}
+
+	void unmapRange(DeviceHandle buffer, uint32_t offset, uint32_t size) override {
+		if (buffer >= buffers.size() || offset + size > buffers[buffer].size()) return;
+		counters.bytesUploaded += size;
+		if (recording)
+			stream.write(CommandStream::OpUnmapRange, { buffer, offset, size }, buffers[buffer].data() + offset, size);
+	}
+
+	void bindConstantRange(DeviceStage stage, int slot, DeviceHandle buffer, uint32_t offset, uint32_t size) override {
+		bind(CommandStream::OpBindConstantRange, { (uint32_t)stage, (uint32_t)slot, buffer, offset, size });
+	}
+
+	uint64_t signalFence() override { return ++fenceSignaled; }
+
+	uint64_t completedFence() override {
+		uint64_t done = fenceSignaled > fenceLatency ? fenceSignaled - fenceLatency : 0;
+		return done > fenceWaited ? done : fenceWaited;
+	}
+
+	void waitForFence(uint64_t value) override {
+		if (value > fenceWaited) fenceWaited = value < fenceSignaled ? value : fenceSignaled;
+	}
+
+	void drawIndexed(uint32_t indexCount, uint32_t startIndex, int32_t baseVertex) override {
+		counters.draws++;
+		if (recording)
+			stream.write(CommandStream::OpDrawIndexed, { indexCount, startIndex, (uint32_t)baseVertex });
+	}
+
+	void draw(uint32_t vertexCount, uint32_t startVertex) override {
+		counters.draws++;
+		if (recording)
+			stream.write(CommandStream::OpDraw, { vertexCount, startVertex });
+	}
+
+private:
+	std::vector<std::vector<uint8_t>> buffers;
+	uint64_t fenceSignaled = 0;
+	uint64_t fenceWaited = 0;
+
+	void bind(CommandStream::Op op, std::initializer_list<uint32_t> args) {
+		counters.binds++;
+		if (recording)
+			stream.write(op, args);
+	}
+};
+
+// RenderQueue backend on top of any RenderDevice. Every shader gets its own dynamic
+// buffer for the per-draw constants, bound to VS slot 0 with the shader.
+//
+// With an upload ring the per-shader buffers are only the fallback: each execute()
+// copies the queue's whole constant arena into one big ring buffer with a single
+// no-overwrite map, and every draw binds its block of it by offset.
+class DeviceBackend : public RenderBackend {
+public:
+	void init(RenderDevice* _device) {
+		device = _device;
+	}
+
+	RenderHandle addShader(DeviceHandle shader, uint32_t constantSize) {
+		ShaderBinding binding;
+		binding.shader = shader;
+		binding.constantSize = constantSize;
+		BufferDesc desc;
+		desc.binding = BindConstantBuffer;
+		desc.size = (constantSize + 15) & ~15u;
+		desc.dynamic = true;
+		binding.constants = device->createBuffer(desc, nullptr);
+		shaders.push_back(binding);
+		return (RenderHandle)(shaders.size() - 1);
+	}
+
+	// firstIndex: where in the index buffer the draw starts, e.g. one level of a LOD chain
+	RenderHandle addMesh(DeviceHandle vertexBuffer, DeviceHandle indexBuffer, uint32_t stride, uint32_t indexCount, IndexFormat indexFormat = Index32,
+		uint32_t firstIndex = 0) {
+		MeshBinding binding = { vertexBuffer, indexBuffer, stride, indexCount, indexFormat, firstIndex };
+		meshes.push_back(binding);
+		return (RenderHandle)(meshes.size() - 1);
+	}
+
+	// reuses the handles of removed textures, so a long session of streaming stays in 16 bits
+	RenderHandle addTexture(DeviceHandle texture) {
+		if (!freeTextures.empty()) {
+			RenderHandle handle = freeTextures.back();
+			freeTextures.pop_back();
+			textures[handle] = texture;
+			return handle;
+		}
+		textures.push_back(texture);
+		return (RenderHandle)(textures.size() - 1);
+	}
+
+	// the handle may come back from the next addTexture, packets holding it have to be recorded again
+	void removeTexture(RenderHandle handle) {
+		textures[handle] = InvalidDeviceHandle;
+		freeTextures.push_back(handle);
+	}
+
+	RenderHandle addSampler(DeviceHandle sampler) {
+		samplers.push_back(sampler);
+		return (RenderHandle)(samplers.size() - 1);
+	}
+
+	// bytes: size of the ring buffer, 0 goes back to a buffer per shader. The first call
+	// creates the ring, later ones only switch it on and off: its frames may still be in
+	// flight, so it keeps their fences. False when the device cannot bind constant ranges
+	// or the ring was created with another size.
+	bool enableUploadRing(uint32_t bytes) {
+		ringEnabled = false;
+		if (bytes == 0 || !device->supportsConstantRanges()) return false;
+		if (ringBuffer == InvalidDeviceHandle) {
+			BufferDesc desc;
+			desc.binding = BindConstantBuffer;
+			desc.size = bytes;
+			desc.dynamic = true;
+			ringBuffer = device->createBuffer(desc, nullptr);
+			ring.init(bytes, RenderQueue::ConstantAlignment);
+		}
+		else if (ring.size() != bytes)
+			return false;
+		ringEnabled = true;
+		return true;
+	}
+
+	bool uploadRingEnabled() const { return ringEnabled; }
+	const UploadRing& uploadRing() const { return ring; }
+
+	bool beginConstants(const void* data, uint32_t size) override {
+		if (!ringEnabled) return false;
+		ring.retire(device->completedFence());
+		if (ring.full()) waitForOldest();
+		ring.beginFrame();
+		uint32_t offset;
+		while (!ring.allocate(size, offset)) {
+			// more than the whole ring: this frame goes through the per-shader buffers
+			if (size > ring.size() || ring.framesInFlight() == 0) return false;
+			waitForOldest();
+		}
+		unsigned char* dst = (unsigned char*)device->mapNoOverwrite(ringBuffer);
+		if (dst) memcpy(dst + offset, data, size);
+		device->unmapRange(ringBuffer, offset, size);
+		ringOffset = offset;
+		ringActive = true;
+		return true;
+	}
+
+	void bindConstants(RenderHandle, uint32_t offset, uint32_t size) override {
+		device->bindConstantRange(StageVertex, 0, ringBuffer, ringOffset + offset, size);
+	}
+
+	void endConstants() override {
+		if (!ringActive) return;
+		ring.endFrame(device->signalFence());
+		ringActive = false;
+	}
+
+	void bindShader(RenderHandle handle) override {
+		ShaderBinding& s = shaders[handle];
+		device->bindShader(s.shader);
+		// with the ring the queue binds the draw's range right after
+		if (!ringActive)
+			device->bindConstantBuffer(StageVertex, 0, s.constants);
+	}
+
+	void bindTexture(int slot, RenderHandle handle) override {
+		device->bindTexture(slot, textures[handle]);
+	}
+
+	void bindSampler(int slot, RenderHandle handle) override {
+		device->bindSampler(slot, samplers[handle]);
+	}
+
+	void bindMesh(RenderHandle handle) override {
+		MeshBinding& m = meshes[handle];
+		device->bindVertexBuffer(m.vertexBuffer, m.stride);
+		device->bindIndexBuffer(m.indexBuffer, m.indexFormat);
+	}
+
+	void uploadConstants(RenderHandle handle, const void* data, uint32_t size) override {
+		ShaderBinding& s = shaders[handle];
+		void* dst = device->map(s.constants);
+		if (dst) memcpy(dst, data, size < s.constantSize ? size : s.constantSize);
+		device->unmap(s.constants);
+	}
+
+	void drawIndexed(RenderHandle handle, uint32_t firstIndex, uint32_t indexCount) override {
+		if (indexCount == 0)
+			device->drawIndexed(meshes[handle].indexCount, meshes[handle].firstIndex, 0);
+		else
+			device->drawIndexed(indexCount, firstIndex, 0);
+	}
+
+protected:
+	RenderDevice* device = nullptr;
+
+private:
+	struct ShaderBinding {
+		DeviceHandle shader;
+		DeviceHandle constants;
+		uint32_t constantSize;
+	};
+
+	struct MeshBinding {
+		DeviceHandle vertexBuffer;
+		DeviceHandle indexBuffer;
+		uint32_t stride;
+		uint32_t indexCount;
+		IndexFormat indexFormat;
+		uint32_t firstIndex;
+	};
+
+	std::vector<ShaderBinding> shaders;
+	std::vector<MeshBinding> meshes;
+	std::vector<DeviceHandle> textures;
+	std::vector<RenderHandle> freeTextures;
+	std::vector<DeviceHandle> samplers;
+
+	UploadRing ring;
+	DeviceHandle ringBuffer = InvalidDeviceHandle;
+	uint32_t ringOffset = 0;        // where this execute's arena starts in the ring
+	bool ringEnabled = false;
+	bool ringActive = false;        // between beginConstants and endConstants
+
+	void waitForOldest() {
+		ring.stats.waits++;
+		device->waitForFence(ring.oldestFence());
+		ring.retire(device->completedFence());
+	}
+};
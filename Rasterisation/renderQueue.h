@@ -0,0 +1,305 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include "timer.h"
+#include "profiler.h"
+
+// Handles are small integers handed out by the backend (shaders, meshes, textures,
+// samplers), so packets stay compact and the sort key is the same on every run.
+typedef uint16_t RenderHandle;
+const RenderHandle InvalidRenderHandle = 0xffff;
+
+enum RenderLayer {
+	LayerOpaque = 0,
+	LayerTransparent = 1,
+	LayerOverlay = 2
+};
+
+// One draw: everything the backend needs, nothing it has to look up by name.
+// Texture slots are pixel shader registers (t0 albedo, t1 normal map in every PS).
+struct DrawPacket {
+	static const int MaxTextures = 2;
+
+	uint64_t key = 0;
+	RenderHandle shader = InvalidRenderHandle;
+	RenderHandle mesh = InvalidRenderHandle;
+	RenderHandle textures[MaxTextures] = { InvalidRenderHandle, InvalidRenderHandle };
+	RenderHandle sampler = InvalidRenderHandle;
+	uint8_t layer = LayerOpaque;
+	float depth = 0.0f;             // view distance, opaque draws go front to back
+	uint32_t constantOffset = 0;    // bytes of the VS per-draw cbuffer in the queue's constant arena
+	uint32_t constantSize = 0;
+	uint32_t firstIndex = 0;        // a range of the mesh's index buffer, e.g. culled clusters;
+	uint32_t indexCount = 0;        // 0 draws the mesh's own range
+};
+
+// What RenderQueue::execute drives. Only called when the state really changes.
+class RenderBackend {
+public:
+	virtual ~RenderBackend() {}
+	virtual void bindShader(RenderHandle shader) = 0;
+	virtual void bindTexture(int slot, RenderHandle texture) = 0;
+	virtual void bindSampler(int slot, RenderHandle sampler) = 0;
+	virtual void bindMesh(RenderHandle mesh) = 0;
+	virtual void uploadConstants(RenderHandle shader, const void* data, uint32_t size) = 0;
+	// The whole constant arena, once before the first draw. A backend that keeps it
+	// (in an upload ring) returns true and then gets bindConstants with arena offsets
+	// instead of uploadConstants; endConstants comes after the last draw.
+	virtual bool beginConstants(const void*, uint32_t) { return false; }
+	virtual void bindConstants(RenderHandle, uint32_t, uint32_t) {}
+	virtual void endConstants() {}
+	// indexCount 0: the range the mesh was added with
+	virtual void drawIndexed(RenderHandle mesh, uint32_t firstIndex, uint32_t indexCount) = 0;
+};
+
+struct RenderQueueStats {
+	int draws = 0;
+	int shaderBinds = 0;
+	int textureBinds = 0;
+	int samplerBinds = 0;
+	int meshBinds = 0;
+	int constantUploads = 0;     // or range binds, when the backend keeps the arena
+	int skippedBinds = 0;       // calls the state cache filtered out
+	double sortMs = 0.0;
+	double executeMs = 0.0;
+};
+
+// Per-frame draw list. Objects submit packets (and their constants) in any order,
+// sort() orders them by a 64-bit key with an LSD radix sort, execute() replays them
+// through a state cache so a bind is only issued when it differs from the last one.
+//
+// Key, high to low: layer (2) | shader (10) | texture 0 (16) | mesh (16) | depth (20).
+// Sorting by state first keeps binds down, depth last gives front to back inside a
+// batch. Transparent draws invert the depth bits so they come back to front.
+class RenderQueue {
+public:
+	// constant blocks start on 256 bytes, the unit of constant buffer range offsets
+	static const uint32_t ConstantAlignment = 256;
+
+	RenderQueueStats stats;
+	float farDepth = 200.0f;        // depth is quantised over [0, farDepth]
+
+	void begin() {
+		packets.clear();
+		constants.clear();
+		order.clear();
+		stats = RenderQueueStats();
+	}
+
+	// room up front, so a frame with more draws than any before does not grow the lists
+	void reserve(size_t packetCount, size_t constantBytes) {
+		packets.reserve(packetCount);
+		order.reserve(packetCount);
+		scratch.reserve(packetCount);
+		constants.reserve(constantBytes);
+	}
+
+	// copies per-draw constants, packets of the same object can share the offset
+	uint32_t pushConstants(const void* data, uint32_t size) {
+		uint32_t offset;
+		memcpy(allocConstants(size, offset), data, size);
+		return offset;
+	}
+
+	// room for constants that are written in parts, valid until the next push
+	unsigned char* allocConstants(uint32_t size, uint32_t& offset) {
+		offset = (uint32_t)constants.size();
+		constants.resize(offset + ((size + ConstantAlignment - 1) & ~(ConstantAlignment - 1)));
+		return &constants[offset];
+	}
+
+	void submit(DrawPacket packet) {
+		packet.key = makeKey(packet);
+		packets.push_back(packet);
+	}
+
+	void sort() {
+		PROFILE_SCOPE("render queue: sort");
+		Timer timer;
+		radixSort();
+		stats.sortMs += timer.elapsed() * 1000.0;
+	}
+
+	void execute(RenderBackend& backend) {
+		PROFILE_SCOPE("render queue: execute");
+		if (order.size() != packets.size())
+			sort();
+		Timer timer;
+		resetCache();
+		bool ranges = !constants.empty() && backend.beginConstants(constants.data(), (uint32_t)constants.size());
+		for (const SortItem& item : order) {
+			const DrawPacket& p = packets[item.index];
+			if (p.shader != boundShader) {
+				backend.bindShader(p.shader);
+				boundShader = p.shader;
+				boundConstants = UINT32_MAX;
+				stats.shaderBinds++;
+			}
+			else stats.skippedBinds++;
+			for (int t = 0; t < DrawPacket::MaxTextures; t++) {
+				if (p.textures[t] == InvalidRenderHandle) continue;
+				if (p.textures[t] != boundTextures[t]) {
+					backend.bindTexture(t, p.textures[t]);
+					boundTextures[t] = p.textures[t];
+					stats.textureBinds++;
+				}
+				else stats.skippedBinds++;
+			}
+			if (p.sampler != InvalidRenderHandle) {
+				if (p.sampler != boundSampler) {
+					backend.bindSampler(0, p.sampler);
+					boundSampler = p.sampler;
+					stats.samplerBinds++;
+				}
+				else stats.skippedBinds++;
+			}
+			if (p.mesh != boundMesh) {
+				backend.bindMesh(p.mesh);
+				boundMesh = p.mesh;
+				stats.meshBinds++;
+			}
+			else stats.skippedBinds++;
+			if (p.constantSize > 0 && ranges) {
+				// one buffer for all shaders, a shader bind leaves the slot to be set again
+				if (boundConstants != p.constantOffset) {
+					backend.bindConstants(p.shader, p.constantOffset, p.constantSize);
+					boundConstants = p.constantOffset;
+					stats.constantUploads++;
+				}
+				else stats.skippedBinds++;
+			}
+			else if (p.constantSize > 0) {
+				// every shader keeps its own cbuffer, so only a different block needs an upload
+				if (p.shader >= lastConstants.size())
+					lastConstants.resize(p.shader + 1, UINT32_MAX);
+				if (lastConstants[p.shader] != p.constantOffset) {
+					backend.uploadConstants(p.shader, &constants[p.constantOffset], p.constantSize);
+					lastConstants[p.shader] = p.constantOffset;
+					stats.constantUploads++;
+				}
+				else stats.skippedBinds++;
+			}
+			backend.drawIndexed(p.mesh, p.firstIndex, p.indexCount);
+			stats.draws++;
+		}
+		if (ranges) backend.endConstants();
+		stats.executeMs += timer.elapsed() * 1000.0;
+	}
+
+	size_t size() const { return packets.size(); }
+	const DrawPacket& sorted(size_t i) const { return packets[order[i].index]; }
+
+	uint64_t makeKey(const DrawPacket& p) const {
+		float d = p.depth / farDepth;
+		d = d < 0.0f ? 0.0f : (d > 1.0f ? 1.0f : d);
+		uint64_t depthBits = (uint64_t)(d * (float)0xfffff);
+		if (p.layer == LayerTransparent) depthBits = 0xfffff - depthBits;
+		return ((uint64_t)(p.layer & 0x3) << 62) | ((uint64_t)(p.shader & 0x3ff) << 52) |
+			((uint64_t)p.textures[0] << 36) | ((uint64_t)p.mesh << 20) | depthBits;
+	}
+
+private:
+	std::vector<unsigned char> constants;
+	struct SortItem {
+		uint64_t key;
+		uint32_t index;
+	};
+
+	std::vector<DrawPacket> packets;
+	std::vector<SortItem> order;            // keys and packet indices in key order
+	std::vector<SortItem> scratch;
+	RenderHandle boundShader;
+	RenderHandle boundTextures[DrawPacket::MaxTextures];
+	RenderHandle boundSampler;
+	RenderHandle boundMesh;
+	std::vector<uint32_t> lastConstants;    // per shader, offset of the block it holds
+	uint32_t boundConstants;                // arena offset of the bound range, backends that keep the arena
+
+	// the bound state is unknown at the start of a frame, everything gets set once
+	void resetCache() {
+		boundShader = InvalidRenderHandle;
+		for (int t = 0; t < DrawPacket::MaxTextures; t++)
+			boundTextures[t] = InvalidRenderHandle;
+		boundSampler = InvalidRenderHandle;
+		boundMesh = InvalidRenderHandle;
+		lastConstants.assign(lastConstants.size(), UINT32_MAX);
+		boundConstants = UINT32_MAX;
+	}
+
+	// 8 passes of 8 bits, stable. All histograms come from one read of the keys and
+	// passes where every key has the same byte are skipped.
+	void radixSort() {
+		size_t n = packets.size();
+		order.resize(n);
+		scratch.resize(n);
+		uint32_t count[8][256] = {};
+		for (size_t i = 0; i < n; i++) {
+			uint64_t key = packets[i].key;
+			order[i] = { key, (uint32_t)i };
+			for (int pass = 0; pass < 8; pass++)
+				count[pass][(key >> (pass * 8)) & 0xff]++;
+		}
+		for (int pass = 0; pass < 8; pass++) {
+			int shift = pass * 8;
+			uint32_t* c = count[pass];
+			if (n == 0 || c[(order[0].key >> shift) & 0xff] == n) continue;
+			uint32_t sum = 0;
+			for (int b = 0; b < 256; b++) {
+				uint32_t v = c[b];
+				c[b] = sum;
+				sum += v;
+			}
+			for (size_t i = 0; i < n; i++)
+				scratch[c[(order[i].key >> shift) & 0xff]++] = order[i];
+			order.swap(scratch);
+		}
+	}
+};
+
+// Null backend that writes every call it receives into a list, for headless runs
+// and for checking what the state cache lets through.
+class RecordingBackend : public RenderBackend {
+public:
+	enum CommandType { BindShader, BindTexture, BindSampler, BindMesh, UploadConstants, DrawIndexed };
+
+	struct Command {
+		CommandType type;
+		int slot;
+		RenderHandle handle;
+		uint32_t size;
+	};
+
+	std::vector<Command> commands;
+
+	void clear() { commands.clear(); }
+
+	void bindShader(RenderHandle shader) override { commands.push_back({ BindShader, 0, shader, 0 }); }
+	void bindTexture(int slot, RenderHandle texture) override { commands.push_back({ BindTexture, slot, texture, 0 }); }
+	void bindSampler(int slot, RenderHandle sampler) override { commands.push_back({ BindSampler, slot, sampler, 0 }); }
+	void bindMesh(RenderHandle mesh) override { commands.push_back({ BindMesh, 0, mesh, 0 }); }
+	void uploadConstants(RenderHandle shader, const void*, uint32_t size) override { commands.push_back({ UploadConstants, 0, shader, size }); }
+	void drawIndexed(RenderHandle mesh, uint32_t, uint32_t indexCount) override { commands.push_back({ DrawIndexed, 0, mesh, indexCount }); }
+
+	int count(CommandType type) const {
+		int n = 0;
+		for (auto& c : commands)
+			if (c.type == type) n++;
+		return n;
+	}
+
+	// one line per command, to diff the streams of two runs
+	std::string toString() const {
+		static const char* names[] = { "shader", "texture", "sampler", "mesh", "constants", "draw" };
+		std::ostringstream out;
+		for (auto& c : commands) {
+			out << names[c.type] << " " << c.handle;
+			if (c.type == BindTexture || c.type == BindSampler) out << " slot " << c.slot;
+			if (c.type == UploadConstants) out << " " << c.size << " bytes";
+			out << "\n";
+		}
+		return out.str();
+	}
+};
@@ -6,8 +6,14 @@
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
 #include "mathLib.h"
 #include "shaderReflection.h"
+#include "shaderCache.h"
+#include "fileWatcher.h"
+#include "vertex.h"
 
 #pragma comment(lib, "d3d11.lib")
 #pragma comment(lib, "d3dcompiler.lib")
@@ -15,14 +21,14 @@
 
 class Shader {
 public:
-	ID3D11VertexShader* vertexShader;
-	ID3D11PixelShader* pixelShader;
-	ID3D11InputLayout* layout;
-	ID3D11Buffer* constantBuffer;
+	ID3D11VertexShader* vertexShader = nullptr;
+	ID3D11PixelShader* pixelShader = nullptr;
+	ID3D11InputLayout* layout = nullptr;
+	ID3D11Buffer* constantBuffer = nullptr;
 	std::vector<ConstantBuffer> psConstantBuffers;
 	std::vector<ConstantBuffer> vsConstantBuffers;
-	std::map<std::string, int> textureBindPointsVS;
-	std::map<std::string, int> textureBindPointsPS;
+	std::map<std::string, int, std::less<>> textureBindPointsVS;
+	std::map<std::string, int, std::less<>> textureBindPointsPS;
 
 	void Init(ID3D11Device* device, int sizeInBytes = 16) {
 		D3D11_BUFFER_DESC bd;
@@ -35,20 +41,19 @@ public:
 		device->CreateBuffer(&bd, NULL, &constantBuffer);
 	}
 
-	void loadVS(std::string& filename, DxCore* core) {
-		ID3DBlob* status;
-		ID3DBlob* shader;
-		std::string shaderHLSL = readFile(filename);
-		// compile vertex shader
-		HRESULT hr = D3DCompile(shaderHLSL.c_str(), strlen(shaderHLSL.c_str()), NULL, NULL, NULL, "VS", "vs_5_0", 0, 0, &shader, &status);
-		if (FAILED(hr)) {
-			MessageBoxA(NULL, (char*)status->GetBufferPointer(), "Vertex Shader Error", 0);
-			exit(0);
-		}
+	// format picks the input layout; Packed also compiles with PACKED_VERTICES defined,
+	// the shaders that take meshes decode the compact layout under it. A compile error
+	// ends the program unless error is given, then it gets the message and false comes back.
+	bool loadVS(const std::string& filename, DxCore* core, VertexFormat format = VertexFormat::Full, ShaderCache* cache = nullptr, std::string* error = nullptr) {
+		D3D_SHADER_MACRO packedDefines[] = { { "PACKED_VERTICES", "1" }, { NULL, NULL } };
+		const D3D_SHADER_MACRO* defines = format == VertexFormat::Packed ? packedDefines : NULL;
+		ShaderCacheEntry shader;
+		if (!compile(filename, defines, "VS", "vs_5_0", "Vertex Shader Error", cache, shader, error))
+			return false;
 		// create vertex shader
-		core->device->CreateVertexShader(shader->GetBufferPointer(), shader->GetBufferSize(), NULL, &vertexShader);
+		core->device->CreateVertexShader(shader.bytecode.data(), shader.bytecode.size(), NULL, &vertexShader);
 		ConstantBufferReflection reflection;
-		reflection.build(core, shader, vsConstantBuffers, textureBindPointsVS, ShaderStage::VertexShader);
+		reflection.create(core, shader.reflection, vsConstantBuffers, textureBindPointsVS, ShaderStage::VertexShader);
 		//D3D11_INPUT_ELEMENT_DESC layoutDesc[] =
 		//{
 		//	{ "POS", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
@@ -66,52 +71,64 @@ public:
 			{ "BONEWEIGHTS", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
 		};
 
-		core->device->CreateInputLayout(layoutDesc, 6, shader->GetBufferPointer(), shader->GetBufferSize(), &layout);
-		shader->Release();
+		// STATIC_VERTEX_PACKED / ANIMATED_VERTEX_PACKED
+		D3D11_INPUT_ELEMENT_DESC packedLayoutDesc[] = {
+			{ "POS", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "NORMAL", 0, DXGI_FORMAT_R16G16_SNORM, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "TANGENT", 0, DXGI_FORMAT_R16G16_SNORM, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "TEXCOORD", 0, DXGI_FORMAT_R16G16_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "BONEIDS", 0, DXGI_FORMAT_R8G8B8A8_UINT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+			{ "BONEWEIGHTS", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+		};
+
+		core->device->CreateInputLayout(format == VertexFormat::Packed ? packedLayoutDesc : layoutDesc, 6, shader.bytecode.data(), shader.bytecode.size(), &layout);
+		return true;
 	}
 
-	void loadPS(std::string& filename, DxCore* core) {
-		ID3DBlob* status;
-		ID3DBlob* shader;
-		std::string shaderHLSL = readFile(filename);
-		// compile pixel shader
-		HRESULT hr = D3DCompile(shaderHLSL.c_str(), strlen(shaderHLSL.c_str()), NULL, NULL, NULL, "PS", "ps_5_0", 0, 0, &shader, &status);
-		if (FAILED(hr)) {
-			MessageBoxA(NULL, (char*)status->GetBufferPointer(), "Pixel Shader Error", 0);
-			exit(0);
-		}
+	bool loadPS(const std::string& filename, DxCore* core, ShaderCache* cache = nullptr, std::string* error = nullptr) {
+		ShaderCacheEntry shader;
+		if (!compile(filename, NULL, "PS", "ps_5_0", "Pixel Shader Error", cache, shader, error))
+			return false;
 		// create pixel shader
-		core->device->CreatePixelShader(shader->GetBufferPointer(), shader->GetBufferSize(), NULL, &pixelShader);
+		core->device->CreatePixelShader(shader.bytecode.data(), shader.bytecode.size(), NULL, &pixelShader);
 		ConstantBufferReflection reflection;
-		reflection.build(core, shader, psConstantBuffers, textureBindPointsPS, ShaderStage::PixelShader);
-		shader->Release();
+		reflection.create(core, shader.reflection, psConstantBuffers, textureBindPointsPS, ShaderStage::PixelShader);
+		return true;
 	}
 
-	void loadLightPS(std::string& filename, DxCore* core) {
-		ID3DBlob* status;
-		ID3DBlob* shader;
-		std::string shaderHLSL = readFile(filename);
-		// compile pixel shader
-		HRESULT hr = D3DCompile(shaderHLSL.c_str(), strlen(shaderHLSL.c_str()), NULL, NULL, NULL, "PS", "ps_5_0", 0, 0, &shader, &status);
-		if (FAILED(hr)) {
-			MessageBoxA(NULL, (char*)status->GetBufferPointer(), "Pixel Shader Error", 0);
-			exit(0);
-		}
+	bool loadLightPS(const std::string& filename, DxCore* core, ShaderCache* cache = nullptr, std::string* error = nullptr) {
+		ShaderCacheEntry shader;
+		if (!compile(filename, NULL, "PS", "ps_5_0", "Pixel Shader Error", cache, shader, error))
+			return false;
 		// create pixel shader
-		core->device->CreatePixelShader(shader->GetBufferPointer(), shader->GetBufferSize(), NULL, &pixelShader);
-		shader->Release();
+		core->device->CreatePixelShader(shader.bytecode.data(), shader.bytecode.size(), NULL, &pixelShader);
+		return true;
 	}
 
-	void updateConstantVS(std::string constantBufferName, std::string variableName, void* data)
+	// the D3D objects and constant buffers, once nothing draws with this version any more
+	void release() {
+		if (vertexShader) vertexShader->Release();
+		if (pixelShader) pixelShader->Release();
+		if (layout) layout->Release();
+		if (constantBuffer) constantBuffer->Release();
+		for (auto& cb : vsConstantBuffers)
+			cb.free();
+		for (auto& cb : psConstantBuffers)
+			cb.free();
+		*this = Shader();
+	}
+
+	// names are looked up as they are, no std::string is built per call
+	void updateConstantVS(const char* constantBufferName, const char* variableName, void* data)
 	{
 		updateConstant(constantBufferName, variableName, data, vsConstantBuffers);
 	}
-	void updateConstantPS(std::string constantBufferName, std::string variableName, void* data)
+	void updateConstantPS(const char* constantBufferName, const char* variableName, void* data)
 	{
 		updateConstant(constantBufferName, variableName, data, psConstantBuffers);
 	}
 
-	void updateConstant(std::string constantBufferName, std::string variableName, void* data, std::vector<ConstantBuffer>& buffers)
+	void updateConstant(const char* constantBufferName, const char* variableName, void* data, std::vector<ConstantBuffer>& buffers)
 	{
 		for (int i = 0; i < buffers.size(); i++)
 		{
@@ -123,10 +140,12 @@ public:
 		}
 	}
 
-	void updateTexturePS(DxCore* core, std::string name, ID3D11ShaderResourceView* srv, ID3D11SamplerState* state) {
+	void updateTexturePS(DxCore* core, const char* name, ID3D11ShaderResourceView* srv, ID3D11SamplerState* state) {
 		//core->devicecontext->VSSetShaderResources(textureBindPointsVS[name], 1, &srv);
-		core->devicecontext->PSSetShaderResources(textureBindPointsPS[name], 1, &srv);
-		core->devicecontext->PSSetSamplers(textureBindPointsPS[name], 1, &state);
+		auto it = textureBindPointsPS.find(name);
+		if (it == textureBindPointsPS.end()) return;
+		core->devicecontext->PSSetShaderResources(it->second, 1, &srv);
+		core->devicecontext->PSSetSamplers(it->second, 1, &state);
 	}
 
 	void apply(DxCore* core) {
@@ -150,7 +169,41 @@ public:
 	}
 
 private:
-	std::string readFile(std::string& filename) {
+	// bytecode and reflection from the cache when it has this source with these settings,
+	// otherwise compiled, reflected and stored there
+	static bool compile(const std::string& filename, const D3D_SHADER_MACRO* defines, const char* entry, const char* profile, const char* errorTitle,
+		ShaderCache* cache, ShaderCacheEntry& out, std::string* error) {
+		std::string shaderHLSL = readFile(filename);
+		std::string defineKey;
+		for (const D3D_SHADER_MACRO* d = defines; d && d->Name; d++)
+			defineKey += std::string(d->Name) + "=" + (d->Definition ? d->Definition : "") + ";";
+		ShaderCacheKey key = ShaderCache::makeKey(shaderHLSL, defineKey, entry, profile);
+		if (cache && cache->load(filename, key, out))
+			return true;
+		ID3DBlob* status = NULL;
+		ID3DBlob* shader = NULL;
+		HRESULT hr = D3DCompile(shaderHLSL.c_str(), strlen(shaderHLSL.c_str()), NULL, defines, NULL, entry, profile, 0, 0, &shader, &status);
+		if (FAILED(hr)) {
+			std::string message = status ? (char*)status->GetBufferPointer() : filename + ": could not compile";
+			if (status) status->Release();
+			if (error) {
+				*error = message;
+				return false;
+			}
+			MessageBoxA(NULL, message.c_str(), errorTitle, 0);
+			exit(0);
+		}
+		out.key = key;
+		const uint8_t* bytes = (const uint8_t*)shader->GetBufferPointer();
+		out.bytecode.assign(bytes, bytes + shader->GetBufferSize());
+		shader->Release();
+		ConstantBufferReflection reflection;
+		reflection.reflect(out.bytecode.data(), out.bytecode.size(), out.reflection);
+		if (cache) cache->store(filename, out);
+		return true;
+	}
+
+	static std::string readFile(const std::string& filename) {
 		std::ifstream infile;
 		infile.open(filename);
 
@@ -161,19 +214,28 @@ private:
 	}
 };
 
+// Shaders by name. With startWatching a thread keeps an eye on their sources and
+// compiles the ones that change, D3DCompile and the device's create calls are
+// free-threaded. The new versions wait for applyReloads, which the thread that owns the
+// context calls between two frames, so a frame never draws with half of a change; a
+// shader that does not compile keeps its old version and the error is reported.
 class ShaderManager {
 public:
 	std::map<std::string, Shader> shaders;
+	ShaderCache cache;          // compiled shaders beside their .hlsl, startup only compiles what changed
+
+	~ShaderManager() { stopWatching(); }
 
-	void load(std::string& name, std::string& vsFilename, std::string& psFilename, DxCore* core) {
+	void load(const std::string& name, const std::string& vsFilename, const std::string& psFilename, DxCore* core, VertexFormat format = VertexFormat::Full) {
 		Shader shader;
-		shader.loadVS(vsFilename, core);
-		shader.loadPS(psFilename, core);
+		shader.loadVS(vsFilename, core, format, &cache);
+		shader.loadPS(psFilename, core, &cache);
 		shader.Init(core->device);
 		shaders[name] = shader;
+		sources[name] = { vsFilename, psFilename, format };
 	}
 
-	Shader* getShader(std::string& name) {
+	Shader* getShader(const std::string& name) {
 		auto it = shaders.find(name);
 		if (it != shaders.end()) {
 			return &it->second;
@@ -187,4 +249,94 @@ public:
 			shader->apply(core);
 	}
 
-};
\ No newline at end of file
+	// load every shader first, the sources are taken as they are now
+	void startWatching(DxCore* core, int intervalMs = 250) {
+		if (watchThread.joinable()) return;
+		for (auto& source : sources) {
+			watcher.add(source.second.vs);
+			watcher.add(source.second.ps);
+		}
+		watching = true;
+		watchThread = std::thread([this, core, intervalMs] { watch(core, intervalMs); });
+	}
+
+	void stopWatching() {
+		watching = false;
+		if (watchThread.joinable())
+			watchThread.join();
+	}
+
+	// swaps in what the watcher compiled since the last call, between frames on the thread
+	// that owns the context. One line per reload or error, empty when nothing changed.
+	std::string applyReloads() {
+		if (!reloadsReady.load(std::memory_order_acquire)) return std::string();
+		std::vector<std::pair<std::string, Shader>> ready;
+		std::string log;
+		{
+			std::lock_guard<std::mutex> lock(reloadMutex);
+			ready.swap(reloaded);
+			log.swap(reloadLog);
+			reloadsReady = false;
+		}
+		for (auto& r : ready) {
+			// the pointers handed out by getShader stay valid, the objects behind them change
+			Shader& live = shaders[r.first];
+			Shader old = live;
+			live = r.second;
+			old.release();
+		}
+		return log;
+	}
+
+private:
+	struct ShaderSource {
+		std::string vs;
+		std::string ps;
+		VertexFormat format;
+	};
+
+	std::map<std::string, ShaderSource> sources;
+	FileWatcher watcher;
+	std::thread watchThread;
+	std::atomic<bool> watching{ false };
+	std::mutex reloadMutex;
+	std::vector<std::pair<std::string, Shader>> reloaded;   // compiled, waiting for applyReloads
+	std::string reloadLog;
+	std::atomic<bool> reloadsReady{ false };
+
+	void watch(DxCore* core, int intervalMs) {
+		std::vector<std::string> changed;
+		while (watching) {
+			watcher.wait(intervalMs);
+			changed.clear();
+			if (watcher.poll(changed) == 0) continue;
+			for (auto& source : sources) {
+				const ShaderSource& s = source.second;
+				bool dirty = false;
+				for (auto& file : changed)
+					dirty = dirty || file == s.vs || file == s.ps;
+				if (!dirty) continue;
+				Shader shader;
+				std::string error;
+				bool ok = shader.loadVS(s.vs, core, s.format, &cache, &error) && shader.loadPS(s.ps, core, &cache, &error);
+				if (ok) shader.Init(core->device);
+				else shader.release();
+				std::lock_guard<std::mutex> lock(reloadMutex);
+				if (ok) {
+					bool replaced = false;
+					for (auto& r : reloaded) {
+						if (r.first != source.first) continue;
+						// a second change before a frame picked up the first replaces it
+						r.second.release();
+						r.second = shader;
+						replaced = true;
+					}
+					if (!replaced) reloaded.push_back({ source.first, shader });
+					reloadLog += "reloaded " + source.first + "\n";
+				}
+				else reloadLog += source.first + " kept its old version: " + error + "\n";
+				reloadsReady = true;
+			}
+		}
+	}
+};
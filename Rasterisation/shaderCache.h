@@ -0,0 +1,247 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+
+// What D3DReflect reports for one shader stage, the part Shader uses: the constant
+// buffers with their variables and the texture bind points.
+struct ShaderVariableInfo {
+	std::string name;
+	uint32_t offset = 0;
+	uint32_t size = 0;
+};
+
+struct ShaderConstantBufferInfo {
+	std::string name;
+	uint32_t size = 0;          // sum of the variable sizes, what ConstantBuffer::init is given
+	std::vector<ShaderVariableInfo> variables;
+};
+
+struct ShaderTextureInfo {
+	std::string name;
+	int bindPoint = 0;
+};
+
+struct ShaderReflectionInfo {
+	std::vector<ShaderConstantBufferInfo> constantBuffers;     // in register order
+	std::vector<ShaderTextureInfo> textures;
+};
+
+// Everything D3DCompile's output depends on. The shaders have no #include, so the
+// source text stands for all of its input.
+struct ShaderCacheKey {
+	uint64_t sourceHash = 0;
+	std::string defines;        // NAME=VALUE; in the order they are passed
+	std::string entry;
+	std::string profile;
+	uint32_t flags = 0;
+
+	bool operator==(const ShaderCacheKey& o) const {
+		return sourceHash == o.sourceHash && defines == o.defines && entry == o.entry && profile == o.profile && flags == o.flags;
+	}
+	bool operator!=(const ShaderCacheKey& o) const { return !(*this == o); }
+};
+
+struct ShaderCacheEntry {
+	ShaderCacheKey key;
+	std::vector<uint8_t> bytecode;
+	ShaderReflectionInfo reflection;
+};
+
+struct ShaderCacheStats {
+	int hits = 0;
+	int misses = 0;             // no file, or one made from other source or settings
+	int stores = 0;
+};
+
+// Compiled shaders on disk, one sidecar per source file and variant (defines, entry,
+// profile), next to the .hlsl like the .lod files are next to the .gem. A sidecar is
+// used when the key stored in it matches, so an edited source is compiled again and
+// overwrites it. Nothing in here needs D3D, the headless tools read the same files.
+class ShaderCache {
+public:
+	ShaderCacheStats stats;
+	bool enabled = true;        // false: always a miss, nothing written
+
+	static const uint32_t magic = 0x43485347;       // "GSHC"
+	static const uint32_t version = 1;              // bump when the layout below changes
+
+	// FNV-1a, 64 bit
+	static uint64_t hash(const void* data, size_t size, uint64_t h = 14695981039346656037ull) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++)
+			h = (h ^ bytes[i]) * 1099511628211ull;
+		return h;
+	}
+
+	static ShaderCacheKey makeKey(const std::string& source, const std::string& defines, const std::string& entry, const std::string& profile, uint32_t flags = 0) {
+		ShaderCacheKey key;
+		key.sourceHash = hash(source.data(), source.size());
+		key.defines = defines;
+		key.entry = entry;
+		key.profile = profile;
+		key.flags = flags;
+		return key;
+	}
+
+	// <source>.<variant>.gsc, the variant hash leaves the source out so a new version
+	// replaces the old file instead of adding one
+	static std::string path(const std::string& sourceFile, const ShaderCacheKey& key) {
+		uint64_t h = hash(key.defines.data(), key.defines.size());
+		h = hash(key.entry.data(), key.entry.size(), h);
+		h = hash(key.profile.data(), key.profile.size(), h);
+		h = hash(&key.flags, sizeof(key.flags), h);
+		uint32_t variant = (uint32_t)(h ^ (h >> 32));
+		char hex[9];
+		for (int i = 0; i < 8; i++)
+			hex[i] = "0123456789abcdef"[(variant >> (28 - i * 4)) & 0xf];
+		hex[8] = 0;
+		return sourceFile + "." + hex + ".gsc";
+	}
+
+	// the source a sidecar belongs to, empty when the name is not one of ours
+	static std::string sourceOf(const std::string& sidecar) {
+		size_t dot = sidecar.size() > 13 ? sidecar.size() - 13 : std::string::npos;
+		if (dot == std::string::npos || sidecar[dot] != '.' || sidecar.compare(sidecar.size() - 4, 4, ".gsc") != 0) return std::string();
+		return sidecar.substr(0, dot);
+	}
+
+	bool load(const std::string& sourceFile, const ShaderCacheKey& key, ShaderCacheEntry& entry) {
+		if (enabled && read(path(sourceFile, key), entry) && entry.key == key) {
+			stats.hits++;
+			return true;
+		}
+		stats.misses++;
+		return false;
+	}
+
+	bool store(const std::string& sourceFile, const ShaderCacheEntry& entry) {
+		if (!enabled || !write(path(sourceFile, entry.key), entry)) return false;
+		stats.stores++;
+		return true;
+	}
+
+	// "GSHC", version, source hash, flags, defines, entry, profile, bytecode, then the
+	// constant buffers (name, size, variables: name, offset, size) and the textures
+	// (name, bind point). Strings and arrays are a 32-bit count and their elements.
+	static bool read(const std::string& filename, ShaderCacheEntry& entry) {
+		std::ifstream file(filename, std::ios::binary);
+		if (!file) return false;
+		uint32_t header[2] = {};
+		file.read((char*)header, sizeof(header));
+		if (!file || header[0] != magic || header[1] != version) return false;
+		ShaderCacheEntry e;
+		file.read((char*)&e.key.sourceHash, sizeof(e.key.sourceHash));
+		file.read((char*)&e.key.flags, sizeof(e.key.flags));
+		if (!readString(file, e.key.defines) || !readString(file, e.key.entry) || !readString(file, e.key.profile)) return false;
+		uint32_t count = 0;
+		if (!readCount(file, count, 1u << 24)) return false;
+		e.bytecode.resize(count);
+		file.read((char*)e.bytecode.data(), count);
+		if (!readCount(file, count, 16)) return false;
+		e.reflection.constantBuffers.resize(count);
+		for (auto& cb : e.reflection.constantBuffers) {
+			uint32_t variables = 0;
+			if (!readString(file, cb.name) || !readU32(file, cb.size) || !readCount(file, variables, 4096)) return false;
+			cb.variables.resize(variables);
+			for (auto& v : cb.variables)
+				if (!readString(file, v.name) || !readU32(file, v.offset) || !readU32(file, v.size)) return false;
+		}
+		if (!readCount(file, count, 128)) return false;
+		e.reflection.textures.resize(count);
+		for (auto& t : e.reflection.textures) {
+			uint32_t bindPoint = 0;
+			if (!readString(file, t.name) || !readU32(file, bindPoint)) return false;
+			t.bindPoint = (int)bindPoint;
+		}
+		entry = std::move(e);
+		return true;
+	}
+
+	static bool write(const std::string& filename, const ShaderCacheEntry& entry) {
+		std::ofstream file(filename, std::ios::binary);
+		if (!file) return false;
+		uint32_t header[2] = { magic, version };
+		file.write((const char*)header, sizeof(header));
+		file.write((const char*)&entry.key.sourceHash, sizeof(entry.key.sourceHash));
+		file.write((const char*)&entry.key.flags, sizeof(entry.key.flags));
+		writeString(file, entry.key.defines);
+		writeString(file, entry.key.entry);
+		writeString(file, entry.key.profile);
+		writeU32(file, (uint32_t)entry.bytecode.size());
+		file.write((const char*)entry.bytecode.data(), entry.bytecode.size());
+		writeU32(file, (uint32_t)entry.reflection.constantBuffers.size());
+		for (auto& cb : entry.reflection.constantBuffers) {
+			writeString(file, cb.name);
+			writeU32(file, cb.size);
+			writeU32(file, (uint32_t)cb.variables.size());
+			for (auto& v : cb.variables) {
+				writeString(file, v.name);
+				writeU32(file, v.offset);
+				writeU32(file, v.size);
+			}
+		}
+		writeU32(file, (uint32_t)entry.reflection.textures.size());
+		for (auto& t : entry.reflection.textures) {
+			writeString(file, t.name);
+			writeU32(file, (uint32_t)t.bindPoint);
+		}
+		return (bool)file;
+	}
+
+	// one line for the key, one per constant buffer and variable, one for the textures
+	static std::string describe(const ShaderCacheEntry& entry) {
+		std::ostringstream out;
+		out << entry.key.entry << " " << entry.key.profile;
+		if (!entry.key.defines.empty()) out << " [" << entry.key.defines << "]";
+		out << ", " << entry.bytecode.size() << " bytes of bytecode, source " << std::hex << entry.key.sourceHash << std::dec << "\n";
+		for (auto& cb : entry.reflection.constantBuffers) {
+			out << "  cbuffer " << cb.name << " (" << cb.size << " bytes)\n";
+			for (auto& v : cb.variables)
+				out << "    " << v.name << " @" << v.offset << " " << v.size << " bytes\n";
+		}
+		if (!entry.reflection.textures.empty()) {
+			out << "  textures";
+			for (auto& t : entry.reflection.textures)
+				out << " " << t.name << ":t" << t.bindPoint;
+			out << "\n";
+		}
+		return out.str();
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "shader cache: " << stats.hits << " hits, " << stats.misses << " compiled, " << stats.stores << " stored";
+		return out.str();
+	}
+
+private:
+	static bool readU32(std::ifstream& file, uint32_t& v) {
+		file.read((char*)&v, sizeof(v));
+		return (bool)file;
+	}
+
+	static bool readCount(std::ifstream& file, uint32_t& count, uint32_t limit) {
+		return readU32(file, count) && count <= limit;
+	}
+
+	static bool readString(std::ifstream& file, std::string& s) {
+		uint32_t length = 0;
+		if (!readCount(file, length, 4096)) return false;
+		s.resize(length);
+		file.read(&s[0], length);
+		return (bool)file;
+	}
+
+	static void writeU32(std::ofstream& file, uint32_t v) {
+		file.write((const char*)&v, sizeof(v));
+	}
+
+	static void writeString(std::ofstream& file, const std::string& s) {
+		writeU32(file, (uint32_t)s.size());
+		file.write(s.data(), s.size());
+	}
+};
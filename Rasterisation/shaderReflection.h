@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "DxCore.h" // Replace with your DXCore etc
+#include "shaderCache.h"
 
 #pragma comment(lib, "dxguid.lib")
 
@@ -29,7 +30,7 @@ class ConstantBuffer
 {
 public:
 	std::string name;
-	std::map<std::string, ConstantBufferVariable> constantBufferData;
+	std::map<std::string, ConstantBufferVariable, std::less<>> constantBufferData;   // std::less<> so update() can look up a const char*
 	ID3D11Buffer* cb;
 	unsigned char* buffer;
 	unsigned int cbSizeInBytes;
@@ -53,10 +54,11 @@ public:
 		dirty = 1;
 		shaderStage = _shaderStage;
 	}
-	void update(std::string name, void* data)
+	void update(const char* name, void* data)
 	{
-		ConstantBufferVariable cbVariable = constantBufferData[name];
-		memcpy(&buffer[cbVariable.offset], data, cbVariable.size);
+		auto it = constantBufferData.find(name);
+		if (it == constantBufferData.end()) return;
+		memcpy(&buffer[it->second.offset], data, it->second.size);
 		dirty = 1;
 	}
 	void upload(DxCore* core)
@@ -81,39 +83,41 @@ public:
 	void free()
 	{
 		cb->Release();
+		delete[] buffer;
 	}
 };
 
+// D3DReflect into ShaderReflectionInfo, which the shader cache stores, and the
+// constant buffers and texture bind points made from it
 class ConstantBufferReflection
 {
 public:
-	void build(DxCore* core, ID3DBlob* shader, std::vector<ConstantBuffer>& buffers, std::map<std::string, int>& textureBindPoints, ShaderStage shaderStage)
+	void reflect(const void* bytecode, size_t size, ShaderReflectionInfo& info)
 	{
 		ID3D11ShaderReflection* reflection;
-		D3DReflect(shader->GetBufferPointer(), shader->GetBufferSize(), IID_ID3D11ShaderReflection, (void**)&reflection);
+		D3DReflect(bytecode, size, IID_ID3D11ShaderReflection, (void**)&reflection);
 		D3D11_SHADER_DESC desc;
 		reflection->GetDesc(&desc);
 		for (int i = 0; i < desc.ConstantBuffers; i++)
 		{
-			ConstantBuffer buffer;
+			ShaderConstantBufferInfo buffer;
 			ID3D11ShaderReflectionConstantBuffer* constantBuffer = reflection->GetConstantBufferByIndex(i);
 			D3D11_SHADER_BUFFER_DESC cbDesc;
 			constantBuffer->GetDesc(&cbDesc);
 			buffer.name = cbDesc.Name;
-			unsigned int totalSize = 0;
 			for (int n = 0; n < cbDesc.Variables; n++)
 			{
 				ID3D11ShaderReflectionVariable* var = constantBuffer->GetVariableByIndex(n);
 				D3D11_SHADER_VARIABLE_DESC vDesc;
 				var->GetDesc(&vDesc);
-				ConstantBufferVariable bufferVariable;
-				bufferVariable.offset = vDesc.StartOffset;
-				bufferVariable.size = vDesc.Size;
-				buffer.constantBufferData.insert({ vDesc.Name, bufferVariable });
-				totalSize += bufferVariable.size;
+				ShaderVariableInfo variable;
+				variable.name = vDesc.Name;
+				variable.offset = vDesc.StartOffset;
+				variable.size = vDesc.Size;
+				buffer.variables.push_back(variable);
+				buffer.size += variable.size;
 			}
-			buffer.init(core, totalSize, i, shaderStage);
-			buffers.push_back(buffer);
+			info.constantBuffers.push_back(buffer);
 		}
 		for (int i = 0; i < desc.BoundResources; i++)
 		{
@@ -121,8 +125,33 @@ public:
 			reflection->GetResourceBindingDesc(i, &bindDesc);
 			if (bindDesc.Type == D3D_SIT_TEXTURE)
 			{
-				textureBindPoints.insert({ bindDesc.Name, bindDesc.BindPoint });
+				ShaderTextureInfo texture;
+				texture.name = bindDesc.Name;
+				texture.bindPoint = bindDesc.BindPoint;
+				info.textures.push_back(texture);
+			}
+		}
+		reflection->Release();
+	}
+
+	void create(DxCore* core, const ShaderReflectionInfo& info, std::vector<ConstantBuffer>& buffers, std::map<std::string, int, std::less<>>& textureBindPoints, ShaderStage shaderStage)
+	{
+		for (int i = 0; i < (int)info.constantBuffers.size(); i++)
+		{
+			const ShaderConstantBufferInfo& cb = info.constantBuffers[i];
+			ConstantBuffer buffer;
+			buffer.name = cb.name;
+			for (auto& v : cb.variables)
+			{
+				ConstantBufferVariable bufferVariable;
+				bufferVariable.offset = v.offset;
+				bufferVariable.size = v.size;
+				buffer.constantBufferData.insert({ v.name, bufferVariable });
 			}
+			buffer.init(core, cb.size, i, shaderStage);
+			buffers.push_back(buffer);
 		}
+		for (auto& t : info.textures)
+			textureBindPoints.insert({ t.name, t.bindPoint });
 	}
-};
\ No newline at end of file
+};
@@ -1,119 +1,182 @@
 #pragma once
 #include "mathLib.h"
 #include <vector>
-#include "mesh.h"
 #include "collision.h"
-#include "window.h"
-#include "camera.h"
-#include "GamesEngineeringBase.h"
-
-class Bullet {
-public:
+#include "animatedRig.h"
+#include "profiler.h"
+#include "ecs.h"
+#include "components.h"
+#include "terrain.h"
+#include "water.h"
+
+// where a bullet went into the ground, or into the water when water is set
+struct BulletImpact {
 	mathLib::Vec3 position;
-	mathLib::Vec3 direction;
-	float speed;
-	bool isActive;
-	float lifeTime; // Bullet lifetime in seconds
-
-	Bullet(mathLib::Vec3& startPos, mathLib::Vec3& dir, float spd, float maxLifeTime = 3.0f)
-		: position(startPos), direction(dir.normalize()), speed(spd), isActive(true), lifeTime(maxLifeTime) {}
-
-	void update(float deltaTime) {
-		if (!isActive) return;
-
-		// Update position
-		position += direction * speed * deltaTime;
-
-		// Decrease lifetime
-		lifeTime -= deltaTime;
-		if (lifeTime <= 0.0f) {
-			isActive = false;
-		}
-	}
-};
-
-
-class Enemy {
-public:
-	AABB bounds; // Axis-aligned bounding box for collision
-	int health;
-	bool isAlive;
-
-	Enemy(const mathLib::Vec3& minPos, const mathLib::Vec3& maxPos, int hp)
-		: bounds(), health(hp), isAlive(true) {
-		bounds.min = minPos;
-		bounds.max = maxPos;
-	}
-
-	void takeDamage(int damage) {
-		if (!isAlive) return;
-		health -= damage;
-		if (health <= 0) {
-			isAlive = false;
-			// Play death animation or trigger effects
-		}
-	}
+	mathLib::Vec3 normal;
+	bool water = false;
 };
 
+// Bullets and enemies are entities: a bullet is Transform + Velocity + Projectile, an
+// enemy Transform + Bounds + Health. update() moves the bullets over their dense
+// arrays (spread over the job system when there is one), then tests each against the
+// live enemies and removes the ones that hit or ran out of time. With a ground set,
+// bullets that go below it are removed too and listed in impacts until the next update.
+// With water set the same goes for bullets under its surface, whose heights are
+// looked up a batch at a time.
 class ShootingSystem {
 public:
-	std::vector<Bullet> bullets;
-	std::vector<Enemy> enemies;
-	animatedModel* weapon;
+	EntityWorld& world;
+	Query<Transform, Velocity, Projectile> bullets;
+	Query<Transform, Bounds, Health> enemies;
+	AnimatedRig* weapon;
 	float fireCooldown; // Time between shots
 	float cooldownTimer;
 	int damage;
-
-	ShootingSystem(animatedModel* _weapon, float cooldown = 0.5f, int dmg = 25)
-		: weapon(_weapon), fireCooldown(cooldown), cooldownTimer(0.0f), damage(dmg) {}
+	const Heightfield* ground = nullptr;
+	const WaterSurface* water = nullptr;
+	std::vector<BulletImpact> impacts;  // of the last update
+
+	ShootingSystem(EntityWorld& _world, AnimatedRig* _weapon, float cooldown = 0.5f, int dmg = 25)
+		: world(_world), bullets(_world), enemies(_world), weapon(_weapon), fireCooldown(cooldown), cooldownTimer(0.0f), damage(dmg) {
+		// more than the cooldown lets into the air at once, so shooting never reallocates mid frame
+		dead.reserve(64);
+		impacts.reserve(64);
+		world.reserve(world.size() + 64);
+	}
 
 	void shoot(mathLib::Vec3& startPosition, mathLib::Vec3& direction) {
 		if (cooldownTimer > 0.0f) return;
 		cooldownTimer = fireCooldown;
 
 		// Play weapon shooting animation
-		weapon->instance.update("Armature|08 Fire", 0.0f);
+		if (weapon)
+			weapon->instance.update("Armature|08 Fire", 0.0f);
 
 		// Create a bullet
-		bullets.emplace_back(startPosition, direction, 50.0f);
+		spawnBullet(startPosition, direction, 50.0f);
+	}
+
+	Entity spawnBullet(const mathLib::Vec3& startPosition, mathLib::Vec3 direction, float speed, float lifeTime = 3.0f) {
+		Transform transform;
+		transform.position = startPosition;
+		Velocity velocity;
+		velocity.value = direction.normalize() * speed;
+		Projectile projectile;
+		projectile.lifeTime = lifeTime;
+		projectile.damage = damage;
+		return world.create(transform, velocity, projectile);
+	}
+
+	Entity addEnemy(const mathLib::Vec3& minPos, const mathLib::Vec3& maxPos, int hp) {
+		Transform transform;
+		transform.position = (minPos + maxPos) * 0.5f;
+		Bounds bounds;
+		bounds.box.min = minPos;
+		bounds.box.max = maxPos;
+		Health health;
+		health.current = hp;
+		health.maximum = hp;
+		return world.create(transform, bounds, health);
 	}
 
-	void update(float deltaTime) {
+	void update(float deltaTime, JobSystem* jobs = nullptr) {
+		PROFILE_SCOPE("ShootingSystem::update");
 		// Update cooldown timer
 		if (cooldownTimer > 0.0f) cooldownTimer -= deltaTime;
 
-		// Update bullets
-		for (auto& bullet : bullets) {
-			bullet.update(deltaTime);
-			if (bullet.isActive) {
-				checkCollisions(bullet);
+		// move and age the bullets
+		auto step = [deltaTime](Entity, Transform& transform, Velocity& velocity, Projectile& projectile) {
+			transform.position += velocity.value * deltaTime;
+			projectile.lifeTime -= deltaTime;
+		};
+		if (jobs) bullets.parallelEach(*jobs, step);
+		else bullets.each(step);
+
+		// hits, then remove the bullets that are done
+		dead.clear();
+		impacts.clear();
+		bullets.eachChunk([&](size_t count, const Entity* entities, Transform* transforms, Velocity*, Projectile* projectiles) {
+			const size_t Batch = 64;
+			float x[Batch], z[Batch], waterHeights[Batch];
+			for (size_t first = 0; first < count; first += Batch) {
+				size_t n = count - first < Batch ? count - first : Batch;
+				if (water) {
+					for (size_t i = 0; i < n; i++) {
+						x[i] = transforms[first + i].position.x;
+						z[i] = transforms[first + i].position.z;
+					}
+					water->heightsAt(x, z, n, waterHeights);
+				}
+				for (size_t i = 0; i < n; i++) {
+					const mathLib::Vec3& position = transforms[first + i].position;
+					if (projectiles[first + i].lifeTime <= 0.0f || checkCollisions(position, projectiles[first + i])) {
+						dead.push_back(entities[first + i]);
+						continue;
+					}
+					BulletImpact impact;
+					if (water && water->contains(position.x, position.z) && position.y <= waterHeights[i]) {
+						impact.position = mathLib::Vec3(position.x, waterHeights[i], position.z);
+						impact.normal = mathLib::Vec3(0.0f, 1.0f, 0.0f);
+						impact.water = true;
+					}
+					else if (ground) {
+						float height = ground->heightAt(position.x, position.z);
+						if (position.y > height) continue;
+						impact.position = mathLib::Vec3(position.x, height, position.z);
+						impact.normal = ground->normalAt(position.x, position.z);
+					}
+					else continue;
+					impacts.push_back(impact);
+					dead.push_back(entities[first + i]);
+				}
 			}
-		}
-
-		// Remove inactive bullets
-		bullets.erase(std::remove_if(bullets.begin(), bullets.end(),
-			[](Bullet& b) { return !b.isActive; }),
-			bullets.end());
+		});
+		for (Entity entity : dead)
+			world.destroy(entity);
 	}
 
-	void checkCollisions(Bullet& bullet) {
-		for (auto& enemy : enemies) {
-			if (!enemy.isAlive) continue;
-
-			if (enemy.bounds.intersects(Sphere(bullet.position, 0.2f))) { // Bullet radius
-				bullet.isActive = false;
-				enemy.takeDamage(damage);
+	// damages every live enemy the bullet touches, true when there was one
+	bool checkCollisions(const mathLib::Vec3& position, const Projectile& projectile) {
+		PROFILE_SCOPE("collision: bullet vs enemies");
+		bool hit = false;
+		Sphere sphere(position, projectile.radius);
+		enemies.eachChunk([&](size_t count, const Entity*, Transform*, Bounds* bounds, Health* health) {
+			for (size_t i = 0; i < count; i++) {
+				if (!health[i].alive()) continue;
+				if (bounds[i].box.intersects(sphere)) {
+					hit = true;
+					health[i].current -= projectile.damage;
+				}
 			}
-		}
+		});
+		return hit;
+	}
+
+	void clearBullets() {
+		dead.clear();
+		bullets.each([&](Entity entity, Transform&, Velocity&, Projectile&) { dead.push_back(entity); });
+		for (Entity entity : dead)
+			world.destroy(entity);
 	}
 
-	void addEnemy(const Enemy& enemy) {
-		enemies.push_back(enemy);
+	size_t bulletCount() { return bullets.count(); }
+	size_t enemyCount() { return enemies.count(); }
+
+	size_t enemiesAlive() {
+		size_t alive = 0;
+		enemies.eachChunk([&](size_t count, const Entity*, Transform*, Bounds*, Health* health) {
+			for (size_t i = 0; i < count; i++)
+				if (health[i].alive()) alive++;
+		});
+		return alive;
 	}
+
+private:
+	std::vector<Entity> dead;       // bullets to remove after the walk
 };
 
-//static void handleShooting(Window& canvas, TPSCamera& camera, ShootingSystem& shootingSystem, float deltaTime) {
-//	if (canvas.mouseButtons[0]) {
+//static void handleShooting(InputSource& canvas, TPSCamera& camera, ShootingSystem& shootingSystem, float deltaTime) {
+//	if (canvas.mouseButtonDown(0)) {
 //		// Get shooting direction from camera
 //		mathLib::Vec3 shootDirection = camera.front;
 //		mathLib::Vec3 shootPosition = camera.player->position + mathLib::Vec3(0.0f, 1.8f, 0.0f);
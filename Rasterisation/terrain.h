@@ -0,0 +1,489 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "mathLib.h"
+#include "collision.h"
+#include "vertex.h"
+#include "image.h"
+#include "meshSimplifier.h"
+#include "timer.h"
+#include "profiler.h"
+
+// The ground: a regular grid of heights with O(1) height and normal queries for the
+// simulation, cut into square chunks of 16 x 16 cells for drawing. Every chunk has the
+// same index list with four levels (every 1st, 2nd, 4th and 8th sample) and a skirt
+// hanging down along its four sides, so neighbours at different levels leave no cracks
+// and one LodChain serves all of them. No D3D in here, like the mesh optimizer.
+
+// samples edited by Heightfield::edit, inclusive; empty when x1 < x0
+struct SampleRect {
+	int x0 = 0, z0 = 0;
+	int x1 = -1, z1 = -1;
+
+	bool empty() const { return x1 < x0 || z1 < z0; }
+};
+
+class Heightfield {
+public:
+	int width = 0;              // samples along x
+	int depth = 0;              // and along z
+	float spacing = 1.0f;       // between samples, in world units
+	float originX = 0.0f;       // world position of sample (0, 0)
+	float originZ = 0.0f;
+	std::vector<float> heights; // row by row, z major
+
+	void init(int samplesX, int samplesZ, float sampleSpacing, float x, float z) {
+		width = samplesX < 2 ? 2 : samplesX;
+		depth = samplesZ < 2 ? 2 : samplesZ;
+		spacing = sampleSpacing;
+		inverseSpacing = 1.0f / sampleSpacing;
+		originX = x;
+		originZ = z;
+		heights.assign((size_t)width * depth, 0.0f);
+	}
+
+	// fractal value noise, heights in [-amplitude, amplitude]; wavelength of the first
+	// octave in world units, each next one half as long and half as high
+	void generate(uint32_t seed, float amplitude, float wavelength, int octaves = 4) {
+		float total = 0.0f;
+		for (int o = 0, weight = 1; o < octaves; o++, weight *= 2)
+			total += 1.0f / weight;
+		for (int z = 0; z < depth; z++) {
+			for (int x = 0; x < width; x++) {
+				float wx = originX + x * spacing;
+				float wz = originZ + z * spacing;
+				float frequency = 1.0f / wavelength;
+				float weight = 1.0f;
+				float h = 0.0f;
+				for (int o = 0; o < octaves; o++) {
+					h += valueNoise(wx * frequency, wz * frequency, seed + o) * weight;
+					frequency *= 2.0f;
+					weight *= 0.5f;
+				}
+				heights[(size_t)z * width + x] = h / total * amplitude;
+			}
+		}
+	}
+
+	// the first channel of an image resampled onto the grid, 0 to heightScale; false
+	// when it does not load and the heights stay as they are
+	bool loadImage(const std::string& filename, float heightScale) {
+		Image image;
+		if (!image.load(filename) || image.width < 1 || image.height < 1) return false;
+		auto texel = [&](int x, int y) {
+			x = x < 0 ? 0 : (x >= image.width ? image.width - 1 : x);
+			y = y < 0 ? 0 : (y >= image.height ? image.height - 1 : y);
+			return image.texels[((size_t)y * image.width + x) * image.channels] * (1.0f / 255.0f);
+		};
+		for (int z = 0; z < depth; z++) {
+			for (int x = 0; x < width; x++) {
+				float u = (float)x / (width - 1) * (image.width - 1);
+				float v = (float)z / (depth - 1) * (image.height - 1);
+				int iu = (int)u, iv = (int)v;
+				float tu = u - iu, tv = v - iv;
+				float top = texel(iu, iv) + (texel(iu + 1, iv) - texel(iu, iv)) * tu;
+				float bottom = texel(iu, iv + 1) + (texel(iu + 1, iv + 1) - texel(iu, iv + 1)) * tu;
+				heights[(size_t)z * width + x] = (top + (bottom - top) * tv) * heightScale;
+			}
+		}
+		return true;
+	}
+
+	// clamped to the grid
+	float sample(int x, int z) const {
+		x = x < 0 ? 0 : (x >= width ? width - 1 : x);
+		z = z < 0 ? 0 : (z >= depth ? depth - 1 : z);
+		return heights[(size_t)z * width + x];
+	}
+
+	// bilinear between the four samples around (x, z), the edge height outside the grid
+	float heightAt(float x, float z) const {
+		int ix, iz;
+		float tx, tz;
+		cell(x, z, ix, iz, tx, tz);
+		const float* row = &heights[(size_t)iz * width + ix];
+		float top = row[0] + (row[1] - row[0]) * tx;
+		float bottom = row[width] + (row[width + 1] - row[width]) * tx;
+		return top + (bottom - top) * tz;
+	}
+
+	// unit normal of the bilinear surface heightAt follows
+	mathLib::Vec3 normalAt(float x, float z) const {
+		int ix, iz;
+		float tx, tz;
+		cell(x, z, ix, iz, tx, tz);
+		const float* row = &heights[(size_t)iz * width + ix];
+		float dx = ((row[1] - row[0]) + ((row[width + 1] - row[width]) - (row[1] - row[0])) * tz) * inverseSpacing;
+		float dz = ((row[width] - row[0]) + ((row[width + 1] - row[1]) - (row[width] - row[0])) * tx) * inverseSpacing;
+		mathLib::Vec3 n(-dx, 1.0f, -dz);
+		return n / n.getLength();
+	}
+
+	// raises (delta > 0) or lowers the samples within radius of (x, z), most at the
+	// centre and smoothly less towards the edge; returns the samples that changed
+	SampleRect edit(float x, float z, float radius, float delta) {
+		SampleRect rect = around(x, z, radius);
+		for (int sz = rect.z0; sz <= rect.z1; sz++) {
+			for (int sx = rect.x0; sx <= rect.x1; sx++) {
+				float dx = originX + sx * spacing - x;
+				float dz = originZ + sz * spacing - z;
+				float w = 1.0f - (dx * dx + dz * dz) / (radius * radius);
+				if (w > 0.0f) heights[(size_t)sz * width + sx] += w * w * delta;
+			}
+		}
+		return rect;
+	}
+
+	// pulls the heights to height: fully within inner of (x, z), blending out to outer
+	SampleRect flatten(float x, float z, float inner, float outer, float height) {
+		SampleRect rect = around(x, z, outer);
+		for (int sz = rect.z0; sz <= rect.z1; sz++) {
+			for (int sx = rect.x0; sx <= rect.x1; sx++) {
+				float dx = originX + sx * spacing - x;
+				float dz = originZ + sz * spacing - z;
+				float d = sqrtf(dx * dx + dz * dz);
+				if (d >= outer) continue;
+				float t = d <= inner ? 1.0f : (outer - d) / (outer - inner);
+				t = t * t * (3.0f - 2.0f * t);
+				float& h = heights[(size_t)sz * width + sx];
+				h += (height - h) * t;
+			}
+		}
+		return rect;
+	}
+
+	AABB bounds() const {
+		AABB box;
+		box.reset();
+		float low = heights.empty() ? 0.0f : heights[0];
+		float high = low;
+		for (float h : heights) {
+			if (h < low) low = h;
+			if (h > high) high = h;
+		}
+		box.extend(mathLib::Vec3(originX, low, originZ));
+		box.extend(mathLib::Vec3(originX + (width - 1) * spacing, high, originZ + (depth - 1) * spacing));
+		return box;
+	}
+
+	// smooth noise in [-1, 1] with features one unit apart, also what the foliage
+	// density maps are made of
+	static float lattice(int x, int z, uint32_t seed) {
+		uint32_t h = seed * 2654435761u + (uint32_t)x * 374761393u + (uint32_t)z * 668265263u;
+		h = (h ^ (h >> 13)) * 1274126177u;
+		h ^= h >> 16;
+		return (h & 0xffffff) * (2.0f / 16777215.0f) - 1.0f;
+	}
+
+	static float valueNoise(float x, float z, uint32_t seed) {
+		int ix = (int)floorf(x);
+		int iz = (int)floorf(z);
+		float tx = x - ix, tz = z - iz;
+		tx = tx * tx * (3.0f - 2.0f * tx);
+		tz = tz * tz * (3.0f - 2.0f * tz);
+		float top = lattice(ix, iz, seed) + (lattice(ix + 1, iz, seed) - lattice(ix, iz, seed)) * tx;
+		float bottom = lattice(ix, iz + 1, seed) + (lattice(ix + 1, iz + 1, seed) - lattice(ix, iz + 1, seed)) * tx;
+		return top + (bottom - top) * tz;
+	}
+
+private:
+	float inverseSpacing = 1.0f;
+
+	// the cell holding (x, z) and where in it, clamped to the grid
+	void cell(float x, float z, int& ix, int& iz, float& tx, float& tz) const {
+		float fx = (x - originX) * inverseSpacing;
+		float fz = (z - originZ) * inverseSpacing;
+		fx = fx < 0.0f ? 0.0f : (fx > width - 1 ? (float)(width - 1) : fx);
+		fz = fz < 0.0f ? 0.0f : (fz > depth - 1 ? (float)(depth - 1) : fz);
+		ix = (int)fx;
+		iz = (int)fz;
+		if (ix > width - 2) ix = width - 2;
+		if (iz > depth - 2) iz = depth - 2;
+		tx = fx - ix;
+		tz = fz - iz;
+	}
+
+	SampleRect around(float x, float z, float radius) const {
+		SampleRect rect;
+		rect.x0 = (int)ceilf((x - radius - originX) * inverseSpacing);
+		rect.x1 = (int)floorf((x + radius - originX) * inverseSpacing);
+		rect.z0 = (int)ceilf((z - radius - originZ) * inverseSpacing);
+		rect.z1 = (int)floorf((z + radius - originZ) * inverseSpacing);
+		if (rect.x0 < 0) rect.x0 = 0;
+		if (rect.z0 < 0) rect.z0 = 0;
+		if (rect.x1 > width - 1) rect.x1 = width - 1;
+		if (rect.z1 > depth - 1) rect.z1 = depth - 1;
+		return rect;
+	}
+};
+
+const int TerrainChunkCells = 16;
+const int TerrainLevels = 4;        // every 1st, 2nd, 4th and 8th sample
+const int TerrainChunkVertices = (TerrainChunkCells + 1) * (TerrainChunkCells + 1) + 4 * (TerrainChunkCells + 1);
+
+// Vertices: the (cells + 1)^2 grid row by row, then the skirt, one vertex below each
+// edge sample, side by side counterclockwise from above starting along -z.
+struct TerrainChunk {
+	int firstX = 0, firstZ = 0;                 // first sample
+	std::vector<STATIC_VERTEX> vertices;
+	AABB bounds;                                // world space, skirt included
+	float heightErrors[TerrainLevels] = {};     // largest height difference to level 0
+	float lodErrors[TerrainLevels] = {};        // the same over the bounds' diagonal, for LodSelector
+	bool dirty = false;
+};
+
+// what the device needs of a rebuilt chunk, fixed size so it can be copied into a
+// frame snapshot or handed to the device thread without the chunk itself
+struct TerrainChunkUpdate {
+	uint32_t chunk = 0;
+	AABB bounds;
+	float lodErrors[TerrainLevels] = {};
+	STATIC_VERTEX vertices[TerrainChunkVertices];
+
+	void fill(uint32_t index, const TerrainChunk& source) {
+		chunk = index;
+		bounds = source.bounds;
+		memcpy(lodErrors, source.lodErrors, sizeof(lodErrors));
+		memcpy(vertices, source.vertices.data(), sizeof(vertices));
+	}
+};
+
+struct TerrainStats {
+	size_t chunks = 0;
+	size_t dirty = 0;               // waiting for a rebuild
+	size_t rebuilt = 0;             // by the last rebuildDirty
+	uint64_t totalRebuilt = 0;
+	double ms = 0.0;                // of the last rebuildDirty
+};
+
+class TerrainMesh {
+public:
+	int chunksX = 0, chunksZ = 0;
+	std::vector<TerrainChunk> chunks;
+	std::vector<AABB> bounds;       // of each chunk, for a BoundsBatch
+	LodChain chain;                 // indices of every chunk, level by level
+	// the coarsest level of every chunk moved down by its error, so it never covers
+	// more than the ground does: an occluder for OcclusionCuller
+	std::vector<STATIC_VERTEX> occluderVertices;
+	std::vector<unsigned int> occluderIndices;
+	TerrainStats stats;
+
+	// skirtDepth below the edge, plus the chunk's coarsest error; textureScale: UV per unit
+	void build(const Heightfield& heightfield, float skirt = 2.0f, float uvScale = 0.05f) {
+		field = &heightfield;
+		skirtDepth = skirt;
+		textureScale = uvScale;
+		chunksX = (field->width - 2) / TerrainChunkCells + 1;
+		chunksZ = (field->depth - 2) / TerrainChunkCells + 1;
+		chunks.assign((size_t)chunksX * chunksZ, TerrainChunk());
+		bounds.resize(chunks.size());
+		buildChain();
+		const int coarse = TerrainChunkCells >> (TerrainLevels - 1);
+		occluderVertices.resize(chunks.size() * (coarse + 1) * (coarse + 1));
+		occluderIndices.clear();
+		for (size_t c = 0; c < chunks.size(); c++) {
+			TerrainChunk& chunk = chunks[c];
+			chunk.firstX = (int)(c % chunksX) * TerrainChunkCells;
+			chunk.firstZ = (int)(c / chunksX) * TerrainChunkCells;
+			chunk.vertices.resize(TerrainChunkVertices);
+			unsigned int base = (unsigned int)(c * (coarse + 1) * (coarse + 1));
+			for (int z = 0; z < coarse; z++) {
+				for (int x = 0; x < coarse; x++) {
+					unsigned int i = base + z * (coarse + 1) + x;
+					occluderIndices.insert(occluderIndices.end(), { i, i + coarse + 1, i + 1, i + 1, i + coarse + 1, i + coarse + 2 });
+				}
+			}
+			rebuild(c);
+		}
+		rebuiltChunks.clear();
+		rebuiltChunks.reserve(chunks.size());
+		stats = TerrainStats();
+		stats.chunks = chunks.size();
+	}
+
+	// the chunks that hold a sample of rect or one next to it (their normals) are
+	// rebuilt by the next rebuildDirty
+	void markDirty(const SampleRect& rect) {
+		if (rect.empty()) return;
+		int x0 = rect.x0 - 1, x1 = rect.x1 + 1, z0 = rect.z0 - 1, z1 = rect.z1 + 1;
+		int cx0 = x0 <= 0 ? 0 : (x0 - 1) / TerrainChunkCells;
+		int cz0 = z0 <= 0 ? 0 : (z0 - 1) / TerrainChunkCells;
+		int cx1 = x1 / TerrainChunkCells < chunksX - 1 ? x1 / TerrainChunkCells : chunksX - 1;
+		int cz1 = z1 / TerrainChunkCells < chunksZ - 1 ? z1 / TerrainChunkCells : chunksZ - 1;
+		for (int cz = cz0; cz <= cz1; cz++)
+			for (int cx = cx0; cx <= cx1; cx++) {
+				TerrainChunk& chunk = chunks[(size_t)cz * chunksX + cx];
+				if (!chunk.dirty) stats.dirty++;
+				chunk.dirty = true;
+			}
+	}
+
+	// rebuilds up to maxChunks of the dirty chunks from the heightfield, the rest wait
+	// for the next call; rebuilt() lists them until then
+	size_t rebuildDirty(size_t maxChunks = SIZE_MAX) {
+		rebuiltChunks.clear();
+		if (stats.dirty == 0) {
+			stats.rebuilt = 0;
+			return 0;
+		}
+		PROFILE_SCOPE("terrain: rebuild chunks");
+		Timer timer;
+		for (size_t c = 0; c < chunks.size() && rebuiltChunks.size() < maxChunks; c++) {
+			if (!chunks[c].dirty) continue;
+			rebuild(c);
+			rebuiltChunks.push_back((uint32_t)c);
+		}
+		stats.dirty -= rebuiltChunks.size();
+		stats.rebuilt = rebuiltChunks.size();
+		stats.totalRebuilt += rebuiltChunks.size();
+		stats.ms = timer.elapsed() * 1000.0;
+		return rebuiltChunks.size();
+	}
+
+	const std::vector<uint32_t>& rebuilt() const { return rebuiltChunks; }
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "terrain: " << stats.chunks << " chunks, " << stats.totalRebuilt << " rebuilt, " << stats.dirty << " waiting";
+		return out.str();
+	}
+
+private:
+	const Heightfield* field = nullptr;
+	float skirtDepth = 2.0f;
+	float textureScale = 0.05f;
+	std::vector<uint32_t> rebuiltChunks;
+
+	// grid vertex of local sample (x, z), and the one on side `side` at step j along it
+	static unsigned int gridIndex(int x, int z) { return (unsigned int)(z * (TerrainChunkCells + 1) + x); }
+
+	static unsigned int edgeIndex(int side, int j) {
+		const int n = TerrainChunkCells;
+		switch (side) {
+		case 0: return gridIndex(j, 0);
+		case 1: return gridIndex(n, j);
+		case 2: return gridIndex(n - j, n);
+		default: return gridIndex(0, n - j);
+		}
+	}
+
+	static unsigned int skirtIndex(int side, int j) { return (unsigned int)((TerrainChunkCells + 1) * (TerrainChunkCells + 1) + side * (TerrainChunkCells + 1) + j); }
+
+	void buildChain() {
+		const int n = TerrainChunkCells;
+		chain.indices.clear();
+		chain.levels.clear();
+		for (int level = 0; level < TerrainLevels; level++) {
+			int step = 1 << level;
+			MeshLod lod;
+			lod.firstIndex = (uint32_t)chain.indices.size();
+			for (int z = 0; z < n; z += step) {
+				for (int x = 0; x < n; x += step) {
+					unsigned int tl = gridIndex(x, z), tr = gridIndex(x + step, z);
+					unsigned int bl = gridIndex(x, z + step), br = gridIndex(x + step, z + step);
+					chain.indices.insert(chain.indices.end(), { tl, bl, tr, tr, bl, br });
+				}
+			}
+			// walking each side counterclockwise, the skirt faces out
+			for (int side = 0; side < 4; side++) {
+				for (int j = 0; j < n; j += step) {
+					unsigned int p = edgeIndex(side, j), q = edgeIndex(side, j + step);
+					unsigned int pd = skirtIndex(side, j), qd = skirtIndex(side, j + step);
+					chain.indices.insert(chain.indices.end(), { p, q, pd, q, qd, pd });
+				}
+			}
+			lod.indexCount = (uint32_t)chain.indices.size() - lod.firstIndex;
+			chain.levels.push_back(lod);
+		}
+	}
+
+	void rebuild(size_t c) {
+		const int n = TerrainChunkCells;
+		TerrainChunk& chunk = chunks[c];
+		auto height = [&](int x, int z) { return field->sample(chunk.firstX + x, chunk.firstZ + z); };
+
+		// how far each level's triangles are from the samples they skip; the diagonal of
+		// a quad runs from (x + step, z) to (x, z + step) like the index list
+		chunk.heightErrors[0] = 0.0f;
+		for (int level = 1; level < TerrainLevels; level++) {
+			int step = 1 << level;
+			float worst = chunk.heightErrors[level - 1];
+			for (int z = 0; z <= n; z++) {
+				for (int x = 0; x <= n; x++) {
+					int cx = x / step * step, cz = z / step * step;
+					if (cx == n) cx -= step;
+					if (cz == n) cz -= step;
+					float fx = (float)(x - cx) / step, fz = (float)(z - cz) / step;
+					float h00 = height(cx, cz), h10 = height(cx + step, cz);
+					float h01 = height(cx, cz + step), h11 = height(cx + step, cz + step);
+					float h = fx + fz <= 1.0f ? h00 + (h10 - h00) * fx + (h01 - h00) * fz
+						: h11 + (h01 - h11) * (1.0f - fx) + (h10 - h11) * (1.0f - fz);
+					float error = fabsf(height(x, z) - h);
+					if (error > worst) worst = error;
+				}
+			}
+			chunk.heightErrors[level] = worst;
+		}
+
+		// grid, normals from the neighbouring samples, clamped at the field's edge
+		AABB box;
+		box.reset();
+		for (int z = 0; z <= n; z++) {
+			for (int x = 0; x <= n; x++) {
+				int sx = chunk.firstX + x < field->width ? chunk.firstX + x : field->width - 1;
+				int sz = chunk.firstZ + z < field->depth ? chunk.firstZ + z : field->depth - 1;
+				mathLib::Vec3 p(field->originX + sx * field->spacing, field->sample(sx, sz), field->originZ + sz * field->spacing);
+				float dx = (field->sample(sx + 1, sz) - field->sample(sx - 1, sz)) / (2.0f * field->spacing);
+				float dz = (field->sample(sx, sz + 1) - field->sample(sx, sz - 1)) / (2.0f * field->spacing);
+				mathLib::Vec3 normal(-dx, 1.0f, -dz);
+				STATIC_VERTEX v = addVertex(p, normal / normal.getLength(), p.x * textureScale, p.z * textureScale);
+				mathLib::Vec3 tangent(1.0f, dx, 0.0f);
+				v.tangent = tangent / tangent.getLength();
+				chunk.vertices[gridIndex(x, z)] = v;
+				box.extend(p);
+			}
+		}
+		// skirts, deep enough for the largest step to a neighbour at another level
+		float drop = skirtDepth + chunk.heightErrors[TerrainLevels - 1];
+		for (int side = 0; side < 4; side++) {
+			for (int j = 0; j <= n; j++) {
+				STATIC_VERTEX v = chunk.vertices[edgeIndex(side, j)];
+				v.pos.y -= drop;
+				chunk.vertices[skirtIndex(side, j)] = v;
+				box.extend(v.pos);
+			}
+		}
+		chunk.bounds = box;
+		bounds[c] = box;
+		mathLib::Vec3 extent = box.max - box.min;
+		float diagonal = extent.getLength();
+		for (int level = 0; level < TerrainLevels; level++)
+			chunk.lodErrors[level] = diagonal > 0.0f ? chunk.heightErrors[level] / diagonal : 0.0f;
+
+		const int coarse = n >> (TerrainLevels - 1);
+		const int step = 1 << (TerrainLevels - 1);
+		size_t base = c * (coarse + 1) * (coarse + 1);
+		for (int z = 0; z <= coarse; z++) {
+			for (int x = 0; x <= coarse; x++) {
+				STATIC_VERTEX v = chunk.vertices[gridIndex(x * step, z * step)];
+				v.pos.y -= chunk.heightErrors[TerrainLevels - 1];
+				occluderVertices[base + z * (coarse + 1) + x] = v;
+			}
+		}
+		chunk.dirty = false;
+	}
+};
+
+// The world's ground, 200 x 200 units around the origin where the flat plane was:
+// Resources/Textures/heightmap.png when there is one, rolling noise otherwise, kept
+// level around the pool and the spawn point either way
+static void createGround(Heightfield& field, const std::string& resources = "Resources") {
+	field.init(129, 129, 200.0f / 128.0f, -100.0f, -100.0f);
+	if (!field.loadImage(resources + "/Textures/heightmap.png", 12.0f))
+		field.generate(7, 3.0f, 60.0f);
+	field.flatten(0.0f, 0.0f, 16.0f, 32.0f, 0.0f);
+}
@@ -1,9 +1,17 @@
 #pragma once
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
 #include <string>
+#include <map>
+#include <vector>
+#include <set>
+#include <memory>
+#include <functional>
 #include <d3d11.h>
 #include "dxCore.h"
+#include "profiler.h"
+#include "image.h"
+#include "jobSystem.h"
+#include "assetStreamer.h"
+#include "textureResidency.h"
 
 class texture {
 public:
@@ -11,55 +19,56 @@ public:
 	ID3D11ShaderResourceView* srv;
 
 	void init(DxCore* core, int width, int height, int channels, unsigned char* data, DXGI_FORMAT format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB) {
+		D3D11_SUBRESOURCE_DATA initData;
+		memset(&initData, 0, sizeof(D3D11_SUBRESOURCE_DATA));
+		initData.pSysMem = data;
+		initData.SysMemPitch = width * channels;
+		create(core, width, height, 1, &initData, format);
+	}
+
+	// levels [firstLevel, levelCount) of the chain, one subresource each
+	void init(DxCore* core, const MipChain& chain, int firstLevel = 0, DXGI_FORMAT format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB) {
+		std::vector<D3D11_SUBRESOURCE_DATA> initData(chain.levelCount() - firstLevel);
+		for (int i = 0; i < (int)initData.size(); i++) {
+			memset(&initData[i], 0, sizeof(D3D11_SUBRESOURCE_DATA));
+			initData[i].pSysMem = chain.levels[firstLevel + i].data();
+			initData[i].SysMemPitch = chain.levelWidth(firstLevel + i) * chain.channels;
+		}
+		create(core, chain.levelWidth(firstLevel), chain.levelHeight(firstLevel), (int)initData.size(), initData.data(), format);
+	}
+
+	// initData has one entry per level, or is nullptr for a texture filled later by copies
+	void create(DxCore* core, int width, int height, int levels, const D3D11_SUBRESOURCE_DATA* initData, DXGI_FORMAT format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB) {
 		D3D11_TEXTURE2D_DESC texDesc;
 		memset(&texDesc, 0, sizeof(D3D11_TEXTURE2D_DESC));
 		texDesc.Width = width;
 		texDesc.Height = height;
-		texDesc.MipLevels = 1;
+		texDesc.MipLevels = levels;
 		texDesc.ArraySize = 1;
 		texDesc.Format = format;
 		texDesc.SampleDesc.Count = 1;
 		texDesc.Usage = D3D11_USAGE_DEFAULT;
 		texDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
 		texDesc.CPUAccessFlags = 0;
-
-		D3D11_SUBRESOURCE_DATA initData;
-		memset(&initData, 0, sizeof(D3D11_SUBRESOURCE_DATA));
-		initData.pSysMem = data;
-		initData.SysMemPitch = width * channels;
-		core->device->CreateTexture2D(&texDesc, &initData, &tex);
+		core->device->CreateTexture2D(&texDesc, initData, &tex);
 
 		D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc;
 		srvDesc.Format = format;
 		srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
 		srvDesc.Texture2D.MostDetailedMip = 0;
-		srvDesc.Texture2D.MipLevels = 1;
+		srvDesc.Texture2D.MipLevels = levels;
 		core->device->CreateShaderResourceView(tex, &srvDesc, &srv);
 	}
 
 	void load(std::string filename, DxCore* core) {
-		int width = 0;
-		int height = 0;
-		int channels = 0;
-		unsigned char* texels = stbi_load(filename.c_str(), &width, &height, &channels, 0);
-		if (channels == 3) {
-			channels = 4;
-			unsigned char* texelsWithAlpha = new unsigned char[width * height * channels];
-			for (int i = 0; i < (width * height); i++) {
-				texelsWithAlpha[i * 4] = texels[i * 3];
-				texelsWithAlpha[(i * 4) + 1] = texels[(i * 3) + 1];
-				texelsWithAlpha[(i * 4) + 2] = texels[(i * 3) + 2];
-				texelsWithAlpha[(i * 4) + 3] = 255;
-			}
-			// Initialize texture using width, height, channels, and texelsWithAlpha
-			init(core, width, height, channels, texelsWithAlpha);
-			delete[] texelsWithAlpha;
-		}
-		else {
-			// Initialize texture using width, height, channels, and texels
-			init(core, width, height, channels, texels);
-		}
-		stbi_image_free(texels);
+		Image image;
+		image.load(filename);
+		init(core, image);
+	}
+
+	// Initialize texture using width, height, channels, and texels (RGB is already expanded to RGBA)
+	void init(DxCore* core, Image& image) {
+		init(core, image.width, image.height, image.channels, image.texels.data());
 	}
 
 	void free() {
@@ -90,41 +99,284 @@ public:
 	}
 };
 
+// D3D11 side of TextureResidency. Dropping levels creates the smaller texture empty and
+// copies the remaining levels across on the GPU, nothing is read back or uploaded again.
+class DxTextureBackend : public TextureUploadBackend {
+public:
+	// called with a texture's SRV just before it is released (evicted, reduced or unloaded),
+	// so whoever registered it can forget it before the address is reused
+	std::function<void(ID3D11ShaderResourceView*)> onRelease;
+
+	void init(DxCore* _core) { core = _core; }
+
+	DeviceHandle create(const MipChain& chain, int firstLevel) override {
+		PROFILE_SCOPE("texture upload");
+		Slot slot;
+		slot.tex.init(core, chain, firstLevel);
+		slot.width = chain.levelWidth(firstLevel);
+		slot.height = chain.levelHeight(firstLevel);
+		slot.levels = chain.levelCount() - firstLevel;
+		return add(slot);
+	}
+
+	DeviceHandle dropLevels(DeviceHandle texture, int drop) override {
+		PROFILE_SCOPE("texture drop mips");
+		Slot old = slots[texture];
+		Slot slot;
+		slot.width = old.width >> drop > 1 ? old.width >> drop : 1;
+		slot.height = old.height >> drop > 1 ? old.height >> drop : 1;
+		slot.levels = old.levels - drop;
+		slot.tex.create(core, slot.width, slot.height, slot.levels, nullptr);
+		for (int i = 0; i < slot.levels; i++)
+			core->devicecontext->CopySubresourceRegion(slot.tex.tex, i, 0, 0, 0, old.tex.tex, i + drop, nullptr);
+		release(texture);
+		return add(slot);
+	}
+
+	void release(DeviceHandle texture) override {
+		if (onRelease) onRelease(slots[texture].tex.srv);
+		slots[texture].tex.free();
+		slots[texture].tex.srv = nullptr;
+		freeSlots.push_back(texture);
+	}
+
+	ID3D11ShaderResourceView* srv(DeviceHandle texture) { return slots[texture].tex.srv; }
+
+private:
+	struct Slot {
+		texture tex;
+		int width = 0;
+		int height = 0;
+		int levels = 0;
+	};
+	DxCore* core = nullptr;
+	std::vector<Slot> slots;
+	std::vector<DeviceHandle> freeSlots;
+
+	DeviceHandle add(const Slot& slot) {
+		if (!freeSlots.empty()) {
+			DeviceHandle handle = freeSlots.back();
+			freeSlots.pop_back();
+			slots[handle] = slot;
+			return handle;
+		}
+		slots.push_back(slot);
+		return (DeviceHandle)slots.size() - 1;
+	}
+};
+
+// Textures by name, kept within a GPU memory budget by TextureResidency. Names are the
+// filenames without "Resources/". Every lookup through find() or use() counts as a use
+// for the LRU; a texture that is not resident (still streaming, or evicted) gives a
+// placeholder and is loaded again through the streamer, also when it was loaded with
+// load() or loadAll() the first time, so the device thread never decodes a reload.
+// Everything except stream() runs on the thread that owns the device.
 class textureManager
 {
 public:
-	std::map<std::string, texture*> textures;
+	DxTextureBackend backend;
+	TextureResidency residency;
+
+	// 1x1 stand-ins for textures that are not resident: mid grey, and a flat normal for
+	// normal maps. budgetBytes 0 keeps everything resident. Reloads are read and decoded
+	// by the streamer's workers, the upload runs here through jobs' main thread queue.
+	void init(DxCore* core, AssetStreamer& _streamer, JobSystem& _jobs, size_t budgetBytes = 0)
+	{
+		streamer = &_streamer;
+		jobs = &_jobs;
+		unsigned char grey[4] = { 128, 128, 128, 255 };
+		unsigned char flat[4] = { 128, 128, 255, 255 };
+		placeholder.init(core, 1, 1, 4, grey);
+		flatNormal.init(core, 1, 1, 4, flat);
+		backend.init(core);
+		residency.init(&backend, budgetBytes);
+		residency.onReload = [this](TextureId id) { reload(id); };
+	}
+
+	void setBudget(size_t bytes) { residency.setBudget(bytes); }
 
 	void load(DxCore* core, std::string filename)
 	{
-		std::map<std::string, texture*>::iterator it = textures.find(filename);
-		if (it != textures.end())
-		{
+		if (residency.find(resourceName(filename).c_str()) != InvalidTextureId)
 			return;
-		}
-		texture* currentTexture = new texture();
-		currentTexture->load(filename, core);
-		textures.insert({ filename, currentTexture });
+		PROFILE_SCOPE("asset load: texture");
+		Image image;
+		if (!image.load(filename))
+			return;
+		MipChain chain;
+		chain.build(image);
+		residency.upload(add(filename, false), chain);
 	}
 
-	ID3D11ShaderResourceView* find(std::string name)
+	// decodes every file not loaded yet on the job workers; the D3D textures are created
+	// on this thread, which has to be the one that owns the device
+	void loadAll(DxCore* core, const std::vector<std::string>& filenames, JobSystem& jobs)
 	{
-		name = "Resources/" + name;
-		return textures[name]->srv;
+		PROFILE_SCOPE("asset load: textures");
+		std::vector<std::string> pending;
+		for (auto& filename : filenames)
+			if (residency.find(resourceName(filename).c_str()) == InvalidTextureId)
+				pending.push_back(filename);
+		std::vector<MipChain> chains(pending.size());
+		jobs.parallelFor(pending.size(), 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				PROFILE_SCOPE("asset load: texture decode");
+				Image image;
+				if (!image.load(pending[i])) continue;
+				chains[i].build(image);
+				// device calls stay on the device thread
+				jobs.runOnMainThread([this, &chains, &pending, i] {
+					residency.upload(add(pending[i], false), chains[i]);
+				});
+			}
+		});
+		jobs.runMainThreadJobs();
+	}
+
+	// queues the file on the streamer, find() gives the placeholder until it is in. Call from
+	// one thread; the textures themselves are only changed by jobs on the device thread.
+	void stream(AssetStreamer& streamer, JobSystem& jobs, DxCore* core, const std::string& filename, float priority, bool normalMap = false)
+	{
+		if (!streamed.insert(filename).second)
+			return;
+		AssetHandle asset = request(streamer, jobs, filename, priority);
+		// queued after the request, so it runs before the upload job
+		jobs.runOnMainThread([this, &streamer, filename, normalMap, asset] {
+			add(filename, normalMap, &streamer, asset);
+		});
+	}
+
+	// the SRV, or the placeholder while the texture is not resident. Records the use.
+	ID3D11ShaderResourceView* use(TextureId id)
+	{
+		DeviceHandle handle = residency.use(id);
+		if (handle != InvalidDeviceHandle)
+			return backend.srv(handle);
+		return sources[id].normalMap ? flatNormal.srv : placeholder.srv;
+	}
+
+	TextureId id(const char* name) const { return residency.find(name); }
+
+	// a use by a draw packet that kept its SRV from an earlier frame
+	void touch(TextureId textureId)
+	{
+		if (textureId != InvalidTextureId)
+			residency.use(textureId);
+	}
+
+	// called per draw, so no string is built for the lookup
+	ID3D11ShaderResourceView* find(const char* name)
+	{
+		TextureId textureId = residency.find(name);
+		return textureId != InvalidTextureId ? use(textureId) : nullptr;
+	}
+
+	ID3D11ShaderResourceView* find(const std::string& name)
+	{
+		return find(name.c_str());
+	}
+
+	// once per frame after the draws: brings the textures back under budget
+	void endFrame()
+	{
+		residency.endFrame();
+	}
+
+	// changes when a name is registered or a GPU copy changes, draw packets that hold
+	// SRVs rebuild then
+	uint64_t generation() const
+	{
+		return residency.generation() + registered;
 	}
 
 	void unload(std::string name)
 	{
-		textures[name]->free();
-		textures.erase(name);
+		TextureId textureId = residency.find(resourceName(name).c_str());
+		if (textureId != InvalidTextureId)
+			residency.evict(textureId);
 	}
 
-	//~textureManager()
-	//{
-	//	for (auto it = textures.cbegin(); it != textures.cend(); )
-	//	{
-	//		it->second->free();
-	//		textures.erase(it++);
-	//	}
-	//}
-};
\ No newline at end of file
+	std::string report() const
+	{
+		return residency.report();
+	}
+
+	static std::string resourceName(const std::string& filename)
+	{
+		const std::string prefix = "Resources/";
+		return filename.compare(0, prefix.size(), prefix) == 0 ? filename.substr(prefix.size()) : filename;
+	}
+
+private:
+	// where an evicted texture comes back from
+	struct Source {
+		std::string filename;
+		bool normalMap = false;
+		AssetStreamer* streamer = nullptr;
+		AssetHandle asset = InvalidAsset;
+	};
+	AssetStreamer* streamer = nullptr;
+	JobSystem* jobs = nullptr;
+	texture placeholder;
+	texture flatNormal;
+	std::vector<Source> sources;           // by TextureId
+	uint64_t registered = 0;
+	std::set<std::string> streamed;        // on the thread that calls stream()
+
+	TextureId add(const std::string& filename, bool normalMap, AssetStreamer* streamer = nullptr, AssetHandle asset = InvalidAsset)
+	{
+		TextureId textureId = residency.add(resourceName(filename));
+		if (textureId >= sources.size()) {
+			sources.resize(textureId + 1);
+			registered++;
+		}
+		Source& source = sources[textureId];
+		source.filename = filename;
+		source.normalMap = normalMap;
+		source.streamer = streamer;
+		source.asset = asset;
+		return textureId;
+	}
+
+	// the decode runs on the streamer's workers, the upload on the device thread
+	AssetHandle request(AssetStreamer& assetStreamer, JobSystem& jobSystem, const std::string& filename, float priority)
+	{
+		return assetStreamer.request<MipChain>(filename, priority,
+			[](const std::vector<unsigned char>& file, MipChain& chain) {
+				Image image;
+				if (!image.decode(file)) return (size_t)0;
+				chain.build(image);
+				return chain.sizeInBytes();
+			},
+			[this, &jobSystem, filename](MipChain& chain) {
+				std::shared_ptr<MipChain> decoded = std::make_shared<MipChain>(std::move(chain));
+				jobSystem.runOnMainThread([this, filename, decoded] {
+					TextureId id = residency.find(resourceName(filename).c_str());
+					if (id != InvalidTextureId)
+						residency.upload(id, *decoded);
+				});
+			},
+			nullptr,
+			[this, &jobSystem, filename] {
+				jobSystem.runOnMainThread([this, filename] {
+					TextureId id = residency.find(resourceName(filename).c_str());
+					if (id != InvalidTextureId)
+						residency.reloadFailed(id);
+				});
+			});
+	}
+
+	// the residency manager wants the full texture back. It comes through the streamer's
+	// load callback; one that was loaded directly is handed to the streamer on its first
+	// reload, ahead of everything streaming by distance.
+	void reload(TextureId textureId)
+	{
+		Source& source = sources[textureId];
+		if (source.streamer) {
+			source.streamer->reload(source.asset);
+			return;
+		}
+		source.streamer = streamer;
+		source.asset = request(*streamer, *jobs, source.filename, -1.0f);
+	}
+};
@@ -0,0 +1,349 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <sstream>
+#include <cstdint>
+#include "image.h"
+#include "renderDevice.h"
+#include "profiler.h"
+
+// Creates and frees the GPU copies the residency manager decides on. textureManager
+// implements it on D3D11, NullTextureBackend only counts, for headless.
+class TextureUploadBackend {
+public:
+	virtual ~TextureUploadBackend() {}
+	// a texture holding levels [firstLevel, levelCount) of the chain
+	virtual DeviceHandle create(const MipChain& chain, int firstLevel) = 0;
+	// a copy of texture without its largest `drop` levels, copied on the GPU; texture is released
+	virtual DeviceHandle dropLevels(DeviceHandle texture, int drop) = 0;
+	virtual void release(DeviceHandle texture) = 0;
+};
+
+struct TextureBackendCounters {
+	uint64_t creates = 0;
+	uint64_t drops = 0;
+	uint64_t releases = 0;
+	uint64_t bytesUploaded = 0;     // from the CPU, level drops copy on the GPU and are not counted
+	size_t liveTextures = 0;
+	size_t liveBytes = 0;
+};
+
+// Fake backend: hands out handles and keeps the sizes, so the residency statistics can be
+// checked without a device.
+class NullTextureBackend : public TextureUploadBackend {
+public:
+	TextureBackendCounters counters;
+
+	DeviceHandle create(const MipChain& chain, int firstLevel) override {
+		Slot slot;
+		slot.width = chain.levelWidth(firstLevel);
+		slot.height = chain.levelHeight(firstLevel);
+		slot.channels = chain.channels;
+		slot.levels = chain.levelCount() - firstLevel;
+		slot.bytes = chain.sizeInBytes(firstLevel);
+		counters.creates++;
+		counters.bytesUploaded += slot.bytes;
+		return add(slot);
+	}
+
+	DeviceHandle dropLevels(DeviceHandle texture, int drop) override {
+		Slot slot = slots[texture];
+		remove(texture);
+		slot.width = slot.width >> drop > 1 ? slot.width >> drop : 1;
+		slot.height = slot.height >> drop > 1 ? slot.height >> drop : 1;
+		slot.levels -= drop;
+		slot.bytes = 0;
+		for (int i = 0; i < slot.levels; i++) {
+			size_t w = slot.width >> i > 1 ? slot.width >> i : 1;
+			size_t h = slot.height >> i > 1 ? slot.height >> i : 1;
+			slot.bytes += w * h * slot.channels;
+		}
+		counters.drops++;
+		return add(slot);
+	}
+
+	void release(DeviceHandle texture) override {
+		counters.releases++;
+		remove(texture);
+	}
+
+	size_t bytes(DeviceHandle texture) const { return slots[texture].bytes; }
+
+private:
+	struct Slot {
+		int width = 0;
+		int height = 0;
+		int channels = 0;
+		int levels = 0;
+		size_t bytes = 0;
+	};
+	std::vector<Slot> slots;
+	std::vector<DeviceHandle> freeSlots;
+
+	DeviceHandle add(const Slot& slot) {
+		DeviceHandle handle;
+		if (!freeSlots.empty()) {
+			handle = freeSlots.back();
+			freeSlots.pop_back();
+			slots[handle] = slot;
+		}
+		else {
+			handle = (DeviceHandle)slots.size();
+			slots.push_back(slot);
+		}
+		counters.liveTextures++;
+		counters.liveBytes += slot.bytes;
+		return handle;
+	}
+
+	void remove(DeviceHandle handle) {
+		counters.liveTextures--;
+		counters.liveBytes -= slots[handle].bytes;
+		slots[handle] = Slot();
+		freeSlots.push_back(handle);
+	}
+};
+
+typedef uint32_t TextureId;
+const TextureId InvalidTextureId = 0xffffffff;
+
+struct TextureResidencyStats {
+	size_t textures = 0;            // registered
+	size_t resident = 0;            // with a GPU copy
+	size_t reduced = 0;             // resident with mips dropped
+	size_t residentBytes = 0;
+	size_t peakBytes = 0;
+	size_t budgetBytes = 0;         // 0 = no limit
+	bool overBudget = false;        // everything resident was used in the last frame
+	uint64_t uploads = 0;
+	uint64_t uploadBytes = 0;
+	uint64_t mipDrops = 0;          // levels dropped
+	uint64_t evictions = 0;
+	uint64_t reloads = 0;           // asked to bring data back
+	uint64_t failedReloads = 0;     // the data did not come back
+	uint64_t misses = 0;            // uses that got the placeholder or a reduced copy
+};
+
+// Keeps the textures that were used recently on the GPU within a byte budget. Every use
+// goes through use(), which records the frame. endFrame() then brings the resident
+// bytes under budget from the least recently used end: first it drops the largest
+// mip of each of those textures in turn (down to minSize), then evicts whole textures.
+// Nothing used in the current frame is touched. A use of a texture that was evicted or
+// reduced asks onReload for the data again; upload() puts it back at full size.
+// Not thread safe, it belongs to the thread that owns the device.
+class TextureResidency {
+public:
+	std::function<void(TextureId)> onReload;
+
+	void init(TextureUploadBackend* _backend, size_t budgetBytes = 0, bool _dropMips = true, int _minSize = 64) {
+		backend = _backend;
+		budget = budgetBytes;
+		dropMips = _dropMips;
+		minSize = _minSize;
+	}
+
+	void setBudget(size_t bytes) { budget = bytes; }
+	size_t budgetBytes() const { return budget; }
+
+	// the id for name, registered with nothing resident the first time
+	TextureId add(const std::string& name) {
+		auto it = ids.find(name);
+		if (it != ids.end())
+			return it->second;
+		TextureId id = (TextureId)entries.size();
+		entries.emplace_back();
+		entries.back().name = name;
+		ids.insert({ name, id });
+		return id;
+	}
+
+	TextureId find(const char* name) const {
+		auto it = ids.find(name);
+		return it != ids.end() ? it->second : InvalidTextureId;
+	}
+
+	// full resolution copy, replaces whatever was resident
+	void upload(TextureId id, const MipChain& chain) {
+		PROFILE_SCOPE("texture residency: upload");
+		Entry& e = entries[id];
+		if (e.handle != InvalidDeviceHandle)
+			releaseCopy(e);
+		e.handle = backend->create(chain, 0);
+		e.width = chain.width;
+		e.height = chain.height;
+		e.channels = chain.channels;
+		e.levels = chain.levelCount();
+		e.firstLevel = 0;
+		e.bytes = chain.sizeInBytes();
+		e.lastUsed = frame;
+		e.reloadPending = false;
+		e.loaded = true;
+		residentBytes += e.bytes;
+		if (residentBytes > counters.peakBytes) counters.peakBytes = residentBytes;
+		counters.uploads++;
+		counters.uploadBytes += e.bytes;
+		changes++;
+	}
+
+	// the GPU copy, or InvalidDeviceHandle while there is none. Records the use.
+	DeviceHandle use(TextureId id) {
+		Entry& e = entries[id];
+		e.lastUsed = frame;
+		if (e.loaded && (e.handle == InvalidDeviceHandle || e.firstLevel > 0)) {
+			counters.misses++;
+			if (!e.reloadPending && onReload) {
+				e.reloadPending = true;
+				counters.reloads++;
+				onReload(id);
+			}
+		}
+		return e.handle;
+	}
+
+	// what onReload was asked for is not coming (the file is gone or broken): the texture
+	// keeps the placeholder or its reduced copy and is not asked for again
+	void reloadFailed(TextureId id) {
+		Entry& e = entries[id];
+		e.reloadPending = false;
+		e.loaded = false;
+		counters.failedReloads++;
+	}
+
+	// frees the GPU copy now, a later use() asks for it again
+	void evict(TextureId id) {
+		Entry& e = entries[id];
+		if (e.handle == InvalidDeviceHandle) return;
+		releaseCopy(e);
+		counters.evictions++;
+	}
+
+	void endFrame() {
+		PROFILE_SCOPE("texture residency: end frame");
+		counters.overBudget = false;
+		if (budget && residentBytes > budget) {
+			// least recently used first, only what was not used this frame
+			candidates.clear();
+			for (TextureId id = 0; id < (TextureId)entries.size(); id++)
+				if (entries[id].handle != InvalidDeviceHandle && entries[id].lastUsed < frame)
+					candidates.push_back(id);
+			std::sort(candidates.begin(), candidates.end(), [this](TextureId a, TextureId b) {
+				return entries[a].lastUsed < entries[b].lastUsed;
+			});
+			bool dropped = dropMips;
+			while (residentBytes > budget && dropped) {
+				dropped = false;
+				for (TextureId id : candidates) {
+					if (residentBytes <= budget) break;
+					if (canDrop(entries[id])) {
+						dropLevel(entries[id]);
+						dropped = true;
+					}
+				}
+			}
+			for (TextureId id : candidates) {
+				if (residentBytes <= budget) break;
+				evict(id);
+			}
+			counters.overBudget = residentBytes > budget;
+		}
+		frame++;
+	}
+
+	// changes whenever a texture's GPU copy does, cached handles are stale then
+	uint64_t generation() const { return changes; }
+	uint64_t currentFrame() const { return frame; }
+
+	const std::string& name(TextureId id) const { return entries[id].name; }
+	bool isResident(TextureId id) const { return entries[id].handle != InvalidDeviceHandle; }
+	int residentLevel(TextureId id) const { return entries[id].firstLevel; }
+	size_t bytes(TextureId id) const { return entries[id].bytes; }
+	size_t count() const { return entries.size(); }
+
+	TextureResidencyStats stats() const {
+		TextureResidencyStats s = counters;
+		s.textures = entries.size();
+		s.residentBytes = residentBytes;
+		s.budgetBytes = budget;
+		for (auto& e : entries) {
+			if (e.handle == InvalidDeviceHandle) continue;
+			s.resident++;
+			if (e.firstLevel > 0) s.reduced++;
+		}
+		return s;
+	}
+
+	std::string report() const {
+		TextureResidencyStats s = stats();
+		std::ostringstream out;
+		out << "textures: " << s.resident << "/" << s.textures << " resident (" << s.reduced << " reduced), "
+			<< s.residentBytes / (1024 * 1024) << " MB";
+		if (s.budgetBytes) out << " of " << s.budgetBytes / (1024 * 1024) << " MB";
+		if (s.overBudget) out << " (over budget)";
+		out << ", peak " << s.peakBytes / (1024 * 1024) << " MB, " << s.uploads << " uploads, " << s.mipDrops << " mips dropped, "
+			<< s.evictions << " evicted, " << s.reloads << " reloads (" << s.failedReloads << " failed), " << s.misses << " misses";
+		return out.str();
+	}
+
+private:
+	struct Entry {
+		std::string name;
+		DeviceHandle handle = InvalidDeviceHandle;
+		int width = 0;                  // of level 0
+		int height = 0;
+		int channels = 0;
+		int levels = 0;
+		int firstLevel = 0;             // largest level resident
+		size_t bytes = 0;               // resident
+		uint64_t lastUsed = 0;
+		bool loaded = false;            // has been uploaded once, so a miss can ask for a reload
+		bool reloadPending = false;
+	};
+
+	TextureUploadBackend* backend = nullptr;
+	std::vector<Entry> entries;
+	std::map<std::string, TextureId, std::less<>> ids;
+	std::vector<TextureId> candidates;
+	size_t budget = 0;
+	size_t residentBytes = 0;
+	bool dropMips = true;
+	int minSize = 64;
+	uint64_t frame = 1;
+	uint64_t changes = 0;
+	TextureResidencyStats counters;
+
+	bool canDrop(const Entry& e) const {
+		int next = e.firstLevel + 1;
+		if (next >= e.levels) return false;
+		int w = e.width >> next;
+		int h = e.height >> next;
+		return w >= minSize && h >= minSize;
+	}
+
+	size_t levelBytes(const Entry& e, int level) const {
+		size_t w = e.width >> level > 1 ? e.width >> level : 1;
+		size_t h = e.height >> level > 1 ? e.height >> level : 1;
+		return w * h * e.channels;
+	}
+
+	void dropLevel(Entry& e) {
+		e.handle = backend->dropLevels(e.handle, 1);
+		size_t freed = levelBytes(e, e.firstLevel);
+		e.firstLevel++;
+		e.bytes -= freed;
+		residentBytes -= freed;
+		counters.mipDrops++;
+		changes++;
+	}
+
+	void releaseCopy(Entry& e) {
+		backend->release(e.handle);
+		e.handle = InvalidDeviceHandle;
+		residentBytes -= e.bytes;
+		e.bytes = 0;
+		e.firstLevel = 0;
+		changes++;
+	}
+};
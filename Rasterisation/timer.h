@@ -0,0 +1,39 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+// Portable high resolution timer, replaces the QueryPerformanceCounter based
+// GamesEngineeringBase::Timer so the same code runs on Windows and Linux.
+class Timer {
+public:
+	Timer() {
+		reset();
+	}
+
+	// Resets the timer
+	void reset() {
+		start = now();
+	}
+
+	// Returns the elapsed time since the last reset in seconds and resets the timer. Call once per frame.
+	float dt() {
+		uint64_t cur = now();
+		float value = static_cast<float>(cur - start) * 1e-9f;
+		start = cur;
+		return value;
+	}
+
+	// Elapsed time since the last reset in seconds, without resetting
+	double elapsed() const {
+		return static_cast<double>(now() - start) * 1e-9;
+	}
+
+	// Monotonic clock in nanoseconds
+	static uint64_t now() {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+private:
+	uint64_t start;
+};
@@ -0,0 +1,199 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstdint>
+#include "mathLib.h"
+#include "timer.h"
+#include "profiler.h"
+
+typedef uint32_t TransformId;
+const TransformId NoTransform = 0xffffffff;
+
+struct TransformStats {
+	size_t nodes = 0;
+	size_t recomputed = 0;      // world matrices rebuilt by the last update
+	double ms = 0.0;
+};
+
+// Local position, rotation and scale of every node in separate arrays, a parent index
+// per node and a dirty flag. A node is added after its parent, so index order is
+// parent-first and update() is one pass: a node is rebuilt when it or an ancestor
+// changed, everything else keeps last frame's world matrix. The locals are built
+// four nodes at a time from the arrays with SSE2, then put under the parent.
+//
+// world = translation * rotation * scale, the order Player and forest used
+// (scaling * rotation * translation with mathLib's operator*). Rotations are turned
+// into matrices like Quaternion::toMatrix: (a, b, c) is the axis part, d the angle part.
+class TransformHierarchy {
+public:
+	TransformStats stats;
+
+	// the quaternion toMatrix turns into the identity
+	static mathLib::Quaternion identityRotation() { return mathLib::Quaternion(0.0f, 0.0f, 0.0f, 1.0f); }
+
+	// the rotation of Matrix::rotateY(theta)
+	static mathLib::Quaternion rotationY(float theta) { return mathLib::Quaternion(0.0f, sinf(theta * 0.5f), 0.0f, cosf(theta * 0.5f)); }
+
+	TransformId add(TransformId parent = NoTransform, const mathLib::Vec3& position = mathLib::Vec3(0.0f, 0.0f, 0.0f),
+		const mathLib::Quaternion& rotation = identityRotation(), const mathLib::Vec3& scale = mathLib::Vec3(1.0f, 1.0f, 1.0f)) {
+		TransformId id = (TransformId)parents.size();
+		parents.push_back(parent < id ? parent : NoTransform);
+		px.push_back(position.x); py.push_back(position.y); pz.push_back(position.z);
+		qa.push_back(rotation.a); qb.push_back(rotation.b); qc.push_back(rotation.c); qd.push_back(rotation.d);
+		sx.push_back(scale.x); sy.push_back(scale.y); sz.push_back(scale.z);
+		dirty.push_back(1);
+		changedFlags.push_back(0);
+		worlds.push_back(mathLib::Matrix());
+		return id;
+	}
+
+	size_t size() const { return parents.size(); }
+	TransformId parent(TransformId id) const { return parents[id]; }
+
+	// setters only mark the node when the value differs, so writing the same position
+	// every frame costs nothing
+	void setPosition(TransformId id, const mathLib::Vec3& p) {
+		if (px[id] == p.x && py[id] == p.y && pz[id] == p.z) return;
+		px[id] = p.x; py[id] = p.y; pz[id] = p.z;
+		dirty[id] = 1;
+	}
+
+	void setRotation(TransformId id, const mathLib::Quaternion& q) {
+		if (qa[id] == q.a && qb[id] == q.b && qc[id] == q.c && qd[id] == q.d) return;
+		qa[id] = q.a; qb[id] = q.b; qc[id] = q.c; qd[id] = q.d;
+		dirty[id] = 1;
+	}
+
+	void setScale(TransformId id, const mathLib::Vec3& s) {
+		if (sx[id] == s.x && sy[id] == s.y && sz[id] == s.z) return;
+		sx[id] = s.x; sy[id] = s.y; sz[id] = s.z;
+		dirty[id] = 1;
+	}
+
+	void setLocal(TransformId id, const mathLib::Vec3& p, const mathLib::Quaternion& q, const mathLib::Vec3& s) {
+		setPosition(id, p);
+		setRotation(id, q);
+		setScale(id, s);
+	}
+
+	mathLib::Vec3 position(TransformId id) const { return mathLib::Vec3(px[id], py[id], pz[id]); }
+	mathLib::Quaternion rotation(TransformId id) const { return mathLib::Quaternion(qa[id], qb[id], qc[id], qd[id]); }
+	mathLib::Vec3 scale(TransformId id) const { return mathLib::Vec3(sx[id], sy[id], sz[id]); }
+
+	// as of the last update
+	const mathLib::Matrix& world(TransformId id) const { return worlds[id]; }
+
+	// rebuilt by the last update, e.g. to refresh bounds only when the node moved
+	bool changed(TransformId id) const { return changedFlags[id] != 0; }
+
+	// rebuilds the world matrices of the changed subtrees, returns how many
+	size_t update() {
+		PROFILE_SCOPE("simulate: transforms");
+		Timer timer;
+		for (TransformId id : pending)
+			changedFlags[id] = 0;
+		pending.clear();
+		for (size_t i = 0; i < parents.size(); i++) {
+			if (!dirty[i] && (parents[i] == NoTransform || !changedFlags[parents[i]])) continue;
+			dirty[i] = 0;
+			changedFlags[i] = 1;
+			pending.push_back((TransformId)i);
+		}
+		// pending is in index order, so every parent is done before its children
+		mathLib::Matrix local[4];
+		for (size_t i = 0; i < pending.size(); i += 4) {
+			size_t count = pending.size() - i < 4 ? pending.size() - i : 4;
+			buildLocals(&pending[i], count, local);
+			for (size_t k = 0; k < count; k++) {
+				TransformId id = pending[i + k];
+				if (parents[id] == NoTransform) worlds[id] = local[k];
+				else concatenate(worlds[parents[id]], local[k], worlds[id]);
+			}
+		}
+		stats.nodes = parents.size();
+		stats.recomputed = pending.size();
+		stats.ms = timer.elapsed() * 1000.0;
+		return pending.size();
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "transforms: " << stats.recomputed << "/" << stats.nodes << " recomputed, " << stats.ms << " ms";
+		return out.str();
+	}
+
+private:
+	// local TRS, one array per component
+	std::vector<float> px, py, pz;
+	std::vector<float> qa, qb, qc, qd;
+	std::vector<float> sx, sy, sz;
+	std::vector<TransformId> parents;
+	std::vector<uint8_t> dirty;             // set since the last update
+	std::vector<uint8_t> changedFlags;      // rebuilt by the last update
+	std::vector<mathLib::Matrix> worlds;
+	std::vector<TransformId> pending;       // rebuilt by the last update, in index order
+
+	// translation * rotation * scale of count (1 to 4) nodes
+	void buildLocals(const TransformId* ids, size_t count, mathLib::Matrix* out) const {
+#if MATHLIB_SSE2
+		TransformId id[4];
+		for (size_t k = 0; k < 4; k++)
+			id[k] = ids[k < count ? k : 0];
+		auto gather = [&](const std::vector<float>& v) { return _mm_setr_ps(v[id[0]], v[id[1]], v[id[2]], v[id[3]]); };
+		__m128 a = gather(qa), b = gather(qb), c = gather(qc), d = gather(qd);
+		__m128 x = gather(sx), y = gather(sy), z = gather(sz);
+		const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+		__m128 aa = _mm_mul_ps(a, a), bb = _mm_mul_ps(b, b), cc = _mm_mul_ps(c, c);
+		__m128 ab = _mm_mul_ps(a, b), ac = _mm_mul_ps(a, c), bc = _mm_mul_ps(b, c);
+		__m128 da = _mm_mul_ps(d, a), db = _mm_mul_ps(d, b), dc = _mm_mul_ps(d, c);
+		// rows of Quaternion::toMatrix, each column times its scale
+		__m128 m[9];
+		m[0] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(bb, cc))), x);
+		m[1] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(ab, dc)), y);
+		m[2] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(ac, db)), z);
+		m[3] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(ab, dc)), x);
+		m[4] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(aa, cc))), y);
+		m[5] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(bc, da)), z);
+		m[6] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(ac, db)), x);
+		m[7] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(bc, da)), y);
+		m[8] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(aa, bb))), z);
+		float lanes[9][4];
+		for (int e = 0; e < 9; e++)
+			_mm_storeu_ps(lanes[e], m[e]);
+		for (size_t k = 0; k < count; k++) {
+			mathLib::Matrix& l = out[k];
+			for (int r = 0; r < 3; r++) {
+				for (int col = 0; col < 3; col++)
+					l.a[r][col] = lanes[r * 3 + col][k];
+			}
+			l.a[0][3] = px[id[k]];
+			l.a[1][3] = py[id[k]];
+			l.a[2][3] = pz[id[k]];
+			l.a[3][0] = 0.0f; l.a[3][1] = 0.0f; l.a[3][2] = 0.0f; l.a[3][3] = 1.0f;
+		}
+#else
+		for (size_t k = 0; k < count; k++) {
+			TransformId id = ids[k];
+			mathLib::Quaternion q(qa[id], qb[id], qc[id], qd[id]);
+			out[k] = mathLib::Matrix::scaling(mathLib::Vec3(sx[id], sy[id], sz[id])) * q.toMatrix() *
+				mathLib::Matrix::translation(mathLib::Vec3(px[id], py[id], pz[id]));
+		}
+#endif
+	}
+
+	// out = parent * local, applying local first
+	static void concatenate(const mathLib::Matrix& parent, const mathLib::Matrix& local, mathLib::Matrix& out) {
+#if MATHLIB_SSE2
+		__m128 row0 = _mm_loadu_ps(local.m), row1 = _mm_loadu_ps(local.m + 4);
+		__m128 row2 = _mm_loadu_ps(local.m + 8), row3 = _mm_loadu_ps(local.m + 12);
+		for (int r = 0; r < 4; r++) {
+			__m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(parent.a[r][0]), row0), _mm_mul_ps(_mm_set1_ps(parent.a[r][1]), row1)),
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(parent.a[r][2]), row2), _mm_mul_ps(_mm_set1_ps(parent.a[r][3]), row3)));
+			_mm_storeu_ps(out.m + r * 4, v);
+		}
+#else
+		out = local.mul(parent);
+#endif
+	}
+};
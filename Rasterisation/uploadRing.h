@@ -0,0 +1,130 @@
+#pragma once
+#include <string>
+#include <sstream>
+#include <cstdint>
+
+struct UploadRingStats {
+	uint64_t frameBytes = 0;        // allocated since the last beginFrame
+	uint64_t peakFrameBytes = 0;
+	uint64_t totalBytes = 0;
+	uint64_t allocations = 0;
+	uint64_t wraps = 0;             // allocations that went back to the start
+	uint64_t waits = 0;             // times the ring was full and a fence had to be waited for
+	uint64_t failures = 0;          // too big even for an empty ring
+	uint64_t frames = 0;
+};
+
+// Linear allocator over one big GPU buffer that the CPU writes and the GPU reads a
+// few frames later. Allocations are carved off the head, one frame after the other;
+// endFrame() tags the bytes of the frame with a fence value and retire() gives them
+// back once the GPU says it passed that fence. Only offsets and fences in here, no
+// device, so the bookkeeping runs and can be checked headless; DeviceBackend puts a
+// buffer behind it.
+//
+// The live bytes are the used bytes before head, wrapping past the end. An allocation
+// that does not fit before the end starts again at 0, the bytes skipped at the end
+// belong to the frame that skipped them and come back with it.
+class UploadRing {
+public:
+	static const int MaxFrames = 16;    // frames in flight the ring can track
+
+	UploadRingStats stats;
+
+	// alignment: of every offset, a power of two (256 for constant buffer offsets)
+	void init(uint32_t bytes, uint32_t offsetAlignment = 256) {
+		capacity = bytes;
+		alignment = offsetAlignment;
+		head = used = 0;
+		frameUsed = 0;
+		first = count = 0;
+		stats = UploadRingStats();
+	}
+
+	uint32_t size() const { return capacity; }
+	uint32_t bytesInUse() const { return used; }
+	int framesInFlight() const { return count; }
+	bool full() const { return count == MaxFrames; }
+
+	// fence of the oldest frame still in flight, the one to wait for when allocate fails
+	uint64_t oldestFence() const { return count > 0 ? frames[first].fence : 0; }
+
+	void beginFrame() {
+		stats.frameBytes = 0;
+		frameUsed = 0;
+	}
+
+	// false when the bytes are not free yet: retire, or wait for oldestFence() and retire
+	bool allocate(uint32_t bytes, uint32_t& offset) {
+		uint32_t aligned = (bytes + alignment - 1) & ~(alignment - 1);
+		if (aligned > capacity || aligned == 0) {
+			if (aligned > capacity) stats.failures++;
+			return false;
+		}
+		uint32_t at = head;
+		uint32_t skipped = 0;
+		if (at + aligned > capacity) {
+			skipped = capacity - at;
+			at = 0;
+		}
+		if (used + skipped + aligned > capacity) return false;
+		if (skipped > 0) stats.wraps++;
+		offset = at;
+		head = at + aligned;
+		if (head == capacity) head = 0;
+		used += skipped + aligned;
+		frameUsed += skipped + aligned;
+		stats.frameBytes += aligned;
+		stats.totalBytes += aligned;
+		stats.allocations++;
+		if (stats.frameBytes > stats.peakFrameBytes) stats.peakFrameBytes = stats.frameBytes;
+		return true;
+	}
+
+	// everything allocated since beginFrame is in use until fence passes; false when
+	// MaxFrames are already in flight (wait for oldestFence() and retire first)
+	bool endFrame(uint64_t fence) {
+		if (count == MaxFrames) return false;
+		Frame& frame = frames[(first + count) % MaxFrames];
+		frame.fence = fence;
+		frame.bytes = frameUsed;
+		frameUsed = 0;
+		count++;
+		stats.frames++;
+		return true;
+	}
+
+	// frees the frames whose fence is at or below completed, oldest first
+	void retire(uint64_t completed) {
+		while (count > 0 && frames[first].fence <= completed) {
+			used -= frames[first].bytes;
+			first = (first + 1) % MaxFrames;
+			count--;
+		}
+		if (used == 0) {
+			// nothing live, the next frame may as well start at the front
+			head = 0;
+		}
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "upload ring: " << (capacity >> 10) << " KB, " << stats.frameBytes << " bytes last frame (peak " << stats.peakFrameBytes << "), "
+			<< stats.allocations << " allocations, " << stats.wraps << " wraps, " << stats.waits << " waits, " << count << " frames in flight";
+		return out.str();
+	}
+
+private:
+	struct Frame {
+		uint64_t fence = 0;
+		uint32_t bytes = 0;     // allocated by the frame, skipped bytes included
+	};
+
+	uint32_t capacity = 0;
+	uint32_t alignment = 256;
+	uint32_t head = 0;
+	uint32_t used = 0;
+	uint32_t frameUsed = 0;     // taken since the last endFrame, skipped bytes included
+	Frame frames[MaxFrames];
+	int first = 0;
+	int count = 0;
+};
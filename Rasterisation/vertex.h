@@ -0,0 +1,266 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include "mathLib.h"
+
+// Vertex layouts shared by the D3D meshes and the CPU paths (software
+// rasterizer, loaders). They must match the input layouts in Shader::loadVS.
+struct STATIC_VERTEX
+{
+	mathLib::Vec3 pos;
+	mathLib::Vec3 normal;
+	mathLib::Vec3 tangent;
+	float tu;
+	float tv;
+};
+
+struct ANIMATED_VERTEX
+{
+	mathLib::Vec3 pos;
+	mathLib::Vec3 normal;
+	mathLib::Vec3 tangent;
+	float tu;
+	float tv;
+	unsigned int bonesIDs[4];
+	float boneWeights[4];
+};
+
+static STATIC_VERTEX addVertex(mathLib::Vec3 p, mathLib::Vec3 n, float tu, float tv)
+{
+	STATIC_VERTEX v;
+	v.pos = p;
+	v.normal = n;
+	//Frame frame;
+	//frame.fromVector(n);
+	//v.tangent = frame.u; // For now
+	v.tangent = mathLib::Vec3(1, 0, 0);
+	v.tu = tu;
+	v.tv = tv;
+	return v;
+}
+
+// How a Mesh stores its vertices on the GPU. Packed is the compact layout below, made
+// when the mesh is created; the CPU copies (staticVertices, animatedVertices) stay full.
+// The shader has to be loaded with the same format (Shader::loadVS).
+enum class VertexFormat {
+	Full,
+	Packed
+};
+
+// 24 bytes instead of 44: normal and tangent octahedral encoded in SNORM16 pairs, UVs as
+// half floats (they wrap, so they can be outside [0, 1]). Positions stay float, the
+// worlds are too large for 16 bits without a per-mesh offset and scale.
+struct STATIC_VERTEX_PACKED
+{
+	mathLib::Vec3 pos;
+	int16_t normal[2];
+	int16_t tangent[2];
+	uint16_t uv[2];
+};
+
+// 32 bytes instead of 76: as above, plus byte bone ids (the shader has 256 bones) and
+// UNORM8 weights that sum to exactly 255
+struct ANIMATED_VERTEX_PACKED
+{
+	mathLib::Vec3 pos;
+	int16_t normal[2];
+	int16_t tangent[2];
+	uint16_t uv[2];
+	uint8_t bonesIDs[4];
+	uint8_t boneWeights[4];
+};
+
+inline int16_t packSnorm16(float v)
+{
+	v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+	return (int16_t)roundf(v * 32767.0f);
+}
+
+inline float unpackSnorm16(int16_t v)
+{
+	float f = v / 32767.0f;
+	return f < -1.0f ? -1.0f : f;
+}
+
+// unit vector onto the octahedron, the lower half folded over the diagonals
+inline void octEncode(const mathLib::Vec3& n, int16_t out[2])
+{
+	float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	if (sum == 0.0f) {
+		out[0] = 0;
+		out[1] = 0;
+		return;
+	}
+	float x = n.x / sum;
+	float y = n.y / sum;
+	if (n.z < 0.0f) {
+		float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	out[0] = packSnorm16(x);
+	out[1] = packSnorm16(y);
+}
+
+// the same decode as octDecode in the vertex shaders
+inline mathLib::Vec3 octDecode(const int16_t in[2])
+{
+	float x = unpackSnorm16(in[0]);
+	float y = unpackSnorm16(in[1]);
+	float z = 1.0f - fabsf(x) - fabsf(y);
+	if (z < 0.0f) {
+		float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	mathLib::Vec3 n(x, y, z);
+	float length = n.getLength();
+	return length > 0.0f ? n / length : n;
+}
+
+// IEEE half, rounded to nearest even; too large becomes infinity, too small zero
+inline uint16_t floatToHalf(float value)
+{
+	uint32_t f;
+	memcpy(&f, &value, sizeof(f));
+	uint32_t sign = (f >> 16) & 0x8000;
+	uint32_t bits = (f >> 23) & 0xff;
+	uint32_t mantissa = f & 0x7fffff;
+	if (bits == 0xff)
+		return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	int exponent = (int)bits - 127 + 15;
+	if (exponent >= 31)
+		return (uint16_t)(sign | 0x7c00);
+	if (exponent <= 0) {
+		// subnormal half
+		if (exponent < -10)
+			return (uint16_t)sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+			half++;
+		return (uint16_t)(sign | half);
+	}
+	uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	// a carry out of the mantissa steps the exponent, which is the right result
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return (uint16_t)(sign | half);
+}
+
+inline float halfToFloat(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	uint32_t f;
+	if (exponent == 0) {
+		if (mantissa == 0)
+			f = sign;
+		else {
+			exponent = 127 - 15 + 1;
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				exponent--;
+			}
+			f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	}
+	else if (exponent == 31)
+		f = sign | 0x7f800000 | (mantissa << 13);
+	else
+		f = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	float value;
+	memcpy(&value, &f, sizeof(value));
+	return value;
+}
+
+// weights normalized to 255 in total: each is rounded down, the remainder goes one by
+// one to the largest fractions, so the shader does not need to renormalize
+inline void packWeights(const float weights[4], uint8_t out[4])
+{
+	float sum = 0.0f;
+	for (int i = 0; i < 4; i++)
+		sum += weights[i] > 0.0f ? weights[i] : 0.0f;
+	if (sum <= 0.0f) {
+		out[0] = 255;
+		out[1] = out[2] = out[3] = 0;
+		return;
+	}
+	float fraction[4];
+	int total = 0;
+	for (int i = 0; i < 4; i++) {
+		float scaled = (weights[i] > 0.0f ? weights[i] : 0.0f) * 255.0f / sum;
+		int whole = (int)scaled;
+		whole = whole > 255 ? 255 : whole;
+		out[i] = (uint8_t)whole;
+		fraction[i] = scaled - whole;
+		total += whole;
+	}
+	while (total < 255) {
+		int largest = 0;
+		for (int i = 1; i < 4; i++)
+			if (fraction[i] > fraction[largest]) largest = i;
+		out[largest]++;
+		fraction[largest] = -1.0f;
+		total++;
+	}
+}
+
+inline STATIC_VERTEX_PACKED packVertex(const STATIC_VERTEX& v)
+{
+	STATIC_VERTEX_PACKED p;
+	p.pos = v.pos;
+	octEncode(v.normal, p.normal);
+	octEncode(v.tangent, p.tangent);
+	p.uv[0] = floatToHalf(v.tu);
+	p.uv[1] = floatToHalf(v.tv);
+	return p;
+}
+
+inline ANIMATED_VERTEX_PACKED packVertex(const ANIMATED_VERTEX& v)
+{
+	ANIMATED_VERTEX_PACKED p;
+	p.pos = v.pos;
+	octEncode(v.normal, p.normal);
+	octEncode(v.tangent, p.tangent);
+	p.uv[0] = floatToHalf(v.tu);
+	p.uv[1] = floatToHalf(v.tv);
+	for (int i = 0; i < 4; i++)
+		p.bonesIDs[i] = (uint8_t)(v.bonesIDs[i] < 255 ? v.bonesIDs[i] : 255);
+	packWeights(v.boneWeights, p.boneWeights);
+	return p;
+}
+
+// CPU decode, what the vertex shader sees
+inline STATIC_VERTEX unpackVertex(const STATIC_VERTEX_PACKED& p)
+{
+	STATIC_VERTEX v;
+	v.pos = p.pos;
+	v.normal = octDecode(p.normal);
+	v.tangent = octDecode(p.tangent);
+	v.tu = halfToFloat(p.uv[0]);
+	v.tv = halfToFloat(p.uv[1]);
+	return v;
+}
+
+inline ANIMATED_VERTEX unpackVertex(const ANIMATED_VERTEX_PACKED& p)
+{
+	ANIMATED_VERTEX v;
+	v.pos = p.pos;
+	v.normal = octDecode(p.normal);
+	v.tangent = octDecode(p.tangent);
+	v.tu = halfToFloat(p.uv[0]);
+	v.tv = halfToFloat(p.uv[1]);
+	for (int i = 0; i < 4; i++) {
+		v.bonesIDs[i] = p.bonesIDs[i];
+		v.boneWeights[i] = p.boneWeights[i] / 255.0f;
+	}
+	return v;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "frameArena.h"
+
+// One bit per instance, written by the culling passes and read by the draw calls.
+// The words are kept in the set's own buffer, reused from frame to frame, unless arena
+// is set: then every resize takes them from that arena and they stay valid until it is
+// reset, so a set in a snapshot costs the heap nothing.
+class VisibilitySet {
+public:
+	uint64_t* words = nullptr;      // wordCount() of them
+	size_t size = 0;
+	FrameArena* arena = nullptr;
+
+	VisibilitySet() {}
+
+	VisibilitySet(const VisibilitySet& other) { *this = other; }
+
+	VisibilitySet& operator=(const VisibilitySet& other) {
+		if (this == &other) return *this;
+		resize(other.size, false);
+		for (size_t i = 0; i < wordCount(); i++)
+			words[i] = other.words[i];
+		return *this;
+	}
+
+	size_t wordCount() const { return (size + 63) / 64; }
+
+	void resize(size_t n, bool visible = true) {
+		size = n;
+		size_t count = wordCount();
+		if (arena)
+			words = arena->allocateArray<uint64_t>(count > 0 ? count : 1);
+		else {
+			buffer.resize(count > 0 ? count : 1);
+			words = buffer.data();
+		}
+		for (size_t i = 0; i < count; i++)
+			words[i] = visible ? ~0ull : 0ull;
+		// keep the bits past the end clear so count() stays exact
+		if (visible && (n & 63))
+			words[count - 1] = (1ull << (n & 63)) - 1;
+	}
+
+	void set(size_t i, bool visible) {
+		if (visible) words[i >> 6] |= 1ull << (i & 63);
+		else words[i >> 6] &= ~(1ull << (i & 63));
+	}
+
+	bool test(size_t i) const {
+		return (words[i >> 6] >> (i & 63)) & 1;
+	}
+
+	size_t count() const {
+		size_t n = 0;
+		for (size_t i = 0; i < wordCount(); i++) {
+			uint64_t w = words[i];
+			while (w) {
+				w &= w - 1;
+				n++;
+			}
+		}
+		return n;
+	}
+
+private:
+	std::vector<uint64_t> buffer;
+};
@@ -0,0 +1,346 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cmath>
+#include <cstdint>
+#include "mathLib.h"
+#include "jobSystem.h"
+#include "timer.h"
+#include "profiler.h"
+
+// The water surface where the CPU can see it. WaveParams is the waterParams cbuffer
+// of waterVertexShader.hlsl, so the numbers the shader draws with are the ones
+// waterHeightAt evaluates:
+//   y = level + sin(x * frequency + time * speed) * amplitude + cos(z * frequency + time * speed) * amplitude
+// with x and z in world space. OceanSpectrum is a second, optional model: an FFT
+// ocean (Tessendorf) on the job workers, tiled over the world. Only the CPU queries
+// follow it; the shader still draws the sum of waves.
+
+// same order and size as cbuffer waterParams
+struct WaveParams {
+	float time = 0.0f;              // seconds
+	float frequency = 1.0f;
+	float amplitude = 0.5f;
+	float speed = 1.0f;
+};
+static_assert(sizeof(WaveParams) == 16, "WaveParams mirrors the 16 byte waterParams cbuffer");
+
+// sin and cos by quadrant: x = j * pi / 2 + r with |r| <= pi / 4, then the sin or cos
+// polynomial of r (cephes), so the SSE2 lanes and the scalar path give the same result
+static float waveSin(float x, int quadrantOffset = 0) {
+	float j = nearbyintf(x * 0.636619772f);
+	float r = ((x - j * 1.5703125f) - j * 4.837512969970703125e-4f) - j * 7.54978995489188216e-8f;
+	int q = (int)j + quadrantOffset;
+	float z = r * r;
+	float s = r + r * z * (-1.6666654611e-1f + z * (8.3321608736e-3f + z * -1.9515295891e-4f));
+	float c = 1.0f - 0.5f * z + z * z * (4.166664568298827e-2f + z * (-1.388731625493765e-3f + z * 2.443315711809948e-5f));
+	float v = (q & 1) ? c : s;
+	return (q & 2) ? -v : v;
+}
+
+static float waveCos(float x) { return waveSin(x, 1); }
+
+#if MATHLIB_SSE2
+static __m128 waveSin4(__m128 x, int quadrantOffset = 0) {
+	__m128i j = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(0.636619772f)));
+	__m128 jf = _mm_cvtepi32_ps(j);
+	__m128 r = _mm_sub_ps(x, _mm_mul_ps(jf, _mm_set1_ps(1.5703125f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(jf, _mm_set1_ps(4.837512969970703125e-4f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(jf, _mm_set1_ps(7.54978995489188216e-8f)));
+	__m128i q = _mm_add_epi32(j, _mm_set1_epi32(quadrantOffset));
+	__m128 z = _mm_mul_ps(r, r);
+	__m128 s = _mm_add_ps(_mm_set1_ps(8.3321608736e-3f), _mm_mul_ps(z, _mm_set1_ps(-1.9515295891e-4f)));
+	s = _mm_add_ps(_mm_set1_ps(-1.6666654611e-1f), _mm_mul_ps(z, s));
+	s = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, z), s));
+	__m128 c = _mm_add_ps(_mm_set1_ps(-1.388731625493765e-3f), _mm_mul_ps(z, _mm_set1_ps(2.443315711809948e-5f)));
+	c = _mm_add_ps(_mm_set1_ps(4.166664568298827e-2f), _mm_mul_ps(z, c));
+	c = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(0.5f), z)), _mm_mul_ps(_mm_mul_ps(z, z), c));
+	__m128 useCos = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+	__m128 v = _mm_or_ps(_mm_and_ps(useCos, c), _mm_andnot_ps(useCos, s));
+	__m128 sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, _mm_set1_epi32(2)), 30));
+	return _mm_xor_ps(v, sign);
+}
+#endif
+
+// the wave the shader adds to a vertex at world (x, z)
+static float waterHeightAt(const WaveParams& waves, float x, float z, float time) {
+	float phase = time * waves.speed;
+	return waveSin(x * waves.frequency + phase) * waves.amplitude + waveCos(z * waves.frequency + phase) * waves.amplitude;
+}
+
+// the same for n points, four at a time with SSE2
+static void waterHeightsAt(const WaveParams& waves, const float* x, const float* z, size_t n, float time, float* out) {
+	size_t i = 0;
+#if MATHLIB_SSE2
+	__m128 frequency = _mm_set1_ps(waves.frequency);
+	__m128 amplitude = _mm_set1_ps(waves.amplitude);
+	__m128 phase = _mm_set1_ps(time * waves.speed);
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = waveSin4(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x + i), frequency), phase));
+		__m128 b = waveSin4(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(z + i), frequency), phase), 1);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_add_ps(a, b), amplitude));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = waterHeightAt(waves, x[i], z[i], time);
+}
+
+// a + bi, the little of std::complex the ocean needs (<complex> does not survive mathLib's max macro)
+struct OceanComplex {
+	float re = 0.0f, im = 0.0f;
+
+	OceanComplex() {}
+	OceanComplex(float _re, float _im) : re(_re), im(_im) {}
+	OceanComplex operator+(const OceanComplex& o) const { return OceanComplex(re + o.re, im + o.im); }
+	OceanComplex operator-(const OceanComplex& o) const { return OceanComplex(re - o.re, im - o.im); }
+	OceanComplex operator*(const OceanComplex& o) const { return OceanComplex(re * o.re - im * o.im, re * o.im + im * o.re); }
+	OceanComplex operator*(float s) const { return OceanComplex(re * s, im * s); }
+	OceanComplex conjugate() const { return OceanComplex(re, -im); }
+	float norm() const { return re * re + im * im; }
+};
+
+struct OceanStats {
+	int size = 0;                   // grid is size x size
+	double ms = 0.0;                // of the last update
+	uint64_t updates = 0;
+};
+
+// Heights (and with choppiness > 0 the sideways displacement) of a square patch of
+// ocean from a Phillips spectrum, evaluated at a time with three inverse FFTs. The
+// patch repeats over the world, so heightAt works anywhere. update() runs the row
+// and column transforms on the job workers.
+class OceanSpectrum {
+public:
+	OceanStats stats;
+	float choppiness = 0.0f;        // 0 leaves offsetX and offsetZ at 0 and skips their FFTs
+	std::vector<float> heights;     // the tile, row by row, z major
+	std::vector<float> offsetX;     // horizontal displacement, choppy waves
+	std::vector<float> offsetZ;
+
+	// n: grid size, a power of two; patchSize in world units; windSpeed in units per
+	// second along windX, windZ; heights scaled to rmsHeight
+	void init(int n, float patchSize, float windSpeed, float windX, float windZ, float rmsHeight, uint32_t seed = 1) {
+		size = n;
+		patch = patchSize;
+		stats = OceanStats();
+		stats.size = n;
+		size_t count = (size_t)n * n;
+		h0.assign(count, Complex());
+		omega.assign(count, 0.0f);
+		kx.assign(count, 0.0f);
+		kz.assign(count, 0.0f);
+		spectrum.assign(count, Complex());
+		spectrumX.assign(count, Complex());
+		spectrumZ.assign(count, Complex());
+		heights.assign(count, 0.0f);
+		offsetX.assign(count, 0.0f);
+		offsetZ.assign(count, 0.0f);
+
+		const float gravity = 9.81f;
+		const float pi = 3.14159265f;
+		float windLength = sqrtf(windX * windX + windZ * windZ);
+		float wx = windLength > 0.0f ? windX / windLength : 1.0f;
+		float wz = windLength > 0.0f ? windZ / windLength : 0.0f;
+		float largest = windSpeed * windSpeed / gravity;   // largest wave from this wind
+		float smallest = largest * 0.001f;                  // damped below this
+		uint32_t state = seed;
+		auto uniform = [&]() {
+			state = state * 1664525u + 1013904223u;
+			return ((state >> 8) + 0.5f) * (1.0f / 16777216.0f);
+		};
+		double energy = 0.0;
+		for (int z = 0; z < n; z++) {
+			for (int x = 0; x < n; x++) {
+				size_t i = (size_t)z * n + x;
+				// FFT order: 0, 1, ..., n/2 - 1, -n/2, ..., -1
+				kx[i] = 2.0f * pi * (x < n / 2 ? x : x - n) / patch;
+				kz[i] = 2.0f * pi * (z < n / 2 ? z : z - n) / patch;
+				float k2 = kx[i] * kx[i] + kz[i] * kz[i];
+				float k = sqrtf(k2);
+				omega[i] = sqrtf(gravity * k);
+				// Box-Muller for the two Gaussian draws
+				float u1 = uniform(), u2 = uniform();
+				float radius = sqrtf(-2.0f * logf(u1));
+				float gr = radius * cosf(2.0f * pi * u2), gi = radius * sinf(2.0f * pi * u2);
+				if (k2 == 0.0f) continue;
+				float facing = (kx[i] * wx + kz[i] * wz) / k;
+				float phillips = expf(-1.0f / (k2 * largest * largest)) / (k2 * k2) * facing * facing * expf(-k2 * smallest * smallest);
+				float amplitude = sqrtf(phillips * 0.5f);
+				h0[i] = Complex(gr * amplitude, gi * amplitude);
+				energy += 2.0 * h0[i].norm();
+			}
+		}
+		// mean of h^2 over the tile is the sum of |h(k)|^2, about twice that of h0
+		float scale = energy > 0.0 ? rmsHeight / (float)sqrt(energy) : 0.0f;
+		for (auto& h : h0)
+			h = h * scale;
+		buildTables();
+	}
+
+	int gridSize() const { return size; }
+	float patchSize() const { return patch; }
+
+	// the tile at time t
+	void update(float time, JobSystem* jobs = nullptr) {
+		if (size == 0) return;
+		PROFILE_SCOPE("water: ocean spectrum");
+		Timer timer;
+		int n = size;
+		bool choppy = choppiness > 0.0f;
+		auto evolve = [&](size_t begin, size_t end) {
+			for (size_t z = begin; z < end; z++) {
+				for (int x = 0; x < n; x++) {
+					size_t i = z * n + x;
+					size_t mirror = ((n - z) % n) * n + (n - x) % n;
+					float c = cosf(omega[i] * time), s = sinf(omega[i] * time);
+					Complex h = h0[i] * Complex(c, s) + h0[mirror].conjugate() * Complex(c, -s);
+					spectrum[i] = h;
+					if (!choppy) continue;
+					// -i k / |k| h
+					float k = sqrtf(kx[i] * kx[i] + kz[i] * kz[i]);
+					float ux = k > 0.0f ? kx[i] / k : 0.0f, uz = k > 0.0f ? kz[i] / k : 0.0f;
+					spectrumX[i] = Complex(h.im * ux, -h.re * ux);
+					spectrumZ[i] = Complex(h.im * uz, -h.re * uz);
+				}
+			}
+		};
+		run(jobs, n, evolve);
+		inverseTransform(spectrum, jobs);
+		if (choppy) {
+			inverseTransform(spectrumX, jobs);
+			inverseTransform(spectrumZ, jobs);
+		}
+		for (size_t i = 0; i < heights.size(); i++) {
+			heights[i] = spectrum[i].re;
+			offsetX[i] = choppy ? spectrumX[i].re * choppiness : 0.0f;
+			offsetZ[i] = choppy ? spectrumZ[i].re * choppiness : 0.0f;
+		}
+		stats.ms = timer.elapsed() * 1000.0;
+		stats.updates++;
+	}
+
+	// bilinear in the tile, repeated over the world (the sideways offsets are left out)
+	float heightAt(float x, float z) const {
+		if (size == 0) return 0.0f;
+		float fx = x / patch * size, fz = z / patch * size;
+		float floorX = floorf(fx), floorZ = floorf(fz);
+		float tx = fx - floorX, tz = fz - floorZ;
+		int ix = (int)floorX & (size - 1), iz = (int)floorZ & (size - 1);
+		int nx = (ix + 1) & (size - 1), nz = (iz + 1) & (size - 1);
+		float top = heights[(size_t)iz * size + ix] + (heights[(size_t)iz * size + nx] - heights[(size_t)iz * size + ix]) * tx;
+		float bottom = heights[(size_t)nz * size + ix] + (heights[(size_t)nz * size + nx] - heights[(size_t)nz * size + ix]) * tx;
+		return top + (bottom - top) * tz;
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "ocean: " << stats.size << "x" << stats.size << ", " << stats.updates << " updates, " << stats.ms << " ms";
+		return out.str();
+	}
+
+private:
+	typedef OceanComplex Complex;
+
+	int size = 0;
+	float patch = 1.0f;
+	std::vector<Complex> h0;        // spectrum at t = 0
+	std::vector<float> omega;       // dispersion, deep water
+	std::vector<float> kx, kz;
+	std::vector<Complex> spectrum, spectrumX, spectrumZ;
+	std::vector<uint32_t> reversed; // bit reversal of each index
+	std::vector<Complex> twiddles;  // e^(2 pi i k / n), k < n / 2
+
+	void buildTables() {
+		int bits = 0;
+		while ((1 << bits) < size) bits++;
+		reversed.resize(size);
+		for (int i = 0; i < size; i++) {
+			uint32_t r = 0;
+			for (int b = 0; b < bits; b++)
+				if (i & (1 << b)) r |= 1u << (bits - 1 - b);
+			reversed[i] = r;
+		}
+		twiddles.resize(size / 2);
+		for (int k = 0; k < size / 2; k++)
+			twiddles[k] = Complex(cosf(2.0f * 3.14159265f * k / size), sinf(2.0f * 3.14159265f * k / size));
+	}
+
+	template<typename F>
+	static void run(JobSystem* jobs, int n, F&& function) {
+		if (jobs) jobs->parallelFor((size_t)n, 8, function);
+		else function(0, (size_t)n);
+	}
+
+	// in place radix 2 over n values stride apart, inverse (positive exponent), unscaled
+	void transform(Complex* data, size_t stride) const {
+		int n = size;
+		for (int i = 0; i < n; i++) {
+			int j = (int)reversed[i];
+			if (j > i) std::swap(data[i * stride], data[j * stride]);
+		}
+		for (int length = 2; length <= n; length <<= 1) {
+			int half = length >> 1;
+			int step = n / length;
+			for (int start = 0; start < n; start += length) {
+				for (int k = 0; k < half; k++) {
+					Complex& a = data[(start + k) * stride];
+					Complex& b = data[(start + k + half) * stride];
+					Complex t = b * twiddles[k * step];
+					b = a - t;
+					a = a + t;
+				}
+			}
+		}
+	}
+
+	// rows, then columns
+	void inverseTransform(std::vector<Complex>& values, JobSystem* jobs) {
+		int n = size;
+		Complex* data = values.data();
+		run(jobs, n, [&](size_t begin, size_t end) {
+			for (size_t row = begin; row < end; row++)
+				transform(data + row * n, 1);
+		});
+		run(jobs, n, [&](size_t begin, size_t end) {
+			for (size_t column = begin; column < end; column++)
+				transform(data + column, (size_t)n);
+		});
+	}
+};
+
+// The water in the world: a rectangle at level with the shader's waves on it, or the
+// ocean tile when one is set. time is the shader's time this frame.
+class WaterSurface {
+public:
+	WaveParams waves;
+	float level = 0.0f;
+	float minX = 0.0f, maxX = 0.0f, minZ = 0.0f, maxZ = 0.0f;
+	const OceanSpectrum* ocean = nullptr;
+
+	void setArea(float centerX, float centerZ, float halfSize) {
+		minX = centerX - halfSize;
+		maxX = centerX + halfSize;
+		minZ = centerZ - halfSize;
+		maxZ = centerZ + halfSize;
+	}
+
+	void setTime(float time) { waves.time = time; }
+
+	bool contains(float x, float z) const { return x >= minX && x <= maxX && z >= minZ && z <= maxZ; }
+
+	float heightAt(float x, float z) const {
+		return level + (ocean ? ocean->heightAt(x, z) : waterHeightAt(waves, x, z, waves.time));
+	}
+
+	void heightsAt(const float* x, const float* z, size_t n, float* out) const {
+		if (ocean) {
+			for (size_t i = 0; i < n; i++)
+				out[i] = level + ocean->heightAt(x[i], z[i]);
+			return;
+		}
+		waterHeightsAt(waves, x, z, n, waves.time, out);
+		for (size_t i = 0; i < n; i++)
+			out[i] += level;
+	}
+};
@@ -8,14 +8,14 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
 	{
 	case WM_DESTROY:
 	{
+		window->quit = true;
 		PostQuitMessage(0);
-		exit(0);
 		return 0;
 	}
 	case WM_CLOSE:
 	{
+		window->quit = true;
 		PostQuitMessage(0);
-		exit(0);
 		return 0;
 	}
 	case WM_KEYDOWN:
@@ -95,6 +95,7 @@ void Window::processMessages() {
 	MSG msg;
 	ZeroMemory(&msg, sizeof(MSG));
 	while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+		if (msg.message == WM_QUIT) quit = true;
 		TranslateMessage(&msg);
 		DispatchMessage(&msg);
 	}
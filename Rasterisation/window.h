@@ -2,11 +2,12 @@
 #include "Windows.h"
 #include <string>
 #include "memory.h"
+#include "input.h"
 
 #define WINDOW_GET_X_LPARAM(lp) ((int)(short)LOWORD(lp))
 #define WINDOW_GET_Y_LPARAM(lp) ((int)(short)HIWORD(lp))
 
-class Window {
+class Window : public InputSource {
 public:
 	HWND hwnd; // handle to the window
 	HINSTANCE hInstance; // handle to the instance about the window
@@ -23,9 +24,13 @@ public:
 	int lastX, lastY;
 	int xOffset, yOffset;
 	bool firstMouse = true;
+	bool quit = false; // the window was closed, the game loop ends and shuts down
 
 	void Init(std::string window_name, int window_width, int window_height, int window_x = 0, int window_y = 0);
 	void updateMouse(int x, int y);
 	void processMessages();
-	void getMouseMovement(float& deltaX, float& deltaY);
+	void getMouseMovement(float& deltaX, float& deltaY) override;
+
+	bool keyDown(int key) override { return keys[key & 0xFF]; }
+	bool mouseButtonDown(int button) override { return mouseButtons[button]; }
 };
\ No newline at end of file